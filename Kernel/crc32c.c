@@ -1,18 +1,18 @@
 /* crc32c.c -- compute CRC-32C using the Intel crc32 instruction
  * Copyright (C) 2013 Mark Adler
  * Original Version 1.1  1 Aug 2013  Mark Adler
- * Current  Version 1.2  2 Feb 2015
+ * Current  Version 1.6  17 Oct 2026
  */
 
 /*
  This software is provided 'as-is', without any express or implied
  warranty.  In no event will the author be held liable for any damages
  arising from the use of this software.
- 
+    
  Permission is granted to anyone to use this software for any purpose,
  including commercial applications, and to alter it and redistribute it
  freely, subject to the following restrictions:
- 
+    
  1. The origin of this software must not be misrepresented; you must not
  claim that you wrote the original software. If you use this software
  in a product, an acknowledgment in the product documentation would be
@@ -20,7 +20,7 @@
  2. Altered source versions must be plainly marked as such, and must not be
  misrepresented as being the original software.
  3. This notice may not be removed or altered from any source distribution.
- 
+    
  Mark Adler
  madler@alumni.caltech.edu
  */
@@ -33,10 +33,23 @@
  1.0  10 Feb 2013  First version
  1.1   1 Aug 2013  Correct comments on why three crc instructions in parallel
  1.2  20 Dec 2014  Modified by Nareg Sinenian to include hardware CRC32C only
+ 1.3  17 Oct 2026  Select an implementation at run time: SSE 4.2, SSE 4.2
+                   with PCLMULQDQ, ARMv8 CRC32 or slicing-by-8 in software
+ 1.4  17 Oct 2026  Add crc32c_copy() to compute the crc while copying
+ 1.5  17 Oct 2026  Add crc32c_combine() and crc32c_iovec()
+ 1.6  17 Oct 2026  Add crc32c_batch() to interleave many small buffers
  */
 
 #include "crc32c.h"
 
+#if !defined(KERNEL) && defined(__aarch64__)
+#if defined(__linux__)
+#include <sys/auxv.h>
+#elif defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+#endif
+
 /* CRC-32C (iSCSI) polynomial in reversed bit order. */
 #define POLY 0x82f63b78
 
@@ -133,37 +146,158 @@ static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
     zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
 }
 
+/* Compute x^n modulo the CRC-32C polynomial, in reversed bit order (the
+ coefficient of x^0 is the most significant bit). */
+static uint32_t crc32c_xpow(size_t n)
+{
+    uint32_t p = 0x80000000;    /* x^0 */
+    
+    while (n--)
+        p = (p & 1) ? (p >> 1) ^ POLY : p >> 1;
+    return p;
+}
+
+/* Multiply a and b modulo the CRC-32C polynomial, both in reversed bit
+ order. */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m, p;
+    
+    m = (uint32_t)1 << 31;
+    p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+/* Table of x^2^n modulo the CRC-32C polynomial, for n = 0..31. */
+static uint32_t crc32c_x2n_table[32];
+
+/* Compute x^(2^k * n) modulo the CRC-32C polynomial using the table above,
+ with one multiplication per set bit of n. */
+static uint32_t crc32c_x2nmodp(uint64_t n, unsigned k)
+{
+    uint32_t p;
+    
+    p = (uint32_t)1 << 31;      /* x^0 == 1 */
+    while (n) {
+        if (n & 1)
+            p = crc32c_multmodp(crc32c_x2n_table[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
 /* Block sizes for three-way parallel crc computation.  LONG and SHORT must
- both be powers of two.  The associated string constants must be set
- accordingly, for use in constructing the assembler instructions. */
+ both be powers of two. */
 #define LONG 8192
-#define LONGx1 "8192"
-#define LONGx2 "16384"
 #define SHORT 256
-#define SHORTx1 "256"
-#define SHORTx2 "512"
 
 /* Tables for hardware crc that shift a crc by LONG and SHORT zeros. */
 static uint32_t crc32c_long[4][256];
 static uint32_t crc32c_short[4][256];
 
-/* Initialize tables for shifting crcs. */
-void crc32c_init(void)
+/* Tables for the slicing-by-8 software crc.  crc32c_table[0] is the usual
+ byte-at-a-time table; crc32c_table[k] advances a byte by k more bytes. */
+static uint32_t crc32c_table[8][256];
+
+/* Constants for shifting a crc by LONG and SHORT zeros using a carry-less
+ multiply followed by a crc instruction (see crc32c_shift_clmul()). */
+static uint64_t crc32c_long_clmul;
+static uint64_t crc32c_short_clmul;
+
+/* Store eight bytes to a destination that may not be aligned. */
+static inline void crc32c_store64(unsigned char *dst, uint64_t data)
 {
-    crc32c_zeros(crc32c_long, LONG);
-    crc32c_zeros(crc32c_short, SHORT);
+    __builtin_memcpy(dst, &data, sizeof(data));
 }
 
-/* Compute CRC-32C using the Intel hardware instruction. */
-uint32_t crc32c(uint32_t crc,const void * buf,size_t len)
+/* Compute CRC-32C in software, eight bytes at a time (slicing-by-8).  If dst
+ is not NULL, the data is also copied to dst.  This assumes a little-endian
+ host, as are all hosts that this driver runs on. */
+static inline uint32_t crc32c_sw_core(uint32_t crc, unsigned char *dst,
+                                      const void *buf, size_t len)
 {
-    // NS modification - return initial value if buffer empty
-    if(!len || !buf)
-        return crc;
+    const unsigned char *next = (const unsigned char *)buf;
+    uint64_t crc0, data;
     
+    crc0 = crc ^ 0xffffffff;
+    while (len && ((uintptr_t)next & 7) != 0) {
+        if (dst)
+            *dst++ = *next;
+        crc0 = crc32c_table[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        data = *(const uint64_t *)next;
+        if (dst) {
+            crc32c_store64(dst, data);
+            dst += 8;
+        }
+        crc0 ^= data;
+        crc0 = crc32c_table[7][crc0 & 0xff] ^
+               crc32c_table[6][(crc0 >> 8) & 0xff] ^
+               crc32c_table[5][(crc0 >> 16) & 0xff] ^
+               crc32c_table[4][(crc0 >> 24) & 0xff] ^
+               crc32c_table[3][(crc0 >> 32) & 0xff] ^
+               crc32c_table[2][(crc0 >> 40) & 0xff] ^
+               crc32c_table[1][(crc0 >> 48) & 0xff] ^
+               crc32c_table[0][crc0 >> 56];
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        if (dst)
+            *dst++ = *next;
+        crc0 = crc32c_table[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+        len--;
+    }
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_sw_core(crc, NULL, buf, len);
+}
+
+static uint32_t crc32c_sw_copy(uint32_t crc, void *dst, const void *src, size_t len)
+{
+    return crc32c_sw_core(crc, (unsigned char *)dst, src, len);
+}
+
+static void crc32c_sw_batch(uint32_t *crcs, const void *const *bufs,
+                            const size_t *lens, unsigned int count)
+{
+    unsigned int n;
+    
+    for (n = 0; n < count; n++)
+        crcs[n] = crc32c_sw_core(crcs[n], NULL, bufs[n], lens[n]);
+}
+
+/* Compute the crc using a one-byte and an eight-byte crc instruction (u8 and
+ u64) and a pair of functions that shift a crc by LONG and SHORT zeros.  The
+ instructions are inlined into each of the implementations below.  If dst is
+ not NULL, each eight-byte word is stored to dst as it is loaded for the crc,
+ so that the data is read only once. */
+static inline uint32_t crc32c_3way(uint32_t crc, unsigned char *dst,
+                                   const void *buf, size_t len,
+                                   uint32_t (*u8)(uint32_t, uint8_t),
+                                   uint32_t (*u64)(uint32_t, uint64_t),
+                                   uint32_t (*shift_long)(uint32_t),
+                                   uint32_t (*shift_short)(uint32_t))
+{
     const unsigned char *next = (const unsigned char *)buf;
     const unsigned char *end;
-    uint64_t crc0, crc1, crc2;      /* need to be 64 bits for crc32q */
+    uint32_t crc0, crc1, crc2;
+    uint64_t data0, data1, data2;
     
     /* pre-process the crc */
     crc0 = crc ^ 0xffffffff;
@@ -171,9 +305,9 @@ uint32_t crc32c(uint32_t crc,const void * buf,size_t len)
     /* compute the crc for up to seven leading bytes to bring the data pointer
      to an eight-byte boundary */
     while (len && ((uintptr_t)next & 7) != 0) {
-        __asm__("crc32b\t" "(%1), %0"
-                : "=r"(crc0)
-                : "r"(next), "0"(crc0));
+        if (dst)
+            *dst++ = *next;
+        crc0 = u8(crc0, *next);
         next++;
         len--;
     }
@@ -187,16 +321,25 @@ uint32_t crc32c(uint32_t crc,const void * buf,size_t len)
         crc2 = 0;
         end = next + LONG;
         do {
-            __asm__("crc32q\t" "(%3), %0\n\t"
-                    "crc32q\t" LONGx1 "(%3), %1\n\t"
-                    "crc32q\t" LONGx2 "(%3), %2"
-                    : "=r"(crc0), "=r"(crc1), "=r"(crc2)
-                    : "r"(next), "0"(crc0), "1"(crc1), "2"(crc2));
+            data0 = *(const uint64_t *)next;
+            data1 = *(const uint64_t *)(next + LONG);
+            data2 = *(const uint64_t *)(next + LONG*2);
+            if (dst) {
+                crc32c_store64(dst, data0);
+                crc32c_store64(dst + LONG, data1);
+                crc32c_store64(dst + LONG*2, data2);
+                dst += 8;
+            }
+            crc0 = u64(crc0, data0);
+            crc1 = u64(crc1, data1);
+            crc2 = u64(crc2, data2);
             next += 8;
         } while (next < end);
-        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
-        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+        crc0 = shift_long(crc0) ^ crc1;
+        crc0 = shift_long(crc0) ^ crc2;
         next += LONG*2;
+        if (dst)
+            dst += LONG*2;
         len -= LONG*3;
     }
     
@@ -207,16 +350,25 @@ uint32_t crc32c(uint32_t crc,const void * buf,size_t len)
         crc2 = 0;
         end = next + SHORT;
         do {
-            __asm__("crc32q\t" "(%3), %0\n\t"
-                    "crc32q\t" SHORTx1 "(%3), %1\n\t"
-                    "crc32q\t" SHORTx2 "(%3), %2"
-                    : "=r"(crc0), "=r"(crc1), "=r"(crc2)
-                    : "r"(next), "0"(crc0), "1"(crc1), "2"(crc2));
+            data0 = *(const uint64_t *)next;
+            data1 = *(const uint64_t *)(next + SHORT);
+            data2 = *(const uint64_t *)(next + SHORT*2);
+            if (dst) {
+                crc32c_store64(dst, data0);
+                crc32c_store64(dst + SHORT, data1);
+                crc32c_store64(dst + SHORT*2, data2);
+                dst += 8;
+            }
+            crc0 = u64(crc0, data0);
+            crc1 = u64(crc1, data1);
+            crc2 = u64(crc2, data2);
             next += 8;
         } while (next < end);
-        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
-        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+        crc0 = shift_short(crc0) ^ crc1;
+        crc0 = shift_short(crc0) ^ crc2;
         next += SHORT*2;
+        if (dst)
+            dst += SHORT*2;
         len -= SHORT*3;
     }
     
@@ -224,22 +376,375 @@ uint32_t crc32c(uint32_t crc,const void * buf,size_t len)
      block */
     end = next + (len - (len & 7));
     while (next < end) {
-        __asm__("crc32q\t" "(%1), %0"
-                : "=r"(crc0)
-                : "r"(next), "0"(crc0));
+        data0 = *(const uint64_t *)next;
+        if (dst) {
+            crc32c_store64(dst, data0);
+            dst += 8;
+        }
+        crc0 = u64(crc0, data0);
         next += 8;
     }
     len &= 7;
     
     /* compute the crc for up to seven trailing bytes */
     while (len) {
-        __asm__("crc32b\t" "(%1), %0"
-                : "=r"(crc0)
-                : "r"(next), "0"(crc0));
+        if (dst)
+            *dst++ = *next;
+        crc0 = u8(crc0, *next);
         next++;
         len--;
     }
     
     /* return a post-processed crc */
-    return (uint32_t)crc0 ^ 0xffffffff;
+    return crc0 ^ 0xffffffff;
+}
+
+/* Load eight bytes from a source that may not be aligned. */
+static inline uint64_t crc32c_load64(const unsigned char *src)
+{
+    uint64_t data;
+    
+    __builtin_memcpy(&data, src, sizeof(data));
+    return data;
+}
+
+/* Finish a pre-processed crc over the remaining bytes of one buffer. */
+static inline uint32_t crc32c_tail(uint32_t crc0, const unsigned char *next,
+                                   size_t len,
+                                   uint32_t (*u8)(uint32_t, uint8_t),
+                                   uint32_t (*u64)(uint32_t, uint64_t))
+{
+    while (len >= 8) {
+        crc0 = u64(crc0, crc32c_load64(next));
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc0 = u8(crc0, *next);
+        next++;
+        len--;
+    }
+    return crc0;
+}
+
+/* Compute the crcs of many independent buffers, three at a time.  The
+ three streams are interleaved over their common length so that the crc
+ instructions of different buffers overlap, hiding the three-cycle latency
+ that otherwise dominates on short buffers such as a 48-byte header. */
+static inline void crc32c_batch_3way(uint32_t *crcs, const void *const *bufs,
+                                     const size_t *lens, unsigned int count,
+                                     uint32_t (*u8)(uint32_t, uint8_t),
+                                     uint32_t (*u64)(uint32_t, uint64_t))
+{
+    const unsigned char *next0, *next1, *next2;
+    uint32_t crc0, crc1, crc2;
+    size_t common, k;
+    unsigned int n;
+    
+    for (n = 0; n + 3 <= count; n += 3) {
+        next0 = (const unsigned char *)bufs[n];
+        next1 = (const unsigned char *)bufs[n + 1];
+        next2 = (const unsigned char *)bufs[n + 2];
+        crc0 = crcs[n] ^ 0xffffffff;
+        crc1 = crcs[n + 1] ^ 0xffffffff;
+        crc2 = crcs[n + 2] ^ 0xffffffff;
+        
+        common = lens[n];
+        if (lens[n + 1] < common)
+            common = lens[n + 1];
+        if (lens[n + 2] < common)
+            common = lens[n + 2];
+        common &= ~(size_t)7;
+        
+        for (k = 0; k < common; k += 8) {
+            crc0 = u64(crc0, crc32c_load64(next0 + k));
+            crc1 = u64(crc1, crc32c_load64(next1 + k));
+            crc2 = u64(crc2, crc32c_load64(next2 + k));
+        }
+        
+        crcs[n] = crc32c_tail(crc0, next0 + common, lens[n] - common, u8, u64) ^ 0xffffffff;
+        crcs[n + 1] = crc32c_tail(crc1, next1 + common, lens[n + 1] - common, u8, u64) ^ 0xffffffff;
+        crcs[n + 2] = crc32c_tail(crc2, next2 + common, lens[n + 2] - common, u8, u64) ^ 0xffffffff;
+    }
+    for (; n < count; n++)
+        crcs[n] = crc32c_tail(crcs[n] ^ 0xffffffff, (const unsigned char *)bufs[n],
+                              lens[n], u8, u64) ^ 0xffffffff;
+}
+
+/* Shift a crc by LONG and SHORT zeros using the lookup tables. */
+static inline uint32_t crc32c_shift_long(uint32_t crc)
+{
+    return crc32c_shift(crc32c_long, crc);
+}
+
+static inline uint32_t crc32c_shift_short(uint32_t crc)
+{
+    return crc32c_shift(crc32c_short, crc);
+}
+
+#if defined(__x86_64__)
+
+/* Intel SSE 4.2 crc instructions. */
+static inline uint32_t crc32c_sse42_u8(uint32_t crc, uint8_t data)
+{
+    __asm__("crc32b\t" "%1, %0" : "+r"(crc) : "rm"(data));
+    return crc;
+}
+
+static inline uint32_t crc32c_sse42_u64(uint32_t crc, uint64_t data)
+{
+    uint64_t crc64 = crc;
+    
+    __asm__("crc32q\t" "%1, %0" : "+r"(crc64) : "rm"(data));
+    return (uint32_t)crc64;
+}
+
+/* Shift a crc by n zero bytes given the constant k = x^(8n-33) modulo the
+ polynomial.  The carry-less product of the crc and k is a 64-bit value that
+ the crc instruction (which multiplies by x^32 and reduces) brings to the
+ shifted crc, so no lookup tables are needed. */
+static inline uint32_t crc32c_shift_clmul(uint64_t k, uint32_t crc)
+{
+    uint64_t product;
+    
+    __asm__("movq\t" "%1, %%xmm0\n\t"
+            "movq\t" "%2, %%xmm1\n\t"
+            "pclmulqdq\t" "$0x00, %%xmm1, %%xmm0\n\t"
+            "movq\t" "%%xmm0, %0"
+            : "=r"(product)
+            : "r"((uint64_t)crc), "r"(k)
+            : "xmm0", "xmm1");
+    return crc32c_sse42_u64(0, product);
+}
+
+static inline uint32_t crc32c_shift_long_clmul(uint32_t crc)
+{
+    return crc32c_shift_clmul(crc32c_long_clmul, crc);
+}
+
+static inline uint32_t crc32c_shift_short_clmul(uint32_t crc)
+{
+    return crc32c_shift_clmul(crc32c_short_clmul, crc);
+}
+
+/* Compute CRC-32C using the Intel hardware instruction. */
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_3way(crc, NULL, buf, len, crc32c_sse42_u8, crc32c_sse42_u64,
+                       crc32c_shift_long, crc32c_shift_short);
+}
+
+static uint32_t crc32c_sse42_copy(uint32_t crc, void *dst, const void *src, size_t len)
+{
+    return crc32c_3way(crc, (unsigned char *)dst, src, len, crc32c_sse42_u8,
+                       crc32c_sse42_u64, crc32c_shift_long, crc32c_shift_short);
+}
+
+/* Compute CRC-32C using the Intel hardware instruction, combining the three
+ streams with a carry-less multiply instead of table lookups. */
+static uint32_t crc32c_sse42_clmul(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_3way(crc, NULL, buf, len, crc32c_sse42_u8, crc32c_sse42_u64,
+                       crc32c_shift_long_clmul, crc32c_shift_short_clmul);
+}
+
+static void crc32c_sse42_batch(uint32_t *crcs, const void *const *bufs,
+                               const size_t *lens, unsigned int count)
+{
+    crc32c_batch_3way(crcs, bufs, lens, count, crc32c_sse42_u8, crc32c_sse42_u64);
+}
+
+static uint32_t crc32c_sse42_clmul_copy(uint32_t crc, void *dst, const void *src, size_t len)
+{
+    return crc32c_3way(crc, (unsigned char *)dst, src, len, crc32c_sse42_u8,
+                       crc32c_sse42_u64, crc32c_shift_long_clmul,
+                       crc32c_shift_short_clmul);
+}
+
+/* Determine whether the processor supports SSE 4.2 and PCLMULQDQ. */
+static void crc32c_cpu_features(int *sse42, int *pclmul)
+{
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    
+    __asm__("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    *sse42 = (ecx >> 20) & 1;
+    *pclmul = (ecx >> 1) & 1;
+}
+
+#elif defined(__aarch64__)
+
+/* ARMv8 crc instructions. */
+static inline uint32_t crc32c_armv8_u8(uint32_t crc, uint8_t data)
+{
+    __asm__(".arch_extension crc\n\t"
+            "crc32cb\t" "%w0, %w0, %w1" : "+r"(crc) : "r"((uint32_t)data));
+    return crc;
+}
+
+static inline uint32_t crc32c_armv8_u64(uint32_t crc, uint64_t data)
+{
+    __asm__(".arch_extension crc\n\t"
+            "crc32cx\t" "%w0, %w0, %x1" : "+r"(crc) : "r"(data));
+    return crc;
+}
+
+/* Compute CRC-32C using the ARMv8 hardware instruction. */
+static uint32_t crc32c_armv8(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_3way(crc, NULL, buf, len, crc32c_armv8_u8, crc32c_armv8_u64,
+                       crc32c_shift_long, crc32c_shift_short);
+}
+
+static void crc32c_armv8_batch(uint32_t *crcs, const void *const *bufs,
+                               const size_t *lens, unsigned int count)
+{
+    crc32c_batch_3way(crcs, bufs, lens, count, crc32c_armv8_u8, crc32c_armv8_u64);
+}
+
+static uint32_t crc32c_armv8_copy(uint32_t crc, void *dst, const void *src, size_t len)
+{
+    return crc32c_3way(crc, (unsigned char *)dst, src, len, crc32c_armv8_u8,
+                       crc32c_armv8_u64, crc32c_shift_long, crc32c_shift_short);
+}
+
+/* Determine whether the processor supports the ARMv8 CRC32 instructions. */
+static int crc32c_cpu_features(void)
+{
+#if defined(__ARM_FEATURE_CRC32) || defined(KERNEL)
+    /* every 64-bit ARM processor that runs macOS implements CRC32 */
+    return 1;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & (1 << 7)) != 0;   /* HWCAP_CRC32 */
+#elif defined(__APPLE__)
+    int value = 0;
+    size_t size = sizeof(value);
+    
+    if (sysctlbyname("hw.optional.armv8_crc32", &value, &size, NULL, 0))
+        return 0;
+    return value;
+#else
+    return 0;
+#endif
+}
+
+#endif
+
+/* Implementation selected by crc32c_init(). */
+static uint32_t (*crc32c_impl)(uint32_t, const void *, size_t) = crc32c_sw;
+static uint32_t (*crc32c_copy_impl)(uint32_t, void *, const void *, size_t) = crc32c_sw_copy;
+static void (*crc32c_batch_impl)(uint32_t *, const void *const *, const size_t *,
+                                 unsigned int) = crc32c_sw_batch;
+static const char *crc32c_impl_name = "slicing-by-8";
+
+/* Initialize tables and select the fastest implementation. */
+void crc32c_init(void)
+{
+    uint32_t n, k, crc;
+    
+    crc32c_zeros(crc32c_long, LONG);
+    crc32c_zeros(crc32c_short, SHORT);
+    
+    crc32c_long_clmul = crc32c_xpow(LONG*8 - 33);
+    crc32c_short_clmul = crc32c_xpow(SHORT*8 - 33);
+    
+    crc32c_x2n_table[0] = crc32c_xpow(1);
+    for (n = 1; n < 32; n++)
+        crc32c_x2n_table[n] = crc32c_multmodp(crc32c_x2n_table[n - 1],
+                                              crc32c_x2n_table[n - 1]);
+    
+    for (n = 0; n < 256; n++) {
+        crc = n;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++) {
+        crc = crc32c_table[0][n];
+        for (k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+    
+    crc32c_impl = crc32c_sw;
+    crc32c_copy_impl = crc32c_sw_copy;
+    crc32c_batch_impl = crc32c_sw_batch;
+    crc32c_impl_name = "slicing-by-8";
+
+#if defined(__x86_64__)
+    int sse42, pclmul;
+    
+    crc32c_cpu_features(&sse42, &pclmul);
+    if (sse42 && pclmul) {
+        crc32c_impl = crc32c_sse42_clmul;
+        crc32c_copy_impl = crc32c_sse42_clmul_copy;
+        crc32c_batch_impl = crc32c_sse42_batch;
+        crc32c_impl_name = "sse4.2+pclmul";
+    }
+    else if (sse42) {
+        crc32c_impl = crc32c_sse42;
+        crc32c_copy_impl = crc32c_sse42_copy;
+        crc32c_batch_impl = crc32c_sse42_batch;
+        crc32c_impl_name = "sse4.2";
+    }
+#elif defined(__aarch64__)
+    if (crc32c_cpu_features()) {
+        crc32c_impl = crc32c_armv8;
+        crc32c_copy_impl = crc32c_armv8_copy;
+        crc32c_batch_impl = crc32c_armv8_batch;
+        crc32c_impl_name = "armv8";
+    }
+#endif
+}
+
+/* Get the name of the selected implementation. */
+const char * crc32c_implementation(void)
+{
+    return crc32c_impl_name;
+}
+
+/* Compute CRC-32C using the selected implementation. */
+uint32_t crc32c(uint32_t crc,const void * buf,size_t len)
+{
+    // NS modification - return initial value if buffer empty
+    if(!len || !buf)
+        return crc;
+    
+    return crc32c_impl(crc, buf, len);
+}
+
+/* Copy data and compute its CRC-32C in a single pass. */
+uint32_t crc32c_copy(uint32_t crc,void * dst,const void * src,size_t len)
+{
+    if(!len || !dst || !src)
+        return crc;
+    
+    return crc32c_copy_impl(crc, dst, src, len);
+}
+
+/* Combine the crcs of two consecutive blocks: shift crc1 over len2 zero
+ bytes, which takes O(log(len2)) multiplications, and add crc2. */
+uint32_t crc32c_combine(uint32_t crc1,uint32_t crc2,size_t len2)
+{
+    return crc32c_multmodp(crc32c_x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+/* Compute CRC-32C over a scatter-gather list. */
+uint32_t crc32c_iovec(uint32_t crc,const struct iovec * iov,unsigned int iovcnt)
+{
+    unsigned int n;
+    
+    for (n = 0; n < iovcnt; n++)
+        crc = crc32c(crc, iov[n].iov_base, iov[n].iov_len);
+    return crc;
+}
+
+/* Compute CRC-32C over many independent buffers at once. */
+void crc32c_batch(uint32_t * crcs,const void * const * buffers,
+                  const size_t * lengths,unsigned int count)
+{
+    if(!crcs || !buffers || !lengths)
+        return;
+    
+    crc32c_batch_impl(crcs, buffers, lengths, count);
 }
@@ -11,11 +11,24 @@
 #ifndef __ISCSI_INITIATOR_CRC32C_H__
 #define __ISCSI_INITIATOR_CRC32C_H__
 
+#ifdef KERNEL
 #include <IOKit/IOLib.h>
+#else
+#include <stdint.h>
+#include <stddef.h>
+#endif
+
+#include <sys/uio.h>
 
-/*! Call once to initialize CRC32C. */
+/*! Call once to initialize CRC32C.  Builds the lookup tables and selects
+ *  the fastest implementation supported by the processor (SSE 4.2, SSE 4.2
+ *  with PCLMULQDQ, ARMv8 CRC32 or slicing-by-8 in software). */
 void crc32c_init(void);
 
+/*! Gets the name of the implementation selected by crc32c_init().
+ *  @return name of the implementation. */
+const char * crc32c_implementation(void);
+
 /*! Computes the CRC32C checksum of data.
  *  @param crc the existing crc for prior data, if any,.
  *  @param buffer the buffer to compute
@@ -23,4 +36,41 @@ void crc32c_init(void);
  *  @return the new CRC32C checksum. */
 uint32_t crc32c(uint32_t crc,const void * buffer,size_t length);
 
+/*! Copies data and computes its CRC32C checksum in a single pass, so that
+ *  each byte is read only once.
+ *  @param crc the existing crc for prior data, if any.
+ *  @param dst the buffer to copy to.
+ *  @param src the buffer to copy from and compute.
+ *  @param length the number of bytes to copy.
+ *  @return the new CRC32C checksum. */
+uint32_t crc32c_copy(uint32_t crc,void * dst,const void * src,size_t length);
+
+/*! Combines the CRC32C checksums of two consecutive blocks of data into the
+ *  checksum of the concatenated data, so that blocks can be checksummed
+ *  separately (out of order or on different processors) and merged.
+ *  @param crc1 the checksum of the first block.
+ *  @param crc2 the checksum of the second block.
+ *  @param length2 the length of the second block.
+ *  @return the CRC32C checksum of the first block followed by the second. */
+uint32_t crc32c_combine(uint32_t crc1,uint32_t crc2,size_t length2);
+
+/*! Computes the CRC32C checksum of the data in a scatter-gather list.
+ *  @param crc the existing crc for prior data, if any.
+ *  @param iov the scatter-gather list.
+ *  @param iovcnt the number of entries in the scatter-gather list.
+ *  @return the new CRC32C checksum. */
+uint32_t crc32c_iovec(uint32_t crc,const struct iovec * iov,unsigned int iovcnt);
+
+/*! Computes the CRC32C checksums of many independent buffers at once.  On
+ *  processors with CRC instructions the buffers are processed three at a
+ *  time with their instructions interleaved, which is considerably faster
+ *  than separate crc32c() calls for short buffers (such as headers).
+ *  @param crcs on entry, the existing crc of each buffer (0 if none); on
+ *  return, the new CRC32C checksum of each buffer.
+ *  @param buffers the buffers to compute.
+ *  @param lengths the length of each buffer.
+ *  @param count the number of buffers. */
+void crc32c_batch(uint32_t * crcs,const void * const * buffers,
+                  const size_t * lengths,unsigned int count);
+
 #endif
@@ -12,11 +12,6 @@
 
 #define super IOEventSource
 
-struct iSCSITask {
-    queue_chain_t queueChain;
-    UInt32 initiatorTaskTag;
-};
-
 OSDefineMetaClassAndStructors(iSCSIIOEventSource,IOEventSource);
 
 bool iSCSIIOEventSource::init(iSCSIVirtualHBA * owner,
@@ -31,10 +26,6 @@ bool iSCSIIOEventSource::init(iSCSIVirtualHBA * owner,
     iSCSIIOEventSource::session = session;
     iSCSIIOEventSource::connection = connection;
     
-    // Initialize task queue to store parallel SCSI tasks for processing
-    queue_init(&taskQueue);
-    taskQueueLock = IOSimpleLockAlloc();
-    
 	return true;
 }
 
@@ -49,6 +40,15 @@ void iSCSIIOEventSource::socketCallback(socket_t so,
         eventSource->signalWorkAvailable();
 }
 
+/*! Wakes the workloop so that it polls the connection for the responses
+ *  to commands that have just been sent.  Called from the connection's
+ *  transmit workloop when the session polls. */
+void iSCSIIOEventSource::requestPoll()
+{
+    if(getWorkLoop())
+        signalWorkAvailable();
+}
+
 bool iSCSIIOEventSource::checkForWork()
 {
     if(!isEnabled())
@@ -58,18 +58,41 @@ bool iSCSIIOEventSource::checkForWork()
     // actual data is available at the port (as opposed to other socket events)
     iSCSIVirtualHBA * hba = (iSCSIVirtualHBA*)owner;
 
-    if(hba->isPDUAvailable(connection))
+    // Process every PDU that has been buffered for this connection in one
+    // go; a partial PDU waits until the socket signals that more data arrived
+    UInt32 count = 0;
+    
+    while(count < kMaxPDUsPerCheck && hba->isPDUAvailable(connection))
     {
         // Validate action & owner, then call action on our owner & pass in socket
-        if(action && owner)
-            (*action)(owner,session,connection);
+        if(!action || !owner)
+            break;
         
-        // Tell workloop thread to call us again (gives it a chance to handle
-        // other requests first)
-        if(hba->isPDUAvailable(connection))
-            return true;
+        (*action)(owner,session,connection);
+        count++;
+        
+        // Stop as soon as a PDU has failed the connection (e.g., the target
+        // asked for it to be dropped); the HBA workloop releases it
+        if(!isEnabled() || connection->failed)
+            break;
     }
     
+    // Hand over the tasks completed by this batch of PDUs together
+    hba->EndReceiveBatch(session);
+    
+    if(!isEnabled() || connection->failed)
+        return false;
+    
+    // Tell workloop thread to call us again (gives it a chance to handle
+    // other requests first)
+    if(count == kMaxPDUsPerCheck && hba->isPDUAvailable(connection))
+        return true;
+    
+    // In polling mode, spin briefly for the next PDU rather than waiting
+    // for the socket to wake the workloop; call us again if one arrived
+    if(hba->PollForPDU(session,connection))
+        return true;
+    
     // Tell workloop thread not to call us again until we signal again...
 	return false;
 }
\ No newline at end of file
@@ -12,12 +12,10 @@
 #include <IOKit/IOEventSource.h>
 
 #include <sys/kpi_socket.h>
-#include <kern/queue.h>
 
 #include "iSCSIKernelClasses.h"
 #include "iSCSITypesKernel.h"
 
-struct iSCSITask;
 class iSCSIVirtualHBA;
 
 /*! This event source wraps around a network socket and provides a software
@@ -62,6 +60,11 @@ public:
 	static void socketCallback(socket_t so,
 							   iSCSIIOEventSource * eventSource,
 							   int waitf);
+    
+    /*! Wakes the workloop so that it polls the connection for the responses
+     *  to commands that have just been sent.  Called from the connection's
+     *  transmit workloop when the session polls. */
+    void requestPoll();
 
 protected:
 	
@@ -73,21 +76,15 @@ protected:
 		
 private:
 				
+    /*! Maximum number of PDUs processed each time checkForWork() is called,
+     *  which allows the workloop to service other event sources in between. */
+    static const UInt32 kMaxPDUsPerCheck = 64;
+    
     /*! The iSCSI session associated with this event source. */
     iSCSISession * session;
     
     /*! The iSCSI connection associated with this event source. */
     iSCSIConnection * connection;
-    
-    queue_head_t taskQueue;
-    
-    /*! Flag used to indicate whether the task at the head of the queue is a 
-     *  new task that has not yet been processed. */
-    bool newTask;
-    
-    /*! Mutex lock used to prevent simultaneous access to the iSCSI task queue
-     *  (e.g., simultaneous calls to addTaskToQueue() and removeTaskFromQueue(). */
-    IOSimpleLock * taskQueueLock;
 };
 
 #endif /* defined(__ISCSI_EVENT_SOURCE_H__) */
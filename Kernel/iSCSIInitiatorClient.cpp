@@ -214,6 +214,55 @@ const IOExternalMethodDispatch iSCSIInitiatorClient::methods[kiSCSIInitiatorNumM
         0,
         0,                                  // Returned connection count
         kIOUCVariableStructureSize // connection address structures
+    },
+    {
+        (IOExternalMethodAction) &iSCSIInitiatorClient::GetSessionStatistics,
+        1,                                  // Session ID
+        0,
+        0,
+        sizeof(iSCSIKernelSessionStats)     // Statistics to get
+    },
+    {
+        (IOExternalMethodAction) &iSCSIInitiatorClient::GetPoolStatistics,
+        0,
+        0,
+        0,
+        sizeof(iSCSIKernelPoolStats)        // Statistics to get
+    },
+    {
+        (IOExternalMethodAction) &iSCSIInitiatorClient::GetConnectionStatistics,
+        2,                                  // Session ID, connection ID
+        0,
+        0,
+        sizeof(iSCSIKernelConnectionStats)  // Statistics to get
+    },
+    {
+        (IOExternalMethodAction) &iSCSIInitiatorClient::GetLatencyHistogram,
+        4,                                  // Session ID, scope, CID or LUN, category
+        0,
+        0,
+        sizeof(iSCSIKernelLatencyHistogram) // Histogram to get
+    },
+    {
+        (IOExternalMethodAction) &iSCSIInitiatorClient::SetTaskTraceInterval,
+        2,                                  // Session ID, sampling interval
+        0,
+        0,
+        0
+    },
+    {
+        (IOExternalMethodAction) &iSCSIInitiatorClient::GetTaskTrace,
+        1,                                  // Session ID
+        0,
+        0,
+        sizeof(iSCSIKernelTaskTrace)        // Trace records to get
+    },
+    {
+        (IOExternalMethodAction) &iSCSIInitiatorClient::SetPDUTraceEnabled,
+        3,                                  // Session ID, connection ID, enable
+        0,
+        0,
+        0
     }
 };
 
@@ -493,8 +542,17 @@ IOReturn iSCSIInitiatorClient::SetSessionOptions(iSCSIInitiatorClient * target,
     if(!session)
         return kIOReturnNotFound;
     
-    iSCSIKernelSessionCfg * options = (iSCSIKernelSessionCfg*)args->structureInput;
-    session->opts = *options;
+    iSCSIKernelSessionCfg options = *(iSCSIKernelSessionCfg*)args->structureInput;
+    
+    // The session's workloop holds its gate while it polls, so the time it
+    // may spend spinning is limited
+    if(options.pollBudgetUs > kiSCSIMaxPollBudgetUs)
+        options.pollBudgetUs = kiSCSIMaxPollBudgetUs;
+    
+    if(options.pollCPUPercent > kiSCSIMaxPollCPUPercent)
+        options.pollCPUPercent = kiSCSIMaxPollCPUPercent;
+    
+    session->opts = options;
     
     return kIOReturnSuccess;
 }
@@ -1153,5 +1211,232 @@ IOReturn iSCSIInitiatorClient::GetHostInterfaceForConnectionId(iSCSIInitiatorCli
     return kIOReturnSuccess;
 }
 
+IOReturn iSCSIInitiatorClient::GetSessionStatistics(iSCSIInitiatorClient * target,
+                                                    void * reference,
+                                                    IOExternalMethodArguments * args)
+{
+    // Validate buffer is large enough to hold statistics
+    if(args->structureOutputSize < sizeof(iSCSIKernelSessionStats))
+        return kIOReturnMessageTooLarge;
+    
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    
+    SID sessionId = (SID)args->scalarInput[0];
+    
+    // Range-check input
+    if(sessionId >= kiSCSIMaxSessions)
+        return kIOReturnBadArgument;
+    
+    // Do nothing if session doesn't exist
+    iSCSISession * session = hba->sessionList[sessionId];
+    
+    if(!session)
+        return kIOReturnNotFound;
+    
+    iSCSIKernelSessionStats * stats = (iSCSIKernelSessionStats*)args->structureOutput;
+    *stats = session->stats;
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn iSCSIInitiatorClient::GetPoolStatistics(iSCSIInitiatorClient * target,
+                                                 void * reference,
+                                                 IOExternalMethodArguments * args)
+{
+    // Validate buffer is large enough to hold statistics
+    if(args->structureOutputSize < sizeof(iSCSIKernelPoolStats))
+        return kIOReturnMessageTooLarge;
+    
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    
+    iSCSIKernelPoolStats * stats = (iSCSIKernelPoolStats*)args->structureOutput;
+    *stats = hba->poolStats;
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn iSCSIInitiatorClient::GetConnectionStatistics(iSCSIInitiatorClient * target,
+                                                       void * reference,
+                                                       IOExternalMethodArguments * args)
+{
+    // Validate buffer is large enough to hold statistics
+    if(args->structureOutputSize < sizeof(iSCSIKernelConnectionStats))
+        return kIOReturnMessageTooLarge;
+    
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    
+    SID sessionId = (SID)args->scalarInput[0];
+    CID connectionId = (CID)args->scalarInput[1];
+    
+    // Range-check input
+    if(sessionId >= kiSCSIMaxSessions || connectionId >= kiSCSIMaxConnectionsPerSession)
+        return kIOReturnBadArgument;
+    
+    // Do nothing if session doesn't exist
+    iSCSISession * session = hba->sessionList[sessionId];
+    
+    if(!session)
+        return kIOReturnNotFound;
+    
+    iSCSIConnection * connection = session->connections[connectionId];
+    
+    if(!connection)
+        return kIOReturnNotFound;
+    
+    hba->GetConnectionStatistics(connection,(iSCSIKernelConnectionStats*)args->structureOutput);
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn iSCSIInitiatorClient::GetLatencyHistogram(iSCSIInitiatorClient * target,
+                                                   void * reference,
+                                                   IOExternalMethodArguments * args)
+{
+    // Validate buffer is large enough to hold the histogram
+    if(args->structureOutputSize < sizeof(iSCSIKernelLatencyHistogram))
+        return kIOReturnMessageTooLarge;
+    
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    
+    SID sessionId = (SID)args->scalarInput[0];
+    
+    // Range-check input
+    if(sessionId >= kiSCSIMaxSessions)
+        return kIOReturnBadArgument;
+    
+    // Do nothing if session doesn't exist
+    iSCSISession * session = hba->sessionList[sessionId];
+    
+    if(!session)
+        return kIOReturnNotFound;
+    
+    iSCSIKernelLatencyHistogram * histogram =
+        hba->GetLatencyHistogram(session,(UInt32)args->scalarInput[1],
+                                 args->scalarInput[2],(UInt32)args->scalarInput[3]);
+    
+    if(!histogram)
+        return kIOReturnNotFound;
+    
+    memcpy(args->structureOutput,histogram,sizeof(iSCSIKernelLatencyHistogram));
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn iSCSIInitiatorClient::SetTaskTraceInterval(iSCSIInitiatorClient * target,
+                                                    void * reference,
+                                                    IOExternalMethodArguments * args)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    
+    SID sessionId = (SID)args->scalarInput[0];
+    
+    // Range-check input
+    if(sessionId >= kiSCSIMaxSessions)
+        return kIOReturnBadArgument;
+    
+    // Do nothing if session doesn't exist
+    iSCSISession * session = hba->sessionList[sessionId];
+    
+    if(!session)
+        return kIOReturnNotFound;
+    
+    hba->SetTaskTraceInterval(session,(UInt32)args->scalarInput[1]);
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn iSCSIInitiatorClient::GetTaskTrace(iSCSIInitiatorClient * target,
+                                            void * reference,
+                                            IOExternalMethodArguments * args)
+{
+    // Validate buffer is large enough to hold the trace records
+    if(args->structureOutputSize < sizeof(iSCSIKernelTaskTrace))
+        return kIOReturnMessageTooLarge;
+    
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    
+    SID sessionId = (SID)args->scalarInput[0];
+    
+    // Range-check input
+    if(sessionId >= kiSCSIMaxSessions)
+        return kIOReturnBadArgument;
+    
+    // Do nothing if session doesn't exist
+    iSCSISession * session = hba->sessionList[sessionId];
+    
+    if(!session)
+        return kIOReturnNotFound;
+    
+    hba->GetTaskTrace(session,(iSCSIKernelTaskTrace*)args->structureOutput);
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn iSCSIInitiatorClient::SetPDUTraceEnabled(iSCSIInitiatorClient * target,
+                                                  void * reference,
+                                                  IOExternalMethodArguments * args)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    
+    SID sessionId = (SID)args->scalarInput[0];
+    CID connectionId = (CID)args->scalarInput[1];
+    
+    // Range-check input
+    if(sessionId >= kiSCSIMaxSessions || connectionId >= kiSCSIMaxConnectionsPerSession)
+        return kIOReturnBadArgument;
+    
+    // Do nothing if session doesn't exist
+    iSCSISession * session = hba->sessionList[sessionId];
+    
+    if(!session)
+        return kIOReturnNotFound;
+    
+    iSCSIConnection * connection = session->connections[connectionId];
+    
+    if(!connection)
+        return kIOReturnNotFound;
+    
+    if(hba->SetPDUTraceEnabled(connection,(bool)args->scalarInput[2]))
+        return kIOReturnNoMemory;
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn iSCSIInitiatorClient::clientMemoryForType(UInt32 type,
+                                                   IOOptionBits * options,
+                                                   IOMemoryDescriptor ** memory)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,provider);
+    
+    SID sessionId = (SID)(type >> 16);
+    CID connectionId = (CID)(type & 0xFFFF);
+    
+    // Range-check input
+    if(!hba || sessionId >= kiSCSIMaxSessions || connectionId >= kiSCSIMaxConnectionsPerSession)
+        return kIOReturnBadArgument;
+    
+    iSCSISession * session = hba->sessionList[sessionId];
+    
+    if(!session)
+        return kIOReturnNotFound;
+    
+    iSCSIConnection * connection = session->connections[connectionId];
+    
+    if(!connection)
+        return kIOReturnNotFound;
+    
+    // The trace is allocated when it is first enabled
+    if(!connection->PDUTraceMemory)
+        return kIOReturnNotReady;
+    
+    // The mapping holds a reference, so the trace outlives the connection
+    // until user space unmaps it
+    connection->PDUTraceMemory->retain();
+    *memory = connection->PDUTraceMemory;
+    *options = kIOMapReadOnly;
+    
+    return kIOReturnSuccess;
+}
+
 
 
@@ -133,6 +133,34 @@ public:
     static IOReturn GetHostInterfaceForConnectionId(iSCSIInitiatorClient * target,
                                                     void * reference,
                                                     IOExternalMethodArguments * args);
+    
+    static IOReturn GetSessionStatistics(iSCSIInitiatorClient * target,
+                                         void * reference,
+                                         IOExternalMethodArguments * args);
+    
+    static IOReturn GetPoolStatistics(iSCSIInitiatorClient * target,
+                                      void * reference,
+                                      IOExternalMethodArguments * args);
+    
+    static IOReturn GetConnectionStatistics(iSCSIInitiatorClient * target,
+                                            void * reference,
+                                            IOExternalMethodArguments * args);
+    
+    static IOReturn GetLatencyHistogram(iSCSIInitiatorClient * target,
+                                        void * reference,
+                                        IOExternalMethodArguments * args);
+    
+    static IOReturn SetTaskTraceInterval(iSCSIInitiatorClient * target,
+                                         void * reference,
+                                         IOExternalMethodArguments * args);
+    
+    static IOReturn GetTaskTrace(iSCSIInitiatorClient * target,
+                                 void * reference,
+                                 IOExternalMethodArguments * args);
+    
+    static IOReturn SetPDUTraceEnabled(iSCSIInitiatorClient * target,
+                                       void * reference,
+                                       IOExternalMethodArguments * args);
 
     /*! Dispatched function invoked from user-space to send data
      *  over an existing, active connection. */
@@ -207,6 +235,16 @@ public:
                                               UInt32 type,
                                               io_user_reference_t refCon);
     
+    /*! Invoked when a user-space application maps memory of this user
+     *  client.  Maps the PDU trace of a connection read-only.
+     *  @param type the memory type (see iSCSIKernelPDUTraceMemoryType()).
+     *  @param options the options of the mapping.
+     *  @param memory the memory descriptor to map.
+     *  @return an error code indicating the result of the operation. */
+    virtual IOReturn clientMemoryForType(UInt32 type,
+                                         IOOptionBits * options,
+                                         IOMemoryDescriptor ** memory);
+    
     /*! Send a notification message to the user-space application.
      *  @param message details regarding the notification message.
      *  @return an error code indicating the result of the operation. */
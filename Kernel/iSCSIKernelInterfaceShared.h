@@ -126,6 +126,13 @@ enum functionNames {
     kiSCSIGetPortalAddressForConnectionId,
     kiSCSIGetPortalPortForConnectionId,
     kiSCSIGetHostInterfaceForConnectionId,
+    kiSCSIGetSessionStatistics,
+    kiSCSIGetPoolStatistics,
+    kiSCSIGetConnectionStatistics,
+    kiSCSIGetLatencyHistogram,
+    kiSCSISetTaskTraceInterval,
+    kiSCSIGetTaskTrace,
+    kiSCSISetPDUTraceEnabled,
 	kiSCSIInitiatorNumMethods
 };
 
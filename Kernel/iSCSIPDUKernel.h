@@ -27,6 +27,9 @@ namespace iSCSIPDU {
     
     /*! Reserved target transfer tag value. */
     static const UInt32 kiSCSIPDUTargetTransferTagReserved = 0xFFFFFFFF;
+    
+    /*! Reserved initiator task tag value. */
+    static const UInt32 kiSCSIPDUInitiatorTaskTagReserved = 0xFFFFFFFF;
 
     
     ///////////////////// For use with SCSI command PDUs ///////////////////////
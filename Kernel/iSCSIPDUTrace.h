@@ -0,0 +1,56 @@
+/*!
+ * @author		Nareg Sinenian
+ * @file		iSCSIPDUTrace.h
+ * @version		1.0
+ * @copyright	(c) 2013-2015 Nareg Sinenian. All rights reserved.
+ * @brief		Writes records to the PDU trace rings of a connection.  This
+ *              header depends only on iSCSITypesShared.h and on
+ *              OSMemoryBarrier(), so that it can be benchmarked on the host.
+ */
+
+#ifndef __ISCSI_PDU_TRACE_H__
+#define __ISCSI_PDU_TRACE_H__
+
+#include "iSCSITypesShared.h"
+
+/*! Records a PDU in a ring of a PDU trace.  Each ring has a single producer
+ *  (the workloop that sends or receives PDUs).
+ *  @param ring the ring to record the PDU in.
+ *  @param timestampNs the time at which the PDU was sent or received.
+ *  @param opCode the opcode of the PDU.
+ *  @param flags the opcode-specific flags of the PDU.
+ *  @param initiatorTaskTag the initiator task tag of the PDU.
+ *  @param sequenceNumber the CmdSN or StatSN of the PDU.
+ *  @param expSequenceNumber the ExpStatSN or ExpCmdSN of the PDU.
+ *  @param dataLength the length of the PDU's data segment. */
+static inline void iSCSIPDUTraceRecordPDU(iSCSIKernelPDUTraceRing * ring,
+                                          UInt64 timestampNs,
+                                          UInt8 opCode,
+                                          UInt8 flags,
+                                          UInt32 initiatorTaskTag,
+                                          UInt32 sequenceNumber,
+                                          UInt32 expSequenceNumber,
+                                          UInt32 dataLength)
+{
+    UInt64 position = ring->head;
+    iSCSIKernelPDUTraceRecord * record = &ring->records[position & (kiSCSIPDUTraceRecords-1)];
+    
+    // Invalidate the record while it is rewritten, so that a reader that
+    // copies it at the same time discards the copy
+    record->sequence = 0;
+    OSMemoryBarrier();
+    
+    record->timestampNs = timestampNs;
+    record->initiatorTaskTag = initiatorTaskTag;
+    record->sequenceNumber = sequenceNumber;
+    record->expSequenceNumber = expSequenceNumber;
+    record->dataLength = dataLength;
+    record->opCode = opCode;
+    record->flags = flags;
+    
+    OSMemoryBarrier();
+    record->sequence = position + 1;
+    ring->head = position + 1;
+}
+
+#endif /* defined(__ISCSI_PDU_TRACE_H__) */
@@ -0,0 +1,193 @@
+/*!
+ * @author		Nareg Sinenian
+ * @file		iSCSIR2TSequence.h
+ * @version		1.0
+ * @copyright	(c) 2013-2015 Nareg Sinenian. All rights reserved.
+ * @brief		Bookkeeping of the R2T (ready to transfer) sequences of a
+ *              task and of the Data-Out PDUs that service them.  This
+ *              header has no dependencies other than the UInt8, UInt32,
+ *              UInt64 and bool types, so that it can be tested on the host.
+ */
+
+#ifndef __ISCSI_R2T_SEQUENCE_H__
+#define __ISCSI_R2T_SEQUENCE_H__
+
+#include "iSCSISerialNumber.h"
+
+/*! State of an R2T (ready to transfer) sequence that is being serviced. */
+typedef struct iSCSIR2TSequence {
+    
+    /*! Indicates whether this entry holds an R2T that is being serviced. */
+    bool active;
+    
+    /*! LUN field of the R2T (network byte order). */
+    UInt64 LUN;
+    
+    /*! Target transfer tag of the R2T (network byte order). */
+    UInt32 targetTransferTag;
+    
+    /*! R2T sequence number. */
+    UInt32 R2TSN;
+    
+    /*! Offset of the requested data, relative to the transfer. */
+    UInt32 bufferOffset;
+    
+    /*! Number of bytes requested by the target. */
+    UInt32 desiredDataLength;
+    
+    /*! Number of bytes of the sequence that have been sent. */
+    UInt32 dataSent;
+    
+    /*! Data sequence number of the next Data-Out PDU of the sequence. */
+    UInt32 dataSN;
+    
+} iSCSIR2TSequence;
+
+/*! Gets the number of R2Ts that a target may have outstanding for a task.
+ *  @param maxOutstandingR2T the negotiated value of MaxOutstandingR2T.
+ *  @param sequenceCount the number of sequences a task can track.
+ *  @return the negotiated value, limited to what a task can track. */
+static inline UInt32 iSCSIR2TGetMaxOutstanding(UInt32 maxOutstandingR2T,
+                                               UInt32 sequenceCount)
+{
+    if(maxOutstandingR2T > sequenceCount)
+        return sequenceCount;
+    
+    return (maxOutstandingR2T == 0) ? 1 : maxOutstandingR2T;
+}
+
+/*! Records the data sequence requested by an R2T in the sequences of a
+ *  task.  A target that has more R2Ts outstanding for the task than the
+ *  negotiated MaxOutstandingR2T violates the protocol; the R2T is not
+ *  recorded in that case.
+ *  @param sequences the task's sequences.
+ *  @param sequenceCount the number of entries in sequences.
+ *  @param activeCount the number of active sequences; this is updated.
+ *  @param maxOutstandingR2T the negotiated value of MaxOutstandingR2T.
+ *  @param LUN the LUN field of the R2T (network byte order).
+ *  @param targetTransferTag the target transfer tag (network byte order).
+ *  @param R2TSN the R2T sequence number.
+ *  @param bufferOffset the offset of the requested data.
+ *  @param desiredDataLength the number of bytes requested.
+ *  @return the recorded sequence, or NULL if the target exceeded
+ *  MaxOutstandingR2T. */
+static inline iSCSIR2TSequence * iSCSIR2TSequenceAdd(iSCSIR2TSequence * sequences,
+                                                     UInt32 sequenceCount,
+                                                     UInt8 * activeCount,
+                                                     UInt32 maxOutstandingR2T,
+                                                     UInt64 LUN,
+                                                     UInt32 targetTransferTag,
+                                                     UInt32 R2TSN,
+                                                     UInt32 bufferOffset,
+                                                     UInt32 desiredDataLength)
+{
+    if(*activeCount >= iSCSIR2TGetMaxOutstanding(maxOutstandingR2T,sequenceCount))
+        return NULL;
+    
+    UInt32 index;
+    for(index = 0; index < sequenceCount; index++)
+        if(!sequences[index].active)
+            break;
+    
+    iSCSIR2TSequence * sequence = &sequences[index];
+    sequence->active            = true;
+    sequence->LUN               = LUN;
+    sequence->targetTransferTag = targetTransferTag;
+    sequence->R2TSN             = R2TSN;
+    sequence->bufferOffset      = bufferOffset;
+    sequence->desiredDataLength = desiredDataLength;
+    sequence->dataSent          = 0;
+    sequence->dataSN            = 0;
+    
+    (*activeCount)++;
+    return sequence;
+}
+
+/*! Gets the oldest (lowest R2TSN) active sequence of a task; this is the
+ *  only sequence that may be serviced when data sequences must be sent in
+ *  order.
+ *  @param sequences the task's sequences.
+ *  @param sequenceCount the number of entries in sequences.
+ *  @return the oldest sequence, or NULL if no sequence is active. */
+static inline iSCSIR2TSequence * iSCSIR2TSequenceGetOldest(iSCSIR2TSequence * sequences,
+                                                           UInt32 sequenceCount)
+{
+    iSCSIR2TSequence * oldest = NULL;
+    
+    for(UInt32 index = 0; index < sequenceCount; index++)
+    {
+        iSCSIR2TSequence * sequence = &sequences[index];
+        
+        if(sequence->active &&
+           (!oldest || iSCSISerialLessThan(sequence->R2TSN,oldest->R2TSN)))
+            oldest = sequence;
+    }
+    return oldest;
+}
+
+/*! Gets the data segment carried by the next Data-Out PDU of a sequence;
+ *  the PDU's data sequence number is the sequence's dataSN.  The sequence
+ *  must have data left to send.
+ *  @param sequence the sequence.
+ *  @param maxSegmentLength the largest data segment the target accepts.
+ *  @param segmentOffset returns the offset of the segment.
+ *  @param segmentLength returns the length of the segment.
+ *  @return true if the PDU is the final PDU of the sequence. */
+static inline bool iSCSIR2TSequenceGetNextSegment(const iSCSIR2TSequence * sequence,
+                                                  UInt32 maxSegmentLength,
+                                                  UInt32 * segmentOffset,
+                                                  UInt32 * segmentLength)
+{
+    UInt32 remainingDataLength = sequence->desiredDataLength - sequence->dataSent;
+    
+    *segmentOffset = sequence->bufferOffset + sequence->dataSent;
+    *segmentLength = (remainingDataLength < maxSegmentLength) ? remainingDataLength : maxSegmentLength;
+    
+    return *segmentLength == remainingDataLength;
+}
+
+/*! Records that the next Data-Out PDU of a sequence has been sent.
+ *  @param sequence the sequence.
+ *  @param segmentLength the length of the PDU's data segment. */
+static inline void iSCSIR2TSequenceSegmentSent(iSCSIR2TSequence * sequence,
+                                               UInt32 segmentLength)
+{
+    sequence->dataSent += segmentLength;
+    sequence->dataSN++;
+}
+
+/*! Releases a sequence of a task (e.g., once all of its data was sent).
+ *  @param sequence the sequence.
+ *  @param activeCount the number of active sequences of the task; this is
+ *  updated. */
+static inline void iSCSIR2TSequenceRelease(iSCSIR2TSequence * sequence,
+                                           UInt8 * activeCount)
+{
+    sequence->active = false;
+    (*activeCount)--;
+}
+
+/*! Adds a task to the tasks whose R2T sequences a connection services,
+ *  unless the task is already listed.
+ *  @param taskTags the initiator task tags of the listed tasks.
+ *  @param taskCount the number of listed tasks; this is updated.
+ *  @param maxTasks the number of entries in taskTags.
+ *  @param initiatorTaskTag the task's initiator task tag.
+ *  @return false if the list is full. */
+static inline bool iSCSIR2TTaskListAdd(UInt32 * taskTags,
+                                       UInt8 * taskCount,
+                                       UInt8 maxTasks,
+                                       UInt32 initiatorTaskTag)
+{
+    for(UInt8 index = 0; index < *taskCount; index++)
+        if(taskTags[index] == initiatorTaskTag)
+            return true;
+    
+    if(*taskCount == maxTasks)
+        return false;
+    
+    taskTags[(*taskCount)++] = initiatorTaskTag;
+    return true;
+}
+
+#endif /* defined(__ISCSI_R2T_SEQUENCE_H__) */
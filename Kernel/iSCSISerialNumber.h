@@ -0,0 +1,45 @@
+/*!
+ * @author		Nareg Sinenian
+ * @file		iSCSISerialNumber.h
+ * @version		1.0
+ * @copyright	(c) 2013-2015 Nareg Sinenian. All rights reserved.
+ * @brief		Serial number arithmetic (RFC1982) used to compare iSCSI
+ *              sequence numbers.  This header has no dependencies other
+ *              than the UInt32 and bool types, so that it can be tested on
+ *              the host.
+ */
+
+#ifndef __ISCSI_SERIAL_NUMBER_H__
+#define __ISCSI_SERIAL_NUMBER_H__
+
+/*! Compares two sequence numbers (e.g., CmdSN or StatSN) using serial number
+ *  arithmetic as defined by RFC1982 with SERIAL_BITS = 32, as required by
+ *  RFC3720.  Sequence numbers that are exactly 2^31 apart are not comparable
+ *  and this function returns false for either ordering.
+ *  @param a the first sequence number.
+ *  @param b the second sequence number.
+ *  @return true if a is less than b. */
+static inline bool iSCSISerialLessThan(UInt32 a,UInt32 b)
+{
+    return (a < b && (b - a) < 0x80000000) || (a > b && (a - b) > 0x80000000);
+}
+
+/*! Compares two sequence numbers using serial number arithmetic (RFC1982).
+ *  @param a the first sequence number.
+ *  @param b the second sequence number.
+ *  @return true if a is greater than b. */
+static inline bool iSCSISerialGreaterThan(UInt32 a,UInt32 b)
+{
+    return iSCSISerialLessThan(b,a);
+}
+
+/*! Compares two sequence numbers using serial number arithmetic (RFC1982).
+ *  @param a the first sequence number.
+ *  @param b the second sequence number.
+ *  @return true if a is less than or equal to b. */
+static inline bool iSCSISerialLessThanOrEqual(UInt32 a,UInt32 b)
+{
+    return a == b || iSCSISerialLessThan(a,b);
+}
+
+#endif /* defined(__ISCSI_SERIAL_NUMBER_H__) */
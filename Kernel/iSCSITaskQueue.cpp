@@ -12,6 +12,28 @@
 struct iSCSITask {
     queue_chain_t queueChain;
     UInt32 initiatorTaskTag;
+    
+    /*! Indicates whether the node is in the queue of outstanding tasks. */
+    bool active;
+    
+    /*! Initiator task tag of the task whose completion was posted. */
+    UInt32 completedTaskTag;
+    
+    /*! Nonzero while the node is on the completed task list. */
+    volatile UInt32 completionPosted;
+    
+    /*! Link used while the node is on the completed task list. */
+    iSCSITask * completionNext;
+};
+
+struct iSCSISubmission {
+    
+    /*! Sequence number of the slot.  A slot at ring position p may be
+     *  claimed by a producer when this is p, and holds a task that may be
+     *  taken by the consumer when this is p+1. */
+    volatile UInt32 sequence;
+    
+    UInt32 initiatorTaskTag;
 };
 
 OSDefineMetaClassAndStructors(iSCSITaskQueue,IOEventSource);
@@ -28,113 +50,406 @@ bool iSCSITaskQueue::init(iSCSIVirtualHBA * owner,
     iSCSITaskQueue::session = session;
     iSCSITaskQueue::connection = connection;
     
-    // Initialize task queue to store parallel SCSI tasks for processing
-    queue_init(&taskQueue);
+    // Tasks that have been started (and await completion) are kept in a
+    // queue that only the transmit workloop touches
+    queue_init(&activeTaskQueue);
+    
+    // Tasks waiting to be started are submitted through a ring that is large
+    // enough to hold every task the HBA can have, so it never fills up
+    submissionRingSize = 1;
+    
+    while(submissionRingSize < iSCSIVirtualHBA::kMaxTaskCount)
+        submissionRingSize <<= 1;
+    
+    if(!(submissionRing = (iSCSISubmission *)IOMalloc(submissionRingSize*sizeof(iSCSISubmission))))
+        return false;
+    
+    for(UInt32 index = 0; index < submissionRingSize; index++)
+        submissionRing[index].sequence = index;
+    
+    submissionHead = 0;
+    submissionTail = 0;
 
-    newTask = false;
+    outstandingTaskCount = 0;
+    completedTaskList = NULL;
+    
+    // Each entry of the session's task table has a node, so starting and
+    // completing tasks never allocates (and posting a completion can't fail)
+    if(!(taskPool = (iSCSITask *)IOMalloc(session->kTaskTableSize*sizeof(iSCSITask))))
+        return false;
+    
+    memset(taskPool,0,session->kTaskTableSize*sizeof(iSCSITask));
     
 	return true;
 }
 
-/*! Queues a new iSCSI task for delayed processing.
- *  @param initiatorTaskTag the iSCSI task tag associated with the task. */
-void iSCSITaskQueue::queueTask(UInt32 initiatorTaskTag)
+/*! Frees the event source, including its task nodes. */
+void iSCSITaskQueue::free()
+{
+    if(taskPool)
+        IOFree(taskPool,session->kTaskTableSize*sizeof(iSCSITask));
+    
+    if(submissionRing)
+        IOFree(submissionRing,submissionRingSize*sizeof(iSCSISubmission));
+    
+    taskPool = NULL;
+    submissionRing = NULL;
+    super::free();
+}
+
+/*! Gets the node of a task.  Each entry of the session's task table has
+ *  a node in this queue, so nodes are never allocated.
+ *  @param initiatorTaskTag the iSCSI task tag of the task.
+ *  @return the task node. */
+iSCSITask * iSCSITaskQueue::getTaskNode(UInt32 initiatorTaskTag)
 {
-    // Signal the workloop thread that work is available only if this is
-    // the only task in the queue (otherwise the task preceding this is
-    // being processed; we'll get to this once that's done).
-    iSCSITask * task = (iSCSITask*)IOMalloc(sizeof(iSCSITask));
-    task->initiatorTaskTag = initiatorTaskTag;
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    UInt32 taskId = hba->ParseInitiatorTaskTagForTaskId(initiatorTaskTag);
     
-    if(!onThread())
-        OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
+    return &taskPool[taskId & (session->kTaskTableSize-1)];
+}
+
+/*! Removes a task from the queue of outstanding tasks.  Called with the
+ *  gate closed.
+ *  @param task the node of the task. */
+void iSCSITaskQueue::retireTask(iSCSITask * task)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
     
-    bool firstTaskInQueue = false;
-    if(queue_empty(&taskQueue))
-        firstTaskInQueue = true;
+    queue_remove(&activeTaskQueue,task,iSCSITask *,queueChain);
+    task->active = false;
+    outstandingTaskCount--;
     
-    queue_enter(&taskQueue,task,iSCSITask *,queueChain);
+    OSDecrementAtomic((SInt32 *)&hba->poolStats.taskNodesInUse);
+}
+
+/*! Queues a new iSCSI task for delayed processing.  This may be called
+ *  from several threads at once and doesn't take the workloop's gate.
+ *  @param initiatorTaskTag the iSCSI task tag associated with the task.
+ *  @return true if the task was queued, false if the queue is full. */
+bool iSCSITaskQueue::queueTask(UInt32 initiatorTaskTag)
+{
+    // Tasks are queued from SCSI stack threads; a producer claims the slot
+    // at the head of the submission ring by advancing the head
+    UInt32 position;
+    iSCSISubmission * slot;
     
-    // Signal the workloop to process a new task...
-    if(firstTaskInQueue) {
-        newTask = true;
+    while(true)
+    {
+        position = submissionHead;
+        slot = &submissionRing[position & (submissionRingSize-1)];
+        
+        SInt32 difference = (SInt32)(slot->sequence - position);
+        
+        // The slot still holds a task that hasn't been started
+        if(difference < 0)
+            return false;
         
-        if(getWorkLoop())
-            signalWorkAvailable();
+        // Otherwise another producer may have claimed it first
+        if(difference == 0 && OSCompareAndSwap(position,position + 1,&submissionHead))
+            break;
     }
+    
+    // Publish the task to the transmit workloop
+    slot->initiatorTaskTag = initiatorTaskTag;
+    OSMemoryBarrier();
+    slot->sequence = position + 1;
+    
+    // Let the workloop decide whether the task can be started right away
+    // (otherwise we'll get to it once a task completes)...
+    signalWorkAvailable();
+    return true;
+}
+
+/*! Gets the oldest task that has been submitted but not yet started.
+ *  The task remains in the submission ring.  Called with the gate closed.
+ *  @param initiatorTaskTag the iSCSI task tag of the task.
+ *  @return true if a task was found, false if no task is waiting. */
+bool iSCSITaskQueue::peekSubmittedTask(UInt32 * initiatorTaskTag)
+{
+    iSCSISubmission * slot = &submissionRing[submissionTail & (submissionRingSize-1)];
+    
+    if(slot->sequence != submissionTail + 1)
+        return false;
+    
+    // Read the task only after its publication has been observed
+    OSMemoryBarrier();
+    *initiatorTaskTag = slot->initiatorTaskTag;
+    return true;
+}
+
+/*! Removes the task returned by peekSubmittedTask() from the submission
+ *  ring, making its slot available to producers.  Called with the gate
+ *  closed. */
+void iSCSITaskQueue::popSubmittedTask()
+{
+    iSCSISubmission * slot = &submissionRing[submissionTail & (submissionRingSize-1)];
+    
+    OSMemoryBarrier();
+    slot->sequence = submissionTail + submissionRingSize;
+    submissionTail++;
+}
+
+/*! Removes an outstanding task from the queue (either the task has been
+ *  successfully completed or aborted).  Tasks may be completed in any order.
+ *  This may be called from any thread (typically the receive workloop)
+ *  without blocking on the transmit workloop: a completion notice is posted
+ *  and the task is removed by the transmit workloop.
+ *  @param initiatorTaskTag the iSCSI task tag of the task to complete. */
+void iSCSITaskQueue::completeTask(UInt32 initiatorTaskTag)
+{
+    postCompletedTask(initiatorTaskTag);
+    
+    // A slot has opened up; let the transmit workloop start further tasks
+    signalWorkAvailable();
+}
+
+/*! Posts a completion notice for a task like completeTask(), but doesn't
+ *  wake the transmit workloop.  The caller signals the workloop (with
+ *  signalTransmitWork()) once it has completed a batch of tasks.
+ *  @param initiatorTaskTag the iSCSI task tag of the task to complete. */
+void iSCSITaskQueue::postCompletedTask(UInt32 initiatorTaskTag)
+{
+    iSCSITask * task = getTaskNode(initiatorTaskTag);
+    
+    // A task completes once, and its node is taken off the list before the
+    // node is used by another task (see checkForWork()), so the node is
+    // only on the list already if this task's completion is pending
+    if(!OSCompareAndSwap(0,1,&task->completionPosted))
+        return;
+    
+    task->completedTaskTag = initiatorTaskTag;
+    
+    iSCSITask * head;
+    
+    do {
+        head = (iSCSITask *)completedTaskList;
+        task->completionNext = head;
+    } while(!OSCompareAndSwapPtr(head,task,&completedTaskList));
 }
 
-/*! Removes a task from the queue (either the task has been successfully
- *  completed or aborted).
+/*! Removes the tasks for which completion notices have been posted from
+ *  the queue of outstanding tasks.  Called with the gate closed. */
+void iSCSITaskQueue::drainCompletedTasks()
+{
+    // Take the whole list at once; producers only ever push onto its head
+    iSCSITask * task;
+    
+    do {
+        task = (iSCSITask *)completedTaskList;
+    } while(task && !OSCompareAndSwapPtr(task,NULL,&completedTaskList));
+    
+    while(task)
+    {
+        iSCSITask * next = task->completionNext;
+        UInt32 completedTaskTag = task->completedTaskTag;
+        
+        // The node may be posted again from here on
+        OSMemoryBarrier();
+        task->completionPosted = 0;
+        
+        // The task may never have been started (e.g., it timed out while
+        // waiting in the submission ring)
+        if(task->active && task->initiatorTaskTag == completedTaskTag)
+            retireTask(task);
+        
+        task = next;
+    }
+}
+
+/*! Removes the oldest task from the queue (either the task has been
+ *  successfully completed or aborted).  Outstanding tasks are removed
+ *  before tasks that have not yet been processed.
  *  @return the iSCSI task tag for the task that was just completed. */
 UInt32 iSCSITaskQueue::completeCurrentTask()
 {
     UInt32 taskTag = 0;
-    iSCSITask * task = NULL;
     
-    // Do nothing if the queue is empty
-    if(queue_empty(&taskQueue))
-        return taskTag;
+    closeGate();
+    drainCompletedTasks();
     
-    // Remove the completed task (at the head of the queue) and then
-    // move onto the next task if one exists
-    if(!onThread())
-        OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
-
-    queue_remove_first(&taskQueue,task,iSCSITask *, queueChain);
-
-    if(task) {
+    // Remove the oldest outstanding task, or the oldest pending task if
+    // no tasks are outstanding
+    if(!queue_empty(&activeTaskQueue)) {
+        iSCSITask * task = (iSCSITask *)queue_first(&activeTaskQueue);
+        
         taskTag = task->initiatorTaskTag;
-        IOFree(task,sizeof(iSCSITask));
+        retireTask(task);
     }
+    else if(peekSubmittedTask(&taskTag))
+        popSubmittedTask();
     
     // If there are still tasks to process let the HBA know...
-    if(!queue_empty(&taskQueue)) {
-        newTask = true;
-        if(getWorkLoop())
-            signalWorkAvailable();
-    }
+    UInt32 nextTaskTag;
+    
+    if(peekSubmittedTask(&nextTaskTag) && canStartTask())
+        signalWorkAvailable();
+    
+    openGate();
     return taskTag;
 }
 
-/*! Gets the iSCSI task tag of the task that is current being processed.
+/*! Gets the iSCSI task tag of the oldest task that is being processed.
  *  @return iSCSI task tag of the current task. */
-UInt32 getCurrentTask()
+UInt32 iSCSITaskQueue::getCurrentTask()
 {
-    return 0;
+    if(queue_empty(&activeTaskQueue))
+        return 0;
+    
+    return ((iSCSITask *)queue_first(&activeTaskQueue))->initiatorTaskTag;
 }
 
-bool iSCSITaskQueue::checkForWork()
+/*! Gets the number of tasks that have been started but not completed.
+ *  @return the number of outstanding tasks. */
+UInt32 iSCSITaskQueue::getOutstandingTaskCount()
 {
-    if(!isEnabled())
-        return false;
+    return outstandingTaskCount;
+}
+
+/*! Gets whether the queue contains any tasks (outstanding or pending).
+ *  Tasks for which completion notices have been posted are removed first,
+ *  so this should be called with the gate closed.
+ *  @return true if there are no tasks in the queue. */
+bool iSCSITaskQueue::isEmpty()
+{
+    drainCompletedTasks();
+    
+    UInt32 initiatorTaskTag;
+    return queue_empty(&activeTaskQueue) && !peekSubmittedTask(&initiatorTaskTag);
+}
+
+/*! Gets whether another task may be started on this connection.  This is
+ *  the case if fewer than queue depth tasks are outstanding and the
+ *  session's command window is open.
+ *  @return true if another task may be started. */
+bool iSCSITaskQueue::canStartTask()
+{
+    // Always allow at least one outstanding task per connection
+    UInt32 queueDepth = connection->opts.queueDepth;
+    if(queueDepth == 0)
+        queueDepth = 1;
     
-    // Check task flag before proceeding
-    if(!newTask)
+    if(outstandingTaskCount >= queueDepth)
         return false;
     
-    newTask = false;
+    // Hold tasks while the command window is closed; the HBA will resume
+    // the queue once the target opens the window again
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    
+    if(!hba->IsCommandWindowOpen(session)) {
+        hba->BeginCommandWindowStall(session);
+        
+        // The receive workloop may have opened the window before the stall
+        // was recorded, in which case it won't resume this queue
+        if(!hba->IsCommandWindowOpen(session))
+            return false;
+    }
+    return true;
+}
+
+/*! Reserves the command sequence number of the next task to start.  The
+ *  window may close between canStartTask() and this call (connections of a
+ *  session take command sequence numbers from their own workloops), so the
+ *  reservation itself checks the window.
+ *  @param cmdSN the reserved command sequence number.
+ *  @return true if a command sequence number was reserved, false if the
+ *  session's command window is closed. */
+bool iSCSITaskQueue::reserveCmdSN(UInt32 * cmdSN)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    
+    if(hba->ReserveCmdSN(session,cmdSN))
+        return true;
+    
+    hba->BeginCommandWindowStall(session);
+    
+    // As in canStartTask(), the window may have opened before the stall was
+    // recorded, in which case this queue won't be resumed
+    return hba->ReserveCmdSN(session,cmdSN);
+}
 
+/*! Signals the workloop to start queued tasks if any can be started.
+ *  This is called (from the receive workloop) when the session's command
+ *  window opens; the queue itself is examined by the transmit workloop. */
+void iSCSITaskQueue::resumeQueuedTasks()
+{
+    if(!isEnabled())
+        return;
+    
+    signalWorkAvailable();
+}
+
+/*! Signals the transmit workloop that there is work to do other than
+ *  starting tasks (such as sending data solicited by an R2T).  This may
+ *  be called from any thread. */
+void iSCSITaskQueue::signalTransmitWork()
+{
+    signalWorkAvailable();
+}
+
+bool iSCSITaskQueue::checkForWork()
+{
+    // A failed connection is released by the HBA, which completes its tasks
+    if(!isEnabled() || connection->failed)
+        return false;
+    
     // Validate action & owner, then call action on our owner & pass in socket
     // this function will continue processing the task
-    if(action && owner) {
- 
-        UInt32 taskTag;
+    if(!action || !owner)
+        return false;
+    
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    
+    // Send control PDUs (NOP-Out replies, latency probes and task management
+    // requests) ahead of further commands
+    hba->SendQueuedControlPDUs(session,connection);
+    
+    // Retire tasks completed by the receive workloop (this may open up
+    // slots for further tasks), then send data solicited by R2Ts
+    drainCompletedTasks();
+    bool moreData = hba->ServiceQueuedR2Ts(session,connection);
+    
+    UInt32 initiatorTaskTag, cmdSN;
+    
+    if(peekSubmittedTask(&initiatorTaskTag) && canStartTask() && reserveCmdSN(&cmdSN))
+    {
+        iSCSITask * task = getTaskNode(initiatorTaskTag);
         
-        if(!onThread())
-            OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
+        // The previous task of this node posted its completion before its
+        // task table entry was reused, but perhaps after the notices were
+        // drained above; retire it before the node is reused
+        if(task->completionPosted || task->active)
+            drainCompletedTasks();
         
-        if(queue_empty(&taskQueue))
-            return false;
+        if(task->active)
+            retireTask(task);
         
-        iSCSITask * task = (iSCSITask *)queue_first(&taskQueue);
-        taskTag = task->initiatorTaskTag;
+        // Move the task at the head of the submission ring to the list of
+        // outstanding tasks before starting it (the action may complete the task)
+        popSubmittedTask();
+        
+        task->initiatorTaskTag = initiatorTaskTag;
+        task->active = true;
+        queue_enter(&activeTaskQueue,task,iSCSITask *,queueChain);
+        outstandingTaskCount++;
+        
+        UInt32 inUse = OSIncrementAtomic((SInt32 *)&hba->poolStats.taskNodesInUse) + 1;
+        
+        if(inUse > hba->poolStats.taskNodesHighWater)
+            hba->poolStats.taskNodesHighWater = inUse;
+        
+        (*action)(owner,session,connection,initiatorTaskTag,cmdSN);
         
-        (*action)(owner,session,connection,taskTag);
+        // Tell workloop thread to call us again if another task can be started
+        // (gives it a chance to handle other requests first)
+        if(peekSubmittedTask(&initiatorTaskTag) && canStartTask())
+            return true;
     }
-   
-    // Tell workloop thread not to call us again until we signal again...
-	return false;
+    
+    // No further tasks can be started for now; send the commands that
+    // have been gathered in the connection's transmit batch
+    hba->FlushPDUs(session,connection);
+	return moreData;
 }
 
 /*! Removes all tasks from the queue. */
@@ -143,17 +458,17 @@ void iSCSITaskQueue::clearTasksFromQueue()
     // Ensure the event source is disabled before proceeding...
     disable();
     
-    // Iterate over queue and clear all tasks (free memory for each task)
-    iSCSITask * task = NULL;
+    // Iterate over queue and clear all tasks
+    closeGate();
+    drainCompletedTasks();
     
-    if(!onThread())
-        OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
+    while(!queue_empty(&activeTaskQueue))
+        retireTask((iSCSITask *)queue_first(&activeTaskQueue));
     
-    while(!queue_empty(&taskQueue))
-    {
-        queue_remove_first(&taskQueue,task,iSCSITask *, queueChain);
-        if(task)
-            IOFree(task,sizeof(iSCSITask));
-    }
+    UInt32 initiatorTaskTag;
+    
+    while(peekSubmittedTask(&initiatorTaskTag))
+        popSubmittedTask();
+    
+    openGate();
 }
-
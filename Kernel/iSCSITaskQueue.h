@@ -17,13 +17,20 @@
 #include "iSCSIVirtualHBA.h"
 
 struct iSCSITask;
+struct iSCSISubmission;
 
 /*! Provides an iSCSI task queue for an iSCSI HBA.  The HBA queues tasks as
- *  it receives them from the SCSI layer by calling queueTask().
- *  This queue will invoke a callback function gated against
- *  the HBA workloop to process new tasks as existing tasks are completed.
- *  Once the task is processed, the HBA should call completeCurrentTask() to 
- *  let the queue know that the task has been processed. */
+ *  it receives them from the SCSI layer by calling queueTask(), which
+ *  submits them through a lock-free ring without taking the gate.  This
+ *  queue will invoke a callback function gated against the connection's
+ *  transmit workloop to begin processing queued tasks.  Up to the
+ *  connection's queue depth of tasks may be outstanding at any one time,
+ *  provided that the session's command window (MaxCmdSN) allows another
+ *  command to be issued.  Once a task has been processed, the HBA should
+ *  call completeTask() with the task's initiator task tag to let the queue
+ *  know that the task has been processed (tasks may complete in any
+ *  order).  The queue also sends data solicited by R2Ts that the receive
+ *  workloop has handed over (see signalTransmitWork()). */
 class iSCSITaskQueue : public IOEventSource
 {
     OSDeclareDefaultStructors(iSCSITaskQueue);
@@ -35,7 +42,8 @@ public:
     typedef bool (*Action) (iSCSIVirtualHBA * owner,
                             iSCSISession * session,
                             iSCSIConnection * connection,
-                            UInt32 initiatorTaskTag);
+                            UInt32 initiatorTaskTag,
+                            UInt32 cmdSN);
 	
 	/*! Initializes the event source with an owner and an action.
 	 *	@param owner the owner that this event source will be attached to.
@@ -50,22 +58,60 @@ public:
                       iSCSISession * session,
                       iSCSIConnection * connection);
     
-    /*! Queues a new iSCSI task for delayed processing. 
-     *  @param initiatorTaskTag the iSCSI task tag associated with the task. */
-    void queueTask(UInt32 initiatorTaskTag);
+    /*! Queues a new iSCSI task for delayed processing.  This may be called
+     *  from several threads at once and doesn't take the workloop's gate.
+     *  @param initiatorTaskTag the iSCSI task tag associated with the task.
+     *  @return true if the task was queued, false if the queue is full. */
+    bool queueTask(UInt32 initiatorTaskTag);
     
-    /*! Removes a task from the queue (either the task has been successfully
-     *  completed or aborted).
+    /*! Removes an outstanding task from the queue (either the task has been
+     *  successfully completed or aborted).  Tasks may be completed in any order.
+     *  This may be called from any thread (typically the receive workloop)
+     *  without blocking on the transmit workloop: a completion notice is posted
+     *  and the task is removed by the transmit workloop.
+     *  @param initiatorTaskTag the iSCSI task tag of the task to complete. */
+    void completeTask(UInt32 initiatorTaskTag);
+    
+    /*! Posts a completion notice for a task like completeTask(), but doesn't
+     *  wake the transmit workloop.  The caller signals the workloop (with
+     *  signalTransmitWork()) once it has completed a batch of tasks.  The
+     *  notice is the task's own node, so posting never fails.
+     *  @param initiatorTaskTag the iSCSI task tag of the task to complete. */
+    void postCompletedTask(UInt32 initiatorTaskTag);
+    
+    /*! Removes the oldest task from the queue (either the task has been
+     *  successfully completed or aborted).  Outstanding tasks are removed
+     *  before tasks that have not yet been processed.
      *  @return the iSCSI task tag for the task that was just completed. */
     UInt32 completeCurrentTask();
     
     /*! Removes all tasks from the queue. */
     void clearTasksFromQueue();
     
-    /*! Gets the iSCSI task tag of the task that is current being processed.
+    /*! Gets the iSCSI task tag of the oldest task that is being processed.
      *  @return iSCSI task tag of the current task. */
     UInt32 getCurrentTask();
     
+    /*! Gets the number of tasks that have been started but not completed.
+     *  @return the number of outstanding tasks. */
+    UInt32 getOutstandingTaskCount();
+    
+    /*! Gets whether the queue contains any tasks (outstanding or pending).
+     *  Tasks for which completion notices have been posted are removed first,
+     *  so this should be called with the gate closed.
+     *  @return true if there are no tasks in the queue. */
+    bool isEmpty();
+    
+    /*! Signals the workloop to start queued tasks if any can be started.
+     *  This is called (from the receive workloop) when the session's command
+     *  window opens; the queue itself is examined by the transmit workloop. */
+    void resumeQueuedTasks();
+    
+    /*! Signals the transmit workloop that there is work to do other than
+     *  starting tasks (such as sending data solicited by an R2T).  This may
+     *  be called from any thread. */
+    void signalTransmitWork();
+    
 protected:
     
     /*! Called by the attached work loop to check if there is any processing
@@ -73,18 +119,81 @@ protected:
 	 *	to by this object.
 	 *	@return true if there was work, false otherwise. */
 	virtual bool checkForWork();
+    
+    /*! Frees the event source, including its task nodes. */
+    virtual void free();
 
 private:
     
+    /*! Gets the node of a task.  Each entry of the session's task table has
+     *  a node in this queue, so nodes are never allocated.
+     *  @param initiatorTaskTag the iSCSI task tag of the task.
+     *  @return the task node. */
+    iSCSITask * getTaskNode(UInt32 initiatorTaskTag);
+    
+    /*! Removes a task from the queue of outstanding tasks.  Called with the
+     *  gate closed.
+     *  @param task the node of the task. */
+    void retireTask(iSCSITask * task);
+    
+    /*! Removes the tasks for which completion notices have been posted from
+     *  the queue of outstanding tasks.  Called with the gate closed. */
+    void drainCompletedTasks();
+    
+    /*! Gets the oldest task that has been submitted but not yet started.
+     *  The task remains in the submission ring.  Called with the gate closed.
+     *  @param initiatorTaskTag the iSCSI task tag of the task.
+     *  @return true if a task was found, false if no task is waiting. */
+    bool peekSubmittedTask(UInt32 * initiatorTaskTag);
+    
+    /*! Removes the task returned by peekSubmittedTask() from the submission
+     *  ring, making its slot available to producers.  Called with the gate
+     *  closed. */
+    void popSubmittedTask();
+    
+    /*! Gets whether another task may be started on this connection.  This is
+     *  the case if fewer than queue depth tasks are outstanding and the
+     *  session's command window is open.
+     *  @return true if another task may be started. */
+    bool canStartTask();
+    
+    /*! Reserves the command sequence number of the next task to start.
+     *  @param cmdSN the reserved command sequence number.
+     *  @return true if a command sequence number was reserved, false if the
+     *  session's command window is closed. */
+    bool reserveCmdSN(UInt32 * cmdSN);
+    
     /*! The iSCSI session associated with this event source. */
     iSCSISession * session;
     
     /*! The iSCSI connection associated with this event source. */
     iSCSIConnection * connection;
     
-    queue_head_t taskQueue;
+    /*! Ring of tasks that have been queued but not yet started.  Any
+     *  number of threads may submit tasks; only the workloop takes them. */
+    iSCSISubmission * submissionRing;
+    
+    /*! Number of slots in the submission ring (a power of two). */
+    UInt32 submissionRingSize;
+    
+    /*! Position of the next slot to be claimed by a producer. */
+    volatile UInt32 submissionHead;
+    
+    /*! Position of the next slot to be taken by the workloop. */
+    UInt32 submissionTail;
+    
+    /*! Tasks that have been started and are awaiting completion. */
+    queue_head_t activeTaskQueue;
+    
+    /*! Number of tasks in the active task queue. */
+    UInt32 outstandingTaskCount;
+    
+    /*! Task nodes of this queue, indexed like the session's task table. */
+    iSCSITask * taskPool;
     
-    bool newTask;
+    /*! Lock-free list of the nodes of tasks that have completed, posted by
+     *  completeTask() and taken as a whole by the transmit workloop. */
+    void * volatile completedTaskList;
     
 };
 
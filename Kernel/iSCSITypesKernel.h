@@ -12,19 +12,201 @@
 
 
 #include <IOKit/IOLib.h>
+#include <IOKit/IOMemoryDescriptor.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/scsi/spi/IOSCSIParallelInterfaceController.h>
 #include <sys/socket.h>
 
 #include "iSCSITypesShared.h"
+#include "iSCSIRFC3720Defaults.h"
+#include "iSCSIPDUKernel.h"
+#include "iSCSISerialNumber.h"
+#include "iSCSIR2TSequence.h"
 
 class iSCSITaskQueue;
 class iSCSIIOEventSource;
 
+/*! Advances a sequence number to a new value unless it is already at or
+ *  beyond that value (serial number arithmetic, RFC1982).  The sequence
+ *  number may be advanced by several threads at once.
+ *  @param serial the sequence number to advance.
+ *  @param value the new value. */
+inline void iSCSISerialAdvance(volatile UInt32 * serial,UInt32 value)
+{
+    UInt32 current;
+    
+    do {
+        current = *serial;
+        
+        if(!iSCSISerialGreaterThan(value,current))
+            return;
+    } while(!OSCompareAndSwap(current,value,serial));
+}
+
+/*! A control PDU (NOP-Out or task management request) that is waiting to
+ *  be sent by the transmit workloop of a connection.  Control PDUs are
+ *  preallocated with the connection (see iSCSIConnection::controlPDUs). */
+typedef struct iSCSIControlPDU {
+    
+    /*! Link used while the PDU is on the connection's control queue. */
+    struct iSCSIControlPDU * next;
+    
+    /*! Basic header segment of the PDU. */
+    UInt8 bhs[kiSCSIPDUBasicHeaderSegmentSize];
+    
+    /*! Length of the data segment, in bytes. */
+    UInt32 length;
+    
+    /*! Storage for the data segment, which belongs to the connection. */
+    UInt8 * data;
+    
+} iSCSIControlPDU;
+
+/*! Data that the HBA associates with each SCSI task.  This is stored in the
+ *  HBA-specific data area that the SCSI family allocates for every task
+ *  (see ReportHBASpecificTaskDataSize()). */
+typedef struct iSCSITaskData {
+    
+    /*! Connection that the task was assigned to. */
+    CID connectionId;
+    
+    /*! Kernel mapping of the task's data buffer.  The mapping is created
+     *  the first time the task needs to access its data; the task's
+     *  reference is dropped when the task completes (under the session's
+     *  task table lock, see iSCSIVirtualHBA::GetTaskDataMap()). */
+    IOMemoryMap * dataMap;
+    
+    /*! R2T sequences of this task that are being serviced. */
+    iSCSIR2TSequence R2TSequences[kiSCSIMaxOutstandingR2T];
+    
+    /*! Number of active entries in R2TSequences. */
+    UInt8 activeR2TCount;
+    
+    /*! Time at which the task was queued by the SCSI stack (absolute time). */
+    UInt64 queueTime;
+    
+    /*! Time at which the task was started (absolute time). */
+    UInt64 startTime;
+    
+    /*! Time at which the task's SCSI command PDU was sent (absolute time). */
+    UInt64 commandSentTime;
+    
+    /*! Time at which the first PDU for the task was received (absolute
+     *  time). */
+    UInt64 firstResponseTime;
+    
+    /*! Time at which the task's status was received (absolute time). */
+    UInt64 statusTime;
+    
+    /*! The task itself; used to hand completed tasks to the HBA workloop. */
+    SCSIParallelTaskIdentifier parallelTask;
+    
+    /*! Status and service response that the task is completed with. */
+    SCSITaskStatus completionStatus;
+    SCSIServiceResponse completionResponse;
+    
+    /*! Link used while the task is waiting to be completed by the HBA
+     *  workloop. */
+    void * completionNext;
+    
+    /*! Set (with the session's gate closed) once the task is being
+     *  completed, so that a response and a timeout racing for the same task
+     *  complete it only once. */
+    bool completing;
+    
+} iSCSITaskData;
+
+/*! Entry of a session's task table.  SCSI tasks are assigned an entry when
+ *  they are queued and the initiator task tag encodes the entry's index and
+ *  generation, so that the task that a PDU refers to can be found with a
+ *  single array index and responses to stale tags are detected. */
+typedef struct iSCSITaskEntry {
+    
+    /*! Link used while the entry is on the session's free list. */
+    struct iSCSITaskEntry * next;
+    
+    /*! The SCSI task that occupies the entry, or NULL if it is free. */
+    SCSIParallelTaskIdentifier parallelTask;
+    
+    /*! HBA-specific state (R2T, mapping and timing) of the task. */
+    iSCSITaskData * taskData;
+    
+    /*! Incremented each time the entry is released. */
+    UInt16 generation;
+    
+    /*! Initiator task tag of the task if the transmit workloop couldn't
+     *  start it or send its data, so that the HBA workloop fails it (see
+     *  iSCSIVirtualHBA::FailTask()); 0xFFFFFFFF otherwise. */
+    volatile UInt32 failedTaskTag;
+    
+} iSCSITaskEntry;
+
+/*! An outstanding task management request of a session.  Task management
+ *  responses carry neither the LUN nor the referenced task, so they are
+ *  recorded here; the request's index is its initiator task tag. */
+typedef struct iSCSITaskMgmtRequest {
+    
+    /*! Indicates whether the entry holds an outstanding request. */
+    bool inUse;
+    
+    /*! Task management function of the request. */
+    UInt8 function;
+    
+    /*! Connection that the request was sent on. */
+    CID connectionId;
+    
+    /*! LUN addressed by the request. */
+    SCSILogicalUnitNumber LUN;
+    
+    /*! Task referenced by an abort task request. */
+    SCSITaggedTaskIdentifier taggedTaskId;
+    
+} iSCSITaskMgmtRequest;
+
+/*! Estimates the throughput and task rate of a connection in one direction
+ *  (reads or writes).  Time is only accumulated while tasks of that
+ *  direction are outstanding, so that the estimates reflect what the
+ *  connection can carry rather than how busy it happens to be. */
+typedef struct iSCSIRateEstimator {
+    
+    /*! Number of tasks that have been started but not completed. */
+    UInt32 outstandingTasks;
+    
+    /*! System uptime (absolute time) from which busy time is accumulated. */
+    UInt64 busyStartTime;
+    
+    /*! Busy time (absolute time) accumulated for the current sample. */
+    UInt64 busyTime;
+    
+    /*! Bytes transferred by tasks completed during the current sample. */
+    UInt64 sampleBytes;
+    
+    /*! Number of tasks completed during the current sample. */
+    UInt32 sampleTasks;
+    
+    /*! Moving average of the throughput, in bytes per second. */
+    UInt64 bytesPerSecond;
+    
+    /*! Moving average of the number of tasks completed per second. */
+    UInt32 IOPS;
+    
+    /*! Number of tasks completed. */
+    UInt64 tasksCompleted;
+    
+    /*! Number of bytes transferred. */
+    UInt64 bytesTransferred;
+    
+} iSCSIRateEstimator;
+
 /*! Definition of a single connection that is associated with a particular
  *  iSCSI session. */
 typedef struct iSCSIConnection {
     
-    /*! Status sequence number expected by the initiator. */
-    UInt32 expStatSN;
+    /*! Status sequence number expected by the initiator.  This is advanced
+     *  by the receive workloop and read by the transmit workloop. */
+    volatile UInt32 expStatSN;
     
     /*! Connection ID. */
     CID CID; // Might need this for ErrorRecovery (otherwise have to search through list for it)
@@ -44,8 +226,11 @@ typedef struct iSCSIConnection {
     /*! Socket used for communication. */
     socket_t socket;
     
-    /*! Used to keep track of R2T PDUs. */
-    UInt32 R2TSN;
+    /*! Workloop that sends the PDUs of this connection (commands, solicited
+     *  data and control PDUs).  PDUs are received and processed by the
+     *  session's workloop, so that sending and receiving proceed in
+     *  parallel. */
+    IOWorkLoop * txWorkLoop;
     
     /*! iSCSI task queue used to manage tasks for this connection. */
     iSCSITaskQueue * taskQueue;
@@ -58,7 +243,8 @@ typedef struct iSCSIConnection {
     iSCSIKernelConnectionCfg opts;
     
     /*! Amount of data, in bytes, that this connection has been requested
-     *  to transfer.  This is used for bitrate-based load balancing. */
+     *  to transfer by tasks that have not yet completed.  This is used for
+     *  bitrate-based load balancing. */
     UInt64 dataToTransfer;
     
     /*! The maximum length of data allowed for immediate data (data sent as part
@@ -67,27 +253,177 @@ typedef struct iSCSIConnection {
      *  is a session option while the latter is a connection option. */
     UInt32 immediateDataLength;
     
-    /*! Keeps track of when processing began for a particualr task, as
-     *  represented by the system uptime (seconds component). */
-    clock_sec_t taskStartTimeSec;
+    /*! Throughput and task rate of read tasks on this connection. */
+    iSCSIRateEstimator readRate;
+    
+    /*! Throughput and task rate of write tasks on this connection. */
+    iSCSIRateEstimator writeRate;
+    
+    /*! Smoothed round-trip time of the connection, in microseconds. */
+    UInt32 smoothedRTTUs;
+    
+    /*! Round-trip time variation of the connection, in microseconds. */
+    UInt32 RTTVarianceUs;
+    
+    /*! Number of round-trip time samples taken; the estimator is seeded
+     *  by the first sample. */
+    UInt32 RTTSampleCount;
+    
+    /*! Indicates whether a latency probe (NOP-Out) has been sent on this
+     *  connection and its NOP-In has not yet been received. */
+    bool probeOutstanding;
+    
+    /*! System uptime (absolute time) when the last latency probe was sent. */
+    UInt64 probeSendTime;
+    
+    /*! Latency histograms of tasks on this connection, for each category
+     *  (see the enumerated type iSCSILatencyCategories). */
+    iSCSIKernelLatencyHistogram latency[kiSCSILatencyCategoryCount];
+    
+    /*! Histograms of the time tasks on this connection spend in each stage
+     *  (see the enumerated type iSCSITaskStages). */
+    iSCSIKernelLatencyHistogram stageLatency[kiSCSITaskStageCount];
+    
+    /*! Memory shared with user space that holds the PDU trace of this
+     *  connection; allocated the first time the trace is enabled. */
+    IOBufferMemoryDescriptor * PDUTraceMemory;
+    
+    /*! Kernel address of PDUTraceMemory. */
+    iSCSIKernelPDUTrace * PDUTrace;
     
-    /*! Keeps track of when processing began for a particualr task, as
-     *  represented by the system uptime (microseconds component). */
-    clock_usec_t taskStartTimeUSec;
+    /*! Indicates whether PDUs sent and received are recorded in PDUTrace. */
+    volatile bool PDUTraceEnabled;
     
-    /*! Keeps track of the iSCSI data transfer rate of this connection,
-     *  in units of bytes per second.  This number is obtained by averaging
-     *  over 5 tasks. */
-    UInt32 bytesPerSecond;
+    /*! Nonzero once the connection has failed (e.g., the target violated
+     *  the protocol); a failed connection is released from the HBA
+     *  workloop (see iSCSIVirtualHBA::FailConnection()). */
+    volatile UInt32 failed;
     
-    /*! Size of moving average (# points) to use to compute average speed. */
-    static const UInt8 kBytesPerSecAvgWindowSize = 30;
+    /*! Maximum number of PDUs that are gathered into a single send. */
+    static const UInt8 kTxBatchSize = 16;
     
-    /*! Last few measurements of bytes per second on this connection. */
-    UInt32 bytesPerSecondHistory[kBytesPerSecAvgWindowSize];
+    /*! Maximum number of iovecs per PDU (header, header digest, data,
+     *  padding and data digest). */
+    static const UInt8 kTxIovecsPerPDU = 5;
     
-    /*! Keeps track of the index in the above array should be populated next. */
-    UInt8 bytesPerSecHistoryIdx;
+    /*! Basic header segments of the PDUs in the transmit batch. */
+    UInt8 txBHS[kTxBatchSize][kiSCSIPDUBasicHeaderSegmentSize];
+    
+    /*! Data segments of the PDUs in the transmit batch (these are not
+     *  copied and must remain valid until the batch is flushed). */
+    const void * txData[kTxBatchSize];
+    
+    /*! Lengths of the data segments of the PDUs in the transmit batch. */
+    UInt32 txDataLength[kTxBatchSize];
+    
+    /*! Header digests of the PDUs in the transmit batch. */
+    UInt32 txHeaderDigest[kTxBatchSize];
+    
+    /*! Data digests of the PDUs in the transmit batch. */
+    UInt32 txDataDigest[kTxBatchSize];
+    
+    /*! Scatter-gather list used to send the transmit batch. */
+    struct iovec txIovec[kTxBatchSize*kTxIovecsPerPDU];
+    
+    /*! Number of PDUs in the transmit batch. */
+    UInt8 txCount;
+    
+    /*! Mappings of task data buffers that PDUs in the transmit batch are
+     *  sent from (at most one per PDU).  These are held until the batch is
+     *  flushed, as the task may complete in the meantime. */
+    IOMemoryMap * txDataMaps[kTxBatchSize];
+    
+    /*! Number of entries in txDataMaps. */
+    UInt8 txDataMapCount;
+    
+    /*! System uptime (absolute time) when the first PDU of the transmit
+     *  batch was queued. */
+    UInt64 txBatchStartTime;
+    
+    /*! Maximum number of tasks with pending R2T sequences per connection.
+     *  Every task the HBA allows outstanding (iSCSIVirtualHBA::kMaxTaskCount)
+     *  may be a write that is waiting for data, so the connection must be
+     *  able to track all of them. */
+    static const UInt8 kMaxR2TTasks = 128;
+    
+    /*! Initiator task tags of tasks that have R2T sequences that are
+     *  waiting to be serviced on this connection. */
+    UInt32 R2TTaskTags[kMaxR2TTasks];
+    
+    /*! Number of entries in R2TTaskTags. */
+    UInt8 R2TTaskCount;
+    
+    /*! Number of entries in the R2T ring (a power of two).  A target that
+     *  honors MaxOutstandingR2T has no more than kiSCSIMaxOutstandingR2T
+     *  R2Ts outstanding for each of kMaxR2TTasks tasks, so the ring only
+     *  fills up if the target violates the protocol. */
+    static const UInt32 kR2TRingSize = kiSCSIMaxOutstandingR2T*kMaxR2TTasks;
+    
+    /*! Basic header segments of R2T PDUs that have been received but not
+     *  yet picked up by the transmit workloop.  The ring has a single
+     *  producer (the receive workloop) and a single consumer (the transmit
+     *  workloop). */
+    UInt8 R2TRing[kR2TRingSize][kiSCSIPDUBasicHeaderSegmentSize];
+    
+    /*! Number of R2Ts added to the ring (written by the receive workloop). */
+    volatile UInt32 R2TRingHead;
+    
+    /*! Number of R2Ts taken from the ring (written by the transmit
+     *  workloop). */
+    volatile UInt32 R2TRingTail;
+    
+    /*! Lock-free list of control PDUs (iSCSIControlPDU) waiting to be sent,
+     *  most recent first.  Any thread may add PDUs without taking a gate;
+     *  the transmit workloop sends them ahead of further commands. */
+    void * volatile controlQueue;
+    
+    /*! Number of control PDUs of the connection (one bit each in
+     *  controlPDUsInUse).  This leaves room for every task management
+     *  request of the session, a latency probe and responses to NOP-Ins. */
+    static const UInt8 kControlPDUCount = 32;
+    
+    /*! Size of the data segment of all but the last control PDU.  Task
+     *  management requests carry no data and latency probes carry a
+     *  timestamp. */
+    static const UInt32 kControlPDUDataSize = 64;
+    
+    /*! Control PDUs that are taken by SendControlPDU() and returned once
+     *  the transmit workloop has sent (or discarded) them. */
+    iSCSIControlPDU controlPDUs[kControlPDUCount];
+    
+    /*! Data segments of all but the last control PDU. */
+    UInt8 controlPDUData[kControlPDUCount - 1][kControlPDUDataSize];
+    
+    /*! Data segment of the last control PDU, which is large enough to echo
+     *  the ping data of any NOP-In (see AllocPDUBuffer()). */
+    UInt8 controlPDULargeData[kRFC3720_MaxRecvDataSegmentLength];
+    
+    /*! Bitmap of the control PDUs that are in use. */
+    volatile UInt32 controlPDUsInUse;
+    
+    /*! Indicates that tasks of this connection have completed since
+     *  completions were last handed over, so that the transmit workloop
+     *  should be woken to start further tasks. */
+    bool completionsHeld;
+    
+    /*! Size of the receive buffer, in bytes. */
+    static const UInt32 kRecvBufferSize = 65536;
+    
+    /*! PDUs with data segments of at least this size are dispatched as soon
+     *  as their header has been buffered; the remainder of the data segment
+     *  is then received directly into its final destination. */
+    static const UInt32 kRecvDirectThreshold = 16384;
+    
+    /*! Buffer that holds bytes received from the socket that have not yet
+     *  been consumed.  Bytes are pulled from the socket in as few calls as
+     *  possible and complete PDUs are parsed straight from this buffer. */
+    UInt8 * recvBuffer;
+    
+    /*! Offset of the first unconsumed byte in the receive buffer. */
+    UInt32 recvBufferStart;
+    
+    /*! Offset one past the last valid byte in the receive buffer. */
+    UInt32 recvBufferEnd;
     
 } iSCSIConnection;
 
@@ -102,14 +438,58 @@ typedef struct iSCSISession {
      *  this kernel extension since there is a 1-1 mapping. */
     SID sessionId;
     
-    /*! Command sequence number to be used for the next initiator command. */
-    UInt32 cmdSN;
+    /*! Workloop that receives and processes the PDUs of all of the
+     *  session's connections.  Each session has its own thread, so sessions
+     *  don't serialize behind one another (each connection sends from its
+     *  own transmit workloop). */
+    IOWorkLoop * workLoop;
+    
+    /*! Command sequence number to be used for the next initiator command
+     *  (advanced atomically by the transmit workloops of all connections). */
+    volatile UInt32 cmdSN;
     
     /*! Command seqeuence number expected by the target. */
-    UInt32 expCmdSN;
+    volatile UInt32 expCmdSN;
     
     /*! Maximum command seqeuence number allowed. */
-    UInt32 maxCmdSN;
+    volatile UInt32 maxCmdSN;
+    
+    /*! Time at which the command window (CmdSN > MaxCmdSN) closed and tasks
+     *  started being held, in microseconds of system uptime; 0 if tasks
+     *  aren't being held. */
+    volatile UInt64 windowStallStartUs;
+    
+    /*! Command window statistics for this session. */
+    iSCSIKernelSessionStats stats;
+    
+    /*! Completed tasks (iSCSITaskData) that are being held back so that
+     *  they can be handed to the HBA workloop together, most recent first.
+     *  Only the session's workloop touches the held completions. */
+    void * heldCompletions;
+    
+    /*! Oldest of the held completions. */
+    void * heldCompletionsTail;
+    
+    /*! Number of held completions. */
+    UInt32 heldCompletionCount;
+    
+    /*! System uptime (absolute time) when the oldest held completion
+     *  was held. */
+    UInt64 heldCompletionsTime;
+    
+    /*! Timer that hands over held completions once they have been held
+     *  for the session's completionCoalesceUs. */
+    IOTimerEventSource * completionTimer;
+    
+    /*! Indicates whether the completion timer is armed. */
+    bool completionTimerArmed;
+    
+    /*! System uptime (absolute time) when the current polling CPU budget
+     *  interval started. */
+    UInt64 pollIntervalStartTime;
+    
+    /*! Time spent polling during the current interval (absolute time). */
+    UInt64 pollIntervalTime;
     
     /*! Connections associated with this session. */
     iSCSIConnection * * connections;
@@ -119,6 +499,67 @@ typedef struct iSCSISession {
     
     /*! Number of active connections. */
     UInt32 numActiveConnections;
+    
+    /*! Connection that was assigned the last task (used for round-robin
+     *  connection scheduling). */
+    CID lastScheduledConnectionId;
+    
+    /*! Number of entries in the task table (must be a power of two, no larger
+     *  than 256 and at least the maximum number of tasks of the HBA). */
+    static const UInt16 kTaskTableSize = 256;
+    
+    /*! Table of SCSI tasks, indexed by the low bits of the initiator task tag. */
+    iSCSITaskEntry * taskTable;
+    
+    /*! List of task table entries that are not in use. */
+    iSCSITaskEntry * freeTaskEntries;
+    
+    /*! Lock that protects the list of free entries (entries are taken by
+     *  SCSI stack threads and released by the session's workloop). */
+    IOSimpleLock * taskTableLock;
+    
+    /*! Maximum number of task management requests that may be outstanding
+     *  at once. */
+    static const UInt8 kMaxTaskMgmtRequests = 16;
+    
+    /*! Outstanding task management requests (protected by the gate of the
+     *  session's workloop). */
+    iSCSITaskMgmtRequest taskMgmtRequests[kMaxTaskMgmtRequests];
+    
+    /*! Number of LUNs for which latency histograms are kept; LUNs are
+     *  assigned histograms in the order in which they are first used. */
+    static const UInt8 kLatencyLUNCount = 8;
+    
+    /*! LUNs that have been assigned latency histograms. */
+    SCSILogicalUnitNumber latencyLUNs[kLatencyLUNCount];
+    
+    /*! Number of entries of latencyLUNs in use. */
+    UInt32 latencyLUNsInUse;
+    
+    /*! Latency histograms of each LUN in latencyLUNs, for each category. */
+    iSCSIKernelLatencyHistogram LUNLatency[kLatencyLUNCount][kiSCSILatencyCategoryCount];
+    
+    /*! One in every taskTraceInterval completed tasks is recorded in the
+     *  task trace (0 disables the trace). */
+    UInt32 taskTraceInterval;
+    
+    /*! Number of completed tasks considered for the task trace. */
+    UInt32 taskTraceCounter;
+    
+    /*! Ring of the most recently sampled tasks. */
+    iSCSIKernelTaskTraceRecord taskTrace[kiSCSITaskTraceRecords];
+    
+    /*! Number of records written to the task trace. */
+    UInt64 taskTraceHead;
+    
+    /*! Number of records removed from the task trace (or overwritten). */
+    UInt64 taskTraceTail;
+    
+    /*! Number of records overwritten before they were retrieved. */
+    UInt32 taskTraceDropped;
+    
+    /*! Protects the task trace ring; only taken for sampled tasks. */
+    IOSimpleLock * taskTraceLock;
         
     /*! Indicates whether session is active, which means that a SCSI target
      *  exists and is backing the the iSCSI session. */
@@ -9,6 +9,7 @@
 #include "iSCSIIOEventSource.h"
 #include "iSCSITaskQueue.h"
 #include "iSCSITypesKernel.h"
+#include "iSCSIPDUTrace.h"
 #include "iSCSIRFC3720Defaults.h"
 #include "crc32c.h"
 
@@ -38,9 +39,9 @@ const UInt16 iSCSIVirtualHBA::kMaxConnectionsPerSession = kiSCSIMaxConnectionsPe
 /*! Maximum number of session allowed (globally). */
 const UInt16 iSCSIVirtualHBA::kMaxSessions = kiSCSIMaxSessions;
 
-/*! Highest LUN supported by the virtual HBA.  Due to internal design 
- *  contraints, this number should never exceed 2**8 - 1 or 255 (8-bits). */
-const SCSILogicalUnitNumber iSCSIVirtualHBA::kHighestLun = 63;
+/*! Highest LUN supported by the virtual HBA.  This is the largest LUN that
+ *  can be expressed using the SAM flat space addressing method (14-bits). */
+const SCSILogicalUnitNumber iSCSIVirtualHBA::kHighestLun = 16383;
 
 /*! Highest SCSI device ID supported by the HBA.  SCSI device identifiers are
  *  just the session identifiers. */
@@ -48,18 +49,106 @@ const SCSIDeviceIdentifier iSCSIVirtualHBA::kHighestSupportedDeviceId = kMaxSess
 
 /*! Maximum number of SCSI tasks the HBA can handle.  Increasing this number will
  *  increase the wired memory consumed by this kernel extension. */
-const UInt32 iSCSIVirtualHBA::kMaxTaskCount = 10;
+const UInt32 iSCSIVirtualHBA::kMaxTaskCount = 128;
+
+/*! Default number of SCSI tasks that may be outstanding on a connection (the
+ *  number of tasks actually outstanding is also bounded by the command window
+ *  advertised by the target). */
+const UInt16 iSCSIVirtualHBA::kDefaultQueueDepth = 32;
+
+/*! Size of the buffer used to discard data segments that cannot be processed
+ *  (e.g., data for a task that no longer exists). */
+const UInt32 iSCSIVirtualHBA::kFlushBufferSize = 512;
+
+/*! Longest time, in microseconds, that a PDU is held in a connection's
+ *  transmit batch waiting for other PDUs to be sent along with it. */
+const UInt32 iSCSIVirtualHBA::kTxBatchDeadlineUs = 50;
+
+/*! Number of consecutive socket sends that may make no progress before a
+ *  transmit batch is abandoned and the connection failed.  Each send is
+ *  limited by the socket's send timeout (one second). */
+const UInt32 iSCSIVirtualHBA::kTxMaxStalledSends = 10;
+
+/*! Number of bytes received from a socket at a time when a digest is
+ *  computed over the bytes received.  Each chunk is checksummed right after
+ *  it is received, while it is still in the cache. */
+const UInt32 iSCSIVirtualHBA::kDigestChunkSize = 32768;
+
+/*! Size, in bytes, of the PDU buffers in each size class.  The largest
+ *  class holds the largest data segment the initiator accepts. */
+const UInt32 iSCSIVirtualHBA::kPDUBufferSizes[kiSCSIPDUBufferPoolClasses] =
+    { 256, 1024, kRFC3720_MaxRecvDataSegmentLength };
+
+/*! Number of preallocated PDU buffers in each size class.  PDU buffers are
+ *  only held while a received PDU is being processed by its session's
+ *  workloop, which processes one PDU at a time; with a buffer per session
+ *  in each class the pools can't run out. */
+const UInt32 iSCSIVirtualHBA::kPDUBuffersPerClass = kiSCSIMaxSessions;
 
 /*! Number of PDUs that are transmitted before we calculate an average speed
  *  for the connection (1024^2 = 1048576). */
 const UInt32 iSCSIVirtualHBA::kNumBytesPerAvgBW = 1048576;
 
-/*! Default task timeout for new tasks (milliseconds). */
+/*! Default task timeout for new tasks (milliseconds).  Used until the
+ *  round-trip time of a connection has been measured. */
 const UInt32 iSCSIVirtualHBA::kiSCSITaskTimeoutMs = 2000;
 
+/*! Default floor for task timeouts (milliseconds).  Keeps a connection with
+ *  a very short round-trip time from timing out tasks that are delayed by
+ *  a momentarily busy target. */
+const UInt32 iSCSIVirtualHBA::kTaskTimeoutMinMs = 1000;
+
+/*! Default ceiling for task timeouts (milliseconds). */
+const UInt32 iSCSIVirtualHBA::kTaskTimeoutMaxMs = 60000;
+
+/*! Number of retransmission timeouts (RFC6298) that a task's round trip
+ *  may take before the task is timed out. */
+const UInt32 iSCSIVirtualHBA::kTaskTimeoutRTOMultiple = 4;
+
+/*! Default number of completed tasks held before they are handed over to
+ *  the SCSI stack, even if the receive batch hasn't ended. */
+const UInt16 iSCSIVirtualHBA::kCompletionCoalesceCount = 16;
+
+/*! Default time completed tasks are held after a receive batch
+ *  (microseconds); by default they are handed over as the batch ends. */
+const UInt32 iSCSIVirtualHBA::kCompletionCoalesceUs = 0;
+
+/*! Default poll budget (microseconds); polling is disabled by default and
+ *  is meant for sessions whose latency matters more than CPU time. */
+const UInt32 iSCSIVirtualHBA::kPollBudgetUs = 0;
+
+/*! Default share of CPU time that polling may use (percent). */
+const UInt8 iSCSIVirtualHBA::kPollCPUPercent = 25;
+
+/*! Interval over which the CPU time spent polling is limited
+ *  (milliseconds). */
+const UInt32 iSCSIVirtualHBA::kPollIntervalMs = 1000;
+
+/*! Smallest allowance for round-trip time variation (microseconds); this is
+ *  the clock granularity term G of RFC6298. */
+const UInt32 iSCSIVirtualHBA::kRTTGranularityUs = 1000;
+
+/*! Largest transfer (bytes) of a task whose completion time is used as a
+ *  round-trip time sample; the duration of larger tasks is dominated by
+ *  the transfer itself. */
+const UInt32 iSCSIVirtualHBA::kRTTSampleMaxTransferSize = 4096;
+
 /*! Default TCP timeout for new connections (milliseconds). */
 const UInt32 iSCSIVirtualHBA::kiSCSITCPTimeoutMs = 1000;
 
+/*! Interval between latency probes on each connection (milliseconds).  The
+ *  probes also serve as keepalives for idle connections. */
+const UInt32 iSCSIVirtualHBA::kLatencyProbeIntervalMs = 2000;
+
+/*! Busy time over which each throughput sample is taken (microseconds).
+ *  Tasks complete in bursts; sampling over an interval rather than per
+ *  task keeps concurrent tasks from being measured against each other. */
+const UInt32 iSCSIVirtualHBA::kRateSampleIntervalUs = 50000;
+
+/*! Weight given to a new throughput sample (1/kRateEWMADivisor).  With
+ *  50 ms samples, the estimate adapts to a change in about half a second. */
+const UInt32 iSCSIVirtualHBA::kRateEWMADivisor = 8;
+
 
 OSDefineMetaClassAndStructors(iSCSIVirtualHBA,IOSCSIParallelInterfaceController);
 
@@ -125,132 +214,189 @@ SCSIServiceResponse iSCSIVirtualHBA::AbortTaskRequest(SCSITargetIdentifier targe
 													  SCSILogicalUnitNumber LUN,
 													  SCSITaggedTaskIdentifier taggedTaskID)
 {
-    // Grab session and connection, send task managment request
-    iSCSISession * session = sessionList[targetId];
-    if(session == NULL)
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-
-    // Create a SCSI target management PDU and send
-    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncAbortTask);
-    bhs.LUN = OSSwapHostToBigInt64(LUN);
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncAbortTask;
-    bhs.referencedTaskTag = OSSwapHostToBigInt32((UInt32)taggedTaskID);
-
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-    
     DBLog("iSCSI: Abort task request\n");
-    
-	return kSCSIServiceResponse_Request_In_Process;
+    return SendTaskMgmtRequest(targetId,LUN,kiSCSIPDUTaskMgmtFuncAbortTask,taggedTaskID);
 }
 
 SCSIServiceResponse iSCSIVirtualHBA::AbortTaskSetRequest(SCSITargetIdentifier targetId,
 														 SCSILogicalUnitNumber LUN)
 {
-    // Grab session and connection, send task managment request
-    iSCSISession * session = sessionList[targetId];
-    if(session == NULL)
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-
-    // Create a SCSI target management PDU and send
-    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncAbortTaskSet);
-    bhs.LUN = OSSwapHostToBigInt64(LUN);
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncAbortTaskSet;
-    
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-    
     DBLog("iSCSI: Abort task set request\n");
-    
-	return kSCSIServiceResponse_Request_In_Process;
+    return SendTaskMgmtRequest(targetId,LUN,kiSCSIPDUTaskMgmtFuncAbortTaskSet,0);
 }
 
 SCSIServiceResponse iSCSIVirtualHBA::ClearACARequest(SCSITargetIdentifier targetId,
 													 SCSILogicalUnitNumber LUN)
 {
-    // Grab session and connection, send task managment request
-    iSCSISession * session = sessionList[targetId];
-    if(session == NULL)
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-
-    // Create a SCSI target management PDU and send
-    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncClearACA);
-    bhs.LUN = OSSwapHostToBigInt64(LUN);
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncClearACA;
-    
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-    
     DBLog("iSCSI: Clear ACA request\n");
-    
-	return kSCSIServiceResponse_Request_In_Process;
+    return SendTaskMgmtRequest(targetId,LUN,kiSCSIPDUTaskMgmtFuncClearACA,0);
 }
 
 SCSIServiceResponse iSCSIVirtualHBA::ClearTaskSetRequest(SCSITargetIdentifier targetId,
 														 SCSILogicalUnitNumber LUN)
 {
-    // Grab session and connection, send task managment request
-    iSCSISession * session = sessionList[targetId];
-    if(session == NULL)
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-
-    // Create a SCSI target management PDU and send
-    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncClearTaskSet);
-    bhs.LUN = OSSwapHostToBigInt64(LUN);
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncClearTaskSet;
-    
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-    
     DBLog("iSCSI: Clear task set request\n");
-    
-	return kSCSIServiceResponse_Request_In_Process;
+    return SendTaskMgmtRequest(targetId,LUN,kiSCSIPDUTaskMgmtFuncClearTaskSet,0);
 }
 
 SCSIServiceResponse iSCSIVirtualHBA::LogicalUnitResetRequest(SCSITargetIdentifier targetId,
 															 SCSILogicalUnitNumber LUN)
 {
-    // Grab session and connection, send task managment request
-    iSCSISession * session = sessionList[targetId];
-    if(session == NULL)
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-
-    // Create a SCSI target management PDU and send
-    iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncLUNReset);
-    bhs.LUN = OSSwapHostToBigInt64(LUN);
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncLUNReset;
-    
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-
     DBLog("iSCSI: LUN reset request\n");
-    
-	return kSCSIServiceResponse_Request_In_Process;
+    return SendTaskMgmtRequest(targetId,LUN,kiSCSIPDUTaskMgmtFuncLUNReset,0);
 }
 
 SCSIServiceResponse iSCSIVirtualHBA::TargetResetRequest(SCSITargetIdentifier targetId)
 {
-    // Grab session and connection, send task managment request
+    DBLog("iSCSI: Target reset request\n");
+    return SendTaskMgmtRequest(targetId,0,kiSCSIPDUTaskMgmtFuncTargetWarmReset,0);
+}
+
+/*! Sends a task management request for the SCSI stack.  The request is
+ *  recorded in the session's table of outstanding requests, where its
+ *  response finds it (see ProcessTaskMgmtRsp()).  An abort task request is
+ *  sent on the connection that has allegiance to the task and refers to
+ *  the task by its initiator task tag; other requests are sent on any
+ *  active connection.
+ *  @param targetId the target (session) that the request is for.
+ *  @param LUN the logical unit that the request addresses.
+ *  @param function the task management function.
+ *  @param taggedTaskID the task to abort (abort task requests only).
+ *  @return the service response of the request. */
+SCSIServiceResponse iSCSIVirtualHBA::SendTaskMgmtRequest(SCSITargetIdentifier targetId,
+                                                         SCSILogicalUnitNumber LUN,
+                                                         UInt8 function,
+                                                         SCSITaggedTaskIdentifier taggedTaskID)
+{
+    if(targetId >= kMaxSessions)
+        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+    
     iSCSISession * session = sessionList[targetId];
     if(session == NULL)
         return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
-
-    // Create a SCSI target management PDU and send
+    
+    // Create a SCSI task management PDU
     iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
-    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncTargetWarmReset;
-    bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,0,kiSCSIPDUTaskMgmtFuncTargetWarmReset);
+    bhs.function = kiSCSIPDUTaskMgmtFuncFlag | function;
     
-    if(SendPDU(session,session->connections[0],(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0))
-        return kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+    if(function != kiSCSIPDUTaskMgmtFuncTargetWarmReset)
+        bhs.LUN = BuildLUNField(LUN);
     
-    DBLog("iSCSI: Target reset request\n");
+    SCSIServiceResponse serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
+    iSCSIConnection * connection = NULL;
+    iSCSITaskMgmtRequest * request = NULL;
+    
+    // Connections are released, tasks are completed and task management
+    // responses are processed with the session's gate closed
+    session->workLoop->closeGate();
+    
+    if(function == kiSCSIPDUTaskMgmtFuncAbortTask)
+    {
+        SCSIParallelTaskIdentifier task = FindTaskForAddress(targetId,LUN,taggedTaskID);
+        iSCSITaskData * taskData = NULL;
+        UInt32 initiatorTaskTag = kiSCSIPDUInitiatorTaskTagReserved;
+        
+        if(task) {
+            taskData = (iSCSITaskData *)GetHBADataPointer(task);
+            initiatorTaskTag = (UInt32)GetControllerTaskIdentifier(task);
+        }
+        
+        // A task that is already being completed has nothing left to abort
+        if(!taskData || taskData->completing ||
+           FindTaskForInitiatorTaskTag(session,initiatorTaskTag) != task) {
+            serviceResponse = kSCSIServiceResponse_TASK_COMPLETE;
+            goto TASK_MGMT_DONE;
+        }
+        
+        bhs.referencedTaskTag = initiatorTaskTag;
+        
+        // Address the logical unit exactly as the task's command did
+        SCSILogicalUnitBytes LUNBytes;
+        GetLogicalUnitBytes(task,&LUNBytes);
+        memcpy(&bhs.LUN,LUNBytes,sizeof(LUNBytes));
+        
+        if(taskData->connectionId < kMaxConnectionsPerSession)
+            connection = session->connections[taskData->connectionId];
+    }
+    else {
+        for(CID connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+        {
+            iSCSIConnection * conn = session->connections[connectionId];
+            
+            if(conn && conn->taskQueue->isEnabled()) {
+                connection = conn;
+                break;
+            }
+        }
+    }
+    
+    if(!connection)
+        goto TASK_MGMT_DONE;
+    
+    for(UInt8 index = 0; index < session->kMaxTaskMgmtRequests; index++)
+    {
+        if(!session->taskMgmtRequests[index].inUse) {
+            request = &session->taskMgmtRequests[index];
+            bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,index);
+            break;
+        }
+    }
+    
+    if(!request) {
+        DBLog("iSCSI: Too many outstanding task management requests\n");
+        goto TASK_MGMT_DONE;
+    }
+    
+    if(SendControlPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,0))
+        goto TASK_MGMT_DONE;
+    
+    request->inUse = true;
+    request->function = function;
+    request->connectionId = connection->CID;
+    request->LUN = LUN;
+    request->taggedTaskId = taggedTaskID;
+    
+    serviceResponse = kSCSIServiceResponse_Request_In_Process;
+    
+TASK_MGMT_DONE:
+    session->workLoop->openGate();
+	return serviceResponse;
+}
+
+/*! Completes an outstanding task management request and releases its
+ *  entry.  Called with the session's gate closed.
+ *  @param session the session that the request belongs to.
+ *  @param request the request to complete.
+ *  @param serviceResponse the service response reported to the SCSI stack. */
+void iSCSIVirtualHBA::CompleteTaskMgmtRequest(iSCSISession * session,
+                                              iSCSITaskMgmtRequest * request,
+                                              SCSIServiceResponse serviceResponse)
+{
+    SCSILogicalUnitNumber LUN = request->LUN;
+    request->inUse = false;
     
-	return kSCSIServiceResponse_Request_In_Process;
+    // Tell the SCSI stack that the function completed or failed
+    switch(request->function)
+    {
+        case kiSCSIPDUTaskMgmtFuncAbortTask:
+            CompleteAbortTask(session->sessionId,LUN,request->taggedTaskId,serviceResponse);
+        break;
+        case kiSCSIPDUTaskMgmtFuncAbortTaskSet:
+            CompleteAbortTaskSet(session->sessionId,LUN,serviceResponse);
+        break;
+        case kiSCSIPDUTaskMgmtFuncClearACA:
+            CompleteClearACA(session->sessionId,LUN,serviceResponse);
+        break;
+        case kiSCSIPDUTaskMgmtFuncClearTaskSet:
+            CompleteClearTaskSet(session->sessionId,LUN,serviceResponse);
+        break;
+        case kiSCSIPDUTaskMgmtFuncLUNReset:
+            CompleteLogicalUnitReset(session->sessionId,LUN,serviceResponse);
+        break;
+        case kiSCSIPDUTaskMgmtFuncTargetWarmReset:
+            CompleteTargetReset(session->sessionId,serviceResponse);
+        break;
+    };
 }
 
 SCSIInitiatorIdentifier iSCSIVirtualHBA::ReportInitiatorIdentifier()
@@ -271,9 +417,8 @@ UInt32 iSCSIVirtualHBA::ReportMaximumTaskCount()
 
 UInt32 iSCSIVirtualHBA::ReportHBASpecificTaskDataSize()
 {
-    // Due to a bug (feature?) in the SCSI family driver, this value cannot
-    // be zero, even if task data is not required.
-	return 1;
+    // Per-task state, including the connection the task was assigned to
+	return sizeof(iSCSITaskData);
 }
 
 UInt32 iSCSIVirtualHBA::ReportHBASpecificDeviceDataSize()
@@ -294,8 +439,9 @@ bool iSCSIVirtualHBA::InitializeController()
 {
     DBLog("iSCSI: Initializing virtual HBA\n");
     
-    // Initialize CRC32C
+    // Initialize CRC32C (selects the fastest implementation for this CPU)
     crc32c_init();
+    DBLog("iSCSI: CRC32C implementation: %s\n",crc32c_implementation());
     
     // Setup session & target list
     sessionList = (iSCSISession **)IOMalloc(kMaxSessions*sizeof(iSCSISession*));
@@ -306,6 +452,12 @@ bool iSCSIVirtualHBA::InitializeController()
     
     memset(sessionList,0,kMaxSessions*sizeof(iSCSISession *));
     
+    // Preallocate buffers used to process PDU data segments
+    if(!AllocPDUBufferPools()) {
+        IOFree(sessionList,kMaxSessions*sizeof(iSCSISession*));
+        return false;
+    }
+    
     // Set product name.
     SetHBAProperty(kIOPropertyProductNameKey,OSString::withCString(ISCSI_PRODUCT_NAME));
     SetHBAProperty(kIOPropertyProductRevisionLevelKey,OSString::withCString(ISCSI_PRODUCT_REVISION_LEVEL));
@@ -330,16 +482,113 @@ void iSCSIVirtualHBA::TerminateController()
     // Free up our list of sessions and targets
     IOFree(sessionList,kMaxSessions*sizeof(iSCSISession*));
     targetList->free();
+    
+    ReleasePDUBufferPools();
 }
 
 bool iSCSIVirtualHBA::StartController()
 {
+    // Latency probes are driven by a timer rather than queued with tasks,
+    // so that I/O never waits behind a probe's round trip
+    probeTimer = IOTimerEventSource::timerEventSource(this,&ProbeTimerFired);
+    
+    if(!probeTimer)
+        return false;
+    
+    if(GetWorkLoop()->addEventSource(probeTimer) != kIOReturnSuccess) {
+        probeTimer->release();
+        probeTimer = NULL;
+        return false;
+    }
+    
+    probeTimer->setTimeoutMS(kLatencyProbeIntervalMs);
+    
+    // Sessions process tasks on their own workloops and hand completed
+    // tasks back to this workloop, which completes them with the SCSI stack
+    pendingCompletions = NULL;
+    completionSource = IOInterruptEventSource::interruptEventSource(this,&CompletionSourceFired);
+    
+    if(!completionSource)
+        goto COMPLETION_SOURCE_ALLOC_FAILURE;
+    
+    if(GetWorkLoop()->addEventSource(completionSource) != kIOReturnSuccess)
+        goto COMPLETION_SOURCE_ADD_FAILURE;
+    
+    // Failed connections are released from this workloop
+    connectionFailureSource =
+        IOInterruptEventSource::interruptEventSource(this,&ConnectionFailureSourceFired);
+    
+    if(!connectionFailureSource)
+        goto FAILURE_SOURCE_ALLOC_FAILURE;
+    
+    if(GetWorkLoop()->addEventSource(connectionFailureSource) != kIOReturnSuccess)
+        goto FAILURE_SOURCE_ADD_FAILURE;
+    
+    // Tasks that the transmit workloops can't start are failed from here too
+    taskFailureSource =
+        IOInterruptEventSource::interruptEventSource(this,&TaskFailureSourceFired);
+    
+    if(!taskFailureSource)
+        goto TASK_FAILURE_SOURCE_ALLOC_FAILURE;
+    
+    if(GetWorkLoop()->addEventSource(taskFailureSource) != kIOReturnSuccess)
+        goto TASK_FAILURE_SOURCE_ADD_FAILURE;
+    
 	// Successfully started controller
 	return true;
+    
+TASK_FAILURE_SOURCE_ADD_FAILURE:
+    taskFailureSource->release();
+    taskFailureSource = NULL;
+    
+TASK_FAILURE_SOURCE_ALLOC_FAILURE:
+    GetWorkLoop()->removeEventSource(connectionFailureSource);
+    
+FAILURE_SOURCE_ADD_FAILURE:
+    connectionFailureSource->release();
+    connectionFailureSource = NULL;
+    
+FAILURE_SOURCE_ALLOC_FAILURE:
+    GetWorkLoop()->removeEventSource(completionSource);
+    
+COMPLETION_SOURCE_ADD_FAILURE:
+    completionSource->release();
+    completionSource = NULL;
+    
+COMPLETION_SOURCE_ALLOC_FAILURE:
+    probeTimer->cancelTimeout();
+    GetWorkLoop()->removeEventSource(probeTimer);
+    probeTimer->release();
+    probeTimer = NULL;
+    return false;
 }
 
 void iSCSIVirtualHBA::StopController()
 {
+    if(probeTimer) {
+        probeTimer->cancelTimeout();
+        GetWorkLoop()->removeEventSource(probeTimer);
+        probeTimer->release();
+        probeTimer = NULL;
+    }
+    
+    if(completionSource) {
+        GetWorkLoop()->removeEventSource(completionSource);
+        completionSource->release();
+        completionSource = NULL;
+    }
+    
+    if(connectionFailureSource) {
+        GetWorkLoop()->removeEventSource(connectionFailureSource);
+        connectionFailureSource->release();
+        connectionFailureSource = NULL;
+    }
+    
+    if(taskFailureSource) {
+        GetWorkLoop()->removeEventSource(taskFailureSource);
+        taskFailureSource->release();
+        taskFailureSource = NULL;
+    }
 }
 
 void iSCSIVirtualHBA::HandleInterruptRequest()
@@ -354,30 +603,52 @@ void iSCSIVirtualHBA::HandleTimeout(SCSIParallelTaskIdentifier task)
     // Determine the target identifier (session identifier) and connection
     // associated with this task and remove the task from the task queue.
     SID sessionId = (UInt16)GetTargetIdentifier(task);
-    CID connectionId = *((UInt32*)GetHBADataPointer(task));
     
-    if(connectionId >= kMaxConnectionsPerSession)
+    if(sessionId >= kMaxSessions)
         return;
     
     iSCSISession * session = sessionList[sessionId];
     if(!session)
         return;
     
-    iSCSIConnection * connection = session->connections[connectionId];
-    if(!connection)
+    // Tasks are completed from the session's workloop (the receive side);
+    // with its gate closed, the task can't complete while it is examined
+    session->workLoop->closeGate();
+    
+    // The response may have completed the task (releasing its entry in the
+    // task table) after the timeout fired; the tag's generation detects this
+    UInt32 initiatorTaskTag = (UInt32)GetControllerTaskIdentifier(task);
+    iSCSITaskData * taskData = (iSCSITaskData *)GetHBADataPointer(task);
+    
+    if(FindTaskForInitiatorTaskTag(session,initiatorTaskTag) != task ||
+       !taskData || taskData->completing) {
+        session->workLoop->openGate();
+        return;
+    }
+    
+    CID connectionId = taskData->connectionId;
+    iSCSIConnection * connection = NULL;
+    
+    if(connectionId < kMaxConnectionsPerSession)
+        connection = session->connections[connectionId];
+    
+    if(!connection) {
+        session->workLoop->openGate();
         return;
+    }
     
-    // If the task timeout is due to a broken connection, handle it.
-    // Otherwise the target may be taking too long, just report it up the
-    // driver stack
+    // If the task timeout is due to a broken connection, handle it (this
+    // completes the connection's tasks).  Otherwise the target may be taking
+    // too long, just report it up the driver stack
     struct sockaddr peername;
-    if(sock_getpeername(connection->socket,&peername,sizeof(peername))) {
+    if(connection->failed || sock_getpeername(connection->socket,&peername,sizeof(peername))) {
+        session->workLoop->openGate();
         HandleConnectionTimeout(sessionId,connectionId);
         return;
     }
-
-    // Let task queue know that the last (current) task should be removed
-    connection->taskQueue->completeCurrentTask();
+    
+    // Let task queue know that this task should be removed
+    connection->taskQueue->completeTask(initiatorTaskTag);
     
     // Notify the SCSI stack that the task could not be delivered
     CompleteParallelTask(session,
@@ -385,6 +656,9 @@ void iSCSIVirtualHBA::HandleTimeout(SCSIParallelTaskIdentifier task)
                          task,
                          kSCSITaskStatus_DeliveryFailure,
                          kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+    
+    DeliverCompletions(session);
+    session->workLoop->openGate();
 }
 
 /*! Handles connection timeouts.
@@ -411,12 +685,138 @@ void iSCSIVirtualHBA::HandleConnectionTimeout(SID sessionId,CID connectionId)
         ReleaseSession(sessionId);
 }
 
+/*! Marks a connection as failed and has it released from the HBA workloop.
+ *  The session and transmit workloops call this when a connection can't
+ *  continue, since they can't release a connection while they are
+ *  processing it.  Failed connections stop processing PDUs right away.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection that failed. */
+void iSCSIVirtualHBA::FailConnection(iSCSISession * session,iSCSIConnection * connection)
+{
+    // Only the first failure needs to be reported
+    if(!OSCompareAndSwap(0,1,&connection->failed))
+        return;
+    
+    DBLog("iSCSI: Connection %d of session %d failed\n",connection->CID,session->sessionId);
+    
+    connectionFailureSource->interruptOccurred(NULL,NULL,0);
+}
+
+/*! Called on the HBA workloop when connections have failed; releases
+ *  every failed connection (and the session, if it was the last one).
+ *  @param owner an instance of this class.
+ *  @param sender the event source that was signaled.
+ *  @param count the number of times the event source was signaled. */
+void iSCSIVirtualHBA::ConnectionFailureSourceFired(OSObject * owner,IOInterruptEventSource * sender,int count)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    
+    if(!hba)
+        return;
+    
+    for(SID sessionId = 0; sessionId < kMaxSessions; sessionId++)
+    {
+        for(CID connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+        {
+            // Releasing the last connection releases the session as well
+            iSCSISession * session = hba->sessionList[sessionId];
+            
+            if(!session)
+                break;
+            
+            iSCSIConnection * connection = session->connections[connectionId];
+            
+            if(connection && connection->failed)
+                hba->HandleConnectionTimeout(sessionId,connectionId);
+        }
+    }
+}
+
+/*! Has a task failed from the HBA workloop.  The transmit workloop calls
+ *  this when it can't start a task or send its data: it can't take the
+ *  session's gate to complete the task itself, and the task would
+ *  otherwise wait for its timeout.
+ *  @param session the session that the task belongs to.
+ *  @param initiatorTaskTag the initiator task tag of the task. */
+void iSCSIVirtualHBA::FailTask(iSCSISession * session,UInt32 initiatorTaskTag)
+{
+    UInt32 taskId = ParseInitiatorTaskTagForTaskId(initiatorTaskTag);
+    session->taskTable[taskId & (session->kTaskTableSize-1)].failedTaskTag = initiatorTaskTag;
+    
+    DBLog("iSCSI: Failing task %x\n",initiatorTaskTag);
+    
+    taskFailureSource->interruptOccurred(NULL,NULL,0);
+}
+
+/*! Called on the HBA workloop when tasks have failed; completes every
+ *  failed task with a service delivery failure.
+ *  @param owner an instance of this class.
+ *  @param sender the event source that was signaled.
+ *  @param count the number of times the event source was signaled. */
+void iSCSIVirtualHBA::TaskFailureSourceFired(OSObject * owner,IOInterruptEventSource * sender,int count)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    
+    if(!hba)
+        return;
+    
+    for(SID sessionId = 0; sessionId < kMaxSessions; sessionId++)
+    {
+        iSCSISession * session = hba->sessionList[sessionId];
+        
+        if(!session)
+            continue;
+        
+        // With the session's gate closed, tasks can't complete while their
+        // entries are examined
+        session->workLoop->closeGate();
+        
+        for(UInt16 index = 0; index < session->kTaskTableSize; index++)
+        {
+            iSCSITaskEntry * entry = &session->taskTable[index];
+            UInt32 initiatorTaskTag = entry->failedTaskTag;
+            
+            if(initiatorTaskTag == kiSCSIPDUInitiatorTaskTagReserved)
+                continue;
+            
+            entry->failedTaskTag = kiSCSIPDUInitiatorTaskTagReserved;
+            
+            // The task may have completed (and the entry been reused) since
+            // it was failed; the tag's generation detects this
+            SCSIParallelTaskIdentifier parallelTask =
+                hba->FindTaskForInitiatorTaskTag(session,initiatorTaskTag);
+            
+            if(!parallelTask || entry->taskData->completing)
+                continue;
+            
+            CID connectionId = entry->taskData->connectionId;
+            iSCSIConnection * connection = NULL;
+            
+            if(connectionId < kMaxConnectionsPerSession)
+                connection = session->connections[connectionId];
+            
+            if(!connection)
+                continue;
+            
+            connection->taskQueue->completeTask(initiatorTaskTag);
+            
+            hba->CompleteParallelTask(session,
+                                      connection,
+                                      parallelTask,
+                                      kSCSITaskStatus_DeliveryFailure,
+                                      kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+        }
+        
+        hba->DeliverCompletions(session);
+        session->workLoop->openGate();
+    }
+}
+
 SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentifier parallelTask)
 {
     // Here we set an (iSCSI) initiator task tag for the SCSI task and queue
     // the iSCSI task for later processing
     SCSITargetIdentifier targetId   = GetTargetIdentifier(parallelTask);
-    SCSILogicalUnitNumber LUN       = GetLogicalUnitNumber(parallelTask);
     SCSITaggedTaskIdentifier taskId = GetTaggedTaskIdentifier(parallelTask);
     
     iSCSISession * session = sessionList[(SID)targetId];
@@ -425,53 +825,61 @@ SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentif
         return kSCSIServiceResponse_FUNCTION_REJECTED;
     
     // Determine which connection this task should be assigned to based on
-    // bitrate and processing load; we do this by looking at the amount of
-    // data each connection needs to transfer
-    iSCSIConnection * connection = NULL;
-    size_t minTimeToTransfer = INT64_MAX;
-    
-    for(UInt32 idx = 0; idx < kiSCSIMaxConnectionsPerSession; idx++)
-    {
-        iSCSIConnection * conn = session->connections[idx];
-        
-        // If this connection slot doesn't exist or isn't enabled, move on...
-        if(!conn || !conn->taskQueue->isEnabled())
-            continue;
-        
-        if(conn->bytesPerSecond == 0) {
-            connection = conn;
-            break;
-        }
-        
-        size_t timeToTransfer = conn->dataToTransfer / conn->bytesPerSecond;
-        
-        if(timeToTransfer <= minTimeToTransfer) {
-            minTimeToTransfer = timeToTransfer;
-            connection = conn;
-        }
-    }
+    // the session's scheduling policy (bitrate, processing load, etc.)
+    UInt64 transferSize = GetRequestedDataTransferCount(parallelTask);
+    iSCSIConnection * connection =
+        SelectConnectionForTask(session,GetDataTransferDirection(parallelTask),transferSize);
     
-    connection = session->connections[0];
     if(!connection || !connection->dataRecvEventSource)
         return kSCSIServiceResponse_FUNCTION_REJECTED;
     
     // Associate a connection identifier with this task; this is used to
     // maintain the connection associated with a task when only task information
     // is available (e.g., in the case of a task timeout).
-    *((UInt32*)GetHBADataPointer(parallelTask)) = 0;
+    iSCSITaskData * taskData = (iSCSITaskData *)GetHBADataPointer(parallelTask);
+    taskData->connectionId = connection->CID;
+    taskData->dataMap = NULL;
+    taskData->activeR2TCount = 0;
+    taskData->startTime = 0;
+    taskData->commandSentTime = 0;
+    taskData->firstResponseTime = 0;
+    taskData->statusTime = 0;
+    taskData->parallelTask = parallelTask;
+    taskData->completionNext = NULL;
+    taskData->completing = false;
+    clock_get_uptime(&taskData->queueTime);
+    memset(taskData->R2TSequences,0,sizeof(taskData->R2TSequences));
+    
+    // Assign the task an entry in the session's task table; the initiator
+    // task tag identifies that entry
+    UInt32 initiatorTaskTag = AllocTaskEntry(session,parallelTask,taskData);
+    
+    if(initiatorTaskTag == kiSCSIPDUInitiatorTaskTagReserved)
+        return kSCSIServiceResponse_FUNCTION_REJECTED;
     
-    // Add the amount of data that we need to transfer to this connection
-    OSAddAtomic64(GetRequestedDataTransferCount(parallelTask),&connection->dataToTransfer);
-
-    // Build and set iSCSI initiator task tag
-    UInt32 initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeSCSITask,LUN,taskId);
     SetControllerTaskIdentifier(parallelTask,initiatorTaskTag);
     
+    // Add the amount of data that we need to transfer to this connection
+    // (removed again once the task completes)
+    OSAddAtomic64(transferSize,&connection->dataToTransfer);
+    
     DBLog("iSCSI: Transfer size: %d\n",connection->dataToTransfer);
     
+    // Timeout is based on the round-trip time and data rate of the
+    // connection.  It is armed here rather than when the task is started:
+    // setting it takes the HBA's gate, which the transmit workloop must not
+    // take (the HBA workloop closes the transmit gate when it deactivates a
+    // connection)
+    SetTimeoutForTask(parallelTask,
+                      GetTaskTimeout(session,connection,GetDataTransferDirection(parallelTask),transferSize));
+    
     // Queue task in the event source (we'll remove it from the queue when were
     // done processing the task)
-    connection->taskQueue->queueTask(initiatorTaskTag);
+    if(!connection->taskQueue->queueTask(initiatorTaskTag)) {
+        OSAddAtomic64(-(SInt64)transferSize,&connection->dataToTransfer);
+        ReleaseTaskEntry(session,initiatorTaskTag);
+        return kSCSIServiceResponse_FUNCTION_REJECTED;
+    }
     
     DBLog("iSCSI: Queued task %llx\n",taskId);
     return kSCSIServiceResponse_Request_In_Process;
@@ -480,23 +888,21 @@ SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentif
 void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
                                                 iSCSISession * session,
                                                 iSCSIConnection * connection,
-                                                UInt32 initiatorTaskTag)
+                                                UInt32 initiatorTaskTag,
+                                                UInt32 cmdSN)
 {
-    // Task tag corresponding to a connection timeout measurement
-    if(owner->ParseInitiatorTaskTagForTaskType(initiatorTaskTag) == kInitiatorTaskTypeLatency)
-    {
-        // Send a NOP out...
-        owner->MeasureConnectionLatency(session,connection);
-        return;
-    }
-    
     // Grab parallel task associated with this iSCSI task
     SCSIParallelTaskIdentifier parallelTask =
-        owner->FindTaskForControllerIdentifier(session->sessionId,initiatorTaskTag);
+        owner->FindTaskForInitiatorTaskTag(session,initiatorTaskTag);
     
     if(!parallelTask)
     {
         DBLog("iSCSI: Task not found, flushing stream (BeginTaskOnWorkloopThread)\n");
+        
+        // Free up the slot this task occupied in the queue, and the command
+        // sequence number reserved for it
+        connection->taskQueue->completeTask(initiatorTaskTag);
+        owner->ReleaseCmdSN(session,connection,cmdSN);
         return;
     }
     
@@ -506,10 +912,11 @@ void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
     UInt32  transferSize            = (UInt32)owner->GetRequestedDataTransferCount(parallelTask);
     UInt8   cdbSize                 = owner->GetCommandDescriptorBlockSize(parallelTask);
     
-    // Now that we know task is valid, timestamp the connection indicating
-    // when we started processing the task
-    clock_get_system_microtime(&(connection->taskStartTimeSec),
-                               &(connection->taskStartTimeUSec));
+    // Now that we know task is valid, timestamp the task indicating when we
+    // started processing it
+    iSCSITaskData * taskData = (iSCSITaskData *)owner->GetHBADataPointer(parallelTask);
+    clock_get_uptime(&taskData->startTime);
+    owner->StartTaskRateSample(connection,transferDirection,taskData->startTime);
     
     // Create a SCSI request PDU
     iSCSIPDUSCSICmdBHS bhs  = iSCSIPDUSCSICmdBHSInit;
@@ -519,9 +926,13 @@ void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
     owner->GetLogicalUnitBytes(parallelTask,&LUN);
     memcpy(&bhs.LUN,LUN,sizeof(LUN));
 
-    // The initiator task tag is just LUN and task identifier
+    // The initiator task tag identifies the task's entry in the task table
     bhs.initiatorTaskTag = initiatorTaskTag;
     
+    // The command sequence number was reserved when the task was started,
+    // while the command window was known to be open
+    bhs.cmdSN = OSSwapHostToBigInt32(cmdSN);
+    
     if(transferDirection == kSCSIDataTransfer_FromInitiatorToTarget)
         bhs.flags |= kiSCSIPDUSCSICmdFlagWrite;
     else
@@ -551,14 +962,11 @@ void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
             bhs.flags |= kiSCSIPDUSCSICmdTaskAttrSimple; break;
     };
     
-    // Default timeout for new tasks...
-    owner->SetTimeoutForTask(parallelTask,kiSCSITaskTimeoutMs);
-    
     // For non-WRITE commands, send off SCSI command PDU immediately.
     if(transferDirection != kSCSIDataTransfer_FromInitiatorToTarget)
     {
         bhs.flags |= kiSCSIPDUSCSICmdFlagNoUnsolicitedData;
-        owner->SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0);
+        owner->QueuePDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,0);
         return;
     }
     
@@ -567,14 +975,26 @@ void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
     if(session->opts.initialR2T && !session->opts.immediateData)
     {
         bhs.flags |= kiSCSIPDUSCSICmdFlagNoUnsolicitedData;
-        owner->SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0);
+        owner->QueuePDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,0);
+        return;
+    }
+    
+    // For SCSI WRITE command PDUs, use the task's mapping of its data buffer
+    IOMemoryMap * dataMap = owner->GetTaskDataMap(session,parallelTask);
+    
+    if(!dataMap || dataMap->getLength() < transferSize)
+    {
+        DBLog("iSCSI: Host data buffer doesn't contain requested data\n");
+        
+        if(dataMap)
+            dataMap->release();
+        
+        owner->ReleaseCmdSN(session,connection,cmdSN);
+        owner->FailTask(session,initiatorTaskTag);
         return;
     }
     
-    // For SCSI WRITE command PDUs, map pointer to IOMemoryDescriptor buffer
-    IOMemoryDescriptor  * dataDesc  = owner->GetDataBuffer(parallelTask);
-    IOMemoryMap         * dataMap   = dataDesc->map();
-    UInt8               * data      = (UInt8 *)dataMap->getAddress();
+    UInt8 * data = (UInt8 *)dataMap->getAddress();
 
     // Offset relative to transfer request (not relative to IOMemoryDescriptor)
     UInt32 dataOffset = 0;
@@ -591,11 +1011,13 @@ void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
         if(session->opts.initialR2T || dataLen == transferSize)
             bhs.flags |= kiSCSIPDUSCSICmdFlagNoUnsolicitedData;
 
-        owner->SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,data,dataLen);
+        // The data is sent from the task's buffer once the batch is flushed
+        if(!owner->QueuePDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,data,dataLen))
+            owner->HoldTxDataMap(connection,dataMap);
+        
         dataOffset += dataLen;
         
         owner->SetRealizedDataTransferCount(parallelTask,dataLen);
-        connection->dataToTransfer -= dataLen;
     }
 
     // Follow up with data out PDUs up to the firstBurstLength bytes if R2T=No
@@ -603,63 +1025,30 @@ void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
        dataOffset < session->opts.firstBurstLength &&   // Haven't hit burst limit
        dataOffset < transferSize)                       // Data left to send
     {
-        iSCSIPDUDataOutBHS bhsDataOut = iSCSIPDUDataOutBHSInit;
-        bhsDataOut.LUN              = bhs.LUN;
-        bhsDataOut.initiatorTaskTag = bhs.initiatorTaskTag;
-        bhsDataOut.targetTransferTag = kiSCSIPDUTargetTransferTagReserved;
+        // Unsolicited data is sent as a single sequence with a reserved
+        // target transfer tag
+        iSCSIR2TSequence sequence;
+        memset(&sequence,0,sizeof(sequence));
+        sequence.LUN                = bhs.LUN;
+        sequence.targetTransferTag  = kiSCSIPDUTargetTransferTagReserved;
+        sequence.bufferOffset       = dataOffset;
+        sequence.desiredDataLength  = min(session->opts.firstBurstLength-dataOffset,
+                                          transferSize-dataOffset);
         
-        UInt32 dataSN = 0;
-        UInt32 maxTransferLength = connection->opts.maxSendDataSegmentLength;
-        UInt32 remainingDataLength = min(session->opts.firstBurstLength-dataOffset,
-                                         transferSize-dataOffset);
+        errno_t err = owner->SendDataOutSequence(session,connection,parallelTask,
+                                                 bhs.initiatorTaskTag,&sequence,
+                                                 UINT32_MAX);
+        if(err != 0) {
+            DBLog("iSCSI: Send error: %d\n",err);
+            dataMap->release();
+            owner->FailTask(session,initiatorTaskTag);
+            return;
+        }
         
-        while(remainingDataLength != 0)
-        {
-            bhsDataOut.bufferOffset = OSSwapHostToBigInt32(dataOffset);
-            bhsDataOut.dataSN = OSSwapHostToBigInt32(dataSN);
-            
-            if(maxTransferLength < remainingDataLength) {
-                DBLog("iSCSI: Max transfer length: %d\n",maxTransferLength);
-                int err = owner->SendPDU(session,connection,
-                                         (iSCSIPDUInitiatorBHS*)&bhsDataOut,NULL,
-                                         data,maxTransferLength);
-                
-                if(err != 0) {
-                    DBLog("iSCSI: Send error: %d\n",err);
-                    dataMap->unmap();
-                    dataMap->release();
-                    return;
-                }
-                
-                DBLog("iSCSI: dataoffset: %d\n",dataOffset);
-                
-                remainingDataLength -= maxTransferLength;
-                data                += maxTransferLength;
-                dataOffset          += maxTransferLength;
-            }
-            // This is the final PDU of the sequence
-            else {
-                DBLog("iSCSI: Sending final data out\n");
-                bhsDataOut.flags = kiSCSIPDUDataOutFinalFlag;
-                int err = owner->SendPDU(session,connection,
-                                         (iSCSIPDUInitiatorBHS*)&bhsDataOut,NULL,
-                                         data,remainingDataLength);
-                
-                if(err != 0) {
-                    DBLog("iSCSI: Send error: %d\n",err);
-                    dataMap->unmap();
-                    dataMap->release();
-                    return;
-                }
-                break;
-            }
-            // Increment the data sequence number
-            dataSN++;
-        }
+        owner->SetRealizedDataTransferCount(parallelTask,
+                                            dataOffset+sequence.desiredDataLength);
     }
-
-    // Release mapping to IOMemoryDescriptor buffer
-    dataMap->unmap();
+    
     dataMap->release();
 }
 
@@ -704,7 +1093,7 @@ bool iSCSIVirtualHBA::ProcessTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
             break;
             
         case kiSCSIPDUOpCodeR2T:
-            owner->ProcessR2T(session,connection,(iSCSIPDUR2TBHS*)&bhs);
+            owner->QueueR2T(session,connection,(iSCSIPDUR2TBHS*)&bhs);
             break;
         case kiSCSIPDUOpCodeReject:
             owner->ProcessReject(session,connection,(iSCSIPDURejectBHS*)&bhs);
@@ -717,6 +1106,7 @@ bool iSCSIVirtualHBA::ProcessTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
         // Catch-all for anything else...
         default: break;
     };
+    
     return true;
 }
 
@@ -731,56 +1121,312 @@ void iSCSIVirtualHBA::CompleteParallelTask(iSCSISession * session,
                                            SCSITaskStatus completionStatus,
                                            SCSIServiceResponse serviceResponse)
 {
-    if(GetDataTransferDirection(parallelRequest) == kSCSIDataTransfer_NoDataTransfer) {
+    // Each task is completed exactly once (all callers hold the session's
+    // gate, so the flag needs no atomics)
+    iSCSITaskData * taskData = (iSCSITaskData *)GetHBADataPointer(parallelRequest);
+    
+    if(taskData) {
+        if(taskData->completing)
+            return;
+        taskData->completing = true;
+    }
+    
+    // This task no longer counts towards the connection's outstanding data
+    OSAddAtomic64(-(SInt64)GetRequestedDataTransferCount(parallelRequest),
+                  &connection->dataToTransfer);
+    
+    // Drop the task's reference to the mapping of its data buffer, if one
+    // was created; the transmit workloop may hold its own until it's done
+    // sending from the buffer (see GetTaskDataMap())
+    if(taskData) {
+        IOSimpleLockLock(session->taskTableLock);
+        IOMemoryMap * dataMap = taskData->dataMap;
+        taskData->dataMap = NULL;
+        IOSimpleLockUnlock(session->taskTableLock);
+        
+        if(dataMap)
+            dataMap->release();
+    }
+    
+    // Free the task's entry in the task table; later PDUs that carry its
+    // initiator task tag are treated as stale
+    ReleaseTaskEntry(session,(UInt32)GetControllerTaskIdentifier(parallelRequest));
+    
+    // Tasks that were never started (e.g., those rejected when a connection
+    // is deactivated) carry no timing information
+    if(taskData && taskData->startTime != 0)
+    {
+        UInt8 transferDirection = GetDataTransferDirection(parallelRequest);
+        UInt64 transferSize = GetRequestedDataTransferCount(parallelRequest);
+        bool completed = (serviceResponse == kSCSIServiceResponse_TASK_COMPLETE);
+        
+        UInt64 now, elapsedNs;
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now - taskData->startTime,&elapsedNs);
+        
+        // Failed tasks are recorded too; their latency is what the host saw
+        RecordTaskLatency(session,connection,parallelRequest,elapsedNs/1000);
+        RecordTaskStages(session,connection,parallelRequest,taskData,serviceResponse,now);
+        
+        // Small tasks complete in about one round trip; use them as RTT
+        // samples (no-data commands such as TEST UNIT READY are particularly
+        // good ones).  Tasks that timed out or failed would skew the estimate.
+        if(completed && transferSize <= kRTTSampleMaxTransferSize)
+            UpdateConnectionRTT(connection,elapsedNs/1000);
+        
+        UpdateConnectionRates(connection,transferDirection,completed ? transferSize : 0,now);
+    }
+    
+    if(!taskData) {
         super::CompleteParallelTask(parallelRequest,completionStatus,serviceResponse);
         return;
     }
+    
+    // Hold the task so that it is handed to the HBA workloop, which
+    // completes it with the SCSI stack, along with others completed by the
+    // same receive batch (this is called on the session's workloop)
+    taskData->parallelTask = parallelRequest;
+    taskData->completionStatus = completionStatus;
+    taskData->completionResponse = serviceResponse;
+    taskData->completionNext = session->heldCompletions;
+    
+    if(!session->heldCompletions)
+        session->heldCompletionsTail = taskData;
+    
+    if(session->heldCompletionCount++ == 0)
+        clock_get_uptime(&session->heldCompletionsTime);
+    
+    session->heldCompletions = taskData;
+    connection->completionsHeld = true;
+    
+    if(session->opts.completionCoalesceCount != 0 &&
+       session->heldCompletionCount >= session->opts.completionCoalesceCount)
+        DeliverCompletions(session);
+}
 
-    // Compute the time it took to complete this task; first grab the timestamp
-    // when task was first started
-    clock_usec_t usecs;
-    clock_sec_t  secs;
-    clock_get_system_microtime(&secs,&usecs);
+/*! Hands the completions held by a session to the HBA workloop with a
+ *  single signal, and wakes the transmit workloops of connections whose
+ *  tasks have completed.  Called on the session's workloop.
+ *  @param session the session. */
+void iSCSIVirtualHBA::DeliverCompletions(iSCSISession * session)
+{
+    // Task queues refill once per batch rather than once per task
+    for(CID connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+    {
+        iSCSIConnection * connection = session->connections[connectionId];
+        
+        if(connection && connection->completionsHeld) {
+            connection->completionsHeld = false;
+            connection->taskQueue->signalTransmitWork();
+        }
+    }
+    
+    if(session->completionTimerArmed) {
+        session->completionTimer->cancelTimeout();
+        session->completionTimerArmed = false;
+    }
+    
+    if(!session->heldCompletions)
+        return;
+    
+    // Splice the held completions (most recent first, like the HBA's list)
+    // onto the HBA's list at once
+    iSCSITaskData * tail = (iSCSITaskData *)session->heldCompletionsTail;
+    void * head;
+    
+    do {
+        head = pendingCompletions;
+        tail->completionNext = head;
+    } while(!OSCompareAndSwapPtr(head,session->heldCompletions,&pendingCompletions));
+    
+    session->stats.completionsDelivered += session->heldCompletionCount;
+    session->stats.completionBatches++;
+    
+    session->heldCompletions = NULL;
+    session->heldCompletionsTail = NULL;
+    session->heldCompletionCount = 0;
+    
+    completionSource->interruptOccurred(NULL,NULL,0);
+}
+
+/*! Called on the session's workloop once a batch of received PDUs has
+ *  been processed.  Held completions are handed over unless the
+ *  session's options allow them to be held for longer, in which case
+ *  the completion timer is armed.
+ *  @param session the session. */
+void iSCSIVirtualHBA::EndReceiveBatch(iSCSISession * session)
+{
+    if(session->heldCompletionCount == 0)
+        return;
+    
+    UInt32 coalesceUs = session->opts.completionCoalesceUs;
+    
+    if(coalesceUs == 0) {
+        DeliverCompletions(session);
+        return;
+    }
+    
+    UInt64 currentTime, heldNs;
+    clock_get_uptime(&currentTime);
+    absolutetime_to_nanoseconds(currentTime - session->heldCompletionsTime,&heldNs);
+    
+    if(heldNs >= (UInt64)coalesceUs*1000) {
+        DeliverCompletions(session);
+        return;
+    }
+    
+    // Wait for further completions, but no longer than the oldest
+    // completion may be held
+    if(!session->completionTimerArmed) {
+        session->completionTimer->setTimeoutUS(coalesceUs - (UInt32)(heldNs/1000));
+        session->completionTimerArmed = true;
+    }
+}
+
+/*! Spins for up to the session's poll budget waiting for a PDU to arrive
+ *  on a connection that has tasks outstanding.  The time spent polling
+ *  is limited to the session's share of CPU time: a poll ends early once
+ *  that share is used up.  Called on the session's workloop.
+ *  @param session the session.
+ *  @param connection the connection to poll.
+ *  @return true if a PDU is available. */
+bool iSCSIVirtualHBA::PollForPDU(iSCSISession * session,iSCSIConnection * connection)
+{
+    UInt32 pollBudgetUs = session->opts.pollBudgetUs;
+    
+    // Only poll while responses are expected
+    if(pollBudgetUs == 0 || connection->taskQueue->getOutstandingTaskCount() == 0)
+        return false;
+    
+    UInt64 startTime, elapsedNs;
+    clock_get_uptime(&startTime);
+    
+    // Limit polling to a share of each interval
+    absolutetime_to_nanoseconds(startTime - session->pollIntervalStartTime,&elapsedNs);
+    
+    if(elapsedNs >= (UInt64)kPollIntervalMs*1000000) {
+        session->pollIntervalStartTime = startTime;
+        session->pollIntervalTime = 0;
+    }
+    
+    UInt64 pollNs;
+    absolutetime_to_nanoseconds(session->pollIntervalTime,&pollNs);
+    
+    UInt64 allowanceNs = (UInt64)kPollIntervalMs*1000000*session->opts.pollCPUPercent/100;
+    
+    if(pollNs >= allowanceNs) {
+        session->stats.pollsThrottled++;
+        return false;
+    }
+    
+    // Spin for the poll budget, or for what is left of the interval's
+    // allowance if that is less
+    UInt64 budgetNs = (UInt64)pollBudgetUs*1000;
+    
+    if(budgetNs > allowanceNs - pollNs)
+        budgetNs = allowanceNs - pollNs;
+    
+    UInt64 deadline;
+    nanoseconds_to_absolutetime(budgetNs,&deadline);
+    deadline += startTime;
+    
+    UInt64 currentTime = startTime;
+    bool available = false;
     
-    UInt64 duration_usecs = (secs  - connection->taskStartTimeSec)*1e6 +
-                            (usecs - connection->taskStartTimeUSec);
+    while(!(available = isPDUAvailable(connection)) && currentTime < deadline)
+        clock_get_uptime(&currentTime);
     
-    // Calculate transfer speed over entire task...
-    UInt64 bytesTransferred = GetRequestedDataTransferCount(parallelRequest);
+    clock_get_uptime(&currentTime);
+    session->pollIntervalTime += currentTime - startTime;
+    
+    absolutetime_to_nanoseconds(currentTime - startTime,&pollNs);
+    session->stats.polls++;
+    session->stats.pollTimeUs += pollNs/1000;
+    
+    if(available)
+        session->stats.pollHits++;
+    
+    return available;
+}
 
-    // Add newest measurement to list (overwriting oldest one)
-    connection->bytesPerSecondHistory[connection->bytesPerSecHistoryIdx]
-        = (UInt32)(bytesTransferred / (duration_usecs / 1.0e6));
+/*! Called on a session's workloop when its completions have been held
+ *  for the session's completionCoalesceUs; hands them over.
+ *  @param owner an instance of this class.
+ *  @param sender the timer event source that fired. */
+void iSCSIVirtualHBA::CompletionTimerFired(OSObject * owner,IOTimerEventSource * sender)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    
+    if(!hba)
+        return;
     
-    // Advance index so next oldest record is overwritten next time (roll over)
-    connection->bytesPerSecHistoryIdx++;
-    if(connection->bytesPerSecHistoryIdx == connection->kBytesPerSecAvgWindowSize)
+    for(SID sessionId = 0; sessionId < kMaxSessions; sessionId++)
     {
-        connection->bytesPerSecHistoryIdx = 0;
+        iSCSISession * session = hba->sessionList[sessionId];
+        
+        if(!session || session->completionTimer != sender)
+            continue;
         
-        // Queue a latency measurement operation
-        UInt32 initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeLatency,0,0);
-        connection->taskQueue->queueTask(initiatorTaskTag);
+        session->completionTimerArmed = false;
+        hba->DeliverCompletions(session);
+        break;
     }
+}
+
+/*! Called on the HBA workloop when session workloops have handed over
+ *  completed tasks; completes them with the SCSI stack in the order in
+ *  which they were handed over.
+ *  @param owner an instance of this class.
+ *  @param sender the event source that was signaled.
+ *  @param count the number of times the event source was signaled. */
+void iSCSIVirtualHBA::CompletionSourceFired(OSObject * owner,IOInterruptEventSource * sender,int count)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    
+    if(!hba)
+        return;
     
-    // Iterate over last few points, compute peak value
-    connection->bytesPerSecond = 0;
-    for(UInt8 i = 0; i < connection->kBytesPerSecAvgWindowSize; i++)
-        if(connection->bytesPerSecond < connection->bytesPerSecondHistory[i])
-            connection->bytesPerSecond = connection->bytesPerSecondHistory[i];
+    // Take every task that has been handed over so far
+    iSCSITaskData * list;
+    do {
+        list = (iSCSITaskData *)hba->pendingCompletions;
+    } while(!OSCompareAndSwapPtr(list,NULL,(void * volatile *)&hba->pendingCompletions));
     
-    DBLog("iSCSI: Bytes per second: %d\n",connection->bytesPerSecond);
-
-    super::CompleteParallelTask(parallelRequest,completionStatus,serviceResponse);
+    // The list is most recent first; reverse it to complete tasks in order
+    iSCSITaskData * ordered = NULL;
+    
+    while(list) {
+        iSCSITaskData * next = (iSCSITaskData *)list->completionNext;
+        list->completionNext = ordered;
+        ordered = list;
+        list = next;
+    }
+    
+    while(ordered) {
+        iSCSITaskData * taskData = ordered;
+        ordered = (iSCSITaskData *)taskData->completionNext;
+        
+        // The task data belongs to the task and is gone once it completes
+        hba->super::CompleteParallelTask(taskData->parallelTask,
+                                         taskData->completionStatus,
+                                         taskData->completionResponse);
+    }
 }
 
 void iSCSIVirtualHBA::ProcessTaskMgmtRsp(iSCSISession * session,
                                          iSCSIConnection * connection,
                                          iSCSIPDU::iSCSIPDUTaskMgmtRspBHS * bhs)
 {
-    // Extract LUN and function code from task tag
-    UInt8 taskMgmtFunction = ParseInitiatorTaskTagForTaskId(bhs->initiatorTaskTag);
-    UInt64 LUN = ParseInitiatorTaskTagForLUN(bhs->initiatorTaskTag);
+    // The task tag is the index of the request, which records the function
+    // and the LUN that the response refers to
+    UInt32 index = ParseInitiatorTaskTagForTaskId(bhs->initiatorTaskTag);
+    
+    if(ParseInitiatorTaskTagForTaskType(bhs->initiatorTaskTag) != kInitiatorTaskTypeTaskMgmt ||
+       index >= session->kMaxTaskMgmtRequests || !session->taskMgmtRequests[index].inUse)
+    {
+        DBLog("iSCSI: Task management request not found\n");
+        return;
+    }
     
     // Setup the SCSI response code based on response from PDU
     SCSIServiceResponse serviceResponse;
@@ -805,22 +1451,7 @@ void iSCSIVirtualHBA::ProcessTaskMgmtRsp(iSCSISession * session,
         break;
     };
 
-    // Tell the SCSI stack that the function completed or failed
-    if(taskMgmtFunction == kiSCSIPDUTaskMgmtFuncAbortTask)
-        CompleteAbortTask(session->sessionId, LUN, 0, serviceResponse);
-    else if (taskMgmtFunction == kiSCSIPDUTaskMgmtFuncAbortTaskSet)
-        CompleteAbortTaskSet(session->sessionId, LUN, serviceResponse);
-    else if (taskMgmtFunction == kiSCSIPDUTaskMgmtFuncClearACA)
-        CompleteClearACA(session->sessionId, LUN, serviceResponse);
-    else if (taskMgmtFunction == kiSCSIPDUTaskMgmtFuncClearTaskSet)
-        CompleteClearTaskSet(session->sessionId, LUN, serviceResponse);
-    else if (taskMgmtFunction == kiSCSIPDUTaskMgmtFuncLUNReset)
-        CompleteLogicalUnitReset(session->sessionId, LUN, serviceResponse);
-    else if (taskMgmtFunction == kiSCSIPDUTaskMgmtFuncTargetWarmReset)
-        CompleteTargetReset(session->sessionId, serviceResponse);
-    
-    // Task is complete, remove it from the queue
-    connection->taskQueue->completeCurrentTask();
+    CompleteTaskMgmtRequest(session,&session->taskMgmtRequests[index],serviceResponse);
 }
 
 void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
@@ -830,10 +1461,17 @@ void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
     const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
     
     // Grab data payload (ping data)
-    UInt8 data[length];
+    UInt8 * data = (UInt8 *)AllocPDUBuffer(length);
+    
+    if(!data) {
+        DBLog("iSCSI: NOP in data segment too large\n");
+        FlushPDUData(session,connection,length);
+        return;
+    }
     
     if(RecvPDUData(session,connection,data,length,MSG_WAITALL) != 0) {
         DBLog("iSCSI: Failed to retreive NOP in data\n");
+        FreePDUBuffer(data,length);
         return;
     }
     
@@ -842,8 +1480,10 @@ void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
     {
         // Will use this to calculate latency; our initiated NOP contained
         // a timestamp that is sent back to us
-        if(length != (sizeof(clock_sec_t) + sizeof(clock_usec_t)))
+        if(length != (sizeof(clock_sec_t) + sizeof(clock_usec_t))) {
+            FreePDUBuffer(data,length);
             return;
+        }
         
         clock_sec_t secs_stamp, secs;
         clock_usec_t microsecs_stamp, microsecs;
@@ -855,12 +1495,18 @@ void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
         // Grab current system uptime
         clock_get_system_microtime(&secs,&microsecs);
     
-        UInt32 latency_ms = (secs - secs_stamp)*1e3 + (microsecs - microsecs_stamp)/1e3;
+        SInt64 latencyUs = ((SInt64)secs - (SInt64)secs_stamp)*1000000 +
+                           ((SInt64)microsecs - (SInt64)microsecs_stamp);
+        
+        // Ignore replies carrying a timestamp from the future (corrupted)
+        if(latencyUs >= 0)
+            UpdateConnectionRTT(connection,(UInt64)latencyUs);
         
-        DBLog("iSCSI: Connection latency: %d ms\n",latency_ms);
+        DBLog("iSCSI: Connection latency: %lld us (SRTT %u us, RTTVAR %u us)\n",
+              latencyUs,connection->smoothedRTTUs,connection->RTTVarianceUs);
         
-        // Remove latency measurement task from queue
-        connection->taskQueue->completeCurrentTask();
+        // Allow the next probe to be sent
+        connection->probeOutstanding = false;
     }
     // The target initiated this ping, just copy parameters and respond
     else {
@@ -868,9 +1514,11 @@ void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
         bhsRsp.LUN = bhs->LUN;
         bhsRsp.targetTransferTag = bhs->targetTransferTag;
         
-        if(SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhsRsp,NULL,data,length))
+        if(SendControlPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhsRsp,data,length))
             DBLog("iSCSI: Failed to send NOP response\n");
     }
+    
+    FreePDUBuffer(data,length);
 }
 
 void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
@@ -881,10 +1529,14 @@ void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
     const UInt8 senseDataHeaderSize = 2;
     
     const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
-    UInt8 data[length];
+    UInt8 * data = NULL;
 
     if(length > 0) {
-        if(RecvPDUData(session,connection,data,length,MSG_WAITALL))
+        if(!(data = (UInt8 *)AllocPDUBuffer(length))) {
+            DBLog("iSCSI: Sense data segment too large\n");
+            FlushPDUData(session,connection,length);
+        }
+        else if(RecvPDUData(session,connection,data,length,MSG_WAITALL))
             DBLog("iSCSI: Error retrieving data segment\n");
         else
             DBLog("iSCSI: Received sense data\n");
@@ -892,23 +1544,23 @@ void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
 
     // Grab parallel task associated with this PDU, indexed by task tag
     SCSIParallelTaskIdentifier parallelTask =
-        FindTaskForControllerIdentifier(session->sessionId,bhs->initiatorTaskTag);
+        FindTaskForInitiatorTaskTag(session,bhs->initiatorTaskTag);
     
     if(!parallelTask)
     {
-        DBLog("iSCSI: Task not found, flushing stream (ProcessSCSIResponse)\n");
-        
-        // Flush stream
-        UInt8 buffer[length];
-        RecvPDUData(session,connection,buffer,length,MSG_WAITALL);
+        // The data segment has already been received above
+        DBLog("iSCSI: Task not found (ProcessSCSIResponse)\n");
         
+        if(data)
+            FreePDUBuffer(data,length);
         return;
     }
     
+    TimestampTaskResponse(parallelTask,true);
     SetRealizedDataTransferCount(parallelTask,(UInt32)GetRequestedDataTransferCount(parallelTask));
 
     // Process sense data if the PDU came with any...
-    if(length >= senseDataHeaderSize)
+    if(data && length >= senseDataHeaderSize)
     {
         // First two bytes of the data segment are the size of the sense data
         UInt16 senseDataLength = *((UInt16*)&data[0]);
@@ -929,6 +1581,9 @@ void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
         }
     }
     
+    if(data)
+        FreePDUBuffer(data,length);
+    
     // Set the SCSI completion status and service response, let SCSI stack
     // know that we're done with this task...
     
@@ -940,10 +1595,11 @@ void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
     else
         serviceResponse = kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE;
     
-    CompleteParallelTask(session,connection,parallelTask,completionStatus,serviceResponse);
+    // Task is complete, remove it from the queue (the transmit workloop is
+    // woken once the completions of this receive batch are handed over)
+    connection->taskQueue->postCompletedTask(bhs->initiatorTaskTag);
     
-    // Task is complete, remove it from the queue
-    connection->taskQueue->completeCurrentTask();
+    CompleteParallelTask(session,connection,parallelTask,completionStatus,serviceResponse);
     
     DBLog("iSCSI: Processed SCSI response\n");
 }
@@ -956,7 +1612,7 @@ void iSCSIVirtualHBA::ProcessDataIn(iSCSISession * session,
 
     // Grab parallel task associated with this PDU, indexed by task tag
     SCSIParallelTaskIdentifier parallelTask =
-        FindTaskForControllerIdentifier(session->sessionId,bhs->initiatorTaskTag);
+        FindTaskForInitiatorTaskTag(session,bhs->initiatorTaskTag);
     
     if(length == 0)
     {
@@ -964,48 +1620,87 @@ void iSCSIVirtualHBA::ProcessDataIn(iSCSISession * session,
         return;
     }
     
-    UInt8 buffer[length];
-    
     // If task not found, flush stream
     if(!parallelTask)
     {
         DBLog("iSCSI: Task not found\n");
-        RecvPDUData(session,connection,buffer,length,MSG_WAITALL);
+        FlushPDUData(session,connection,length);
         return;
     }
     
+    TimestampTaskResponse(parallelTask,false);
+    
     // System buffer offset for this PDU data segment...
     UInt32 dataOffset = OSSwapBigToHostInt32(bhs->bufferOffset);
     
-    if(RecvPDUData(session,connection,buffer,length,0))
-        DBLog("iSCSI: Error in retrieving data segment length.\n");
-    else {
-        IOMemoryDescriptor  * dataDesc = GetDataBuffer(parallelTask);
-        dataDesc->writeBytes(dataOffset,buffer,length);
-        SetRealizedDataTransferCount(parallelTask,dataOffset+length);
-        connection->dataToTransfer -= length;
+    // Receive the data segment directly into the task's data buffer; ensure
+    // that the data segment fits within the buffer first
+    IOMemoryMap * dataMap = GetTaskDataMap(session,parallelTask);
+    
+    if(!dataMap || (UInt64)dataOffset + length > dataMap->getLength())
+    {
+        DBLog("iSCSI: Data-in segment exceeds host data buffer\n");
+        
+        if(dataMap)
+            dataMap->release();
+        
+        if(FlushPDUData(session,connection,length))
+            FailConnection(session,connection);
+        
+        goto DATA_IN_FAILURE;
     }
     
+    // After a receive error the stream is no longer at a PDU boundary (or
+    // the data can't be trusted), so the connection can't be used either
+    errno_t result;
+    result = RecvPDUData(session,connection,(UInt8 *)dataMap->getAddress() + dataOffset,length,0);
+    dataMap->release();
+    
+    if(result)
+    {
+        DBLog("iSCSI: Error in retrieving data segment.\n");
+        FailConnection(session,connection);
+        goto DATA_IN_FAILURE;
+    }
+    
+    SetRealizedDataTransferCount(parallelTask,dataOffset+length);
+    
     // If the PDU contains a status response, complete this task
     if((bhs->flags & kiSCSIPDUDataInFinalFlag) && (bhs->flags & kiSCSIPDUDataInStatusFlag))
     {
+        TimestampTaskResponse(parallelTask,true);
         SetRealizedDataTransferCount(parallelTask,(UInt32)GetRequestedDataTransferCount(parallelTask));
         
+        // Task is complete, remove it from the queue (the transmit workloop
+        // is woken once the completions of this batch are handed over)
+        connection->taskQueue->postCompletedTask(bhs->initiatorTaskTag);
+        
         CompleteParallelTask(session,
                              connection,
                              parallelTask,
                              (SCSITaskStatus)bhs->status,
                              kSCSIServiceResponse_TASK_COMPLETE);
         
-        // Task is complete, remove it from the queue
-        connection->taskQueue->completeCurrentTask();
-        
         DBLog("iSCSI: Processed data-in PDU\n");
     }
     
     // Send acknowledgement to target if one is required
     if(bhs->flags & kiSCSIPDUDataInAckFlag)
     {}
+    
+    return;
+    
+DATA_IN_FAILURE:
+    
+    // Part of the task's data was lost; fail the task now rather than
+    // letting a later status report the full transfer as successful
+    connection->taskQueue->postCompletedTask(bhs->initiatorTaskTag);
+    
+    CompleteParallelTask(session,
+                         connection,
+                         parallelTask,
+                         kSCSITaskStatus_DeliveryFailure,
+                         kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
 }
 
 /*! Process an incoming asynchronous message PDU.
@@ -1022,16 +1717,20 @@ void iSCSIVirtualHBA::ProcessAsyncMsg(iSCSISession * session,
         // The target will drop all connections for this session
         case kiSCSIPDUAsyncMsgDropAllConnections: break;
 
-        // The target will drop the specified connection
+        // The target will drop the specified connection.  The connection
+        // is being processed by this workloop and can't be released here;
+        // it is released from the HBA workloop instead
         case kiSCSIPDUAsynMsgDropConnection:
-            ReleaseConnection(session->sessionId,connection->CID);
+            FailConnection(session,connection);
+            break;
+            
         case kiSCSIPDUAsyncMsgLogout:
             
             break;
             
         // Target requests parameter negotiation (no support; drop connection)
         case kiSCSIPDUAsyncMsgNegotiateParams:
-            ReleaseConnection(session->sessionId,connection->CID);
+            FailConnection(session,connection);
             break;
             
 
@@ -1051,24 +1750,27 @@ void iSCSIVirtualHBA::ProcessAsyncMsg(iSCSISession * session,
     const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS *)bhs);
     UInt8 * data;
     
-    if(!(data = (UInt8*)IOMalloc(length)))
-       return;
+    if(!(data = (UInt8*)AllocPDUBuffer(length))) {
+        FlushPDUData(session,connection,length);
+        return;
+    }
     
     RecvPDUData(session,connection,data,length,0);
-    IOFree(data,length);
+    FreePDUBuffer(data,length);
 }
 
-/*! Process an incoming R2T PDU.
+/*! Hands an incoming R2T PDU to the transmit workloop of the connection
+ *  it was received on.  Called from the receive workloop.
  *  @param session the session associated with the R2T PDU.
  *  @param connection the connection associated with the R2T PDU.
  *  @param bhs the basic header segment of the R2T PDU. */
-void iSCSIVirtualHBA::ProcessR2T(iSCSISession * session,
-                                 iSCSIConnection * connection,
-                                 iSCSIPDU::iSCSIPDUR2TBHS * bhs)
+void iSCSIVirtualHBA::QueueR2T(iSCSISession * session,
+                               iSCSIConnection * connection,
+                               iSCSIPDU::iSCSIPDUR2TBHS * bhs)
 {
     // Grab parallel task associated with this PDU, indexed by task tag
     SCSIParallelTaskIdentifier parallelTask =
-        FindTaskForControllerIdentifier(session->sessionId,bhs->initiatorTaskTag);
+        FindTaskForInitiatorTaskTag(session,bhs->initiatorTaskTag);
     
     if(!parallelTask)
     {
@@ -1076,96 +1778,81 @@ void iSCSIVirtualHBA::ProcessR2T(iSCSISession * session,
         return;
     }
     
-    // Create a mapping to the task's data buffer.  This is the data that
-    // we will read and pack into a sequence of PDUs to send to the target.
-    IOMemoryDescriptor  * dataDesc   = GetDataBuffer(parallelTask);
-    IOMemoryMap         * dataMap    = dataDesc->map();
-    UInt8               * data       = (UInt8 *)dataMap->getAddress();
-
-    // Obtain requested data offset and requested lengths
-    UInt32 dataOffset           = OSSwapBigToHostInt32(bhs->bufferOffset);
-    UInt32 remainingDataLength  = OSSwapBigToHostInt32(bhs->desiredDataLength);
-
-    // Ensure that our data buffer contains all of the requested data
-    if(dataOffset + remainingDataLength > (UInt32)dataMap->getLength())
+    TimestampTaskResponse(parallelTask,false);
+    
+    // The receive workloop is the only producer and the transmit workloop
+    // the only consumer, so the ring needs no lock
+    UInt32 head = connection->R2TRingHead;
+    
+    // The ring holds every R2T the target may have outstanding, so a full
+    // ring means the target ignored MaxOutstandingR2T; the R2T can't be
+    // dropped (the task would never complete), so fail the connection
+    if(head - connection->R2TRingTail == connection->kR2TRingSize)
     {
-        DBLog("iSCSI: Host data buffer doesn't contain requested data");
-        dataMap->unmap();
-        dataMap->release();
+        DBLog("iSCSI: Too many R2Ts awaiting transmit\n");
+        FailConnection(session,connection);
         return;
     }
     
-    // Amount of data to transfer in each iteration (per PDU)
-    UInt32 maxTransferLength = connection->opts.maxSendDataSegmentLength;
+    memcpy(connection->R2TRing[head & (connection->kR2TRingSize-1)],bhs,
+           kiSCSIPDUBasicHeaderSegmentSize);
     
-    data += dataOffset;
+    // Publish the R2T before advancing the head
+    OSMemoryBarrier();
+    connection->R2TRingHead = head + 1;
     
-    DBLog("iSCSI: dataoffset: %d\n",dataOffset);
-    DBLog("iSCSI: desired data length: %d\n",remainingDataLength);
+    connection->taskQueue->signalTransmitWork();
+}
+
+/*! Records the data sequence requested by an R2T PDU so that it can be
+ *  serviced.  Called from the transmit workloop.
+ *  @param session the session associated with the R2T PDU.
+ *  @param connection the connection associated with the R2T PDU.
+ *  @param bhs the basic header segment of the R2T PDU. */
+void iSCSIVirtualHBA::ProcessR2T(iSCSISession * session,
+                                 iSCSIConnection * connection,
+                                 iSCSIPDU::iSCSIPDUR2TBHS * bhs)
+{
+    // The task may have completed since the R2T was received
+    SCSIParallelTaskIdentifier parallelTask =
+        FindTaskForInitiatorTaskTag(session,bhs->initiatorTaskTag);
     
-    UInt32 dataSN = 0;
+    if(!parallelTask)
+    {
+        DBLog("iSCSI: Task not found\n");
+        return;
+    }
     
-    // Create data PDUs and send them until all desired data has been sent
-    iSCSIPDUDataOutBHS bhsDataOut = iSCSIPDUDataOutBHSInit;
-    bhsDataOut.LUN              = bhs->LUN;
-    bhsDataOut.initiatorTaskTag = bhs->initiatorTaskTag;
+    iSCSITaskData * taskData = (iSCSITaskData *)GetHBADataPointer(parallelTask);
+    
+    // Record the R2T; the data it requests is sent by ServicePendingR2Ts().
+    // A target that ignores the negotiated MaxOutstandingR2T violates the
+    // protocol
+    iSCSIR2TSequence * sequence =
+        iSCSIR2TSequenceAdd(taskData->R2TSequences,kiSCSIMaxOutstandingR2T,&taskData->activeR2TCount,
+                            session->opts.maxOutStandingR2T,bhs->LUN,bhs->targetTransferTag,
+                            OSSwapBigToHostInt32(bhs->R2TSN),
+                            OSSwapBigToHostInt32(bhs->bufferOffset),
+                            OSSwapBigToHostInt32(bhs->desiredDataLength));
+    if(!sequence)
+    {
+        DBLog("iSCSI: Target exceeded MaxOutstandingR2T\n");
+        FailConnection(session,connection);
+        return;
+    }
     
-    // Let target know that this data out sequence is in response to the
-    // transfer tag the target gave us with the R2TSN (both in high-byte order)
-    bhsDataOut.targetTransferTag = bhs->targetTransferTag;
-
-    while(remainingDataLength != 0)
+    // Every outstanding task fits, so running out of room is also a
+    // protocol violation
+    if(!iSCSIR2TTaskListAdd(connection->R2TTaskTags,&connection->R2TTaskCount,
+                            connection->kMaxR2TTasks,bhs->initiatorTaskTag))
     {
-        bhsDataOut.bufferOffset = OSSwapHostToBigInt32(dataOffset);
-        bhsDataOut.dataSN = OSSwapHostToBigInt32(dataSN);
-
-        if(maxTransferLength < remainingDataLength) {
-            DBLog("iSCSI: Max transfer length: %d\n",maxTransferLength);
-            int err = SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhsDataOut,
-                              NULL,data,maxTransferLength);
-            
-            if(err != 0) {
-                DBLog("iSCSI: Send error: %d\n",err);
-                dataMap->unmap();
-                dataMap->release();
-                return;
-            }
-            
-            DBLog("iSCSI: dataoffset: %d\n",dataOffset);
-            DBLog("iSCSI: desired data length: %d\n",remainingDataLength);
-            
-            remainingDataLength -= maxTransferLength;
-            data                += maxTransferLength;
-            dataOffset          += maxTransferLength;
-        }
-        // This is the final PDU of the sequence
-        else {
-            DBLog("iSCSI: Sending final data out\n");
-            bhsDataOut.flags = kiSCSIPDUDataOutFinalFlag;
-            int err = SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhsDataOut,
-                              NULL,data,remainingDataLength);
-            
-            if(err != 0) {
-                DBLog("iSCSI: Send error: %d\n",err);
-                dataMap->unmap();
-                dataMap->release();
-                return;
-            }
-            break;
-        }
-        // Increment the data sequence number
-        dataSN++;
+        DBLog("iSCSI: Too many tasks with outstanding R2Ts\n");
+        FailConnection(session,connection);
+        return;
     }
-
-    // Let the driver stack know how much we've transferred (everything)
-    UInt32 transferLen = OSSwapBigToHostInt32(bhs->desiredDataLength);
-    SetRealizedDataTransferCount(parallelTask,transferLen+dataOffset);
-                                              
-    connection->dataToTransfer -= transferLen;
     
-    // Release the mapping object (this leaves the descriptor and buffer intact)
-    dataMap->unmap();
-    dataMap->release();
+    DBLog("iSCSI: dataoffset: %d\n",sequence->bufferOffset);
+    DBLog("iSCSI: desired data length: %d\n",sequence->desiredDataLength);
 }
 
 /*! Process an incoming reject PDU.
@@ -1192,7 +1879,10 @@ void iSCSIVirtualHBA::MeasureConnectionLatency(iSCSISession * session,
     // transfer tag takes on the reserved value fo this type of NOP out)
     iSCSIPDUNOPOutBHS bhs = iSCSIPDUNOPOutBHSInit;
     bhs.targetTransferTag = kiSCSIPDUTargetTransferTagReserved;
-    bhs.initiatorTaskTag  = 0;
+    
+    // The target echoes the task tag in its NOP in, which identifies it as
+    // the reply to a latency probe
+    bhs.initiatorTaskTag  = BuildInitiatorTaskTag(kInitiatorTaskTypeLatency,0);
     
     // Calculate current uptime and send it to the target with this NOP out.
     // The target will echo the value and this allows us to estimate the
@@ -1202,74 +1892,1340 @@ void iSCSIVirtualHBA::MeasureConnectionLatency(iSCSISession * session,
     clock_get_system_microtime((clock_sec_t*)data,
                                (clock_usec_t*)(data+sizeof(clock_sec_t)));
     
-    SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhs,NULL,data,length);
+    if(SendControlPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhs,data,length))
+        return;
+    
+    clock_get_uptime(&connection->probeSendTime);
+    connection->probeOutstanding = true;
 }
 
-
-//////////////////////////////// iSCSI FUNCTIONS ///////////////////////////////
-
-/*! Allocates a new iSCSI session and returns a session qualifier ID.
- *  @param targetIQN the name of the target, or NULL if discovery session.
- *  @param portalAddress the IPv4/IPv6 or hostname of the portal.
- *  @param portalPort the TCP port used for the connection.
- *  @param hostInterface the host interface to use for the connection.
- *  @param portalSockaddr the BSD socket structure used to identify the target.
- *  @param hostSockaddr the BSD socket structure used to identify the host adapter.
- *  @param sessionId identifier for the new session.
- *  @param connectionId identifier for the new connection.
- *  @return error code indicating result of operation. */
-errno_t iSCSIVirtualHBA::CreateSession(OSString * targetIQN,
-                                       OSString * portalAddress,
-                                       OSString * portalPort,
-                                       OSString * hostInterface,
-                                       const struct sockaddr_storage * portalSockaddr,
-                                       const struct sockaddr_storage * hostSockaddr,
-                                       SID * sessionId,
-                                       CID * connectionId)
+/*! Called periodically by the probe timer to send a latency probe on
+ *  every active connection that does not already have one outstanding.
+ *  @param owner an instance of this class.
+ *  @param sender the timer event source that fired. */
+void iSCSIVirtualHBA::ProbeTimerFired(OSObject * owner,IOTimerEventSource * sender)
 {
-    // Validate inputs
-    if(!portalSockaddr || !hostSockaddr || !sessionId || !connectionId)
-        return EINVAL;
-
-    // Default session and connection Ids
-    *sessionId = kiSCSIInvalidSessionId;
-    *connectionId = kiSCSIInvalidConnectionId;
-
-    // Initialize default error (try again)
-    errno_t error = EAGAIN;
-    
-    // Find an open session slot
-    SID sessionIdx;
-    for(sessionIdx = 0; sessionIdx < kMaxSessions; sessionIdx++)
-        if(!sessionList[sessionIdx])
-            break;
-    
-    // If no slots were available tell user to try again later...
-    if(sessionIdx == kMaxSessions)
-        goto SESSION_ID_ALLOC_FAILURE;
-
-    // Alloc new session, validate
-    iSCSISession * newSession;
-    
-    if(!(newSession = (iSCSISession*)IOMalloc(sizeof(iSCSISession))))
-        goto SESSION_ALLOC_FAILURE;
-
-    // Setup connections array for new session
-    newSession->connections = (iSCSIConnection **)IOMalloc(kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
     
-    if(!newSession->connections)
-        goto SESSION_CONNECTION_LIST_ALLOC_FAILURE;
+    if(!hba)
+        return;
     
-    // Reset all connections
-    memset(newSession->connections,0,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
+    UInt64 currentTime;
+    clock_get_uptime(&currentTime);
     
-    // Setup session parameters with defaults
-    newSession->sessionId = sessionIdx;
-    newSession->numActiveConnections = 0;
-    newSession->active = false;
-    newSession->cmdSN = 0;
-    newSession->expCmdSN = 0;
+    for(SID sessionId = 0; sessionId < kMaxSessions; sessionId++)
+    {
+        iSCSISession * session = hba->sessionList[sessionId];
+        
+        if(!session)
+            continue;
+        
+        // Probe state is shared with the session's workloop, which receives
+        // the replies (the probes themselves are handed to the transmit
+        // workloop of each connection, so this never waits on a send)
+        session->workLoop->closeGate();
+        
+        for(CID connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+        {
+            iSCSIConnection * connection = session->connections[connectionId];
+            
+            if(!connection || !connection->taskQueue->isEnabled())
+                continue;
+            
+            // A probe that hasn't been answered within the longest task
+            // timeout is considered lost and is sent again
+            if(connection->probeOutstanding) {
+                UInt64 elapsedNs;
+                absolutetime_to_nanoseconds(currentTime - connection->probeSendTime,&elapsedNs);
+                
+                if(elapsedNs < (UInt64)session->opts.taskTimeoutMaxMs*1000000)
+                    continue;
+                
+                DBLog("iSCSI: Latency probe unanswered (CID %d)\n",connectionId);
+            }
+            
+            hba->MeasureConnectionLatency(session,connection);
+        }
+        
+        session->workLoop->openGate();
+    }
+    
+    sender->setTimeoutMS(kLatencyProbeIntervalMs);
+}
+
+/*! Adds a round-trip time sample to the connection's smoothed RTT and
+ *  RTT variance estimators (Jacobson/Karels, as specified by RFC6298).
+ *  @param connection the connection that was measured.
+ *  @param sampleUs the round-trip time measured, in microseconds. */
+void iSCSIVirtualHBA::UpdateConnectionRTT(iSCSIConnection * connection,UInt64 sampleUs)
+{
+    // The kernel's min() and max() take 32-bit arguments, so 64-bit values
+    // are compared explicitly
+    UInt32 sample = (sampleUs > UINT32_MAX) ? UINT32_MAX : (UInt32)sampleUs;
+    
+    // The first measurement seeds the estimators (RFC6298, section 2.2)
+    if(connection->RTTSampleCount == 0) {
+        connection->smoothedRTTUs = sample;
+        connection->RTTVarianceUs = sample/2;
+    }
+    // RTTVAR <- 3/4 * RTTVAR + 1/4 * |SRTT - R'|
+    // SRTT   <- 7/8 * SRTT   + 1/8 * R'
+    else {
+        UInt32 delta = (connection->smoothedRTTUs > sample) ?
+            connection->smoothedRTTUs - sample : sample - connection->smoothedRTTUs;
+        
+        connection->RTTVarianceUs = (UInt32)(((UInt64)connection->RTTVarianceUs*3 + delta)/4);
+        connection->smoothedRTTUs = (UInt32)(((UInt64)connection->smoothedRTTUs*7 + sample)/8);
+    }
+    connection->RTTSampleCount++;
+}
+
+/*! Computes the timeout of a task from the round-trip time estimate and
+ *  data rate of the connection that it runs on.  The timeout is limited
+ *  to the floor and ceiling configured for the session.
+ *  @param session the session the task belongs to.
+ *  @param connection the connection the task was assigned to.
+ *  @param transferDirection the direction of the task's data transfer.
+ *  @param transferSize the number of bytes the task transfers.
+ *  @return the timeout, in milliseconds. */
+UInt32 iSCSIVirtualHBA::GetTaskTimeout(iSCSISession * session,
+                                       iSCSIConnection * connection,
+                                       UInt8 transferDirection,
+                                       UInt64 transferSize)
+{
+    UInt32 minTimeoutMs = session->opts.taskTimeoutMinMs;
+    UInt32 maxTimeoutMs = max(session->opts.taskTimeoutMaxMs,minTimeoutMs);
+    
+    // Until the connection has been measured, fall back to the default
+    if(connection->RTTSampleCount == 0)
+        return min(max(kiSCSITaskTimeoutMs,minTimeoutMs),maxTimeoutMs);
+    
+    // RTO = SRTT + max(G, 4 * RTTVAR), allowing for several of these
+    UInt64 varianceUs = (UInt64)connection->RTTVarianceUs*4;
+    
+    if(varianceUs < kRTTGranularityUs)
+        varianceUs = kRTTGranularityUs;
+    
+    UInt64 timeoutUs = (connection->smoothedRTTUs + varianceUs)*kTaskTimeoutRTOMultiple;
+    
+    // Allow twice the time the data should take at the measured rate
+    UInt64 bytesPerSecond = GetConnectionBytesPerSecond(connection,transferDirection);
+    
+    if(bytesPerSecond != 0)
+        timeoutUs += (transferSize*2*1000000)/bytesPerSecond;
+    
+    UInt64 timeoutMs = timeoutUs/1000;
+    
+    if(timeoutMs < minTimeoutMs)
+        return minTimeoutMs;
+    
+    if(timeoutMs > maxTimeoutMs)
+        return maxTimeoutMs;
+    
+    return (UInt32)timeoutMs;
+}
+
+/*! Records that a task has started on a connection, for the rate
+ *  estimator of the task's direction.
+ *  @param connection the connection the task runs on.
+ *  @param transferDirection the direction of the task's data transfer.
+ *  @param startTime the time the task was started (absolute time). */
+void iSCSIVirtualHBA::StartTaskRateSample(iSCSIConnection * connection,
+                                          UInt8 transferDirection,
+                                          UInt64 startTime)
+{
+    iSCSIRateEstimator * rate = GetRateEstimator(connection,transferDirection);
+    
+    if(!rate)
+        return;
+    
+    // Busy time starts accumulating once the direction has work outstanding
+    // (tasks start on the transmit workloop and complete on the receive
+    // workloop, so the count is updated atomically)
+    if(OSIncrementAtomic((SInt32 *)&rate->outstandingTasks) == 0)
+        rate->busyStartTime = startTime;
+}
+
+/*! Records that a task has completed on a connection and updates the
+ *  throughput and task rate estimates of the task's direction.  Completed
+ *  bytes and tasks are accumulated until kRateSampleIntervalUs of busy time
+ *  has passed; the resulting sample is then folded into the moving averages.
+ *  @param connection the connection the task ran on.
+ *  @param transferDirection the direction of the task's data transfer.
+ *  @param bytesTransferred the number of bytes the task transferred.
+ *  @param completionTime the time the task completed (absolute time). */
+void iSCSIVirtualHBA::UpdateConnectionRates(iSCSIConnection * connection,
+                                            UInt8 transferDirection,
+                                            UInt64 bytesTransferred,
+                                            UInt64 completionTime)
+{
+    iSCSIRateEstimator * rate = GetRateEstimator(connection,transferDirection);
+    
+    if(!rate || rate->outstandingTasks == 0)
+        return;
+    
+    rate->busyTime += completionTime - rate->busyStartTime;
+    rate->busyStartTime = completionTime;
+    
+    // Once this drops to zero the transmit workloop may restart busyStartTime
+    OSMemoryBarrier();
+    OSDecrementAtomic((SInt32 *)&rate->outstandingTasks);
+    
+    rate->sampleBytes += bytesTransferred;
+    rate->sampleTasks++;
+    rate->bytesTransferred += bytesTransferred;
+    rate->tasksCompleted++;
+    
+    UInt64 busyTimeNs;
+    absolutetime_to_nanoseconds(rate->busyTime,&busyTimeNs);
+    
+    if(busyTimeNs < (UInt64)kRateSampleIntervalUs*1000)
+        return;
+    
+    UInt64 bytesPerSecond = (rate->sampleBytes*1000000000)/busyTimeNs;
+    UInt32 IOPS = (UInt32)(((UInt64)rate->sampleTasks*1000000000)/busyTimeNs);
+    
+    // The first sample seeds the averages
+    if(rate->bytesPerSecond == 0 && rate->IOPS == 0) {
+        rate->bytesPerSecond = bytesPerSecond;
+        rate->IOPS = IOPS;
+    }
+    else {
+        rate->bytesPerSecond = (rate->bytesPerSecond*(kRateEWMADivisor-1) + bytesPerSecond)/kRateEWMADivisor;
+        rate->IOPS = (UInt32)(((UInt64)rate->IOPS*(kRateEWMADivisor-1) + IOPS)/kRateEWMADivisor);
+    }
+    
+    rate->busyTime = 0;
+    rate->sampleBytes = 0;
+    rate->sampleTasks = 0;
+    
+    DBLog("iSCSI: %s rate: %llu bytes/s, %u IOPS (CID %d)\n",
+          (rate == &connection->readRate) ? "Read" : "Write",
+          rate->bytesPerSecond,rate->IOPS,connection->CID);
+}
+
+/*! Gets the estimated throughput of a connection in one direction.  If
+ *  that direction hasn't been measured, the other direction is used.
+ *  @param connection the connection.
+ *  @param transferDirection the direction of interest.
+ *  @return the throughput in bytes per second, or 0 if the connection
+ *  hasn't been measured. */
+UInt64 iSCSIVirtualHBA::GetConnectionBytesPerSecond(iSCSIConnection * connection,
+                                                    UInt8 transferDirection)
+{
+    iSCSIRateEstimator * rate = GetRateEstimator(connection,transferDirection);
+    
+    if(rate && rate->bytesPerSecond != 0)
+        return rate->bytesPerSecond;
+    
+    // Tasks without data (or unmeasured directions) use whichever estimate
+    // is available
+    if(connection->readRate.bytesPerSecond != 0)
+        return connection->readRate.bytesPerSecond;
+    
+    return connection->writeRate.bytesPerSecond;
+}
+
+/*! Gets the estimated number of tasks per second that a connection
+ *  completes in one direction.
+ *  @param connection the connection.
+ *  @param transferDirection the direction of interest.
+ *  @return the task rate, or 0 if the direction hasn't been measured. */
+UInt32 iSCSIVirtualHBA::GetConnectionIOPS(iSCSIConnection * connection,
+                                          UInt8 transferDirection)
+{
+    iSCSIRateEstimator * rate = GetRateEstimator(connection,transferDirection);
+    return rate ? rate->IOPS : 0;
+}
+
+/*! Adds a latency to a histogram using atomic operations, so that the
+ *  histogram can be read at any time without locking.
+ *  @param histogram the histogram.
+ *  @param latencyUs the latency, in microseconds. */
+static void AddToLatencyHistogram(iSCSIKernelLatencyHistogram * histogram,UInt64 latencyUs)
+{
+    UInt32 bucket = iSCSILatencyHistogramGetBucket(latencyUs);
+    
+    OSIncrementAtomic64((volatile SInt64 *)&histogram->buckets[bucket]);
+    OSAddAtomic64(latencyUs,(volatile SInt64 *)&histogram->sumUs);
+    OSIncrementAtomic64((volatile SInt64 *)&histogram->count);
+    
+    UInt64 maxUs;
+    do {
+        maxUs = histogram->maxUs;
+        if(latencyUs <= maxUs)
+            break;
+    } while(!OSCompareAndSwap64(maxUs,latencyUs,(volatile UInt64 *)&histogram->maxUs));
+}
+
+/*! Records the latency of a task in the histograms of its connection
+ *  and of its LUN.  Histograms are updated with atomic operations only.
+ *  @param session the session the task belongs to.
+ *  @param connection the connection the task ran on.
+ *  @param parallelTask the task.
+ *  @param latencyUs the time from when the task was started until it
+ *  completed, in microseconds. */
+void iSCSIVirtualHBA::RecordTaskLatency(iSCSISession * session,
+                                        iSCSIConnection * connection,
+                                        SCSIParallelTaskIdentifier parallelTask,
+                                        UInt64 latencyUs)
+{
+    UInt32 category = GetLatencyCategory(parallelTask);
+    AddToLatencyHistogram(&connection->latency[category],latencyUs);
+    
+    // Find the LUN's histograms; LUNs are assigned histograms as they are
+    // first seen until all have been assigned (tasks complete on the
+    // workloop, so only one thread assigns histograms)
+    SCSILogicalUnitNumber LUN = GetLogicalUnitNumber(parallelTask);
+    UInt32 index;
+    
+    for(index = 0; index < session->latencyLUNsInUse; index++)
+        if(session->latencyLUNs[index] == LUN)
+            break;
+    
+    if(index == session->latencyLUNsInUse)
+    {
+        if(index == session->kLatencyLUNCount)
+            return;
+        
+        session->latencyLUNs[index] = LUN;
+        OSIncrementAtomic(&session->latencyLUNsInUse);
+    }
+    
+    AddToLatencyHistogram(&session->LUNLatency[index][category],latencyUs);
+}
+
+/*! Records the time a task spent in each stage (see the enumerated type
+ *  iSCSITaskStages) in the stage histograms of its connection and, if
+ *  the task is sampled, in the session's task trace.
+ *  @param session the session the task belongs to.
+ *  @param connection the connection the task ran on.
+ *  @param parallelTask the task.
+ *  @param taskData the task's timestamps.
+ *  @param serviceResponse the service response the task completed with.
+ *  @param completionTime the time the task completed (absolute time). */
+void iSCSIVirtualHBA::RecordTaskStages(iSCSISession * session,
+                                       iSCSIConnection * connection,
+                                       SCSIParallelTaskIdentifier parallelTask,
+                                       iSCSITaskData * taskData,
+                                       SCSIServiceResponse serviceResponse,
+                                       UInt64 completionTime)
+{
+    // Each stage ends where the next one begins
+    const UInt64 stageTimes[kiSCSITaskStageCount+1] = {
+        taskData->queueTime,
+        taskData->startTime,
+        taskData->commandSentTime,
+        taskData->firstResponseTime,
+        taskData->statusTime,
+        completionTime
+    };
+    
+    UInt32 stageUs[kiSCSITaskStageCount];
+    
+    for(UInt32 stage = 0; stage < kiSCSITaskStageCount; stage++)
+    {
+        stageUs[stage] = kiSCSITaskStageNotReached;
+        
+        // Stages are skipped if the task never reached them (e.g., tasks
+        // that were aborted before their status was received)
+        if(stageTimes[stage] == 0 || stageTimes[stage+1] < stageTimes[stage])
+            continue;
+        
+        UInt64 elapsedNs;
+        absolutetime_to_nanoseconds(stageTimes[stage+1] - stageTimes[stage],&elapsedNs);
+        
+        UInt64 elapsedUs = elapsedNs/1000;
+        stageUs[stage] = elapsedUs < kiSCSITaskStageNotReached ? (UInt32)elapsedUs : kiSCSITaskStageNotReached-1;
+        AddToLatencyHistogram(&connection->stageLatency[stage],elapsedUs);
+    }
+    
+    // Sample one in every taskTraceInterval tasks into the task trace
+    UInt32 interval = session->taskTraceInterval;
+    
+    if(interval == 0 || (UInt32)OSIncrementAtomic((volatile SInt32 *)&session->taskTraceCounter) % interval != 0)
+        return;
+    
+    iSCSIKernelTaskTraceRecord record;
+    UInt64 completionTimeNs;
+    absolutetime_to_nanoseconds(completionTime,&completionTimeNs);
+    
+    record.completionTimeUs = completionTimeNs/1000;
+    record.LUN = GetLogicalUnitNumber(parallelTask);
+    record.initiatorTaskTag = (UInt32)GetControllerTaskIdentifier(parallelTask);
+    record.transferLength = (UInt32)GetRequestedDataTransferCount(parallelTask);
+    memcpy(record.stageUs,stageUs,sizeof(record.stageUs));
+    record.connectionId = connection->CID;
+    record.category = GetLatencyCategory(parallelTask);
+    record.serviceResponse = serviceResponse;
+    
+    // Overwrite the oldest record if the trace is full
+    IOSimpleLockLock(session->taskTraceLock);
+    
+    session->taskTrace[session->taskTraceHead % kiSCSITaskTraceRecords] = record;
+    session->taskTraceHead++;
+    
+    if(session->taskTraceHead - session->taskTraceTail > kiSCSITaskTraceRecords) {
+        session->taskTraceTail++;
+        session->taskTraceDropped++;
+    }
+    
+    IOSimpleLockUnlock(session->taskTraceLock);
+}
+
+/*! Sets how often completed tasks of a session are sampled into the
+ *  session's task trace.
+ *  @param session the session.
+ *  @param interval one in every interval tasks is sampled (0 disables
+ *  the task trace). */
+void iSCSIVirtualHBA::SetTaskTraceInterval(iSCSISession * session,UInt32 interval)
+{
+    session->taskTraceInterval = interval;
+    session->taskTraceCounter = 0;
+}
+
+/*! Removes all records from a session's task trace.
+ *  @param session the session.
+ *  @param trace the records, oldest first. */
+void iSCSIVirtualHBA::GetTaskTrace(iSCSISession * session,iSCSIKernelTaskTrace * trace)
+{
+    IOSimpleLockLock(session->taskTraceLock);
+    
+    trace->count = (UInt32)(session->taskTraceHead - session->taskTraceTail);
+    trace->dropped = session->taskTraceDropped;
+    
+    for(UInt32 index = 0; index < trace->count; index++)
+        trace->records[index] =
+            session->taskTrace[(session->taskTraceTail + index) % kiSCSITaskTraceRecords];
+    
+    session->taskTraceTail = session->taskTraceHead;
+    session->taskTraceDropped = 0;
+    
+    IOSimpleLockUnlock(session->taskTraceLock);
+}
+
+/*! Enables or disables the PDU trace of a connection.  The trace is
+ *  allocated the first time it is enabled and is kept until the
+ *  connection is released, so that user-space mappings remain valid.
+ *  @param connection the connection.
+ *  @param enable true to start recording PDUs, false to stop.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::SetPDUTraceEnabled(iSCSIConnection * connection,bool enable)
+{
+    if(enable && !connection->PDUTraceMemory)
+    {
+        IOBufferMemoryDescriptor * memory =
+            IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                  sizeof(iSCSIKernelPDUTrace),page_size);
+        if(!memory)
+            return ENOMEM;
+        
+        bzero(memory->getBytesNoCopy(),sizeof(iSCSIKernelPDUTrace));
+        
+        // Another thread may have enabled the trace at the same time, in
+        // which case its buffer is used
+        if(!OSCompareAndSwapPtr(NULL,memory,(void * volatile *)&connection->PDUTraceMemory))
+            memory->release();
+    }
+    
+    // Whichever thread installed the buffer, the trace pointer is set from
+    // it before the trace is enabled (the winner may not have set it yet)
+    if(enable)
+        connection->PDUTrace = (iSCSIKernelPDUTrace *)connection->PDUTraceMemory->getBytesNoCopy();
+    
+    // The trace must be visible before it is enabled
+    OSMemoryBarrier();
+    connection->PDUTraceEnabled = enable;
+    
+    return 0;
+}
+
+/*! Records a PDU in a connection's PDU trace.  Each ring has a single
+ *  producer: sent PDUs are recorded on the connection's transmit workloop
+ *  (FlushPDUs()) and received PDUs on the session's workloop
+ *  (RecvPDUHeader()), so neither ring needs a lock.  Callers check
+ *  PDUTraceEnabled first so that a disabled trace costs a single branch.
+ *  @param connection the connection.
+ *  @param direction one of the iSCSIPDUTraceDirections values.
+ *  @param opCode the PDU opcode (byte 0 of the header).
+ *  @param flags the PDU flags (byte 1 of the header).
+ *  @param initiatorTaskTag the initiator task tag of the PDU.
+ *  @param sequenceNumber CmdSN or StatSN, in host byte order.
+ *  @param expSequenceNumber ExpStatSN or ExpCmdSN, in host byte order.
+ *  @param dataLength the length of the PDU's data segment. */
+void iSCSIVirtualHBA::RecordPDUTrace(iSCSIConnection * connection,
+                                     UInt32 direction,
+                                     UInt8 opCode,
+                                     UInt8 flags,
+                                     UInt32 initiatorTaskTag,
+                                     UInt32 sequenceNumber,
+                                     UInt32 expSequenceNumber,
+                                     UInt32 dataLength)
+{
+    UInt64 now, timestampNs;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now,&timestampNs);
+    
+    iSCSIPDUTraceRecordPDU(&connection->PDUTrace->rings[direction],timestampNs,
+                           opCode,flags,initiatorTaskTag,sequenceNumber,
+                           expSequenceNumber,dataLength);
+}
+
+/*! Gets the latency histogram of a connection or LUN.
+ *  @param session the session.
+ *  @param scope whether a connection, LUN or stage histogram is requested
+ *  (see the enumerated type iSCSILatencyScopes).
+ *  @param identifier the connection ID or LUN.
+ *  @param category the category of commands (see the enumerated type
+ *  iSCSILatencyCategories) or, for stage histograms, the stage (see the
+ *  enumerated type iSCSITaskStages).
+ *  @return the histogram, or NULL if no such histogram exists. */
+iSCSIKernelLatencyHistogram * iSCSIVirtualHBA::GetLatencyHistogram(iSCSISession * session,
+                                                                   UInt32 scope,
+                                                                   UInt64 identifier,
+                                                                   UInt32 category)
+{
+    if(scope == kiSCSILatencyScopeStage)
+    {
+        if(category >= kiSCSITaskStageCount ||
+           identifier >= kMaxConnectionsPerSession || !session->connections[identifier])
+            return NULL;
+        
+        return &session->connections[identifier]->stageLatency[category];
+    }
+    
+    if(category >= kiSCSILatencyCategoryCount)
+        return NULL;
+    
+    if(scope == kiSCSILatencyScopeConnection)
+    {
+        if(identifier >= kMaxConnectionsPerSession || !session->connections[identifier])
+            return NULL;
+        
+        return &session->connections[identifier]->latency[category];
+    }
+    
+    if(scope == kiSCSILatencyScopeLUN)
+    {
+        for(UInt32 index = 0; index < session->latencyLUNsInUse; index++)
+            if(session->latencyLUNs[index] == identifier)
+                return &session->LUNLatency[index][category];
+    }
+    
+    return NULL;
+}
+
+/*! Gets the throughput, task rate and round-trip time estimates of a
+ *  connection.
+ *  @param connection the connection.
+ *  @param stats the statistics to get. */
+void iSCSIVirtualHBA::GetConnectionStatistics(iSCSIConnection * connection,
+                                              iSCSIKernelConnectionStats * stats)
+{
+    stats->readBytesPerSecond = connection->readRate.bytesPerSecond;
+    stats->writeBytesPerSecond = connection->writeRate.bytesPerSecond;
+    stats->readIOPS = connection->readRate.IOPS;
+    stats->writeIOPS = connection->writeRate.IOPS;
+    stats->readsCompleted = connection->readRate.tasksCompleted;
+    stats->writesCompleted = connection->writeRate.tasksCompleted;
+    stats->bytesRead = connection->readRate.bytesTransferred;
+    stats->bytesWritten = connection->writeRate.bytesTransferred;
+    stats->smoothedRTTUs = connection->smoothedRTTUs;
+    stats->RTTVarianceUs = connection->RTTVarianceUs;
+}
+
+/*! Updates the command window of a session using the ExpCmdSN and
+ *  MaxCmdSN fields of a PDU received from the target.  Values are
+ *  compared using serial number arithmetic (RFC1982) and stale or invalid
+ *  windows are ignored per RFC3720.  If the window opens, task queues of
+ *  all connections are resumed.
+ *  @param session the session to update.
+ *  @param expCmdSN the ExpCmdSN received from the target.
+ *  @param maxCmdSN the MaxCmdSN received from the target. */
+void iSCSIVirtualHBA::UpdateCommandWindow(iSCSISession * session,
+                                          UInt32 expCmdSN,
+                                          UInt32 maxCmdSN)
+{
+    // Per RFC3720, if MaxCmdSN is less than ExpCmdSN - 1 both values
+    // must be ignored
+    if(iSCSISerialLessThan(maxCmdSN,expCmdSN - 1))
+        return;
+    
+    // Values may arrive out of order across connections; only move forward
+    iSCSISerialAdvance(&session->expCmdSN,expCmdSN);
+    iSCSISerialAdvance(&session->maxCmdSN,maxCmdSN);
+    
+    session->stats.windowSize = session->maxCmdSN - session->expCmdSN + 1;
+
+    // If tasks were held because the window was closed, account for the
+    // time spent waiting and resume task queues for all connections.  The
+    // stall is only ever ended here, so that a transmit workloop that
+    // closes the window again is always resumed by a later update.
+    UInt64 stallStartUs = session->windowStallStartUs;
+    
+    if(stallStartUs == 0 || !IsCommandWindowOpen(session))
+        return;
+    
+    if(!OSCompareAndSwap64(stallStartUs,0,&session->windowStallStartUs))
+        return;
+    
+    clock_sec_t secs;
+    clock_usec_t usecs;
+    clock_get_system_microtime(&secs,&usecs);
+    
+    OSAddAtomic64((UInt64)secs*1000000 + usecs - stallStartUs,
+                  (SInt64 *)&session->stats.windowStallTimeUs);
+    
+    for(CID connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+    {
+        iSCSIConnection * connection = session->connections[connectionId];
+        
+        if(connection && connection->taskQueue)
+            connection->taskQueue->resumeQueuedTasks();
+    }
+}
+
+/*! Gets whether the target will accept a new command on a session
+ *  (that is, whether CmdSN <= MaxCmdSN).
+ *  @param session the session to check.
+ *  @return true if another command may be issued. */
+bool iSCSIVirtualHBA::IsCommandWindowOpen(iSCSISession * session)
+{
+    return iSCSISerialLessThanOrEqual(session->cmdSN,session->maxCmdSN);
+}
+
+/*! Reserves the next command sequence number of a session, provided that
+ *  it is within the command window (CmdSN <= MaxCmdSN).  Checking the
+ *  window and taking the number is a single compare-and-swap, so that
+ *  connections starting tasks at the same time can't issue a command past
+ *  MaxCmdSN.
+ *  @param session the session.
+ *  @param cmdSN the reserved command sequence number.
+ *  @return true if a command sequence number was reserved, false if the
+ *  command window is closed. */
+bool iSCSIVirtualHBA::ReserveCmdSN(iSCSISession * session,UInt32 * cmdSN)
+{
+    UInt32 current;
+    
+    do {
+        current = session->cmdSN;
+        
+        if(!iSCSISerialLessThanOrEqual(current,session->maxCmdSN))
+            return false;
+        
+    } while(!OSCompareAndSwap(current,current + 1,&session->cmdSN));
+    
+    *cmdSN = current;
+    
+    // Track command window utilization as seen by this command
+    UInt32 expCmdSN = session->expCmdSN;
+    UInt32 windowInUse = current + 1 - expCmdSN;
+    
+    OSIncrementAtomic64((SInt64 *)&session->stats.commandsIssued);
+    OSAddAtomic64(windowInUse,(SInt64 *)&session->stats.windowInUseSum);
+    OSAddAtomic64(session->maxCmdSN - expCmdSN + 1,(SInt64 *)&session->stats.windowSizeSum);
+    
+    if(windowInUse > session->stats.peakWindowInUse)
+        session->stats.peakWindowInUse = windowInUse;
+    
+    return true;
+}
+
+/*! Sends a NOP-Out in place of a command whose command sequence number
+ *  was reserved but which could not be sent.  The target delivers commands
+ *  in CmdSN order and would otherwise hold every later command waiting for
+ *  the missing one.  The NOP-Out is not marked for immediate delivery, so
+ *  it consumes the number; the target's reply carries no timestamp and is
+ *  ignored by ProcessNOPIn().  Called from the transmit workloop.
+ *  @param session the session.
+ *  @param connection the connection that reserved the number.
+ *  @param cmdSN the command sequence number to give up. */
+void iSCSIVirtualHBA::ReleaseCmdSN(iSCSISession * session,
+                                   iSCSIConnection * connection,
+                                   UInt32 cmdSN)
+{
+    iSCSIPDUNOPOutBHS bhs = iSCSIPDUNOPOutBHSInit;
+    bhs.targetTransferTag = kiSCSIPDUTargetTransferTagReserved;
+    bhs.initiatorTaskTag  = BuildInitiatorTaskTag(kInitiatorTaskTypeLatency,0);
+    bhs.cmdSN             = OSSwapHostToBigInt32(cmdSN);
+    
+    if(QueuePDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,0))
+        DBLog("iSCSI: Failed to release command sequence number %u\n",cmdSN);
+}
+
+/*! Records that tasks are being held because the command window of a
+ *  session is closed.  Repeated calls while the window remains closed
+ *  have no effect.
+ *  @param session the session whose window is closed. */
+void iSCSIVirtualHBA::BeginCommandWindowStall(iSCSISession * session)
+{
+    if(session->windowStallStartUs != 0)
+        return;
+    
+    clock_sec_t secs;
+    clock_usec_t usecs;
+    clock_get_system_microtime(&secs,&usecs);
+    
+    // Transmit workloops of several connections may find the window closed
+    // at once; only the first records the stall
+    if(!OSCompareAndSwap64(0,(UInt64)secs*1000000 + usecs,&session->windowStallStartUs))
+        return;
+    
+    OSIncrementAtomic64((SInt64 *)&session->stats.windowStallCount);
+    
+    DBLog("iSCSI: Command window closed, holding tasks\n");
+}
+
+
+/*! Allocates the task table of a session.
+ *  @param session the session.
+ *  @return true if the table was allocated. */
+bool iSCSIVirtualHBA::AllocTaskTable(iSCSISession * session)
+{
+    const UInt32 tableSize = session->kTaskTableSize*sizeof(iSCSITaskEntry);
+    
+    if(!(session->taskTable = (iSCSITaskEntry *)IOMalloc(tableSize)))
+        return false;
+    
+    if(!(session->taskTableLock = IOSimpleLockAlloc())) {
+        IOFree(session->taskTable,tableSize);
+        session->taskTable = NULL;
+        return false;
+    }
+    
+    memset(session->taskTable,0,tableSize);
+    session->freeTaskEntries = NULL;
+    
+    // Entries are handed out in order of the free list; push them in
+    // reverse so that low indices are used first
+    for(UInt16 index = session->kTaskTableSize; index > 0; index--) {
+        session->taskTable[index-1].failedTaskTag = kiSCSIPDUInitiatorTaskTagReserved;
+        session->taskTable[index-1].next = session->freeTaskEntries;
+        session->freeTaskEntries = &session->taskTable[index-1];
+    }
+    
+    return true;
+}
+
+/*! Releases the task table of a session.
+ *  @param session the session. */
+void iSCSIVirtualHBA::ReleaseTaskTable(iSCSISession * session)
+{
+    if(session->taskTable)
+        IOFree(session->taskTable,session->kTaskTableSize*sizeof(iSCSITaskEntry));
+    
+    if(session->taskTableLock)
+        IOSimpleLockFree(session->taskTableLock);
+    
+    session->taskTable = NULL;
+    session->taskTableLock = NULL;
+    session->freeTaskEntries = NULL;
+}
+
+/*! Assigns a task table entry to a SCSI task.
+ *  @param session the session that the task belongs to.
+ *  @param parallelTask the task.
+ *  @param taskData the HBA-specific data of the task.
+ *  @return the initiator task tag for the task, or 0xFFFFFFFF if the
+ *  table is full. */
+UInt32 iSCSIVirtualHBA::AllocTaskEntry(iSCSISession * session,
+                                       SCSIParallelTaskIdentifier parallelTask,
+                                       iSCSITaskData * taskData)
+{
+    // Any number of SCSI stack threads take entries at once; a lock-free
+    // pop would be exposed to ABA, so the free list is protected by a lock
+    IOSimpleLockLock(session->taskTableLock);
+    
+    iSCSITaskEntry * entry = session->freeTaskEntries;
+    
+    if(entry)
+        session->freeTaskEntries = entry->next;
+    
+    IOSimpleLockUnlock(session->taskTableLock);
+    
+    if(!entry)
+        return kiSCSIPDUInitiatorTaskTagReserved;
+    
+    entry->taskData = taskData;
+    entry->parallelTask = parallelTask;
+    
+    UInt32 index = (UInt32)(entry - session->taskTable);
+    return BuildInitiatorTaskTag(kInitiatorTaskTypeSCSITask,((UInt32)entry->generation)<<8 | index);
+}
+
+/*! Releases the task table entry of a SCSI task.
+ *  @param session the session that the task belongs to.
+ *  @param initiatorTaskTag the initiator task tag of the task. */
+void iSCSIVirtualHBA::ReleaseTaskEntry(iSCSISession * session,UInt32 initiatorTaskTag)
+{
+    if(!FindTaskForInitiatorTaskTag(session,initiatorTaskTag))
+        return;
+    
+    UInt32 taskId = ParseInitiatorTaskTagForTaskId(initiatorTaskTag);
+    iSCSITaskEntry * entry = &session->taskTable[taskId & (session->kTaskTableSize-1)];
+    
+    // Bumping the generation invalidates the tag before the entry is reused
+    entry->generation++;
+    entry->parallelTask = NULL;
+    entry->taskData = NULL;
+    
+    IOSimpleLockLock(session->taskTableLock);
+    entry->next = session->freeTaskEntries;
+    session->freeTaskEntries = entry;
+    IOSimpleLockUnlock(session->taskTableLock);
+}
+
+/*! Allocates the pools of PDU buffers.
+ *  @return true if the pools were allocated. */
+bool iSCSIVirtualHBA::AllocPDUBufferPools()
+{
+    memset(&poolStats,0,sizeof(poolStats));
+    memset(pduBufferPool,0,sizeof(pduBufferPool));
+    memset(pduBufferLock,0,sizeof(pduBufferLock));
+    
+    for(UInt8 sizeClass = 0; sizeClass < kiSCSIPDUBufferPoolClasses; sizeClass++)
+    {
+        UInt32 bufferSize = kPDUBufferSizes[sizeClass];
+        
+        poolStats.bufferSize[sizeClass] = bufferSize;
+        pduBufferFreeList[sizeClass] = NULL;
+        
+        if(!(pduBufferLock[sizeClass] = IOSimpleLockAlloc()))
+            goto POOL_ALLOC_FAILURE;
+        
+        if(!(pduBufferPool[sizeClass] = (UInt8 *)IOMalloc(bufferSize*kPDUBuffersPerClass)))
+            goto POOL_ALLOC_FAILURE;
+        
+        // Free buffers store the link to the next free buffer in place
+        for(UInt32 index = kPDUBuffersPerClass; index > 0; index--)
+        {
+            void * buffer = pduBufferPool[sizeClass] + (index-1)*bufferSize;
+            *(void **)buffer = pduBufferFreeList[sizeClass];
+            pduBufferFreeList[sizeClass] = buffer;
+        }
+    }
+    return true;
+    
+POOL_ALLOC_FAILURE:
+    ReleasePDUBufferPools();
+    return false;
+}
+
+/*! Releases the pools of PDU buffers. */
+void iSCSIVirtualHBA::ReleasePDUBufferPools()
+{
+    for(UInt8 sizeClass = 0; sizeClass < kiSCSIPDUBufferPoolClasses; sizeClass++)
+    {
+        if(pduBufferPool[sizeClass])
+            IOFree(pduBufferPool[sizeClass],kPDUBufferSizes[sizeClass]*kPDUBuffersPerClass);
+        
+        if(pduBufferLock[sizeClass])
+            IOSimpleLockFree(pduBufferLock[sizeClass]);
+        
+        pduBufferPool[sizeClass] = NULL;
+        pduBufferLock[sizeClass] = NULL;
+        pduBufferFreeList[sizeClass] = NULL;
+    }
+}
+
+/*! Gets a scratch buffer for a PDU data segment from the smallest size
+ *  class that can hold it.  Buffers are always taken from a preallocated
+ *  pool, which is sized so that it can't be exhausted.
+ *  @param length the number of bytes required.
+ *  @return a buffer, or NULL if length exceeds the largest size class. */
+void * iSCSIVirtualHBA::AllocPDUBuffer(UInt32 length)
+{
+    UInt8 sizeClass = 0;
+    
+    while(sizeClass < kiSCSIPDUBufferPoolClasses && length > kPDUBufferSizes[sizeClass])
+        sizeClass++;
+    
+    if(sizeClass == kiSCSIPDUBufferPoolClasses)
+        return NULL;
+    
+    // Buffers are taken by several workloops at once; a lock-free pop would
+    // be exposed to ABA, so the list is protected by a lock
+    IOSimpleLockLock(pduBufferLock[sizeClass]);
+    
+    void * buffer = pduBufferFreeList[sizeClass];
+    
+    if(buffer)
+        pduBufferFreeList[sizeClass] = *(void **)buffer;
+    
+    IOSimpleLockUnlock(pduBufferLock[sizeClass]);
+    
+    if(!buffer)
+        return NULL;
+    
+    UInt32 inUse = OSIncrementAtomic((SInt32 *)&poolStats.buffersInUse[sizeClass]) + 1;
+    
+    if(inUse > poolStats.buffersHighWater[sizeClass])
+        poolStats.buffersHighWater[sizeClass] = inUse;
+    
+    return buffer;
+}
+
+/*! Returns a buffer obtained with AllocPDUBuffer().
+ *  @param buffer the buffer to return.
+ *  @param length the length that was passed to AllocPDUBuffer(). */
+void iSCSIVirtualHBA::FreePDUBuffer(void * buffer,UInt32 length)
+{
+    UInt8 sizeClass = 0;
+    
+    while(sizeClass < kiSCSIPDUBufferPoolClasses && length > kPDUBufferSizes[sizeClass])
+        sizeClass++;
+    
+    if(!buffer || sizeClass == kiSCSIPDUBufferPoolClasses)
+        return;
+    
+    OSDecrementAtomic((SInt32 *)&poolStats.buffersInUse[sizeClass]);
+    
+    IOSimpleLockLock(pduBufferLock[sizeClass]);
+    *(void **)buffer = pduBufferFreeList[sizeClass];
+    pduBufferFreeList[sizeClass] = buffer;
+    IOSimpleLockUnlock(pduBufferLock[sizeClass]);
+}
+
+/*! Gets a kernel mapping of a task's data buffer.  The mapping is
+ *  created once per task and cached in the task's HBA data until the task
+ *  completes.  Every caller gets its own reference, so that the transmit
+ *  workloop can finish sending from the buffer while the receive workloop
+ *  completes the task.
+ *  @param session the session that the task belongs to.
+ *  @param parallelTask the task whose data buffer should be mapped.
+ *  @return the mapping, which the caller must release, or NULL if the task
+ *  has no data buffer or is being completed. */
+IOMemoryMap * iSCSIVirtualHBA::GetTaskDataMap(iSCSISession * session,
+                                              SCSIParallelTaskIdentifier parallelTask)
+{
+    iSCSITaskData * taskData = (iSCSITaskData *)GetHBADataPointer(parallelTask);
+    
+    if(!taskData)
+        return NULL;
+    
+    // Mapping the buffer may block, so it can't be done with the lock held
+    IOMemoryMap * newMap = NULL;
+    
+    if(!taskData->dataMap) {
+        IOMemoryDescriptor * dataDesc = GetDataBuffer(parallelTask);
+        
+        if(dataDesc)
+            newMap = dataDesc->map();
+    }
+    
+    // CompleteParallelTask() marks the task as completing before it takes
+    // the task's mapping with the lock held, so a mapping is never cached
+    // (and leaked) once the task has been completed
+    IOSimpleLockLock(session->taskTableLock);
+    
+    if(!taskData->completing && !taskData->dataMap) {
+        taskData->dataMap = newMap;
+        newMap = NULL;
+    }
+    
+    IOMemoryMap * dataMap = taskData->completing ? NULL : taskData->dataMap;
+    
+    if(dataMap)
+        dataMap->retain();
+    
+    IOSimpleLockUnlock(session->taskTableLock);
+    
+    // Another thread mapped the buffer first, or the task was completed
+    if(newMap)
+        newMap->release();
+    
+    return dataMap;
+}
+
+/*! Sends Data-Out PDUs of a data sequence for a task, continuing from
+ *  where the sequence was last left off.  The data segments are taken
+ *  directly from the task's cached data mapping and consecutive PDUs
+ *  are gathered into a single send wherever possible.
+ *  @param session the session associated with the task.
+ *  @param connection the connection used to send the data.
+ *  @param parallelTask the task whose data is being sent.
+ *  @param initiatorTaskTag the task's initiator task tag.
+ *  @param sequence the data sequence (solicited or unsolicited); this
+ *  is updated to reflect the data that was sent.
+ *  @param maxPDUs the maximum number of PDUs to send.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::SendDataOutSequence(iSCSISession * session,
+                                             iSCSIConnection * connection,
+                                             SCSIParallelTaskIdentifier parallelTask,
+                                             UInt32 initiatorTaskTag,
+                                             iSCSIR2TSequence * sequence,
+                                             UInt32 maxPDUs)
+{
+    // Range-check inputs
+    if(!session || !connection || !parallelTask || !sequence)
+        return EINVAL;
+    
+    UInt32 maxTransferLength = connection->opts.maxSendDataSegmentLength;
+    
+    if(maxTransferLength == 0)
+        return EINVAL;
+    
+    // Ensure that our data buffer contains all of the requested data
+    IOMemoryMap * dataMap = GetTaskDataMap(session,parallelTask);
+    
+    if(!dataMap ||
+       (UInt64)sequence->bufferOffset + sequence->desiredDataLength > dataMap->getLength())
+    {
+        DBLog("iSCSI: Host data buffer doesn't contain requested data\n");
+        
+        if(dataMap)
+            dataMap->release();
+        
+        return EINVAL;
+    }
+    
+    UInt8 * data = (UInt8 *)dataMap->getAddress();
+    UInt32 pdusSent = 0;
+    
+    // Queue PDUs of the sequence; these are gathered into as few sends as
+    // possible by the transmit batch
+    while(sequence->dataSent != sequence->desiredDataLength && pdusSent < maxPDUs)
+    {
+        UInt32 dataOffset, segmentLength;
+        bool finalPDU = iSCSIR2TSequenceGetNextSegment(sequence,maxTransferLength,
+                                                       &dataOffset,&segmentLength);
+        
+        iSCSIPDUDataOutBHS bhs = iSCSIPDUDataOutBHSInit;
+        bhs.LUN                 = sequence->LUN;
+        bhs.initiatorTaskTag    = initiatorTaskTag;
+        bhs.targetTransferTag   = sequence->targetTransferTag;
+        bhs.dataSN              = OSSwapHostToBigInt32(sequence->dataSN);
+        bhs.bufferOffset        = OSSwapHostToBigInt32(dataOffset);
+        
+        // This is the final PDU of the sequence
+        if(finalPDU)
+            bhs.flags = kiSCSIPDUDataOutFinalFlag;
+        
+        // Data segment is sent straight from the task's buffer
+        errno_t result = QueuePDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhs,
+                                  data + dataOffset,segmentLength);
+        if(result != 0) {
+            dataMap->release();
+            return result;
+        }
+        
+        iSCSIR2TSequenceSegmentSent(sequence,segmentLength);
+        pdusSent++;
+    }
+    
+    // The batch is empty once flushed (even if the send failed), so nothing
+    // refers to the buffer after this
+    errno_t result = FlushPDUs(session,connection);
+    dataMap->release();
+    return result;
+}
+
+/*! Sends the next batch of Data-Out PDUs for the R2T sequences of a task.
+ *  Sequences of the same task are interleaved unless the session
+ *  requires data sequences to be sent in order.
+ *  @param session the session associated with the task.
+ *  @param connection the connection the R2Ts were received on.
+ *  @param parallelTask the task whose R2T sequences should be serviced.
+ *  @param initiatorTaskTag the task's initiator task tag.
+ *  @return true if the task has no remaining R2T sequences. */
+bool iSCSIVirtualHBA::ServiceR2TSequences(iSCSISession * session,
+                                          iSCSIConnection * connection,
+                                          SCSIParallelTaskIdentifier parallelTask,
+                                          UInt32 initiatorTaskTag)
+{
+    iSCSITaskData * taskData = (iSCSITaskData *)GetHBADataPointer(parallelTask);
+    
+    // When data sequences must be sent in order only the oldest sequence
+    // (lowest R2TSN) of the task is serviced
+    iSCSIR2TSequence * oldest = NULL;
+    
+    if(session->opts.dataSequenceInOrder)
+        oldest = iSCSIR2TSequenceGetOldest(taskData->R2TSequences,kiSCSIMaxOutstandingR2T);
+    
+    for(UInt8 index = 0; index < kiSCSIMaxOutstandingR2T; index++)
+    {
+        iSCSIR2TSequence * sequence = &taskData->R2TSequences[index];
+        
+        if(!sequence->active || (oldest && sequence != oldest))
+            continue;
+        
+        errno_t err = SendDataOutSequence(session,connection,parallelTask,initiatorTaskTag,
+                                          sequence,connection->kTxBatchSize);
+        if(err != 0) {
+            DBLog("iSCSI: Failed to send requested data (error %d)\n",err);
+            
+            // Abandon all sequences of this task and fail it
+            memset(taskData->R2TSequences,0,sizeof(taskData->R2TSequences));
+            taskData->activeR2TCount = 0;
+            FailTask(session,initiatorTaskTag);
+            break;
+        }
+        
+        // Sequence complete, let the driver stack know how much we've transferred
+        if(sequence->dataSent == sequence->desiredDataLength)
+        {
+            UInt64 transferred = sequence->bufferOffset + sequence->desiredDataLength;
+            
+            if(transferred > GetRealizedDataTransferCount(parallelTask))
+                SetRealizedDataTransferCount(parallelTask,transferred);
+            
+            iSCSIR2TSequenceRelease(sequence,&taskData->activeR2TCount);
+        }
+    }
+    return (taskData->activeR2TCount == 0);
+}
+
+/*! Services the R2T sequences of all tasks on a connection, one batch
+ *  per task at a time.  Servicing stops early when another R2T has
+ *  been handed over by the receive workloop so that it can be picked
+ *  up and interleaved.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to service. */
+void iSCSIVirtualHBA::ServicePendingR2Ts(iSCSISession * session,
+                                         iSCSIConnection * connection)
+{
+    while(connection->R2TTaskCount != 0)
+    {
+        UInt8 index = 0;
+        
+        while(index < connection->R2TTaskCount)
+        {
+            UInt32 initiatorTaskTag = connection->R2TTaskTags[index];
+            
+            SCSIParallelTaskIdentifier parallelTask =
+                FindTaskForInitiatorTaskTag(session,initiatorTaskTag);
+            
+            // Tasks that have completed or are being completed (or that
+            // have been reassigned to another connection) are dropped
+            bool done = true;
+            
+            if(parallelTask) {
+                iSCSITaskData * taskData = (iSCSITaskData *)GetHBADataPointer(parallelTask);
+                
+                if(!taskData->completing && taskData->connectionId == connection->CID)
+                    done = ServiceR2TSequences(session,connection,parallelTask,initiatorTaskTag);
+            }
+            
+            if(done)
+                connection->R2TTaskTags[index] =
+                    connection->R2TTaskTags[--connection->R2TTaskCount];
+            else
+                index++;
+        }
+        
+        // Pick up further R2Ts before continuing
+        if(connection->R2TRingHead != connection->R2TRingTail)
+            break;
+    }
+}
+
+/*! Takes the R2Ts that the receive workloop has handed over to a
+ *  connection and sends the data they solicit.  Called from the
+ *  connection's transmit workloop.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to service.
+ *  @return true if R2T sequences remain to be serviced. */
+bool iSCSIVirtualHBA::ServiceQueuedR2Ts(iSCSISession * session,
+                                        iSCSIConnection * connection)
+{
+    UInt32 tail = connection->R2TRingTail;
+    
+    while(tail != connection->R2TRingHead)
+    {
+        // Read the R2T only after its publication has been observed
+        OSMemoryBarrier();
+        
+        ProcessR2T(session,connection,
+                   (iSCSIPDUR2TBHS *)connection->R2TRing[tail & (connection->kR2TRingSize-1)]);
+        
+        // Release the slot only once the R2T has been consumed
+        OSMemoryBarrier();
+        connection->R2TRingTail = ++tail;
+    }
+    
+    if(connection->R2TTaskCount != 0)
+        ServicePendingR2Ts(session,connection);
+    
+    return connection->R2TTaskCount != 0 || connection->R2TRingHead != connection->R2TRingTail;
+}
+
+/*! Selects the connection that should carry a new task according to the
+ *  session's connection scheduling policy.  Only active connections
+ *  are considered.
+ *  @param session the session that the task belongs to.
+ *  @param transferDirection the direction of the task's data transfer.
+ *  @param transferSize the number of bytes the task will transfer.
+ *  @return the selected connection, or NULL if no connection is active. */
+iSCSIConnection * iSCSIVirtualHBA::SelectConnectionForTask(iSCSISession * session,
+                                                           UInt8 transferDirection,
+                                                           UInt64 transferSize)
+{
+    iSCSIConnection * connection = NULL;
+    
+    // Round-robin: pick the next active connection after the one that was
+    // assigned the last task
+    if(session->opts.connectionSchedulingPolicy == kiSCSIConnectionSchedulingRoundRobin)
+    {
+        for(CID idx = 1; idx <= kMaxConnectionsPerSession; idx++)
+        {
+            CID connectionId = (session->lastScheduledConnectionId + idx) % kMaxConnectionsPerSession;
+            iSCSIConnection * conn = session->connections[connectionId];
+            
+            if(conn && conn->taskQueue->isEnabled()) {
+                session->lastScheduledConnectionId = connectionId;
+                return conn;
+            }
+        }
+        return NULL;
+    }
+    
+    // Least outstanding bytes & bandwidth-weighted: pick the connection that
+    // minimizes a cost computed from the data it has yet to transfer
+    UInt64 minCost = UINT64_MAX;
+    bool minCostMeasured = true;
+    
+    for(CID connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+    {
+        iSCSIConnection * conn = session->connections[connectionId];
+        
+        // If this connection slot doesn't exist or isn't enabled, move on...
+        if(!conn || !conn->taskQueue->isEnabled())
+            continue;
+        
+        UInt64 outstandingBytes = conn->dataToTransfer + transferSize;
+        
+        if(session->opts.connectionSchedulingPolicy == kiSCSIConnectionSchedulingLeastOutstandingBytes)
+        {
+            if(outstandingBytes < minCost) {
+                minCost = outstandingBytes;
+                connection = conn;
+            }
+            continue;
+        }
+        
+        // Bandwidth-weighted: connections whose speed has not yet been
+        // measured are preferred (by outstanding bytes) so that every
+        // connection gets a measurement; otherwise pick the connection that
+        // would finish its outstanding transfers first (in microseconds)
+        UInt64 bytesPerSecond = GetConnectionBytesPerSecond(conn,transferDirection);
+        bool measured = (bytesPerSecond != 0);
+        UInt64 cost = measured ? (outstandingBytes*1000000)/bytesPerSecond : outstandingBytes;
+        
+        if((minCostMeasured && !measured) || (measured == minCostMeasured && cost < minCost)) {
+            minCost = cost;
+            minCostMeasured = measured;
+            connection = conn;
+        }
+    }
+    
+    if(connection)
+        session->lastScheduledConnectionId = connection->CID;
+    
+    return connection;
+}
+
+
+//////////////////////////////// iSCSI FUNCTIONS ///////////////////////////////
+
+/*! Allocates a new iSCSI session and returns a session qualifier ID.
+ *  @param targetIQN the name of the target, or NULL if discovery session.
+ *  @param portalAddress the IPv4/IPv6 or hostname of the portal.
+ *  @param portalPort the TCP port used for the connection.
+ *  @param hostInterface the host interface to use for the connection.
+ *  @param portalSockaddr the BSD socket structure used to identify the target.
+ *  @param hostSockaddr the BSD socket structure used to identify the host adapter.
+ *  @param sessionId identifier for the new session.
+ *  @param connectionId identifier for the new connection.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::CreateSession(OSString * targetIQN,
+                                       OSString * portalAddress,
+                                       OSString * portalPort,
+                                       OSString * hostInterface,
+                                       const struct sockaddr_storage * portalSockaddr,
+                                       const struct sockaddr_storage * hostSockaddr,
+                                       SID * sessionId,
+                                       CID * connectionId)
+{
+    // Validate inputs
+    if(!portalSockaddr || !hostSockaddr || !sessionId || !connectionId)
+        return EINVAL;
+
+    // Default session and connection Ids
+    *sessionId = kiSCSIInvalidSessionId;
+    *connectionId = kiSCSIInvalidConnectionId;
+
+    // Initialize default error (try again)
+    errno_t error = EAGAIN;
+    
+    // Find an open session slot
+    SID sessionIdx;
+    for(sessionIdx = 0; sessionIdx < kMaxSessions; sessionIdx++)
+        if(!sessionList[sessionIdx])
+            break;
+    
+    // If no slots were available tell user to try again later...
+    if(sessionIdx == kMaxSessions)
+        goto SESSION_ID_ALLOC_FAILURE;
+
+    // Alloc new session, validate
+    iSCSISession * newSession;
+    
+    if(!(newSession = (iSCSISession*)IOMalloc(sizeof(iSCSISession))))
+        goto SESSION_ALLOC_FAILURE;
+
+    // Setup connections array for new session
+    newSession->connections = (iSCSIConnection **)IOMalloc(kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
+    
+    if(!newSession->connections)
+        goto SESSION_CONNECTION_LIST_ALLOC_FAILURE;
+    
+    // Reset all connections
+    memset(newSession->connections,0,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
+    
+    // Setup session parameters with defaults
+    newSession->sessionId = sessionIdx;
+    newSession->numActiveConnections = 0;
+    newSession->lastScheduledConnectionId = 0;
+    newSession->active = false;
+    newSession->cmdSN = 0;
+    newSession->expCmdSN = 0;
     newSession->maxCmdSN = 0;
+    newSession->windowStallStartUs = 0;
+    
+    memset(&newSession->stats,0,sizeof(newSession->stats));
+    memset(newSession->taskMgmtRequests,0,sizeof(newSession->taskMgmtRequests));
+    memset(newSession->LUNLatency,0,sizeof(newSession->LUNLatency));
+    newSession->latencyLUNsInUse = 0;
+    newSession->taskTraceInterval = 0;
+    newSession->taskTraceCounter = 0;
+    newSession->taskTraceHead = 0;
+    newSession->taskTraceTail = 0;
+    newSession->taskTraceDropped = 0;
+    
+    if(!(newSession->taskTraceLock = IOSimpleLockAlloc()))
+        goto SESSION_TASK_TRACE_LOCK_ALLOC_FAILURE;
+    
+    if(!AllocTaskTable(newSession))
+        goto SESSION_TASK_TABLE_ALLOC_FAILURE;
+    
+    if(!(newSession->workLoop = IOWorkLoop::workLoop()))
+        goto SESSION_WORKLOOP_ALLOC_FAILURE;
+    
+    // Completions of each receive batch are held and handed over together;
+    // the timer bounds how long they may be held
+    newSession->heldCompletions = NULL;
+    newSession->heldCompletionsTail = NULL;
+    newSession->heldCompletionCount = 0;
+    newSession->heldCompletionsTime = 0;
+    newSession->completionTimerArmed = false;
+    newSession->pollIntervalStartTime = 0;
+    newSession->pollIntervalTime = 0;
+    
+    if(!(newSession->completionTimer = IOTimerEventSource::timerEventSource(this,&CompletionTimerFired)))
+        goto SESSION_COMPLETION_TIMER_ALLOC_FAILURE;
+    
+    if(newSession->workLoop->addEventSource(newSession->completionTimer) != kIOReturnSuccess)
+        goto SESSION_COMPLETION_TIMER_ADD_FAILURE;
     
     newSession->opts.targetPortalGroupTag = 0;
     newSession->opts.targetSessionId = 0;
@@ -1285,6 +3241,13 @@ errno_t iSCSIVirtualHBA::CreateSession(OSString * targetIQN,
     newSession->opts.maxBurstLength = kRFC3720_MaxBurstLength;
     newSession->opts.maxConnections = kRFC3720_MaxConnections;
     newSession->opts.maxOutStandingR2T = kRFC3720_MaxOutstandingR2T;
+    newSession->opts.connectionSchedulingPolicy = kiSCSIConnectionSchedulingBandwidthWeighted;
+    newSession->opts.taskTimeoutMinMs = kTaskTimeoutMinMs;
+    newSession->opts.taskTimeoutMaxMs = kTaskTimeoutMaxMs;
+    newSession->opts.completionCoalesceCount = kCompletionCoalesceCount;
+    newSession->opts.completionCoalesceUs = kCompletionCoalesceUs;
+    newSession->opts.pollBudgetUs = kPollBudgetUs;
+    newSession->opts.pollCPUPercent = kPollCPUPercent;
     
     // Retain new session
     sessionList[sessionIdx] = newSession;
@@ -1305,9 +3268,24 @@ SESSION_CREATE_CONNECTION_FAILURE:
 
     // Remove target from lookup table
     targetList->removeObject(targetIQN);
-    IOFree(newSession->connections,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
     sessionList[sessionIdx] = nullptr;
     *sessionId = kiSCSIInvalidSessionId;
+    newSession->workLoop->removeEventSource(newSession->completionTimer);
+    
+SESSION_COMPLETION_TIMER_ADD_FAILURE:
+    newSession->completionTimer->release();
+    
+SESSION_COMPLETION_TIMER_ALLOC_FAILURE:
+    newSession->workLoop->release();
+    
+SESSION_WORKLOOP_ALLOC_FAILURE:
+    ReleaseTaskTable(newSession);
+    
+SESSION_TASK_TABLE_ALLOC_FAILURE:
+    IOSimpleLockFree(newSession->taskTraceLock);
+    
+SESSION_TASK_TRACE_LOCK_ALLOC_FAILURE:
+    IOFree(newSession->connections,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
  
 SESSION_CONNECTION_LIST_ALLOC_FAILURE:
     IOFree(newSession,sizeof(iSCSISession));
@@ -1357,7 +3335,14 @@ void iSCSIVirtualHBA::ReleaseSession(SID sessionId)
             ReleaseConnection(sessionId,connectionId);
     }
     
-    // Free connection list and session object
+    // Free workloop, task table, task trace, connection list and session
+    // object (connections have removed their event sources by now)
+    theSession->completionTimer->cancelTimeout();
+    theSession->workLoop->removeEventSource(theSession->completionTimer);
+    theSession->completionTimer->release();
+    theSession->workLoop->release();
+    ReleaseTaskTable(theSession);
+    IOSimpleLockFree(theSession->taskTraceLock);
     IOFree(theSession->connections,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
     IOFree(theSession,sizeof(iSCSISession));
     
@@ -1418,9 +3403,33 @@ errno_t iSCSIVirtualHBA::CreateConnection(SID sessionId,
     if(!newConn)
         return EAGAIN;
 
+    newConn->CID = index;
+    newConn->R2TTaskCount = 0;
+    newConn->R2TRingHead = 0;
+    newConn->R2TRingTail = 0;
+    newConn->controlQueue = NULL;
+    newConn->controlPDUsInUse = 0;
+    
+    for(UInt8 pduIndex = 0; pduIndex < newConn->kControlPDUCount - 1; pduIndex++)
+        newConn->controlPDUs[pduIndex].data = newConn->controlPDUData[pduIndex];
+    
+    newConn->controlPDUs[newConn->kControlPDUCount - 1].data = newConn->controlPDULargeData;
+    newConn->failed = 0;
+    newConn->completionsHeld = false;
     newConn->expStatSN = 0;
     newConn->dataToTransfer = 0;
-    newConn->bytesPerSecond = 0;
+    memset(&newConn->readRate,0,sizeof(newConn->readRate));
+    memset(&newConn->writeRate,0,sizeof(newConn->writeRate));
+    newConn->smoothedRTTUs = 0;
+    newConn->RTTVarianceUs = 0;
+    newConn->RTTSampleCount = 0;
+    newConn->probeOutstanding = false;
+    newConn->probeSendTime = 0;
+    newConn->PDUTraceMemory = NULL;
+    newConn->PDUTrace = NULL;
+    newConn->PDUTraceEnabled = false;
+    memset(newConn->latency,0,sizeof(newConn->latency));
+    memset(newConn->stageLatency,0,sizeof(newConn->stageLatency));
     
     newConn->opts.maxRecvDataSegmentLength = kRFC3720_MaxRecvDataSegmentLength;
     newConn->opts.maxSendDataSegmentLength = kRFC3720_MaxRecvDataSegmentLength;
@@ -1430,6 +3439,12 @@ errno_t iSCSIVirtualHBA::CreateConnection(SID sessionId,
     newConn->opts.useIFMarker = kRFC3720_IFMarker;
     newConn->opts.OFMarkInt = kRFC3720_OFMarkInt;
     newConn->opts.IFMarkInt = kRFC3720_IFMarkInt;
+    newConn->opts.queueDepth = kDefaultQueueDepth;
+    
+    newConn->recvBufferStart = 0;
+    newConn->recvBufferEnd = 0;
+    newConn->txCount = 0;
+    newConn->txDataMapCount = 0;
     
     session->connections[index] = newConn;
     *connectionId = index;
@@ -1437,6 +3452,14 @@ errno_t iSCSIVirtualHBA::CreateConnection(SID sessionId,
     // Initialize default error (try again)
     errno_t error = EAGAIN;
     
+    if(!(newConn->recvBuffer = (UInt8 *)IOMalloc(newConn->kRecvBufferSize)))
+        goto RECVBUFFER_ALLOC_FAILURE;
+    
+    // Each connection sends from its own workloop; PDUs are received on
+    // the session's workloop
+    if(!(newConn->txWorkLoop = IOWorkLoop::workLoop()))
+        goto TXWORKLOOP_ALLOC_FAILURE;
+    
     if(!(newConn->taskQueue = OSTypeAlloc(iSCSITaskQueue)))
         goto TASKQUEUE_ALLOC_FAILURE;
     
@@ -1444,7 +3467,7 @@ errno_t iSCSIVirtualHBA::CreateConnection(SID sessionId,
     if(!newConn->taskQueue->init(this,(iSCSITaskQueue::Action)&BeginTaskOnWorkloopThread,session,newConn))
         goto TASKQUEUE_INIT_FAILURE;
     
-    if(GetWorkLoop()->addEventSource(newConn->taskQueue) != kIOReturnSuccess)
+    if(newConn->txWorkLoop->addEventSource(newConn->taskQueue) != kIOReturnSuccess)
         goto TASKQUEUE_ADD_FAILURE;
     
     newConn->taskQueue->disable();
@@ -1456,7 +3479,7 @@ errno_t iSCSIVirtualHBA::CreateConnection(SID sessionId,
     if(!newConn->dataRecvEventSource->init(this,(iSCSIIOEventSource::Action)&ProcessTaskOnWorkloopThread,session,newConn))
         goto EVENTSOURCE_INIT_FAILURE;
     
-    if(GetWorkLoop()->addEventSource(newConn->dataRecvEventSource) != kIOReturnSuccess)
+    if(session->workLoop->addEventSource(newConn->dataRecvEventSource) != kIOReturnSuccess)
         goto EVENTSOURCE_ADD_FAILURE;
     
     newConn->dataRecvEventSource->disable();
@@ -1486,10 +3509,6 @@ errno_t iSCSIVirtualHBA::CreateConnection(SID sessionId,
     sock_setsockopt(newConn->socket,SOL_SOCKET,SO_SNDTIMEO,(const void*)&timeout,sizeof(struct timeval));
     sock_setsockopt(newConn->socket,SOL_SOCKET,SO_RCVTIMEO,(const void*)&timeout,sizeof(struct timeval));
 
-    // Initialize queue that keeps track of connection speed
-    memset(newConn->bytesPerSecondHistory,0,sizeof(UInt8)*newConn->kBytesPerSecAvgWindowSize);
-    newConn->bytesPerSecHistoryIdx = 0;
-    
     newConn->portalAddress = portalAddress;
     newConn->portalPort = portalPort;
     newConn->hostInteface = hostInterface;
@@ -1505,7 +3524,7 @@ SOCKET_BIND_FAILURE:
     sock_close(newConn->socket);
     
 SOCKET_CREATE_FAILURE:
-    GetWorkLoop()->removeEventSource(newConn->dataRecvEventSource);
+    session->workLoop->removeEventSource(newConn->dataRecvEventSource);
     
 EVENTSOURCE_ADD_FAILURE:
     
@@ -1513,7 +3532,7 @@ EVENTSOURCE_INIT_FAILURE:
     newConn->dataRecvEventSource->release();
     
 EVENTSOURCE_ALLOC_FAILURE:
-    GetWorkLoop()->removeEventSource(newConn->taskQueue);
+    newConn->txWorkLoop->removeEventSource(newConn->taskQueue);
     
 TASKQUEUE_ADD_FAILURE:
     
@@ -1521,6 +3540,12 @@ TASKQUEUE_INIT_FAILURE:
     newConn->taskQueue->release();
     
 TASKQUEUE_ALLOC_FAILURE:
+    newConn->txWorkLoop->release();
+    
+TXWORKLOOP_ALLOC_FAILURE:
+    IOFree(newConn->recvBuffer,newConn->kRecvBufferSize);
+    
+RECVBUFFER_ALLOC_FAILURE:
 
     session->connections[index] = 0;
     IOFree(newConn,sizeof(iSCSIConnection));
@@ -1551,22 +3576,49 @@ void iSCSIVirtualHBA::ReleaseConnection(SID sessionId,
     // First deactivate connection before proceeding
     if(connection->taskQueue->isEnabled())
         DeactivateConnection(sessionId,connectionId);
+    
+    // The session's workloop walks the connection list (e.g., when it hands
+    // over completions), so unlink the connection with the gate closed
+    session->workLoop->closeGate();
+    session->connections[connectionId] = NULL;
+    
+    // Requests sent on the connection will never see a response
+    for(UInt8 index = 0; index < session->kMaxTaskMgmtRequests; index++)
+    {
+        iSCSITaskMgmtRequest * request = &session->taskMgmtRequests[index];
+        
+        if(request->inUse && request->connectionId == connectionId)
+            CompleteTaskMgmtRequest(session,request,kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+    }
+    
+    session->workLoop->openGate();
 
     sock_close(connection->socket);
 
     DBLog("iSCSI: Deactivated connection.\n");
 
-    GetWorkLoop()->removeEventSource(connection->dataRecvEventSource);
-    GetWorkLoop()->removeEventSource(connection->taskQueue);
+    session->workLoop->removeEventSource(connection->dataRecvEventSource);
+    connection->txWorkLoop->removeEventSource(connection->taskQueue);
     
     DBLog("iSCSI: Removed event sources.\n");
     
     connection->dataRecvEventSource->release();
     connection->taskQueue->release();
+    connection->txWorkLoop->release();
     connection->dataToTransfer = 0;
     
+    // User-space mappings of the PDU trace hold their own reference
+    if(connection->PDUTraceMemory)
+        connection->PDUTraceMemory->release();
+    
+    // Control PDUs may have been queued since the connection was deactivated
+    DiscardControlPDUs(connection);
+    
+    // PDUs left in the transmit batch are never sent
+    ReleaseTxDataMaps(connection);
+    
+    IOFree(connection->recvBuffer,connection->kRecvBufferSize);
     IOFree(connection,sizeof(iSCSIConnection));
-    session->connections[connectionId] = NULL;
     
     DBLog("iSCSI: Released connection.\n");
 }
@@ -1594,6 +3646,7 @@ errno_t iSCSIVirtualHBA::ActivateConnection(SID sessionId,CID connectionId)
     if(!connection)
         return EINVAL;
     
+    connection->probeOutstanding = false;
     connection->taskQueue->enable();
     connection->dataRecvEventSource->enable();
     
@@ -1659,17 +3712,33 @@ errno_t iSCSIVirtualHBA::DeactivateConnection(SID sessionId,CID connectionId)
     if(!connection)
         return EINVAL;
 
+    // Wait for the session's workloop (receive) and the connection's
+    // transmit workloop to finish with the connection
+    session->workLoop->closeGate();
+    connection->txWorkLoop->closeGate();
+    
     connection->dataRecvEventSource->disable();
     connection->taskQueue->disable();
     
+    // Drop R2Ts that were handed over but not picked up; their tasks are
+    // completed below
+    connection->R2TRingTail = connection->R2TRingHead;
+    connection->R2TTaskCount = 0;
+    
+    // NOP-Out replies, probes and task management requests that haven't
+    // been sent refer to this connection's current state
+    DiscardControlPDUs(connection);
+    
     // Tell driver stack that tasks have been rejected (stack will reattempt
     // the task on a different connection, if one is available)
     UInt32 initiatorTaskTag = 0;
     SCSIParallelTaskIdentifier task;
  
-    while((initiatorTaskTag = connection->taskQueue->completeCurrentTask()) != 0)
+    while(!connection->taskQueue->isEmpty())
     {
-        task = FindTaskForControllerIdentifier(sessionId, initiatorTaskTag);
+        initiatorTaskTag = connection->taskQueue->completeCurrentTask();
+
+        task = FindTaskForInitiatorTaskTag(session,initiatorTaskTag);
         if(!task)
             continue;
         
@@ -1681,165 +3750,713 @@ errno_t iSCSIVirtualHBA::DeactivateConnection(SID sessionId,CID connectionId)
                              kSCSITaskStatus_DeliveryFailure,
                              kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
     }
+    
+    DeliverCompletions(session);
+    
+    connection->txWorkLoop->openGate();
+    session->workLoop->openGate();
 
     OSDecrementAtomic(&session->numActiveConnections);
     
-    // If this is the last active connection, un-mount the target
-    if(session->numActiveConnections == 0)
-        DestroyTargetForID(sessionId);
+    // If this is the last active connection, un-mount the target
+    if(session->numActiveConnections == 0)
+        DestroyTargetForID(sessionId);
+    
+    DBLog("iSCSI: Connection Deactivated");
+    
+    return 0;
+}
+
+/*! Deactivates all iSCSI connections so that parameters can be adjusted or
+ *  negotiated by the iSCSI daemon.
+ *  @param sessionId the session to deactivate.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::DeactivateAllConnections(SID sessionId)
+{
+    if(sessionId >= kMaxSessions)
+        return EINVAL;
+    
+    // Do nothing if session doesn't exist
+    iSCSISession * session = sessionList[sessionId];
+    
+    if(!session)
+        return EINVAL;
+    
+    errno_t error = 0;
+    for(CID connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+    {
+        if(session->connections[connectionId])
+        {
+            if((error = DeactivateConnection(sessionId,connectionId)))
+                return error;
+        }
+    }
+    
+    return 0;
+}
+
+/*! Sends data over a kernel socket associated with iSCSI.  If the specified
+ *  data segment length is not a multiple of 4-bytes, padding bytes will be 
+ *  added to the data segment of the PDU per RF3720 specification.
+ *  This function will automatically calculate the data segment length
+ *  field of the PDU and place it in the header using the correct byte order.
+ *  It will also assign a command sequence number and expected status sequence
+ *  number using values from the session and connection objects to the PDU
+ *  header in the correct (network) byte order.  Any PDUs waiting in the
+ *  connection's transmit batch are sent along with this PDU.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param connectionId the connection associated with the session.
+ *  @param bhs the basic header segment to send.
+ *  @param ahs the additional header segments, if any
+ *  @param data the data segment to send.
+ *  @param length the byte size of the data segment
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
+                                 iSCSIConnection * connection,
+                                 iSCSIPDUInitiatorBHS * bhs,
+                                 iSCSIPDUCommonAHS * ahs,
+                                 const void * data,
+                                 size_t length)
+{
+    // PDUs from the daemon are normally marked for immediate delivery; any
+    // others need a command sequence number within the command window
+    if(!(bhs->opCodeAndDeliveryMarker & kiSCSIPDUImmediateDeliveryFlag) &&
+       bhs->opCodeAndDeliveryMarker != kiSCSIPDUOpCodeDataOut) {
+        UInt32 cmdSN;
+        
+        if(!ReserveCmdSN(session,&cmdSN))
+            return EAGAIN;
+        
+        bhs->cmdSN = OSSwapHostToBigInt32(cmdSN);
+    }
+    
+    errno_t result = QueuePDU(session,connection,bhs,data,length);
+    
+    if(result == 0)
+        result = FlushPDUs(session,connection);
+    
+    return result;
+}
+
+/*! Sends a control PDU (NOP-Out or task management request) on the
+ *  control lane of a connection.  Control PDUs are never queued as tasks
+ *  and are marked for immediate delivery, so they neither consume a command
+ *  sequence number nor wait for the command window to open.  The PDU is
+ *  copied to the connection's control queue and sent by its transmit
+ *  workloop (see SendQueuedControlPDUs()), so callers never wait on the
+ *  transmit gate or on the socket.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to send the PDU on.
+ *  @param bhs the basic header segment to send.
+ *  @param data the data segment to send.
+ *  @param length the byte size of the data segment
+ *  @return error code indicating result of operation (ENOMEM if all of the
+ *  connection's control PDUs are in use). */
+errno_t iSCSIVirtualHBA::SendControlPDU(iSCSISession * session,
+                                        iSCSIConnection * connection,
+                                        iSCSIPDUInitiatorBHS * bhs,
+                                        const void * data,
+                                        size_t length)
+{
+    // Range-check inputs
+    if(!session || !connection || !bhs)
+        return EINVAL;
+    
+    if(!data)
+        length = 0;
+    
+    if(length > sizeof(connection->controlPDULargeData))
+        return EINVAL;
+    
+    bhs->opCodeAndDeliveryMarker |= kiSCSIPDUImmediateDeliveryFlag;
+    
+    // Control PDUs come from SCSI stack threads, the session's workloop and
+    // the HBA workloop (which may hold the session's gate), so they are
+    // copied and handed to the transmit workloop rather than sent here.
+    // Claim one of the connection's control PDUs; only the last one can
+    // hold a large data segment, so leave it for PDUs that need it
+    const UInt32 firstIndex = (length <= connection->kControlPDUDataSize) ? 0 : connection->kControlPDUCount - 1;
+    UInt32 inUse, index;
+    
+    do {
+        inUse = connection->controlPDUsInUse;
+        
+        for(index = firstIndex; index < connection->kControlPDUCount; index++)
+            if(!(inUse & (1U << index)))
+                break;
+        
+        if(index == connection->kControlPDUCount)
+            return ENOMEM;
+        
+    } while(!OSCompareAndSwap(inUse,inUse | (1U << index),&connection->controlPDUsInUse));
+    
+    iSCSIControlPDU * pdu = &connection->controlPDUs[index];
+    memcpy(pdu->bhs,bhs,kiSCSIPDUBasicHeaderSegmentSize);
+    memcpy(pdu->data,data,length);
+    pdu->length = (UInt32)length;
     
-    DBLog("iSCSI: Connection Deactivated");
+    iSCSIControlPDU * head;
     
+    do {
+        head = (iSCSIControlPDU *)connection->controlQueue;
+        pdu->next = head;
+    } while(!OSCompareAndSwapPtr(head,pdu,&connection->controlQueue));
+    
+    connection->taskQueue->signalTransmitWork();
     return 0;
 }
 
-/*! Deactivates all iSCSI connections so that parameters can be adjusted or
- *  negotiated by the iSCSI daemon.
- *  @param sessionId the session to deactivate.
- *  @return error code indicating result of operation. */
-errno_t iSCSIVirtualHBA::DeactivateAllConnections(SID sessionId)
+/*! Sends the PDUs on a connection's control queue, in the order in which
+ *  they were queued.  PDUs already in the transmit batch are sent first,
+ *  so that a task management request never overtakes the command it refers
+ *  to.  Called from the transmit workloop.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection whose control PDUs should be sent. */
+void iSCSIVirtualHBA::SendQueuedControlPDUs(iSCSISession * session,
+                                            iSCSIConnection * connection)
 {
-    if(sessionId >= kMaxSessions)
-        return EINVAL;
+    // Take the whole queue at once; producers only ever push onto its head
+    iSCSIControlPDU * list;
     
-    // Do nothing if session doesn't exist
-    iSCSISession * session = sessionList[sessionId];
+    do {
+        list = (iSCSIControlPDU *)connection->controlQueue;
+    } while(list && !OSCompareAndSwapPtr(list,NULL,&connection->controlQueue));
     
-    if(!session)
-        return EINVAL;
+    if(!list)
+        return;
     
-    errno_t error = 0;
-    for(CID connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
-    {
-        if(session->connections[connectionId])
-        {
-            if((error = DeactivateConnection(sessionId,connectionId)))
-                return error;
-        }
+    // The list is most recent first; reverse it to send PDUs in order
+    iSCSIControlPDU * ordered = NULL;
+    
+    while(list) {
+        iSCSIControlPDU * next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
     }
     
-    return 0;
+    for(iSCSIControlPDU * pdu = ordered; pdu; pdu = pdu->next)
+        if(QueuePDU(session,connection,(iSCSIPDUInitiatorBHS *)pdu->bhs,
+                    pdu->length ? pdu->data : NULL,pdu->length))
+            DBLog("iSCSI: Failed to send control PDU\n");
+    
+    // The batch refers to the data of the PDUs, so send it before they're freed
+    FlushPDUs(session,connection);
+    
+    while(ordered) {
+        iSCSIControlPDU * next = ordered->next;
+        FreeControlPDU(connection,ordered);
+        ordered = next;
+    }
 }
 
-/*! Sends data over a kernel socket associated with iSCSI.  If the specified
- *  data segment length is not a multiple of 4-bytes, padding bytes will be 
- *  added to the data segment of the PDU per RF3720 specification.
- *  This function will automatically calculate the data segment length
- *  field of the PDU and place it in the header using the correct byte order.
- *  It will also assign a command sequence number and expected status sequence
- *  number using values from the session and connection objects to the PDU
- *  header in the correct (network) byte order.
- *  @param sessionId the qualifier part of the ISID (see RFC3720).
- *  @param connectionId the connection associated with the session.
+/*! Frees the PDUs on a connection's control queue without sending them.
+ *  @param connection the connection whose control PDUs should be freed. */
+void iSCSIVirtualHBA::DiscardControlPDUs(iSCSIConnection * connection)
+{
+    iSCSIControlPDU * pdu;
+    
+    do {
+        pdu = (iSCSIControlPDU *)connection->controlQueue;
+    } while(pdu && !OSCompareAndSwapPtr(pdu,NULL,&connection->controlQueue));
+    
+    while(pdu) {
+        iSCSIControlPDU * next = pdu->next;
+        FreeControlPDU(connection,pdu);
+        pdu = next;
+    }
+}
+
+/*! Returns a control PDU to its connection once it's been sent.
+ *  @param connection the connection that owns the PDU.
+ *  @param pdu the PDU to return. */
+void iSCSIVirtualHBA::FreeControlPDU(iSCSIConnection * connection,
+                                     iSCSIControlPDU * pdu)
+{
+    UInt32 index = (UInt32)(pdu - connection->controlPDUs);
+    OSBitAndAtomic(~(1U << index),&connection->controlPDUsInUse);
+}
+
+/*! Adds a PDU to a connection's transmit batch.  The PDU is sent the next
+ *  time the batch is flushed: when the batch is full, when its oldest PDU
+ *  has waited for longer than kTxBatchDeadlineUs, or when FlushPDUs() is
+ *  called (e.g., once the task queue drains).  The basic header segment is
+ *  copied, but the data segment is not and must remain valid until the
+ *  batch has been flushed.  PDUs that aren't marked for immediate delivery
+ *  must carry a command sequence number reserved with ReserveCmdSN(); the
+ *  expected status sequence number and digests are filled in when the
+ *  batch is flushed.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to send the PDU on.
  *  @param bhs the basic header segment to send.
- *  @param ahs the additional header segments, if any
  *  @param data the data segment to send.
  *  @param length the byte size of the data segment
  *  @return error code indicating result of operation. */
-errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
-                                 iSCSIConnection * connection,
-                                 iSCSIPDUInitiatorBHS * bhs,
-                                 iSCSIPDUCommonAHS * ahs,
-                                 const void * data,
-                                 size_t length)
+errno_t iSCSIVirtualHBA::QueuePDU(iSCSISession * session,
+                                  iSCSIConnection * connection,
+                                  iSCSIPDUInitiatorBHS * bhs,
+                                  const void * data,
+                                  size_t length)
 {
     // Range-check inputs
     if(!session || !connection || !bhs)
         return EINVAL;
     
-    // Set the command sequence number & expected status sequence number
-    if(bhs->opCodeAndDeliveryMarker != kiSCSIPDUOpCodeDataOut) {
+    errno_t result = 0;
+    
+    // Flush the batch if it is full or if it has been held for too long
+    if(connection->txCount == connection->kTxBatchSize)
+        result = FlushPDUs(session,connection);
+    else if(connection->txCount != 0) {
+        UInt64 currentTime, elapsedNs;
+        clock_get_uptime(&currentTime);
+        absolutetime_to_nanoseconds(currentTime - connection->txBatchStartTime,&elapsedNs);
+        
+        if(elapsedNs >= (UInt64)kTxBatchDeadlineUs*1000)
+            result = FlushPDUs(session,connection);
+    }
+    
+    if(result != 0)
+        return result;
+    
+    // PDUs marked for immediate delivery carry the next command sequence
+    // number without advancing it; other PDUs (commands) carry the number
+    // reserved for them with ReserveCmdSN() when their task was started
+    if(bhs->opCodeAndDeliveryMarker != kiSCSIPDUOpCodeDataOut &&
+       (bhs->opCodeAndDeliveryMarker & kiSCSIPDUImmediateDeliveryFlag))
         bhs->cmdSN = OSSwapHostToBigInt32(session->cmdSN);
+    
+    if(!data)
+        length = 0;
+    
+    SetDataSegmentLength(bhs,length);
+    
+    UInt8 index = connection->txCount;
+    memcpy(connection->txBHS[index],bhs,kiSCSIPDUBasicHeaderSegmentSize);
+    connection->txData[index] = data;
+    connection->txDataLength[index] = (UInt32)length;
+    
+    if(index == 0)
+        clock_get_uptime(&connection->txBatchStartTime);
+    
+    connection->txCount++;
+    return 0;
+}
+
+/*! Keeps a mapping of a task's data buffer until the transmit batch, which
+ *  holds a PDU sent from that buffer, has been flushed.  The task may be
+ *  completed (dropping its own reference) before then.
+ *  @param connection the connection whose batch holds the PDU.
+ *  @param dataMap the mapping (a reference is taken). */
+void iSCSIVirtualHBA::HoldTxDataMap(iSCSIConnection * connection,IOMemoryMap * dataMap)
+{
+    // Each PDU in the batch holds at most one mapping
+    if(connection->txDataMapCount == connection->kTxBatchSize)
+        return;
+    
+    dataMap->retain();
+    connection->txDataMaps[connection->txDataMapCount++] = dataMap;
+}
+
+/*! Releases the mappings held for a connection's transmit batch.
+ *  @param connection the connection. */
+void iSCSIVirtualHBA::ReleaseTxDataMaps(iSCSIConnection * connection)
+{
+    for(UInt8 index = 0; index < connection->txDataMapCount; index++)
+        connection->txDataMaps[index]->release();
+    
+    connection->txDataMapCount = 0;
+}
+
+/*! Sends all PDUs in a connection's transmit batch with a single send.
+ *  If the batch can't be sent in full, the connection is failed.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection whose transmit batch should be sent.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::FlushPDUs(iSCSISession * session,
+                                   iSCSIConnection * connection)
+{
+    // Range-check inputs
+    if(!session || !connection)
+        return EINVAL;
+    
+    if(connection->txCount == 0)
+        return 0;
+    
+    // A failed connection is about to be released; its byte stream may end
+    // in the middle of a PDU, so nothing more can be sent on it
+    if(connection->failed) {
+        connection->txCount = 0;
+        ReleaseTxDataMaps(connection);
+        return EPIPE;
+    }
+    
+    // Stamp the latest expected status sequence number and compute the
+    // header digests of the whole batch at once (interleaved)
+    const void * headers[iSCSIConnection::kTxBatchSize];
+    size_t headerLengths[iSCSIConnection::kTxBatchSize];
+    
+    for(UInt8 index = 0; index < connection->txCount; index++)
+    {
+        iSCSIPDUInitiatorBHS * bhs = (iSCSIPDUInitiatorBHS *)connection->txBHS[index];
+        bhs->expStatSN = OSSwapHostToBigInt32(connection->expStatSN);
+        
+        if(connection->PDUTraceEnabled)
+            RecordPDUTrace(connection,kiSCSIPDUTraceSent,bhs->opCodeAndDeliveryMarker,
+                           bhs->opCodeFields[0],bhs->initiatorTaskTag,
+                           OSSwapBigToHostInt32(bhs->cmdSN),connection->expStatSN,
+                           connection->txDataLength[index]);
+        
+        headers[index] = bhs;
+        headerLengths[index] = kiSCSIPDUBasicHeaderSegmentSize;
+        connection->txHeaderDigest[index] = 0;
+    }
+    
+    if(connection->opts.useHeaderDigest)
+        crc32c_batch(connection->txHeaderDigest,headers,headerLengths,connection->txCount);
+    
+    size_t bytesSent = 0;
+    errno_t result = SendPDUsFromIovec(connection,&bytesSent);
+    
+    // Part of the batch may have been sent; the target would take whatever
+    // follows for the rest of a PDU, so the connection can't carry on
+    if(result != 0) {
+        DBLog("iSCSI: Send failed after %lu bytes (%d)\n",(unsigned long)bytesSent,result);
+        FailConnection(session,connection);
+    }
+    
+    // Timestamp the SCSI command PDUs of the batch as sent
+    UInt64 sentTime;
+    clock_get_uptime(&sentTime);
+    bool commandsSent = false;
+    
+    for(UInt8 index = 0; index < connection->txCount; index++)
+    {
+        iSCSIPDUInitiatorBHS * bhs = (iSCSIPDUInitiatorBHS *)connection->txBHS[index];
         
-        // Advance cmdSN if PDU is not marked for immediate delivery
-        if(!(bhs->opCodeAndDeliveryMarker & kiSCSIPDUImmediateDeliveryFlag))
-            OSIncrementAtomic(&session->cmdSN);
+        if((bhs->opCodeAndDeliveryMarker & ~kiSCSIPDUImmediateDeliveryFlag) != kiSCSIPDUOpCodeSCSICmd)
+            continue;
+        
+        commandsSent = true;
+        
+        SCSIParallelTaskIdentifier parallelTask =
+            FindTaskForInitiatorTaskTag(session,bhs->initiatorTaskTag);
+        
+        if(parallelTask)
+            ((iSCSITaskData *)GetHBADataPointer(parallelTask))->commandSentTime = sentTime;
     }
     
-    bhs->expStatSN = OSSwapHostToBigInt32(connection->expStatSN);
+    // Connections of a session send from their own workloops
+    OSAddAtomic64(connection->txCount,(SInt64 *)&session->stats.pdusSent);
+    OSIncrementAtomic64((SInt64 *)&session->stats.sendCount);
     
-    SetDataSegmentLength((iSCSIPDUInitiatorBHS*)bhs,length);
+    connection->txCount = 0;
+    ReleaseTxDataMaps(connection);
+    
+    // When the session polls, the receive workloop starts spinning for the
+    // responses now rather than once the socket wakes it
+    if(commandsSent && result == 0 && session->opts.pollBudgetUs != 0)
+        connection->dataRecvEventSource->requestPoll();
+    
+    return result;
+}
 
-    // Send data over the network, return true if all bytes were sent
+/*! Sends all PDUs in a connection's transmit batch with a scatter-gather
+ *  send.  Data digests are computed over the data segments in place.  A
+ *  send that is cut short is resumed where it stopped, until the whole
+ *  batch has been sent.  Called by FlushPDUs().
+ *  @param connection the connection whose transmit batch should be sent.
+ *  @param bytesSent the number of bytes sent.
+ *  @return error code indicating result of operation (the batch has been
+ *  sent in full only if this is 0). */
+errno_t iSCSIVirtualHBA::SendPDUsFromIovec(iSCSIConnection * connection,size_t * bytesSent)
+{
     struct msghdr msg;
-    struct iovec  iovec[5];
     memset(&msg,0,sizeof(struct msghdr));
     
-    msg.msg_iov = iovec;
     unsigned int iovecCnt = 0;
+    UInt32 padding = 0;
     
-    // Set basic header segment
-    iovec[iovecCnt].iov_base  = bhs;
-    iovec[iovecCnt].iov_len   = kiSCSIPDUBasicHeaderSegmentSize;
-    iovecCnt++;
-
-    // Leave room for a header digest
-    if(connection->opts.useHeaderDigest)    {
-        UInt32 headerDigest;
-        
-        // Compute digest
-        headerDigest = crc32c(0,bhs,kiSCSIPDUBasicHeaderSegmentSize);
+    // Compute the digests of all data segments at once (interleaved); the
+    // padding of each segment is added below
+    if(connection->opts.useDataDigest) {
+        const void * data[iSCSIConnection::kTxBatchSize];
+        size_t dataLengths[iSCSIConnection::kTxBatchSize];
         
-        iovec[iovecCnt].iov_base = &headerDigest;
-        iovec[iovecCnt].iov_len  = sizeof(headerDigest);
-        iovecCnt++;
+        for(UInt8 index = 0; index < connection->txCount; index++) {
+            data[index] = connection->txData[index];
+            dataLengths[index] = data[index] ? connection->txDataLength[index] : 0;
+            connection->txDataDigest[index] = 0;
+        }
+        crc32c_batch(connection->txDataDigest,data,dataLengths,connection->txCount);
     }
- 
-    // If theres data to send...
-    if(data)
+    
+    for(UInt8 index = 0; index < connection->txCount; index++)
     {
+        // Set basic header segment
+        connection->txIovec[iovecCnt].iov_base = connection->txBHS[index];
+        connection->txIovec[iovecCnt].iov_len  = kiSCSIPDUBasicHeaderSegmentSize;
+        iovecCnt++;
+        
+        // Add header digest
+        if(connection->opts.useHeaderDigest) {
+            connection->txIovec[iovecCnt].iov_base = &connection->txHeaderDigest[index];
+            connection->txIovec[iovecCnt].iov_len  = sizeof(UInt32);
+            iovecCnt++;
+        }
+        
+        // If theres data to send...
+        const void * data = connection->txData[index];
+        UInt32 length = connection->txDataLength[index];
+        
+        if(!data)
+            continue;
+        
         // Add data segment
-        iovec[iovecCnt].iov_base = (void*)data;
-        iovec[iovecCnt].iov_len  = length;
+        connection->txIovec[iovecCnt].iov_base = (void*)data;
+        connection->txIovec[iovecCnt].iov_len  = length;
         iovecCnt++;
         
         // Add padding bytes if required
-        UInt32 paddingLen = 4-(length % 4);
-        UInt32 padding = 0;
-        if(paddingLen != 4)
-        {
-            iovec[iovecCnt].iov_base  = &padding;
-            iovec[iovecCnt].iov_len   = paddingLen;
+        UInt32 paddingLen = (4 - (length % 4)) % 4;
+        
+        if(paddingLen != 0) {
+            connection->txIovec[iovecCnt].iov_base = &padding;
+            connection->txIovec[iovecCnt].iov_len  = paddingLen;
             iovecCnt++;
         }
- 
-        // Leave room for a data digest
+        
+        // Add data digest (including padding)
         if(connection->opts.useDataDigest) {
-            UInt32 dataDigest;
-            
-            // Compute digest
-            dataDigest = crc32c(0,data,length);
+            if(paddingLen != 0)
+                connection->txDataDigest[index] =
+                    crc32c(connection->txDataDigest[index],&padding,paddingLen);
             
-            // Add padding to digest calculation
-            if(paddingLen != 0 && paddingLen != 4)
-                dataDigest = crc32c(dataDigest,&padding,paddingLen);
-
-            iovec[iovecCnt].iov_base = &dataDigest;
-            iovec[iovecCnt].iov_len  = sizeof(dataDigest);
+            connection->txIovec[iovecCnt].iov_base = &connection->txDataDigest[index];
+            connection->txIovec[iovecCnt].iov_len  = sizeof(UInt32);
             iovecCnt++;
         }
     }
     
-    // Update io vector count, send data
-    msg.msg_iovlen = iovecCnt;
-    size_t bytesSent = 0;
-    int result = sock_send(connection->socket,&msg,0,&bytesSent);
+    struct iovec * iovec = connection->txIovec;
+    UInt32 stalledSends = 0;
+    *bytesSent = 0;
     
-    return result;
+    while(iovecCnt > 0)
+    {
+        msg.msg_iov = iovec;
+        msg.msg_iovlen = iovecCnt;
+        
+        size_t sent = 0;
+        errno_t result = sock_send(connection->socket,&msg,0,&sent);
+        *bytesSent += sent;
+        
+        if(sent == 0)
+            stalledSends++;
+        else
+            stalledSends = 0;
+        
+        // Skip what was sent, trimming the entry that was sent in part
+        while(iovecCnt > 0 && sent >= iovec->iov_len) {
+            sent -= iovec->iov_len;
+            iovec++;
+            iovecCnt--;
+        }
+        
+        if(iovecCnt == 0)
+            break;
+        
+        iovec->iov_base = (UInt8 *)iovec->iov_base + sent;
+        iovec->iov_len -= sent;
+        
+        // The send timeout expired (the target isn't reading); retry for a
+        // while as long as some progress is being made
+        if(result != 0 && result != EWOULDBLOCK && result != EINTR)
+            return result;
+        
+        if(stalledSends == kTxMaxStalledSends)
+            return result ? result : ETIMEDOUT;
+    }
+    return 0;
 }
 
+/*! Gets whether a complete PDU (or the header of a PDU with a large data
+ *  segment) is held in a connection's receive buffer.
+ *  @param connection the connection to check.
+ *  @return true if a PDU can be dispatched, false otherwise. */
+static bool isPDUBuffered(iSCSIConnection * connection)
+{
+    UInt32 bytesBuffered = connection->recvBufferEnd - connection->recvBufferStart;
+    
+    if(bytesBuffered < kiSCSIPDUBasicHeaderSegmentSize)
+        return false;
+    
+    iSCSIPDUTargetBHS * bhs =
+        (iSCSIPDUTargetBHS *)(connection->recvBuffer + connection->recvBufferStart);
+    
+    // Size of the header, including additional header segments and digest
+    UInt32 headerLength = kiSCSIPDUBasicHeaderSegmentSize + bhs->totalAHSLength*4;
+    
+    if(connection->opts.useHeaderDigest)
+        headerLength += sizeof(UInt32);
+    
+    // Size of the data segment, including padding and digest
+    UInt32 dataLength = (bhs->dataSegmentLength[0] << 16) |
+                        (bhs->dataSegmentLength[1] << 8)  |
+                         bhs->dataSegmentLength[2];
+    
+    if(dataLength >= connection->kRecvDirectThreshold)
+        return bytesBuffered >= headerLength;
+    
+    if(dataLength != 0) {
+        dataLength += (4 - (dataLength % 4)) % 4;
+        
+        if(connection->opts.useDataDigest)
+            dataLength += sizeof(UInt32);
+    }
+    return bytesBuffered >= headerLength + dataLength;
+}
 
 /*! Gets whether a PDU is available for receiption on a particular
- *  connection.
+ *  connection.  Any bytes waiting at the socket are first pulled into the
+ *  connection's receive buffer.  A PDU is available once it has been
+ *  buffered in its entirety (or, for PDUs with large data segments, once
+ *  its header has been buffered).
  *  @param the connection to check.
  *  @return true if a PDU is available, false otherwise. */
 bool iSCSIVirtualHBA::isPDUAvailable(iSCSIConnection * connection)
 {
-    int bytesAtSocket;
-    sock_ioctl(connection->socket,FIONREAD,&bytesAtSocket);
+    if(isPDUBuffered(connection))
+        return true;
+    
+    // Move the partial PDU at the tail to the front of the buffer
+    UInt32 bytesBuffered = connection->recvBufferEnd - connection->recvBufferStart;
+    
+    if(connection->recvBufferStart != 0) {
+        memmove(connection->recvBuffer,
+                connection->recvBuffer + connection->recvBufferStart,
+                bytesBuffered);
+        
+        connection->recvBufferStart = 0;
+        connection->recvBufferEnd = bytesBuffered;
+    }
+    
+    // Pull in as many bytes as the socket has (without blocking)
+    struct msghdr msg;
+    struct iovec  iovec;
+    memset(&msg,0,sizeof(struct msghdr));
+    
+    iovec.iov_base = connection->recvBuffer + connection->recvBufferEnd;
+    iovec.iov_len  = connection->kRecvBufferSize - connection->recvBufferEnd;
+    msg.msg_iov    = &iovec;
+    msg.msg_iovlen = 1;
+    
+    size_t bytesRecv = 0;
+    
+    if(iovec.iov_len != 0 &&
+       sock_receive(connection->socket,&msg,MSG_DONTWAIT,&bytesRecv) == 0)
+        connection->recvBufferEnd += bytesRecv;
+    
+    return isPDUBuffered(connection);
+}
 
-    // Guarantee that the data equal to a basic header segment is available
-    return bytesAtSocket >= kiSCSIPDUBasicHeaderSegmentSize;
+/*! Receives data from a connection into a scatter-gather list.  Bytes
+ *  held in the connection's receive buffer are consumed first; any
+ *  remaining bytes are received directly from the socket.
+ *  @param connection the connection to receive from.
+ *  @param iovec the scatter-gather list to fill (modified by this call).
+ *  @param iovecCnt the number of entries in the scatter-gather list.
+ *  @param bytesRecv the number of bytes received.
+ *  @param digest if not NULL, the CRC32C of the bytes received is
+ *  accumulated into the value that this points to.  Buffered bytes are
+ *  checksummed as they are copied out of the receive buffer.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::RecvFromConnection(iSCSIConnection * connection,
+                                            struct iovec * iovec,
+                                            unsigned int iovecCnt,
+                                            size_t * bytesRecv,
+                                            UInt32 * digest)
+{
+    unsigned int index = 0;
+    *bytesRecv = 0;
+    
+    // Consume buffered bytes first
+    while(index < iovecCnt && connection->recvBufferStart != connection->recvBufferEnd)
+    {
+        size_t length = connection->recvBufferEnd - connection->recvBufferStart;
+        
+        if(length > iovec[index].iov_len)
+            length = iovec[index].iov_len;
+        
+        const UInt8 * buffered = connection->recvBuffer + connection->recvBufferStart;
+        
+        if(digest)
+            *digest = crc32c_copy(*digest,iovec[index].iov_base,buffered,length);
+        else
+            memcpy(iovec[index].iov_base,buffered,length);
+        
+        connection->recvBufferStart += length;
+        *bytesRecv += length;
+        
+        if(length == iovec[index].iov_len)
+            index++;
+        else {
+            iovec[index].iov_base = (UInt8 *)iovec[index].iov_base + length;
+            iovec[index].iov_len -= length;
+        }
+    }
+    
+    if(connection->recvBufferStart == connection->recvBufferEnd)
+        connection->recvBufferStart = connection->recvBufferEnd = 0;
+    
+    if(index == iovecCnt)
+        return 0;
+    
+    // Receive the remainder straight from the socket
+    struct msghdr msg;
+    memset(&msg,0,sizeof(struct msghdr));
+    
+    size_t bytesRecvSocket = 0;
+    errno_t result = 0;
+    
+    if(!digest) {
+        msg.msg_iov = &iovec[index];
+        msg.msg_iovlen = iovecCnt - index;
+        
+        result = sock_receive(connection->socket,&msg,MSG_WAITALL,&bytesRecvSocket);
+        *bytesRecv += bytesRecvSocket;
+        
+        return result;
+    }
+    
+    // When computing a digest, receive the remainder in chunks and checksum
+    // each chunk while it is still in the cache
+    while(index < iovecCnt)
+    {
+        struct iovec chunk;
+        chunk.iov_base = iovec[index].iov_base;
+        chunk.iov_len  = iovec[index].iov_len < kDigestChunkSize ? iovec[index].iov_len : kDigestChunkSize;
+        
+        msg.msg_iov = &chunk;
+        msg.msg_iovlen = 1;
+        
+        bytesRecvSocket = 0;
+        result = sock_receive(connection->socket,&msg,MSG_WAITALL,&bytesRecvSocket);
+        
+        *digest = crc32c(*digest,iovec[index].iov_base,bytesRecvSocket);
+        *bytesRecv += bytesRecvSocket;
+        
+        if(result != 0 || bytesRecvSocket != chunk.iov_len)
+            break;
+        
+        if(bytesRecvSocket == iovec[index].iov_len)
+            index++;
+        else {
+            iovec[index].iov_base = (UInt8 *)iovec[index].iov_base + bytesRecvSocket;
+            iovec[index].iov_len -= bytesRecvSocket;
+        }
+    }
+    return result;
 }
 
 
@@ -1859,11 +4476,7 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
         return EINVAL;
     
     // Receive data over the network
-    struct msghdr msg;
     struct iovec  iovec[2];
-    memset(&msg,0,sizeof(struct msghdr));
-    
-    msg.msg_iov = iovec;
     unsigned int iovecCnt = 0;
     
     // Set basic header segment
@@ -1881,11 +4494,9 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
         iovecCnt++;
     }
     
-    msg.msg_iovlen = iovecCnt;
-    
-    // Bytes received from sock_receive call
+    // Bytes received from the connection
     size_t bytesRecv;
-    errno_t result = sock_receive(connection->socket,&msg,MSG_WAITALL,&bytesRecv);
+    errno_t result = RecvFromConnection(connection,iovec,iovecCnt,&bytesRecv,NULL);
     
     if(result != 0)
         DBLog("iSCSI: sock_receive error returned with code %d\n",result);
@@ -1914,6 +4525,11 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
         }
     }
     
+    if(connection->PDUTraceEnabled)
+        RecordPDUTrace(connection,kiSCSIPDUTraceReceived,bhs->opCode,bhs->opCodeFields[0],
+                       bhs->initiatorTaskTag,OSSwapBigToHostInt32(bhs->statSN),
+                       OSSwapBigToHostInt32(bhs->expCmdSN),GetDataSegmentLength(bhs));
+    
     // Update command sequence numbers only if the PDU was not a data PDU
     // (unless the data PDU contains a SCSI service response)
     if(bhs->opCode == kiSCSIPDUOpCodeDataIn) {
@@ -1927,10 +4543,7 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
     bhs->expCmdSN = OSSwapBigToHostInt32(bhs->expCmdSN);
     bhs->statSN = OSSwapBigToHostInt32(bhs->statSN);
     
-    if(bhs->maxCmdSN > session->maxCmdSN)
-        OSWriteLittleInt32(&session->maxCmdSN,0,bhs->maxCmdSN);
-    if(bhs->expCmdSN > session->expCmdSN)
-        OSWriteLittleInt32(&session->expCmdSN,0,bhs->expCmdSN);
+    UpdateCommandWindow(session,bhs->expCmdSN,bhs->maxCmdSN);
     
     if(bhs->opCode != kiSCSIPDUOpCodeDataIn || bhs->statSN != 0)
         OSIncrementAtomic(&connection->expStatSN);
@@ -1957,11 +4570,8 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
     if(!session || !connection || !data)
         return EINVAL;
     
-    // Setup message with required iovec
-    struct msghdr msg;
-    struct iovec  iovec[4];
-    memset(&msg,0,sizeof(struct msghdr));
-    msg.msg_iov = iovec;
+    // Setup required iovec
+    struct iovec  iovec[2];
     unsigned int iovecCnt = 0;
 
     // Setup to receive data block
@@ -1979,31 +4589,24 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
        iovecCnt++;
     }
     
-    UInt32 dataDigest = 0;
-    
-    // Retrieve data digest, if one exists
-    if(connection->opts.useDataDigest)
-    {
-        iovec[iovecCnt].iov_base = &dataDigest;
-        iovec[iovecCnt].iov_len  = sizeof(dataDigest);
-        iovecCnt++;
-    }
+    // The digest (including padding) is computed while the data is received
+    UInt32 calcDigest = 0;
+    UInt32 * digest = connection->opts.useDataDigest ? &calcDigest : NULL;
 
-    msg.msg_iovlen = iovecCnt;
-    
     size_t bytesRecv;
-    errno_t result = sock_receive(connection->socket,&msg,MSG_WAITALL,&bytesRecv);
+    errno_t result = RecvFromConnection(connection,iovec,iovecCnt,&bytesRecv,digest);
     
-    // Verify digest if present
-    if(connection->opts.useDataDigest)
+    // Retrieve and verify data digest, if one exists
+    if(connection->opts.useDataDigest && result == 0)
     {
-        // Compute digest including padding...
-        UInt32 calcDigest = crc32c(0,data,length);
+        UInt32 dataDigest = 0;
+        
+        iovec[0].iov_base = &dataDigest;
+        iovec[0].iov_len  = sizeof(dataDigest);
         
-        if(paddingLen != 4)
-            calcDigest = crc32c(calcDigest,&padding,paddingLen);
+        result = RecvFromConnection(connection,iovec,1,&bytesRecv,NULL);
         
-        if(dataDigest != calcDigest)
+        if(result == 0 && dataDigest != calcDigest)
         {
             DBLog("iSCSI: Failed data digest.\n");
             
@@ -2015,3 +4618,48 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
 
     return result;
 }
+
+/*! Receives and discards a data segment over a kernel socket (including
+ *  padding and data digest).  This is used to keep the stream in sync
+ *  when a data segment cannot be processed.  The data is received in
+ *  fixed-size chunks so that no buffer of the segment size is required.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection associated with the session.
+ *  @param length the length of the data segment to discard.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::FlushPDUData(iSCSISession * session,
+                                      iSCSIConnection * connection,
+                                      size_t length)
+{
+    // Range-check inputs
+    if(!session || !connection)
+        return EINVAL;
+    
+    // Padding and digest (if any) are discarded along with the data
+    size_t remaining = length;
+    
+    if(length % 4 != 0)
+        remaining += 4 - (length % 4);
+    
+    if(connection->opts.useDataDigest)
+        remaining += sizeof(UInt32);
+    
+    UInt8 buffer[kFlushBufferSize];
+    struct iovec  iovec;
+    errno_t result = 0;
+    
+    while(remaining > 0)
+    {
+        iovec.iov_base = buffer;
+        iovec.iov_len  = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+        
+        size_t bytesRecv = 0;
+        result = RecvFromConnection(connection,&iovec,1,&bytesRecv,NULL);
+        
+        if(result || bytesRecv == 0)
+            break;
+        
+        remaining -= bytesRecv;
+    }
+    return result;
+}
@@ -10,8 +10,11 @@
 
 // IOKit includes
 #include <IOKit/IOService.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/scsi/spi/IOSCSIParallelInterfaceController.h>
 #include <IOKit/scsi/IOSCSIProtocolInterface.h>
+#include <IOKit/scsi/SCSICommandOperationCodes.h>
 
 // Libkern includes
 #include <libkern/c++/OSArray.h>
@@ -93,7 +96,8 @@ public:
      *  process at any one time. */
 	virtual UInt32 ReportMaximumTaskCount();
 
-    /*! Returns the data size associated with a particular task (0). */
+    /*! Returns the data size associated with a particular task (the size
+     *  of iSCSITaskData). */
 	virtual UInt32 ReportHBASpecificTaskDataSize();
 
     /*! Returns the device data size (0). */
@@ -128,6 +132,55 @@ public:
      *  @param sessionId the session associated with the timed-out connection.
      *  @param connectionId the connection that timed out. */
     void HandleConnectionTimeout(SID sessionId,CID connectionId);
+    
+    /*! Marks a connection as failed and has it released from the HBA
+     *  workloop.  The session and transmit workloops call this when a
+     *  connection can't continue, since they can't release a connection
+     *  while they are processing it.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection that failed. */
+    void FailConnection(iSCSISession * session,iSCSIConnection * connection);
+    
+    /*! Called on the HBA workloop when connections have failed; releases
+     *  every failed connection (and the session, if it was the last one).
+     *  @param owner an instance of this class.
+     *  @param sender the event source that was signaled.
+     *  @param count the number of times the event source was signaled. */
+    static void ConnectionFailureSourceFired(OSObject * owner,IOInterruptEventSource * sender,int count);
+    
+    /*! Has a task failed from the HBA workloop.  The transmit workloop
+     *  calls this when it can't start a task or send its data, since it
+     *  can't take the session's gate to complete the task itself.
+     *  @param session the session that the task belongs to.
+     *  @param initiatorTaskTag the initiator task tag of the task. */
+    void FailTask(iSCSISession * session,UInt32 initiatorTaskTag);
+    
+    /*! Called on the HBA workloop when tasks have failed; completes every
+     *  failed task with a service delivery failure.
+     *  @param owner an instance of this class.
+     *  @param sender the event source that was signaled.
+     *  @param count the number of times the event source was signaled. */
+    static void TaskFailureSourceFired(OSObject * owner,IOInterruptEventSource * sender,int count);
+    
+    /*! Called periodically by the probe timer to send a latency probe on
+     *  every active connection that does not already have one outstanding.
+     *  @param owner an instance of this class.
+     *  @param sender the timer event source that fired. */
+    static void ProbeTimerFired(OSObject * owner,IOTimerEventSource * sender);
+    
+    /*! Called on the HBA workloop when session workloops have handed over
+     *  completed tasks; completes them with the SCSI stack in the order in
+     *  which they were handed over.
+     *  @param owner an instance of this class.
+     *  @param sender the event source that was signaled.
+     *  @param count the number of times the event source was signaled. */
+    static void CompletionSourceFired(OSObject * owner,IOInterruptEventSource * sender,int count);
+    
+    /*! Called on a session's workloop when its completions have been held
+     *  for the session's completionCoalesceUs; hands them over.
+     *  @param owner an instance of this class.
+     *  @param sender the timer event source that fired. */
+    static void CompletionTimerFired(OSObject * owner,IOTimerEventSource * sender);
 
 	/*! Processes a task passed down by SCSI target devices in driver stack.
      *  @param parallelTask the task to process.
@@ -141,7 +194,8 @@ public:
     static void BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
                                           iSCSISession * session,
                                           iSCSIConnection * connection,
-                                          UInt32 initiatorTaskTag);
+                                          UInt32 initiatorTaskTag,
+                                          UInt32 cmdSN);
     
     /*! Called by our software interrupt source (iSCSIIOEventSource) to let us
      *  know that data has become available for a particular session and
@@ -154,7 +208,9 @@ public:
                                              iSCSIConnection * connection);
     
     /*! This function has been overloaded to provide additional task-timing
-     *  support for multiple connections.
+     *  support for multiple connections.  Tasks are completed with the SCSI
+     *  stack on the HBA workloop rather than on the session's workloop, so
+     *  that session workloops never wait on the HBA's gate.
      *  @param session the session associated with the task.
      *  @param connection the connection associated with the task.
      *  @param parallelRequest the request to complete.
@@ -165,6 +221,28 @@ public:
                               SCSIParallelTaskIdentifier parallelRequest,
                               SCSITaskStatus completionStatus,
                               SCSIServiceResponse serviceResponse);
+    
+    /*! Hands the completions held by a session to the HBA workloop with a
+     *  single signal, and wakes the transmit workloops of connections whose
+     *  tasks have completed.  Called on the session's workloop.
+     *  @param session the session. */
+    void DeliverCompletions(iSCSISession * session);
+    
+    /*! Called on the session's workloop once a batch of received PDUs has
+     *  been processed.  Held completions are handed over unless the
+     *  session's options allow them to be held for longer, in which case
+     *  the completion timer is armed.
+     *  @param session the session. */
+    void EndReceiveBatch(iSCSISession * session);
+    
+    /*! Spins for up to the session's poll budget waiting for a PDU to arrive
+     *  on a connection that has tasks outstanding.  The time spent polling
+     *  is limited to the session's share of CPU time.  Called on the
+     *  session's workloop.
+     *  @param session the session.
+     *  @param connection the connection to poll.
+     *  @return true if a PDU is available. */
+    bool PollForPDU(iSCSISession * session,iSCSIConnection * connection);
 
     
     /////////////////////  FUNCTIONS TO MANIPULATE ISCSI ///////////////////////
@@ -251,7 +329,8 @@ public:
      *  added to the data segment of the PDU per RF3720 specification.
      *  This function will automatically calculate the data segment length
      *  field of the PDU and place it in the header using the correct byte order.
-     *  It will also assign a command sequence number and expected status sequence
+     *  It will also assign a command sequence number (reserving one for PDUs
+     *  that aren't marked for immediate delivery) and expected status sequence
      *  number using values from the session and connection objects to the PDU
      *  header in the correct (network) byte order.
      *  @param sessionId the qualifier part of the ISID (see RFC3720).
@@ -267,13 +346,113 @@ public:
                     iSCSIPDU::iSCSIPDUCommonAHS * ahs,
                     const void * data,
                     size_t length);
+    
+    /*! Sends a control PDU (NOP-Out or task management request) on the
+     *  control lane of a connection.  Control PDUs are never queued as
+     *  tasks and are marked for immediate delivery, so they neither consume
+     *  a command sequence number nor wait for the command window to open.
+     *  The PDU is copied to one of the connection's control PDUs and put
+     *  on its control queue, which the transmit workloop drains, so this
+     *  may be called from any thread without taking a gate.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to send the PDU on.
+     *  @param bhs the basic header segment to send.
+     *  @param data the data segment to send.
+     *  @param length the byte size of the data segment
+     *  @return error code indicating result of operation (ENOMEM if all
+     *  of the connection's control PDUs are in use). */
+    errno_t SendControlPDU(iSCSISession * session,
+                           iSCSIConnection * connection,
+                           iSCSIPDUInitiatorBHS * bhs,
+                           const void * data,
+                           size_t length);
+    
+    /*! Sends the PDUs on a connection's control queue, in the order in
+     *  which they were queued.  Called from the transmit workloop.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection whose control PDUs should be sent. */
+    void SendQueuedControlPDUs(iSCSISession * session,
+                               iSCSIConnection * connection);
+    
+    /*! Frees the PDUs on a connection's control queue without sending them.
+     *  @param connection the connection whose control PDUs should be freed. */
+    void DiscardControlPDUs(iSCSIConnection * connection);
+    
+    /*! Returns a control PDU to its connection once it's been sent.
+     *  @param connection the connection that owns the PDU.
+     *  @param pdu the PDU to return. */
+    void FreeControlPDU(iSCSIConnection * connection,iSCSIControlPDU * pdu);
+    
+    /*! Adds a PDU to a connection's transmit batch.  The PDU is sent the
+     *  next time the batch is flushed (when it is full, when its oldest PDU
+     *  has waited too long, or when FlushPDUs() is called).  The data
+     *  segment is not copied and must remain valid until then.  PDUs that
+     *  aren't marked for immediate delivery must carry a command sequence
+     *  number reserved with ReserveCmdSN().
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to send the PDU on.
+     *  @param bhs the basic header segment to send.
+     *  @param data the data segment to send.
+     *  @param length the byte size of the data segment
+     *  @return error code indicating result of operation. */
+    errno_t QueuePDU(iSCSISession * session,
+                     iSCSIConnection * connection,
+                     iSCSIPDUInitiatorBHS * bhs,
+                     const void * data,
+                     size_t length);
+    
+    /*! Keeps a mapping of a task's data buffer until the transmit batch,
+     *  which holds a PDU sent from that buffer, has been flushed.
+     *  @param connection the connection whose batch holds the PDU.
+     *  @param dataMap the mapping (a reference is taken). */
+    void HoldTxDataMap(iSCSIConnection * connection,IOMemoryMap * dataMap);
+    
+    /*! Releases the mappings held for a connection's transmit batch.
+     *  @param connection the connection. */
+    void ReleaseTxDataMaps(iSCSIConnection * connection);
+    
+    /*! Sends all PDUs in a connection's transmit batch with a single send.
+     *  If the batch can't be sent in full, the connection is failed.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection whose transmit batch should be sent.
+     *  @return error code indicating result of operation. */
+    errno_t FlushPDUs(iSCSISession * session,
+                      iSCSIConnection * connection);
+    
+    /*! Sends all PDUs in a connection's transmit batch with a scatter-gather
+     *  send, resuming sends that are cut short.  Called by FlushPDUs().
+     *  @param connection the connection whose transmit batch should be sent.
+     *  @param bytesSent the number of bytes sent.
+     *  @return error code indicating result of operation (the batch has
+     *  been sent in full only if this is 0). */
+    errno_t SendPDUsFromIovec(iSCSIConnection * connection,size_t * bytesSent);
 
     /*! Gets whether a PDU is available for receiption on a particular
-     *  connection.
+     *  connection.  Any bytes waiting at the socket are first pulled into the
+     *  connection's receive buffer.  A PDU is available once it has been
+     *  buffered in its entirety (or, for PDUs with large data segments, once
+     *  its header has been buffered).
      *  @param the connection to check.
      *  @return true if a PDU is available, false otherwise. */
     static bool isPDUAvailable(iSCSIConnection * connection);
     
+    /*! Receives data from a connection into a scatter-gather list.  Bytes
+     *  held in the connection's receive buffer are consumed first; any
+     *  remaining bytes are received directly from the socket.
+     *  @param connection the connection to receive from.
+     *  @param iovec the scatter-gather list to fill (modified by this call).
+     *  @param iovecCnt the number of entries in the scatter-gather list.
+     *  @param bytesRecv the number of bytes received.
+     *  @param digest if not NULL, the CRC32C of the bytes received is
+     *  accumulated into the value that this points to.  Buffered bytes are
+     *  checksummed as they are copied out of the receive buffer.
+     *  @return error code indicating result of operation. */
+    static errno_t RecvFromConnection(iSCSIConnection * connection,
+                                      struct iovec * iovec,
+                                      unsigned int iovecCnt,
+                                      size_t * bytesRecv,
+                                      UInt32 * digest);
+    
     /*! Receives a basic header segment over a kernel socket.
      *  @param sessionId the qualifier part of the ISID (see RFC3720).
      *  @param connectionId the connection associated with the session.
@@ -301,8 +480,40 @@ public:
                         size_t length,
                         int flags);
     
+    /*! Receives and discards a data segment over a kernel socket (including
+     *  padding and data digest).  This is used to keep the stream in sync
+     *  when a data segment cannot be processed.  The data is received in
+     *  fixed-size chunks so that no buffer of the segment size is required.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection associated with the session.
+     *  @param length the length of the data segment to discard.
+     *  @return error code indicating result of operation. */
+    errno_t FlushPDUData(iSCSISession * session,
+                         iSCSIConnection * connection,
+                         size_t length);
+    
 private:
     
+    /*! Sends a task management request and records it in the session's
+     *  table of outstanding requests.
+     *  @param targetId the target (session) that the request is for.
+     *  @param LUN the logical unit that the request addresses.
+     *  @param function the task management function.
+     *  @param taggedTaskID the task to abort (abort task requests only).
+     *  @return the service response of the request. */
+    SCSIServiceResponse SendTaskMgmtRequest(SCSITargetIdentifier targetId,
+                                            SCSILogicalUnitNumber LUN,
+                                            UInt8 function,
+                                            SCSITaggedTaskIdentifier taggedTaskID);
+    
+    /*! Completes an outstanding task management request.
+     *  @param session the session that the request belongs to.
+     *  @param request the request to complete.
+     *  @param serviceResponse the service response of the request. */
+    void CompleteTaskMgmtRequest(iSCSISession * session,
+                                 iSCSITaskMgmtRequest * request,
+                                 SCSIServiceResponse serviceResponse);
+    
     /*! Process an incoming task management response PDU.
      *  @param session the session associated with the task mgmt response.
      *  @param connection the connection associated with the task mgmt response.
@@ -347,7 +558,17 @@ private:
                          iSCSIConnection * connection,
                          iSCSIPDU::iSCSIPDUAsyncMsgBHS * bhs);
 
-    /*! Process an incoming R2T PDU.
+    /*! Hands an incoming R2T PDU to the transmit workloop of the connection
+     *  it was received on.  Called from the receive workloop.
+     *  @param session the session associated with the R2T PDU.
+     *  @param connection the connection associated with the R2T PDU.
+     *  @param bhs the basic header segment of the R2T PDU. */
+    void QueueR2T(iSCSISession * session,
+                  iSCSIConnection * connection,
+                  iSCSIPDU::iSCSIPDUR2TBHS * bhs);
+    
+    /*! Records the data sequence requested by an R2T PDU so that it can be
+     *  serviced.  Called from the transmit workloop.
      *  @param session the session associated with the R2T PDU.
      *  @param connection the connection associated with the R2T PDU.
      *  @param bhs the basic header segment of the R2T PDU. */
@@ -355,6 +576,56 @@ private:
                     iSCSIConnection * connection,
                     iSCSIPDU::iSCSIPDUR2TBHS * bhs);
     
+    /*! Sends Data-Out PDUs of a data sequence for a task, continuing from
+     *  where the sequence was last left off.  The data segments are taken
+     *  directly from the task's cached data mapping and consecutive PDUs
+     *  are gathered into a single send wherever possible.
+     *  @param session the session associated with the task.
+     *  @param connection the connection used to send the data.
+     *  @param parallelTask the task whose data is being sent.
+     *  @param initiatorTaskTag the task's initiator task tag.
+     *  @param sequence the data sequence (solicited or unsolicited); this
+     *  is updated to reflect the data that was sent.
+     *  @param maxPDUs the maximum number of PDUs to send.
+     *  @return error code indicating result of operation. */
+    errno_t SendDataOutSequence(iSCSISession * session,
+                                iSCSIConnection * connection,
+                                SCSIParallelTaskIdentifier parallelTask,
+                                UInt32 initiatorTaskTag,
+                                iSCSIR2TSequence * sequence,
+                                UInt32 maxPDUs);
+    
+    /*! Sends the next batch of Data-Out PDUs for the R2T sequences of a task.
+     *  Sequences of the same task are interleaved unless the session
+     *  requires data sequences to be sent in order.
+     *  @param session the session associated with the task.
+     *  @param connection the connection the R2Ts were received on.
+     *  @param parallelTask the task whose R2T sequences should be serviced.
+     *  @param initiatorTaskTag the task's initiator task tag.
+     *  @return true if the task has no remaining R2T sequences. */
+    bool ServiceR2TSequences(iSCSISession * session,
+                             iSCSIConnection * connection,
+                             SCSIParallelTaskIdentifier parallelTask,
+                             UInt32 initiatorTaskTag);
+    
+    /*! Services the R2T sequences of all tasks on a connection, one batch
+     *  per task at a time.  Servicing stops early when another R2T has
+     *  been handed over by the receive workloop so that it can be picked
+     *  up and interleaved.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to service. */
+    void ServicePendingR2Ts(iSCSISession * session,
+                            iSCSIConnection * connection);
+    
+    /*! Takes the R2Ts that the receive workloop has handed over to a
+     *  connection and sends the data they solicit.  Called from the
+     *  connection's transmit workloop.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to service.
+     *  @return true if R2T sequences remain to be serviced. */
+    bool ServiceQueuedR2Ts(iSCSISession * session,
+                           iSCSIConnection * connection);
+    
     /*! Process an incoming reject PDU.
      *  @param session the session associated with the reject PDU.
      *  @param connection the connection associated with the reject PDU.
@@ -363,6 +634,70 @@ private:
                        iSCSIConnection * connection,
                        iSCSIPDU::iSCSIPDURejectBHS * bhs);
     
+    /*! Allocates the task table of a session.
+     *  @param session the session.
+     *  @return true if the table was allocated. */
+    bool AllocTaskTable(iSCSISession * session);
+    
+    /*! Releases the task table of a session.
+     *  @param session the session. */
+    void ReleaseTaskTable(iSCSISession * session);
+    
+    /*! Assigns a task table entry to a SCSI task.
+     *  @param session the session that the task belongs to.
+     *  @param parallelTask the task.
+     *  @param taskData the HBA-specific data of the task.
+     *  @return the initiator task tag for the task, or 0xFFFFFFFF if the
+     *  table is full. */
+    UInt32 AllocTaskEntry(iSCSISession * session,
+                          SCSIParallelTaskIdentifier parallelTask,
+                          iSCSITaskData * taskData);
+    
+    /*! Releases the task table entry of a SCSI task.
+     *  @param session the session that the task belongs to.
+     *  @param initiatorTaskTag the initiator task tag of the task. */
+    void ReleaseTaskEntry(iSCSISession * session,UInt32 initiatorTaskTag);
+    
+    /*! Allocates the pools of PDU buffers.
+     *  @return true if the pools were allocated. */
+    bool AllocPDUBufferPools();
+    
+    /*! Releases the pools of PDU buffers. */
+    void ReleasePDUBufferPools();
+    
+    /*! Gets a scratch buffer for a PDU data segment from the smallest size
+     *  class that can hold it.  Buffers are taken from a preallocated pool
+     *  and only come from the heap when the pool has been exhausted.
+     *  @param length the number of bytes required.
+     *  @return a buffer, or NULL if length exceeds the largest size class. */
+    void * AllocPDUBuffer(UInt32 length);
+    
+    /*! Returns a buffer obtained with AllocPDUBuffer().
+     *  @param buffer the buffer to return.
+     *  @param length the length that was passed to AllocPDUBuffer(). */
+    void FreePDUBuffer(void * buffer,UInt32 length);
+    
+    /*! Gets a kernel mapping of a task's data buffer.  The mapping is
+     *  created once per task and cached in the task's HBA data until the
+     *  task completes; every caller gets its own reference.
+     *  @param session the session that the task belongs to.
+     *  @param parallelTask the task whose data buffer should be mapped.
+     *  @return the mapping, which the caller must release, or NULL if the
+     *  task has no data buffer or is being completed. */
+    IOMemoryMap * GetTaskDataMap(iSCSISession * session,
+                                 SCSIParallelTaskIdentifier parallelTask);
+    
+    /*! Selects the connection that should carry a new task according to the
+     *  session's connection scheduling policy.  Only active connections
+     *  are considered.
+     *  @param session the session that the task belongs to.
+     *  @param transferDirection the direction of the task's data transfer.
+     *  @param transferSize the number of bytes the task will transfer.
+     *  @return the selected connection, or NULL if no connection is active. */
+    iSCSIConnection * SelectConnectionForTask(iSCSISession * session,
+                                              UInt8 transferDirection,
+                                              UInt64 transferSize);
+    
     /*! Adjusts the timeouts associated with a particular connection.  This
      *  function uses a NOP out PDU to measure the latency of particular
      *  iSCSI connection. This is achieved by generating and sending 
@@ -372,6 +707,191 @@ private:
      *  @param connection the connection to tune. */
     void MeasureConnectionLatency(iSCSISession * session,
                                   iSCSIConnection * connection);
+    
+    /*! Adds a round-trip time sample to the connection's smoothed RTT and
+     *  RTT variance estimators (Jacobson/Karels, as specified by RFC6298).
+     *  @param connection the connection that was measured.
+     *  @param sampleUs the round-trip time measured, in microseconds. */
+    void UpdateConnectionRTT(iSCSIConnection * connection,UInt64 sampleUs);
+    
+    /*! Computes the timeout of a task from the round-trip time estimate and
+     *  data rate of the connection that it runs on.  The timeout is limited
+     *  to the floor and ceiling configured for the session.
+     *  @param session the session the task belongs to.
+     *  @param connection the connection the task was assigned to.
+     *  @param transferDirection the direction of the task's data transfer.
+     *  @param transferSize the number of bytes the task transfers.
+     *  @return the timeout, in milliseconds. */
+    UInt32 GetTaskTimeout(iSCSISession * session,
+                          iSCSIConnection * connection,
+                          UInt8 transferDirection,
+                          UInt64 transferSize);
+    
+    /*! Records that a task has started on a connection, for the rate
+     *  estimator of the task's direction.
+     *  @param connection the connection the task runs on.
+     *  @param transferDirection the direction of the task's data transfer.
+     *  @param startTime the time the task was started (absolute time). */
+    void StartTaskRateSample(iSCSIConnection * connection,
+                             UInt8 transferDirection,
+                             UInt64 startTime);
+    
+    /*! Records that a task has completed on a connection and updates the
+     *  throughput and task rate estimates of the task's direction.
+     *  @param connection the connection the task ran on.
+     *  @param transferDirection the direction of the task's data transfer.
+     *  @param bytesTransferred the number of bytes the task transferred.
+     *  @param completionTime the time the task completed (absolute time). */
+    void UpdateConnectionRates(iSCSIConnection * connection,
+                               UInt8 transferDirection,
+                               UInt64 bytesTransferred,
+                               UInt64 completionTime);
+    
+    /*! Gets the estimated throughput of a connection in one direction.  If
+     *  that direction hasn't been measured, the other direction is used.
+     *  @param connection the connection.
+     *  @param transferDirection the direction of interest.
+     *  @return the throughput in bytes per second, or 0 if the connection
+     *  hasn't been measured. */
+    UInt64 GetConnectionBytesPerSecond(iSCSIConnection * connection,
+                                       UInt8 transferDirection);
+    
+    /*! Gets the estimated number of tasks per second that a connection
+     *  completes in one direction.
+     *  @param connection the connection.
+     *  @param transferDirection the direction of interest.
+     *  @return the task rate, or 0 if the direction hasn't been measured. */
+    UInt32 GetConnectionIOPS(iSCSIConnection * connection,UInt8 transferDirection);
+    
+    /*! Records the latency of a task in the histograms of its connection
+     *  and of its LUN.  Histograms are updated with atomic operations only.
+     *  @param session the session the task belongs to.
+     *  @param connection the connection the task ran on.
+     *  @param parallelTask the task.
+     *  @param latencyUs the time from when the task was started until it
+     *  completed, in microseconds. */
+    void RecordTaskLatency(iSCSISession * session,
+                           iSCSIConnection * connection,
+                           SCSIParallelTaskIdentifier parallelTask,
+                           UInt64 latencyUs);
+    
+    /*! Records the time a task spent in each stage (see the enumerated type
+     *  iSCSITaskStages) in the stage histograms of its connection and, if
+     *  the task is sampled, in the session's task trace.
+     *  @param session the session the task belongs to.
+     *  @param connection the connection the task ran on.
+     *  @param parallelTask the task.
+     *  @param taskData the task's timestamps.
+     *  @param serviceResponse the service response the task completed with.
+     *  @param completionTime the time the task completed (absolute time). */
+    void RecordTaskStages(iSCSISession * session,
+                          iSCSIConnection * connection,
+                          SCSIParallelTaskIdentifier parallelTask,
+                          iSCSITaskData * taskData,
+                          SCSIServiceResponse serviceResponse,
+                          UInt64 completionTime);
+    
+    /*! Sets how often completed tasks of a session are sampled into the
+     *  session's task trace.
+     *  @param session the session.
+     *  @param interval one in every interval tasks is sampled (0 disables
+     *  the task trace). */
+    void SetTaskTraceInterval(iSCSISession * session,UInt32 interval);
+    
+    /*! Removes all records from a session's task trace.
+     *  @param session the session.
+     *  @param trace the records, oldest first. */
+    void GetTaskTrace(iSCSISession * session,iSCSIKernelTaskTrace * trace);
+    
+    /*! Enables or disables the PDU trace of a connection.  The trace is
+     *  allocated the first time it is enabled and is kept until the
+     *  connection is released, so that user-space mappings remain valid.
+     *  @param connection the connection.
+     *  @param enable true to start recording PDUs, false to stop.
+     *  @return error code indicating result of operation. */
+    errno_t SetPDUTraceEnabled(iSCSIConnection * connection,bool enable);
+    
+    /*! Records a PDU in a connection's PDU trace.  Each ring has a single
+     *  producer: sent PDUs are recorded on the connection's transmit
+     *  workloop (FlushPDUs()) and received PDUs on the session's workloop
+     *  (RecvPDUHeader()).  Callers check PDUTraceEnabled first so that a
+     *  disabled trace costs a single branch.
+     *  @param connection the connection.
+     *  @param direction one of the iSCSIPDUTraceDirections values.
+     *  @param opCode the PDU opcode (byte 0 of the header).
+     *  @param flags the PDU flags (byte 1 of the header).
+     *  @param initiatorTaskTag the initiator task tag of the PDU.
+     *  @param sequenceNumber CmdSN or StatSN, in host byte order.
+     *  @param expSequenceNumber ExpStatSN or ExpCmdSN, in host byte order.
+     *  @param dataLength the length of the PDU's data segment. */
+    void RecordPDUTrace(iSCSIConnection * connection,
+                        UInt32 direction,
+                        UInt8 opCode,
+                        UInt8 flags,
+                        UInt32 initiatorTaskTag,
+                        UInt32 sequenceNumber,
+                        UInt32 expSequenceNumber,
+                        UInt32 dataLength);
+    
+    /*! Gets the latency histogram of a connection or LUN.
+     *  @param session the session.
+     *  @param scope whether a connection, LUN or stage histogram is requested
+     *  (see the enumerated type iSCSILatencyScopes).
+     *  @param identifier the connection ID or LUN.
+     *  @param category the category of commands (see the enumerated type
+     *  iSCSILatencyCategories) or, for stage histograms, the stage (see the
+     *  enumerated type iSCSITaskStages).
+     *  @return the histogram, or NULL if no such histogram exists. */
+    iSCSIKernelLatencyHistogram * GetLatencyHistogram(iSCSISession * session,
+                                                      UInt32 scope,
+                                                      UInt64 identifier,
+                                                      UInt32 category);
+    
+    /*! Gets the throughput, task rate and round-trip time estimates of a
+     *  connection.
+     *  @param connection the connection.
+     *  @param stats the statistics to get. */
+    void GetConnectionStatistics(iSCSIConnection * connection,
+                                 iSCSIKernelConnectionStats * stats);
+    
+    /*! Updates the command window of a session using the ExpCmdSN and
+     *  MaxCmdSN fields of a PDU received from the target.  Values are
+     *  compared using serial number arithmetic (RFC1982) and stale or invalid
+     *  windows are ignored per RFC3720.  If the window opens, task queues of
+     *  all connections are resumed.
+     *  @param session the session to update.
+     *  @param expCmdSN the ExpCmdSN received from the target.
+     *  @param maxCmdSN the MaxCmdSN received from the target. */
+    void UpdateCommandWindow(iSCSISession * session,
+                             UInt32 expCmdSN,
+                             UInt32 maxCmdSN);
+    
+    /*! Gets whether the target will accept a new command on a session
+     *  (that is, whether CmdSN <= MaxCmdSN).
+     *  @param session the session to check.
+     *  @return true if another command may be issued. */
+    bool IsCommandWindowOpen(iSCSISession * session);
+    
+    /*! Reserves the next command sequence number of a session, provided
+     *  that it is within the command window (CmdSN <= MaxCmdSN).
+     *  @param session the session.
+     *  @param cmdSN the reserved command sequence number.
+     *  @return true if a command sequence number was reserved, false if the
+     *  command window is closed. */
+    bool ReserveCmdSN(iSCSISession * session,UInt32 * cmdSN);
+    
+    /*! Sends a NOP-Out in place of a command whose command sequence number
+     *  was reserved but which could not be sent.
+     *  @param session the session.
+     *  @param connection the connection that reserved the number.
+     *  @param cmdSN the command sequence number to give up. */
+    void ReleaseCmdSN(iSCSISession * session,iSCSIConnection * connection,UInt32 cmdSN);
+    
+    /*! Records that tasks are being held because the command window of a
+     *  session is closed.  Repeated calls while the window remains closed
+     *  have no effect.
+     *  @param session the session whose window is closed. */
+    void BeginCommandWindowStall(iSCSISession * session);
 	
     /*! Maximum allowable sessions. */
     static const UInt16 kMaxSessions;
@@ -388,6 +908,29 @@ private:
     /*! Maximum number of SCSI tasks the HBA can handle. */
     static const UInt32 kMaxTaskCount;
     
+    /*! Default number of SCSI tasks that may be outstanding on a connection. */
+    static const UInt16 kDefaultQueueDepth;
+    
+    /*! Size of the buffer used to discard unprocessed data segments. */
+    static const UInt32 kFlushBufferSize;
+    
+    /*! Longest time, in microseconds, that a PDU is held in a transmit batch. */
+    static const UInt32 kTxBatchDeadlineUs;
+    
+    /*! Number of consecutive sends without progress after which a transmit
+     *  batch is abandoned. */
+    static const UInt32 kTxMaxStalledSends;
+    
+    /*! Number of bytes received from a socket at a time when a digest is
+     *  computed over the bytes received. */
+    static const UInt32 kDigestChunkSize;
+    
+    /*! Size, in bytes, of the PDU buffers in each size class. */
+    static const UInt32 kPDUBufferSizes[kiSCSIPDUBufferPoolClasses];
+    
+    /*! Number of preallocated PDU buffers in each size class. */
+    static const UInt32 kPDUBuffersPerClass;
+    
     /*! Number of PDUs that are transmitted before we calculate an average speed
      *  for the connection. */
     static const UInt32 kNumBytesPerAvgBW;
@@ -395,8 +938,49 @@ private:
     /*! Default task timeout for new tasks (milliseconds). */
     static const UInt32 kiSCSITaskTimeoutMs;
     
+    /*! Default floor for task timeouts (milliseconds). */
+    static const UInt32 kTaskTimeoutMinMs;
+    
+    /*! Default ceiling for task timeouts (milliseconds). */
+    static const UInt32 kTaskTimeoutMaxMs;
+    
+    /*! Number of retransmission timeouts allowed for a task's round trip. */
+    static const UInt32 kTaskTimeoutRTOMultiple;
+    
+    /*! Default number of completed tasks held before they are handed over. */
+    static const UInt16 kCompletionCoalesceCount;
+    
+    /*! Default time completed tasks are held after a receive batch
+     *  (microseconds). */
+    static const UInt32 kCompletionCoalesceUs;
+    
+    /*! Default poll budget (microseconds); polling is disabled by default. */
+    static const UInt32 kPollBudgetUs;
+    
+    /*! Default share of CPU time that polling may use (percent). */
+    static const UInt8 kPollCPUPercent;
+    
+    /*! Interval over which the CPU time spent polling is limited
+     *  (milliseconds). */
+    static const UInt32 kPollIntervalMs;
+    
+    /*! Smallest allowance, in microseconds, for round-trip time variation. */
+    static const UInt32 kRTTGranularityUs;
+    
+    /*! Largest transfer, in bytes, of a task used as a round-trip sample. */
+    static const UInt32 kRTTSampleMaxTransferSize;
+    
     /*! Default timeout for new connections (milliseconds). */
     static const UInt32 kiSCSITCPTimeoutMs;
+    
+    /*! Interval between latency probes on each connection (milliseconds). */
+    static const UInt32 kLatencyProbeIntervalMs;
+    
+    /*! Busy time over which each throughput sample is taken (microseconds). */
+    static const UInt32 kRateSampleIntervalUs;
+    
+    /*! Weight given to a new throughput sample (1/kRateEWMADivisor). */
+    static const UInt32 kRateEWMADivisor;
 
     
     /*! Used as part of the iSCSI layer intiator task tag to specify the 
@@ -406,7 +990,7 @@ private:
         /*! Used as part of the iSCSI task tag for all SCSI tasks. */
         kInitiatorTaskTypeSCSITask = 0,
     
-        /*! Used as part of the iSCSI task tag for latency measurement task. */
+        /*! Used as part of the iSCSI task tag for latency probes (NOP-Out). */
         kInitiatorTaskTypeLatency = 1,
     
         /*! Used as part of the iSCSI task tag for all task management operations. */
@@ -414,14 +998,14 @@ private:
     };
     
     /*! Creates the iSCSI layer's initiator task tag for a PDU using the task
-     *  code, LUN, and the SCSI layer's task identifier. */
-    inline UInt32 BuildInitiatorTaskTag(InitiatorTaskTypes taskType,
-                                        SCSILogicalUnitNumber LUN,
-                                        SCSITaggedTaskIdentifier taskId)
+     *  type and a 24-bit task identifier.  For SCSI tasks the identifier is
+     *  the generation and index of the task's entry in the task table; for
+     *  task management requests it is the function code. */
+    inline UInt32 BuildInitiatorTaskTag(InitiatorTaskTypes taskType,UInt32 taskId)
     {
-        // The task tag is constructed using the HBA controller task ID, the
-        // LUN and a taskCode that maps to differnet *types* of iSCSI tasks
-        return ( (UInt32)taskId | ((UInt32)LUN)<<16 | ((UInt32)taskType)<<24 );
+        // The task type occupies the most significant byte so that tags
+        // never collide across task types (and never equal 0xFFFFFFFF)
+        return ( (taskId & 0xFFFFFF) | ((UInt32)taskType)<<24 );
     }
     
     inline InitiatorTaskTypes ParseInitiatorTaskTagForTaskType(UInt32 initiatorTaskTag)
@@ -429,14 +1013,51 @@ private:
         return (InitiatorTaskTypes)((initiatorTaskTag>>24) & 0xFF);
     }
     
-    inline SCSILogicalUnitNumber ParseInitiatorTaskTagForLUN(UInt32 initiatorTaskTag)
+    inline UInt32 ParseInitiatorTaskTagForTaskId(UInt32 initiatorTaskTag)
     {
-        return (UInt32)((initiatorTaskTag>>16) & 0xFF);
+        return (initiatorTaskTag & 0xFFFFFF);
     }
     
-    inline SCSITaggedTaskIdentifier ParseInitiatorTaskTagForTaskId(UInt32 initiatorTaskTag)
+    /*! Looks up the SCSI task that an initiator task tag refers to.  This is
+     *  a single index into the session's task table; tags of tasks that have
+     *  since completed (stale tags) are rejected using the entry generation.
+     *  @param session the session that the tag belongs to.
+     *  @param initiatorTaskTag the initiator task tag.
+     *  @return the task, or NULL if the tag does not refer to an active task. */
+    inline SCSIParallelTaskIdentifier FindTaskForInitiatorTaskTag(iSCSISession * session,
+                                                                  UInt32 initiatorTaskTag)
     {
-        return (UInt32)(initiatorTaskTag & 0xFFFF);
+        if(ParseInitiatorTaskTagForTaskType(initiatorTaskTag) != kInitiatorTaskTypeSCSITask)
+            return NULL;
+        
+        UInt32 taskId = ParseInitiatorTaskTagForTaskId(initiatorTaskTag);
+        iSCSITaskEntry * entry = &session->taskTable[taskId & (session->kTaskTableSize-1)];
+        
+        if(entry->generation != (UInt16)(taskId>>8))
+            return NULL;
+        
+        return entry->parallelTask;
+    }
+    
+    /*! Encodes a LUN into the 8-byte LUN field of a PDU using the SAM
+     *  peripheral device (LUNs below 256), flat space (below 16384),
+     *  extended flat space (below 2^24) or long extended flat space (below
+     *  2^40) addressing method.  PDUs that refer to a task use the task's
+     *  own LUN field instead (see GetLogicalUnitBytes()). */
+    inline UInt64 BuildLUNField(SCSILogicalUnitNumber LUN)
+    {
+        UInt64 field;
+        
+        if(LUN < 256)
+            field = LUN<<48;
+        else if(LUN < 0x4000)
+            field = (0x4000 | LUN)<<48;
+        else if(LUN < 0x1000000)
+            field = (0xD2ULL<<56) | (LUN<<32);
+        else
+            field = (0xE2ULL<<56) | ((LUN & 0xFFFFFFFFFFULL)<<16);
+        
+        return OSSwapHostToBigInt64(field);
     }
     
     inline void SetDataSegmentLength(iSCSIPDUInitiatorBHS * bhs,UInt32 length)
@@ -446,6 +1067,63 @@ private:
         memcpy(bhs->dataSegmentLength,&dataSegLength,kiSCSIPDUDataSegmentLengthSize);
     }
     
+    /*! Gets the rate estimator of a connection for a transfer direction.
+     *  @return the estimator, or NULL for tasks without data. */
+    inline iSCSIRateEstimator * GetRateEstimator(iSCSIConnection * connection,
+                                                 UInt8 transferDirection)
+    {
+        if(transferDirection == kSCSIDataTransfer_FromTargetToInitiator)
+            return &connection->readRate;
+        if(transferDirection == kSCSIDataTransfer_FromInitiatorToTarget)
+            return &connection->writeRate;
+        return NULL;
+    }
+    
+    /*! Timestamps the arrival of a PDU for a task (see iSCSITaskStages).
+     *  The clock is only read for the first PDU of a task and for its status.
+     *  @param parallelTask the task.
+     *  @param status true if the PDU carries the task's status. */
+    inline void TimestampTaskResponse(SCSIParallelTaskIdentifier parallelTask,bool status)
+    {
+        iSCSITaskData * taskData = (iSCSITaskData *)GetHBADataPointer(parallelTask);
+        
+        if(taskData->firstResponseTime != 0 && !status)
+            return;
+        
+        UInt64 now;
+        clock_get_uptime(&now);
+        
+        if(taskData->firstResponseTime == 0)
+            taskData->firstResponseTime = now;
+        if(status)
+            taskData->statusTime = now;
+    }
+    
+    /*! Gets the latency category of a task from its command operation code.
+     *  @return a value from the enumerated type iSCSILatencyCategories. */
+    inline UInt32 GetLatencyCategory(SCSIParallelTaskIdentifier parallelTask)
+    {
+        SCSICommandDescriptorBlock cdb;
+        GetCommandDescriptorBlock(parallelTask,&cdb);
+        
+        switch(cdb[0]) {
+            case kSCSICmd_READ_6:
+            case kSCSICmd_READ_10:
+            case kSCSICmd_READ_12:
+            case kSCSICmd_READ_16:
+                return kiSCSILatencyRead;
+            case kSCSICmd_WRITE_6:
+            case kSCSICmd_WRITE_10:
+            case kSCSICmd_WRITE_12:
+            case kSCSICmd_WRITE_16:
+            case kSCSICmd_WRITE_AND_VERIFY_10:
+            case kSCSICmd_WRITE_AND_VERIFY_12:
+            case kSCSICmd_WRITE_AND_VERIFY_16:
+                return kiSCSILatencyWrite;
+        };
+        return kiSCSILatencyOther;
+    }
+    
     inline UInt32 GetDataSegmentLength(iSCSIPDUTargetBHS * bhs)
     {
         // Length of the data segment of the PDU
@@ -466,6 +1144,35 @@ private:
     /*! Lookup table mapping target names (IQN names) to session identifiers. */
     OSDictionary * targetList;
     
+    /*! Preallocated PDU buffers of each size class. */
+    UInt8 * pduBufferPool[kiSCSIPDUBufferPoolClasses];
+    
+    /*! Lists of PDU buffers of each size class that are not in use. */
+    void * pduBufferFreeList[kiSCSIPDUBufferPoolClasses];
+    
+    /*! Locks that protect the free lists of each size class (buffers are
+     *  taken by the workloops of every session at once). */
+    IOSimpleLock * pduBufferLock[kiSCSIPDUBufferPoolClasses];
+    
+    /*! Usage statistics of the task node and PDU buffer pools. */
+    iSCSIKernelPoolStats poolStats;
+    
+    /*! Timer used to send latency probes on active connections. */
+    IOTimerEventSource * probeTimer;
+    
+    /*! Signaled when tasks are handed over for completion. */
+    IOInterruptEventSource * completionSource;
+    
+    /*! Signaled when a connection has failed and must be released. */
+    IOInterruptEventSource * connectionFailureSource;
+    
+    /*! Signaled when the transmit workloop has failed a task. */
+    IOInterruptEventSource * taskFailureSource;
+    
+    /*! Lock-free list of tasks (iSCSITaskData) that have been handed over
+     *  for completion, most recent first. */
+    void * volatile pendingCompletions;
+    
     friend class iSCSITaskQueue;
 };
 
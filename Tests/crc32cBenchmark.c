@@ -0,0 +1,149 @@
+/*!
+ * @author		Nareg Sinenian
+ * @file		crc32cBenchmark.c
+ * @version		1.0
+ * @copyright	(c) 2014-2015 Nareg Sinenian. All rights reserved.
+ *
+ * Measures the throughput of every CRC32C implementation of crc32c.c that
+ * the processor supports, for buffer sizes typical of iSCSI PDUs, and the
+ * time taken to compute the digests of a transmit batch one buffer at a
+ * time and with the batch interface, for basic header segments (48 bytes)
+ * and small data segments (512 bytes).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc32cImplementations.h"
+
+/*! Number of bytes checksummed for each measurement. */
+static const size_t kBytesPerMeasurement = 256*1024*1024;
+
+/*! Number of buffers in a batch (that of a connection's transmit batch). */
+#define kBuffersPerBatch 16
+
+/*! Number of bytes checksummed in batches for each measurement. */
+static const size_t kBatchBytesPerMeasurement = 1536*1000*1000;
+
+/*! Gets the current time in seconds.
+ *  @return the time. */
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC,&time);
+    return time.tv_sec + time.tv_nsec/1e9;
+}
+
+/*! Measures the time taken to checksum batches of buffers, one buffer at
+ *  a time and with the batch interface.
+ *  @param implementation the implementation to measure.
+ *  @param data the buffers.
+ *  @param bufferSize the size of each buffer. */
+static void benchmarkBatches(const crc32cImplementation * implementation,
+                             const uint8_t * data,
+                             size_t bufferSize)
+{
+    const void * buffers[kBuffersPerBatch];
+    size_t lengths[kBuffersPerBatch];
+    uint32_t crcs[kBuffersPerBatch];
+    uint32_t check = 0;
+    
+    const size_t batchCount = kBatchBytesPerMeasurement/(kBuffersPerBatch*bufferSize);
+    
+    for(unsigned int index = 0; index < kBuffersPerBatch; index++) {
+        buffers[index] = data + index*bufferSize;
+        lengths[index] = bufferSize;
+    }
+    
+    double start = now();
+    
+    for(size_t batch = 0; batch < batchCount; batch++)
+        for(unsigned int index = 0; index < kBuffersPerBatch; index++)
+            check ^= implementation->crc(batch,buffers[index],lengths[index]);
+    
+    double single = now() - start;
+    start = now();
+    
+    for(size_t batch = 0; batch < batchCount; batch++) {
+        for(unsigned int index = 0; index < kBuffersPerBatch; index++)
+            crcs[index] = (uint32_t)batch;
+        
+        implementation->batch(crcs,buffers,lengths,kBuffersPerBatch);
+        
+        for(unsigned int index = 0; index < kBuffersPerBatch; index++)
+            check ^= crcs[index];
+    }
+    
+    double batched = now() - start;
+    const double bufferCount = (double)batchCount*kBuffersPerBatch;
+    
+    // Both loops fold the same checksums into check, which is then 0
+    printf("%-16s%12.1f%12.1f%11.2fx%s\n",implementation->name,
+           single/bufferCount*1e9,batched/bufferCount*1e9,single/batched,
+           check ? "  (mismatch)" : "");
+}
+
+int main(int argc,const char * argv[])
+{
+    // A basic header segment, a small data segment, a typical
+    // MaxRecvDataSegmentLength and a large burst
+    const size_t sizes[] = { 48, 512, 8192, 65536 };
+    const unsigned int sizeCount = sizeof(sizes)/sizeof(sizes[0]);
+    
+    unsigned int count;
+    crc32cImplementation * implementations = crc32cGetImplementations(&count);
+    
+    uint8_t * data = (uint8_t *)malloc(sizes[sizeCount-1]);
+    
+    srand(1);
+    for(size_t index = 0; index < sizes[sizeCount-1]; index++)
+        data[index] = (uint8_t)rand();
+    
+    printf("%-16s","implementation");
+    for(unsigned int size = 0; size < sizeCount; size++)
+        printf("%10zu B",sizes[size]);
+    printf("   (MB/s)\n");
+    
+    for(unsigned int index = 0; index < count; index++)
+    {
+        if(!implementations[index].supported)
+            continue;
+        
+        printf("%-16s",implementations[index].name);
+        
+        for(unsigned int size = 0; size < sizeCount; size++)
+        {
+            size_t iterations = kBytesPerMeasurement/sizes[size];
+            uint32_t crc = 0;
+            double start = now();
+            
+            // Chain the checksums so that the calls can't be elided
+            for(size_t iteration = 0; iteration < iterations; iteration++)
+                crc = implementations[index].crc(crc,data,sizes[size]);
+            
+            double seconds = now() - start;
+            printf("%12.0f",iterations*sizes[size]/seconds/1e6);
+            
+            if(crc == 0x12345678)
+                printf("*");
+        }
+        printf("\n");
+    }
+    
+    // Basic header segments and small data segments, as in a transmit batch
+    const size_t batchSizes[] = { 48, 512 };
+    
+    for(unsigned int size = 0; size < sizeof(batchSizes)/sizeof(batchSizes[0]); size++)
+    {
+        printf("\n%-16s%12s%12s%12s   (%d buffers of %zu bytes per batch, ns per buffer)\n",
+               "implementation","crc32c","batch","speedup",kBuffersPerBatch,batchSizes[size]);
+        
+        for(unsigned int index = 0; index < count; index++)
+            if(implementations[index].supported)
+                benchmarkBatches(&implementations[index],data,batchSizes[size]);
+    }
+    
+    free(data);
+    return 0;
+}
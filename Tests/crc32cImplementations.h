@@ -0,0 +1,69 @@
+/*!
+ * @author		Nareg Sinenian
+ * @file		crc32cImplementations.h
+ * @version		1.0
+ * @copyright	(c) 2014-2015 Nareg Sinenian. All rights reserved.
+ *
+ * Gives the host-side tests and benchmarks access to every CRC32C
+ * implementation in crc32c.c (not just the one crc32c_init() selects).
+ */
+
+#ifndef __ISCSI_CRC32C_IMPLEMENTATIONS_H__
+#define __ISCSI_CRC32C_IMPLEMENTATIONS_H__
+
+#include "crc32c.c"
+
+/*! A CRC32C implementation of crc32c.c. */
+typedef struct crc32cImplementation {
+    
+    /*! Name of the implementation. */
+    const char * name;
+    
+    /*! Computes the checksum of a buffer. */
+    uint32_t (*crc)(uint32_t crc,const void * buffer,size_t length);
+    
+    /*! Copies a buffer and computes its checksum. */
+    uint32_t (*copy)(uint32_t crc,void * dst,const void * src,size_t length);
+    
+    /*! Computes the checksums of many buffers. */
+    void (*batch)(uint32_t * crcs,const void * const * buffers,
+                  const size_t * lengths,unsigned int count);
+    
+    /*! Indicates whether the processor supports the implementation. */
+    int supported;
+    
+} crc32cImplementation;
+
+/*! Gets the implementations of crc32c.c, indicating which ones the
+ *  processor supports.  Calls crc32c_init().
+ *  @param count the number of implementations.
+ *  @return the implementations. */
+static crc32cImplementation * crc32cGetImplementations(unsigned int * count)
+{
+    static crc32cImplementation implementations[] = {
+        { "slicing-by-8", crc32c_sw, crc32c_sw_copy, crc32c_sw_batch, 1 },
+#if defined(__x86_64__)
+        { "sse4.2", crc32c_sse42, crc32c_sse42_copy, crc32c_sse42_batch, 0 },
+        { "sse4.2+pclmul", crc32c_sse42_clmul, crc32c_sse42_clmul_copy, crc32c_sse42_batch, 0 },
+#elif defined(__aarch64__)
+        { "armv8", crc32c_armv8, crc32c_armv8_copy, crc32c_armv8_batch, 0 },
+#endif
+    };
+    
+    crc32c_init();
+    
+#if defined(__x86_64__)
+    int sse42, pclmul;
+    crc32c_cpu_features(&sse42,&pclmul);
+    
+    implementations[1].supported = sse42;
+    implementations[2].supported = sse42 && pclmul;
+#elif defined(__aarch64__)
+    implementations[1].supported = crc32c_cpu_features();
+#endif
+    
+    *count = sizeof(implementations)/sizeof(implementations[0]);
+    return implementations;
+}
+
+#endif
@@ -0,0 +1,257 @@
+/*!
+ * @author		Nareg Sinenian
+ * @file		crc32cTest.c
+ * @version		1.0
+ * @copyright	(c) 2014-2015 Nareg Sinenian. All rights reserved.
+ *
+ * Checks every CRC32C implementation of crc32c.c that the processor
+ * supports against the test vectors of RFC 3720 (appendix B.4) and
+ * against a bitwise reference implementation (including the batch
+ * interface), and checks that crc32c_combine() and crc32c_iovec() agree
+ * with crc32c().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32cImplementations.h"
+
+/*! Number of random buffers checked against the reference. */
+static const unsigned int kRandomBufferCount = 4000;
+
+/*! Size of the random data that buffers are taken from. */
+static const size_t kRandomDataSize = 131072;
+
+/*! Number of random splits checked for crc32c_combine() and crc32c_iovec(). */
+static const unsigned int kRandomSplitCount = 2000;
+
+/*! Largest number of segments a buffer is split into for crc32c_iovec(). */
+static const unsigned int kMaxSegments = 16;
+
+/*! Number of random batches checked for each implementation. */
+static const unsigned int kRandomBatchCount = 2000;
+
+/*! Largest number of buffers in a batch. */
+static const unsigned int kMaxBatchSize = 32;
+
+/*! Number of failed checks. */
+static unsigned int failures = 0;
+
+/*! Records the result of a check.
+ *  @param passed whether the check passed.
+ *  @param what description of the check. */
+static void check(int passed,const char * what)
+{
+    if(!passed) {
+        fprintf(stderr,"FAIL: %s\n",what);
+        failures++;
+    }
+}
+
+/*! Computes the CRC32C checksum of a buffer one bit at a time.
+ *  @param crc the existing crc for prior data, if any.
+ *  @param buffer the buffer to compute.
+ *  @param length the length of the buffer.
+ *  @return the new CRC32C checksum. */
+static uint32_t crc32cReference(uint32_t crc,const void * buffer,size_t length)
+{
+    const uint8_t * bytes = (const uint8_t *)buffer;
+    
+    crc = ~crc;
+    while(length--) {
+        crc ^= *bytes++;
+        for(int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+    }
+    return ~crc;
+}
+
+/*! Checks an implementation against the test vectors of RFC 3720.
+ *  @param implementation the implementation to check. */
+static void testVectors(const crc32cImplementation * implementation)
+{
+    uint8_t zeros[32], ones[32], increasing[32], decreasing[32];
+    char what[128];
+    
+    memset(zeros,0,sizeof(zeros));
+    memset(ones,0xff,sizeof(ones));
+    for(int index = 0; index < 32; index++) {
+        increasing[index] = index;
+        decreasing[index] = 31 - index;
+    }
+    
+    const struct { const char * name; const void * data; size_t length; uint32_t crc; } vectors[] = {
+        { "\"123456789\"", "123456789", 9, 0xe3069283 },
+        { "32 bytes of zeros", zeros, sizeof(zeros), 0x8a9136aa },
+        { "32 bytes of ones", ones, sizeof(ones), 0x62a8ab43 },
+        { "32 increasing bytes", increasing, sizeof(increasing), 0x46dd794e },
+        { "32 decreasing bytes", decreasing, sizeof(decreasing), 0x113fdb5c },
+    };
+    
+    for(unsigned int index = 0; index < sizeof(vectors)/sizeof(vectors[0]); index++)
+    {
+        snprintf(what,sizeof(what),"%s: crc of %s",implementation->name,vectors[index].name);
+        check(implementation->crc(0,vectors[index].data,vectors[index].length) == vectors[index].crc,what);
+    }
+}
+
+/*! Checks an implementation against the reference for random buffers of
+ *  random lengths and alignments, with and without copying.
+ *  @param implementation the implementation to check.
+ *  @param data random data to take buffers from. */
+static void testRandomBuffers(const crc32cImplementation * implementation,const uint8_t * data)
+{
+    uint8_t * copy = (uint8_t *)malloc(kRandomDataSize);
+    char what[128];
+    
+    for(unsigned int index = 0; index < kRandomBufferCount; index++)
+    {
+        // Short buffers exercise the byte-wise head and tail handling
+        size_t offset = rand() % 16;
+        size_t maxLength = index < kRandomBufferCount/2 ? 2048 : kRandomDataSize - 16;
+        size_t length = rand() % maxLength;
+        uint32_t seed = (uint32_t)rand();
+        uint32_t expected = crc32cReference(seed,data + offset,length);
+        
+        snprintf(what,sizeof(what),"%s: crc of %zu bytes at offset %zu",
+                 implementation->name,length,offset);
+        check(implementation->crc(seed,data + offset,length) == expected,what);
+        
+        snprintf(what,sizeof(what),"%s: copy of %zu bytes at offset %zu",
+                 implementation->name,length,offset);
+        memset(copy,0,kRandomDataSize);
+        check(implementation->copy(seed,copy,data + offset,length) == expected &&
+              memcmp(copy,data + offset,length) == 0,what);
+    }
+    free(copy);
+}
+
+/*! Checks an implementation's batch interface against its single buffer
+ *  interface, for batches of random size (so that batches aren't always a
+ *  multiple of the three buffers interleaved at a time) holding buffers of
+ *  random lengths, offsets and seeds.
+ *  @param implementation the implementation to check.
+ *  @param data random data to take buffers from. */
+static void testBatches(const crc32cImplementation * implementation,const uint8_t * data)
+{
+    const void * buffers[kMaxBatchSize];
+    size_t lengths[kMaxBatchSize];
+    uint32_t crcs[kMaxBatchSize], seeds[kMaxBatchSize];
+    char what[128];
+    
+    for(unsigned int index = 0; index < kRandomBatchCount; index++)
+    {
+        unsigned int count = rand() % (kMaxBatchSize + 1);
+        
+        for(unsigned int buffer = 0; buffer < count; buffer++)
+        {
+            // Mostly header-sized buffers, with the occasional data segment
+            lengths[buffer] = rand() % 8 ? rand() % 80 : rand() % 9000;
+            buffers[buffer] = data + rand() % (kRandomDataSize - lengths[buffer]);
+            seeds[buffer] = crcs[buffer] = rand() % 2 ? (uint32_t)rand() : 0;
+        }
+        
+        implementation->batch(crcs,buffers,lengths,count);
+        
+        for(unsigned int buffer = 0; buffer < count; buffer++)
+        {
+            snprintf(what,sizeof(what),"%s: batch of %u, buffer %u of %zu bytes",
+                     implementation->name,count,buffer,lengths[buffer]);
+            check(crcs[buffer] == implementation->crc(seeds[buffer],buffers[buffer],lengths[buffer]),what);
+        }
+    }
+}
+
+/*! Checks that combining the checksums of two parts of a buffer yields the
+ *  checksum of the whole buffer, crc32c_combine(crc(a),crc(b),len(b)) ==
+ *  crc(a || b), for random buffers split at random points (including
+ *  empty parts).
+ *  @param data random data to take buffers from. */
+static void testCombine(const uint8_t * data)
+{
+    char what[128];
+    
+    for(unsigned int index = 0; index < kRandomSplitCount; index++)
+    {
+        size_t length = rand() % (index < kRandomSplitCount/2 ? 256 : kRandomDataSize);
+        size_t split = rand() % (length + 1);
+        const uint8_t * buffer = data + rand() % (kRandomDataSize - length + 1);
+        
+        uint32_t whole = crc32c(0,buffer,length);
+        uint32_t first = crc32c(0,buffer,split);
+        uint32_t second = crc32c(0,buffer + split,length - split);
+        
+        snprintf(what,sizeof(what),"crc32c_combine() of %zu bytes split at %zu",length,split);
+        check(crc32c_combine(first,second,length - split) == whole,what);
+    }
+}
+
+/*! Checks that the checksum of a buffer split into random segments, as
+ *  computed by crc32c_iovec(), is that of the whole buffer.
+ *  @param data random data to take buffers from. */
+static void testIovec(const uint8_t * data)
+{
+    struct iovec iov[kMaxSegments];
+    char what[128];
+    
+    for(unsigned int index = 0; index < kRandomSplitCount; index++)
+    {
+        size_t length = rand() % kRandomDataSize;
+        const uint8_t * buffer = data + rand() % (kRandomDataSize - length + 1);
+        unsigned int segments = 1 + rand() % kMaxSegments;
+        size_t offset = 0;
+        
+        // The last segment takes whatever remains; others may be empty
+        for(unsigned int segment = 0; segment < segments; segment++) {
+            size_t segmentLength = segment == segments - 1 ? length - offset
+                                                           : rand() % (length - offset + 1);
+            iov[segment].iov_base = (void *)(buffer + offset);
+            iov[segment].iov_len = segmentLength;
+            offset += segmentLength;
+        }
+        
+        uint32_t seed = (uint32_t)rand();
+        
+        snprintf(what,sizeof(what),"crc32c_iovec() of %zu bytes in %u segments",length,segments);
+        check(crc32c_iovec(seed,iov,segments) == crc32c(seed,buffer,length),what);
+    }
+}
+
+int main(int argc,const char * argv[])
+{
+    unsigned int count;
+    crc32cImplementation * implementations = crc32cGetImplementations(&count);
+    
+    uint8_t * data = (uint8_t *)malloc(kRandomDataSize);
+    
+    srand(1);
+    for(size_t index = 0; index < kRandomDataSize; index++)
+        data[index] = (uint8_t)rand();
+    
+    for(unsigned int index = 0; index < count; index++)
+    {
+        if(!implementations[index].supported) {
+            printf("%s: not supported by this processor, skipped\n",implementations[index].name);
+            continue;
+        }
+        
+        testVectors(&implementations[index]);
+        testRandomBuffers(&implementations[index],data);
+        testBatches(&implementations[index],data);
+        printf("%s: checked\n",implementations[index].name);
+    }
+    
+    // The public functions use the implementation crc32c_init() selected
+    check(crc32c(0,"123456789",9) == 0xe3069283,"crc32c() of \"123456789\"");
+    check(crc32c(0x12345678,NULL,0) == 0x12345678,"crc32c() of an empty buffer");
+    
+    testCombine(data);
+    testIovec(data);
+    
+    free(data);
+    
+    printf("crc32cTest: %s (selected implementation: %s)\n",
+           failures ? "FAILED" : "passed",crc32c_implementation());
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+/*!
+ * @author		Nareg Sinenian
+ * @file		latencyHistogramTest.c
+ * @version		1.0
+ * @copyright	(c) 2014-2015 Nareg Sinenian. All rights reserved.
+ *
+ * Checks the bucket layout of the kernel's latency histograms
+ * (iSCSILatencyHistogram.h): that the lower bound of every bucket maps
+ * back to that bucket and the value just below it to the previous one,
+ * that small latencies are recorded exactly, that buckets are no wider
+ * than the stated precision and that large latencies are clamped to the
+ * last bucket.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+
+#include "iSCSILatencyHistogram.h"
+
+/*! Number of random latencies checked against the bounds of their bucket. */
+static const unsigned int kRandomLatencyCount = 1000000;
+
+/*! Number of failed checks. */
+static unsigned int failures = 0;
+
+/*! Records the result of a check.
+ *  @param passed whether the check passed.
+ *  @param what description of the check. */
+static void check(int passed,const char * what)
+{
+    if(!passed) {
+        fprintf(stderr,"FAIL: %s\n",what);
+        failures++;
+    }
+}
+
+/*! Gets the smallest latency that is not recorded in a bucket.
+ *  @param bucket the bucket index.
+ *  @return the upper bound of the bucket, in microseconds. */
+static UInt64 bucketLimit(UInt32 bucket)
+{
+    if(bucket + 1 < kiSCSILatencyHistogramBuckets)
+        return iSCSILatencyHistogramGetBucketValue(bucket + 1);
+    return 1ULL << 32;
+}
+
+/*! Checks the edges of every bucket.  The lower bound of each bucket must
+ *  map to the bucket, the value just below it to the previous bucket, and
+ *  lower bounds must increase. */
+static void testBucketEdges()
+{
+    const UInt32 subBuckets = 1 << kiSCSILatencyHistogramSubBucketBits;
+    char what[128];
+    
+    for(UInt32 bucket = 0; bucket < kiSCSILatencyHistogramBuckets; bucket++)
+    {
+        UInt64 value = iSCSILatencyHistogramGetBucketValue(bucket);
+        UInt64 limit = bucketLimit(bucket);
+        
+        snprintf(what,sizeof(what),"bucket %u: lower bound %llu maps to bucket",
+                 bucket,(unsigned long long)value);
+        check(iSCSILatencyHistogramGetBucket(value) == bucket,what);
+        
+        snprintf(what,sizeof(what),"bucket %u: last value %llu maps to bucket",
+                 bucket,(unsigned long long)(limit - 1));
+        check(iSCSILatencyHistogramGetBucket(limit - 1) == bucket,what);
+        
+        snprintf(what,sizeof(what),"bucket %u: lower bound %llu below limit %llu",
+                 bucket,(unsigned long long)value,(unsigned long long)limit);
+        check(value < limit,what);
+        
+        // Small latencies are recorded exactly; others are within the
+        // stated precision of the bucket's lower bound
+        if(bucket < subBuckets) {
+            snprintf(what,sizeof(what),"bucket %u: holds a single value",bucket);
+            check(value == bucket && limit == value + 1,what);
+        }
+        else {
+            snprintf(what,sizeof(what),"bucket %u: width %llu of %llu too large",
+                     bucket,(unsigned long long)(limit - value),(unsigned long long)value);
+            check((limit - value) << (kiSCSILatencyHistogramSubBucketBits - 1) <= value,what);
+        }
+    }
+    
+    // Each power of two starts a new group of sub-buckets
+    for(UInt32 exponent = kiSCSILatencyHistogramSubBucketBits; exponent < 32; exponent++)
+    {
+        UInt32 expected = subBuckets + (exponent - kiSCSILatencyHistogramSubBucketBits)*(subBuckets >> 1);
+        
+        snprintf(what,sizeof(what),"2^%u starts bucket %u",exponent,expected);
+        check(iSCSILatencyHistogramGetBucket(1ULL << exponent) == expected,what);
+    }
+}
+
+/*! Checks that latencies too large for the histogram land in the last
+ *  bucket rather than past the end of it. */
+static void testClamping()
+{
+    const UInt32 last = kiSCSILatencyHistogramBuckets - 1;
+    
+    check(iSCSILatencyHistogramGetBucket(0xFFFFFFFFULL) == last,"2^32-1 maps to the last bucket");
+    check(iSCSILatencyHistogramGetBucket(1ULL << 32) == last,"2^32 maps to the last bucket");
+    check(iSCSILatencyHistogramGetBucket(1ULL << 40) == last,"2^40 maps to the last bucket");
+    check(iSCSILatencyHistogramGetBucket(UINT64_MAX) == last,"2^64-1 maps to the last bucket");
+}
+
+/*! Checks random latencies of random magnitudes against the bounds of the
+ *  bucket they are recorded in. */
+static void testRandomLatencies()
+{
+    char what[128];
+    
+    for(unsigned int index = 0; index < kRandomLatencyCount; index++)
+    {
+        UInt64 random = ((UInt64)rand() << 31) ^ (UInt64)rand();
+        UInt64 latency = random & ((1ULL << (rand() % 33)) - 1);
+        UInt32 bucket = iSCSILatencyHistogramGetBucket(latency);
+        
+        snprintf(what,sizeof(what),"latency %llu in bucket %u",(unsigned long long)latency,bucket);
+        check(bucket < kiSCSILatencyHistogramBuckets &&
+              latency >= iSCSILatencyHistogramGetBucketValue(bucket) &&
+              latency < bucketLimit(bucket),what);
+    }
+}
+
+int main(int argc,const char * argv[])
+{
+    srand(1);
+    
+    testBucketEdges();
+    testClamping();
+    testRandomLatencies();
+    
+    printf("latencyHistogramTest: %s\n",failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
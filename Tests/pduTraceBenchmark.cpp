@@ -0,0 +1,134 @@
+/*!
+ * @author		Nareg Sinenian
+ * @file		pduTraceBenchmark.cpp
+ * @version		1.0
+ * @copyright	(c) 2014-2015 Nareg Sinenian. All rights reserved.
+ *
+ * Measures what the PDU trace (iSCSIPDUTrace.h) adds to the per-PDU work
+ * of a connection's transmit batch: the batch is stamped as FlushPDUs()
+ * does with tracing off and with tracing on, and the time per PDU is
+ * reported for both.  This is built as C++, as iSCSITypesShared.h sizes
+ * arrays with constants.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+
+#define OSMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#include "iSCSIPDUTrace.h"
+
+/*! Number of PDUs in a batch (that of a connection's transmit batch). */
+#define kPDUsPerBatch 16
+
+/*! Number of PDUs stamped for each measurement. */
+static const size_t kPDUsPerMeasurement = 256*1024*1024;
+
+/*! The fields of a basic header segment that FlushPDUs() reads or writes. */
+typedef struct BHS {
+    UInt8 opCode;
+    UInt8 flags;
+    UInt8 reserved[14];
+    UInt32 initiatorTaskTag;
+    UInt8 reserved2[4];
+    UInt32 cmdSN;
+    UInt32 expStatSN;
+    UInt8 reserved3[16];
+} BHS;
+
+/*! Gets the current time in nanoseconds.
+ *  @return the time. */
+static UInt64 nowNs(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC,&time);
+    return (UInt64)time.tv_sec*1000000000ULL + time.tv_nsec;
+}
+
+/*! Gets the current time in seconds.
+ *  @return the time. */
+static double now(void)
+{
+    return nowNs()/1e9;
+}
+
+/*! Stamps batches of PDUs as FlushPDUs() does, recording each PDU in the
+ *  trace if tracing is enabled.
+ *  @param batch the PDUs of the batch.
+ *  @param ring the ring that PDUs are recorded in.
+ *  @param traceEnabled whether PDUs are recorded.
+ *  @return the time taken per PDU, in nanoseconds. */
+static double benchmarkBatches(BHS * batch,
+                               iSCSIKernelPDUTraceRing * ring,
+                               volatile bool * traceEnabled)
+{
+    const size_t batchCount = kPDUsPerMeasurement/kPDUsPerBatch;
+    UInt32 expStatSN = 0;
+    
+    double start = now();
+    
+    for(size_t count = 0; count < batchCount; count++, expStatSN++)
+        for(unsigned int index = 0; index < kPDUsPerBatch; index++)
+        {
+            BHS * bhs = &batch[index];
+            bhs->expStatSN = __builtin_bswap32(expStatSN);
+            
+            if(*traceEnabled)
+                iSCSIPDUTraceRecordPDU(ring,nowNs(),bhs->opCode,bhs->flags,
+                                       bhs->initiatorTaskTag,
+                                       __builtin_bswap32(bhs->cmdSN),expStatSN,
+                                       512);
+        }
+    
+    return (now() - start)/kPDUsPerMeasurement*1e9;
+}
+
+int main(int argc,const char * argv[])
+{
+    BHS batch[kPDUsPerBatch] = {};
+    
+    for(unsigned int index = 0; index < kPDUsPerBatch; index++) {
+        batch[index].opCode = 0x01;
+        batch[index].initiatorTaskTag = index;
+        batch[index].cmdSN = __builtin_bswap32(index);
+    }
+    
+    iSCSIKernelPDUTraceRing * ring = (iSCSIKernelPDUTraceRing *)calloc(1,sizeof(iSCSIKernelPDUTraceRing));
+    volatile bool traceEnabled = false;
+    
+    // Read the clock on its own, as the kernel reads a cheaper clock
+    const size_t clockReads = kPDUsPerMeasurement/16;
+    UInt64 check = 0;
+    double start = now();
+    
+    for(size_t count = 0; count < clockReads; count++)
+        check += nowNs();
+    
+    double clockNs = (now() - start)/clockReads*1e9;
+    
+    double off = benchmarkBatches(batch,ring,&traceEnabled);
+    traceEnabled = true;
+    double on = benchmarkBatches(batch,ring,&traceEnabled);
+    
+    printf("%-16s%12s   (%d PDUs per batch, ns per PDU)\n","tracing","time",kPDUsPerBatch);
+    printf("%-16s%12.2f\n","off",off);
+    printf("%-16s%12.2f\n","on",on);
+    printf("%-16s%12.2f\n","on, no clock",on - clockNs);
+    printf("%-16s%12.2f%s\n","clock read",clockNs,check ? "" : "*");
+    
+    // Every PDU must have been recorded
+    if(ring->head != kPDUsPerMeasurement) {
+        fprintf(stderr,"FAIL: %llu PDUs recorded\n",(unsigned long long)ring->head);
+        return 1;
+    }
+    
+    free(ring);
+    return 0;
+}
@@ -0,0 +1,469 @@
+/*!
+ * @author		Nareg Sinenian
+ * @file		r2tSequenceTest.c
+ * @version		1.0
+ * @copyright	(c) 2014-2015 Nareg Sinenian. All rights reserved.
+ *
+ * Checks the R2T bookkeeping of the kernel (iSCSIR2TSequence.h) against a
+ * stand-in for a target.  The target keeps up to MaxOutstandingR2T R2Ts
+ * outstanding for each of several write tasks and issues them in random
+ * order across tasks; the initiator side services them the way the
+ * transmit workloop does.  Every Data-Out PDU is checked against the R2T
+ * it answers (target transfer tag, DataSN, offset, length and F bit) and
+ * every byte of every task must arrive exactly once, both with interleaved
+ * sequences and with DataSequenceInOrder.  Targets that exceed
+ * MaxOutstandingR2T, or that have R2Ts outstanding for more tasks than a
+ * connection tracks, must be detected.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+typedef uint8_t  UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+
+#include "iSCSIR2TSequence.h"
+
+/*! Number of write tasks serviced at once. */
+#define kTaskCount 8
+
+/*! Number of R2T sequences a task tracks (the kernel uses
+ *  kiSCSIMaxOutstandingR2T, which is also 4). */
+#define kTaskSequences 4
+
+/*! Largest number of bytes requested by a single R2T (MaxBurstLength). */
+static const UInt32 kMaxBurstLength = 64*1024;
+
+/*! Largest data segment of a Data-Out PDU (MaxRecvDataSegmentLength). */
+static const UInt32 kMaxSegmentLength = 8*1024;
+
+/*! Number of Data-Out PDUs sent for a sequence each time it is serviced. */
+static const UInt32 kBatchSize = 3;
+
+/*! Number of times the simulation is run for each ordering. */
+static const unsigned int kRunCount = 50;
+
+/*! An R2T that the target stand-in has outstanding. */
+typedef struct TargetR2T {
+    bool outstanding;
+    UInt32 targetTransferTag;
+    UInt32 R2TSN;
+    UInt32 bufferOffset;
+    UInt32 desiredDataLength;
+    UInt32 received;
+    UInt32 expectedDataSN;
+} TargetR2T;
+
+/*! A write task, as seen by both the initiator and the target stand-in. */
+typedef struct Task {
+    UInt32 initiatorTaskTag;
+    UInt32 length;
+    
+    /*! Initiator: the task's R2T sequences. */
+    iSCSIR2TSequence sequences[kTaskSequences];
+    UInt8 activeCount;
+    
+    /*! Target: R2Ts issued so far and the data still to be requested. */
+    TargetR2T R2Ts[kTaskSequences];
+    UInt32 outstandingR2Ts;
+    UInt32 nextR2TSN;
+    UInt32 requested;
+    
+    /*! Target: number of times each byte of the task was received. */
+    UInt8 * received;
+    UInt32 receivedLength;
+} Task;
+
+/*! Number of failed checks. */
+static unsigned int failures = 0;
+
+/*! Records the result of a check.
+ *  @param passed whether the check passed.
+ *  @param what description of the check. */
+static void check(int passed,const char * what)
+{
+    if(!passed) {
+        if(failures < 20)
+            fprintf(stderr,"FAIL: %s\n",what);
+        failures++;
+    }
+}
+
+/*! Target transfer tag of the next R2T. */
+static UInt32 nextTargetTransferTag = 1;
+
+/*! Task and sequence of the last Data-Out PDU, used to count how often
+ *  PDUs of different sequences are interleaved. */
+static UInt32 lastTask = UINT32_MAX, lastTargetTransferTag = 0;
+static unsigned int sequenceSwitches = 0, taskSwitches = 0, R2TsIssued = 0;
+
+/*! Target stand-in: issues an R2T for the next part of a task's data and
+ *  hands it to the initiator side, as ProcessR2T() does.
+ *  @param task the task.
+ *  @param taskTags the tasks with R2T sequences on the connection.
+ *  @param taskCount the number of entries in taskTags. */
+static void issueR2T(Task * task,UInt32 * taskTags,UInt8 * taskCount)
+{
+    UInt32 index;
+    for(index = 0; index < kTaskSequences; index++)
+        if(!task->R2Ts[index].outstanding)
+            break;
+    
+    TargetR2T * R2T = &task->R2Ts[index];
+    UInt32 remaining = task->length - task->requested;
+    
+    // Bursts are usually full, but not always
+    R2T->outstanding        = true;
+    R2T->targetTransferTag  = nextTargetTransferTag++;
+    R2T->R2TSN              = task->nextR2TSN++;
+    R2T->bufferOffset       = task->requested;
+    R2T->desiredDataLength  = (rand() % 4) ? kMaxBurstLength : 1 + rand() % kMaxBurstLength;
+    R2T->received           = 0;
+    R2T->expectedDataSN     = 0;
+    
+    if(R2T->desiredDataLength > remaining)
+        R2T->desiredDataLength = remaining;
+    
+    task->requested += R2T->desiredDataLength;
+    task->outstandingR2Ts++;
+    R2TsIssued++;
+    
+    iSCSIR2TSequence * sequence =
+        iSCSIR2TSequenceAdd(task->sequences,kTaskSequences,&task->activeCount,kTaskSequences,0,
+                            R2T->targetTransferTag,R2T->R2TSN,
+                            R2T->bufferOffset,R2T->desiredDataLength);
+    check(sequence != NULL,"R2T within MaxOutstandingR2T is accepted");
+    check(iSCSIR2TTaskListAdd(taskTags,taskCount,kTaskCount,task->initiatorTaskTag),
+          "task with R2Ts fits on the connection");
+}
+
+/*! Target stand-in: receives a Data-Out PDU and checks it against the R2T
+ *  that it answers.
+ *  @param task the task that the PDU belongs to.
+ *  @param sequence the sequence that the PDU was sent for (initiator side).
+ *  @param bufferOffset the offset of the PDU's data.
+ *  @param length the length of the PDU's data segment.
+ *  @param finalPDU whether the F bit of the PDU is set.
+ *  @param inOrder whether data sequences must be sent in order. */
+static void receiveDataOut(Task * task,
+                           const iSCSIR2TSequence * sequence,
+                           UInt32 bufferOffset,
+                           UInt32 length,
+                           bool finalPDU,
+                           bool inOrder)
+{
+    char what[160];
+    TargetR2T * R2T = NULL;
+    
+    for(UInt32 index = 0; index < kTaskSequences; index++)
+        if(task->R2Ts[index].outstanding &&
+           task->R2Ts[index].targetTransferTag == sequence->targetTransferTag)
+            R2T = &task->R2Ts[index];
+    
+    snprintf(what,sizeof(what),"task %u: Data-Out for unknown TTT %u",
+             task->initiatorTaskTag,sequence->targetTransferTag);
+    check(R2T != NULL,what);
+    
+    if(!R2T)
+        return;
+    
+    if(task->initiatorTaskTag != lastTask)
+        taskSwitches++;
+    else if(sequence->targetTransferTag != lastTargetTransferTag)
+        sequenceSwitches++;
+    
+    lastTask = task->initiatorTaskTag;
+    lastTargetTransferTag = sequence->targetTransferTag;
+    
+    snprintf(what,sizeof(what),"task %u R2TSN %u: DataSN %u, expected %u",
+             task->initiatorTaskTag,R2T->R2TSN,sequence->dataSN,R2T->expectedDataSN);
+    check(sequence->dataSN == R2T->expectedDataSN,what);
+    
+    snprintf(what,sizeof(what),"task %u R2TSN %u: offset %u, expected %u",
+             task->initiatorTaskTag,R2T->R2TSN,bufferOffset,R2T->bufferOffset + R2T->received);
+    check(bufferOffset == R2T->bufferOffset + R2T->received,what);
+    
+    snprintf(what,sizeof(what),"task %u R2TSN %u: segment of %u bytes",
+             task->initiatorTaskTag,R2T->R2TSN,length);
+    check(length != 0 && length <= kMaxSegmentLength &&
+          R2T->received + length <= R2T->desiredDataLength,what);
+    
+    snprintf(what,sizeof(what),"task %u R2TSN %u: F bit %s after %u of %u bytes",
+             task->initiatorTaskTag,R2T->R2TSN,finalPDU ? "set" : "clear",
+             R2T->received + length,R2T->desiredDataLength);
+    check(finalPDU == (R2T->received + length == R2T->desiredDataLength),what);
+    
+    // With DataSequenceInOrder the data of an R2T is only sent once the
+    // data of all earlier R2Ts of the task has been sent
+    if(inOrder) {
+        for(UInt32 index = 0; index < kTaskSequences; index++)
+        {
+            snprintf(what,sizeof(what),"task %u: R2TSN %u served before R2TSN %u",
+                     task->initiatorTaskTag,R2T->R2TSN,task->R2Ts[index].R2TSN);
+            check(!task->R2Ts[index].outstanding || task->R2Ts[index].R2TSN >= R2T->R2TSN,what);
+        }
+    }
+    
+    for(UInt32 offset = bufferOffset; offset < bufferOffset + length && offset < task->length; offset++)
+        task->received[offset]++;
+    
+    task->receivedLength += length;
+    R2T->received += length;
+    R2T->expectedDataSN++;
+    
+    if(finalPDU) {
+        R2T->outstanding = false;
+        task->outstandingR2Ts--;
+    }
+}
+
+/*! Initiator side: sends the next batch of Data-Out PDUs for the R2T
+ *  sequences of a task, as ServiceR2TSequences() does.
+ *  @param task the task.
+ *  @param inOrder whether data sequences must be sent in order.
+ *  @return true if the task has no remaining R2T sequences. */
+static bool serviceTask(Task * task,bool inOrder)
+{
+    iSCSIR2TSequence * oldest = NULL;
+    
+    if(inOrder)
+        oldest = iSCSIR2TSequenceGetOldest(task->sequences,kTaskSequences);
+    
+    for(UInt32 index = 0; index < kTaskSequences; index++)
+    {
+        iSCSIR2TSequence * sequence = &task->sequences[index];
+        
+        if(!sequence->active || (oldest && sequence != oldest))
+            continue;
+        
+        for(UInt32 pdus = 0; sequence->dataSent != sequence->desiredDataLength && pdus < kBatchSize; pdus++)
+        {
+            UInt32 bufferOffset, length;
+            bool finalPDU = iSCSIR2TSequenceGetNextSegment(sequence,kMaxSegmentLength,
+                                                           &bufferOffset,&length);
+            receiveDataOut(task,sequence,bufferOffset,length,finalPDU,inOrder);
+            iSCSIR2TSequenceSegmentSent(sequence,length);
+        }
+        
+        if(sequence->dataSent == sequence->desiredDataLength)
+            iSCSIR2TSequenceRelease(sequence,&task->activeCount);
+    }
+    return task->activeCount == 0;
+}
+
+/*! Runs a set of write tasks to completion against the target stand-in.
+ *  @param inOrder whether data sequences must be sent in order. */
+static void testInterleavedSequences(bool inOrder)
+{
+    Task tasks[kTaskCount];
+    UInt32 taskTags[kTaskCount];
+    UInt8 taskCount = 0;
+    char what[128];
+    
+    memset(tasks,0,sizeof(tasks));
+    
+    for(UInt32 index = 0; index < kTaskCount; index++)
+    {
+        tasks[index].initiatorTaskTag = index;
+        tasks[index].length = 1 + rand() % (16*kMaxBurstLength);
+        tasks[index].received = calloc(tasks[index].length,1);
+    }
+    
+    bool done = false;
+    
+    while(!done)
+    {
+        // The target issues R2Ts in random order across tasks, keeping no
+        // more than MaxOutstandingR2T outstanding for any task
+        for(UInt32 R2Ts = rand() % (2*kTaskCount); R2Ts != 0; R2Ts--)
+        {
+            Task * task = &tasks[rand() % kTaskCount];
+            
+            if(task->requested < task->length && task->outstandingR2Ts < kTaskSequences)
+                issueR2T(task,taskTags,&taskCount);
+        }
+        
+        // The initiator services a batch of each task with R2Ts, dropping
+        // tasks that have none left (as ServicePendingR2Ts() does)
+        UInt32 index = 0;
+        
+        while(index < taskCount)
+        {
+            if(serviceTask(&tasks[taskTags[index]],inOrder))
+                taskTags[index] = taskTags[--taskCount];
+            else
+                index++;
+        }
+        
+        done = true;
+        for(index = 0; index < kTaskCount; index++)
+            if(tasks[index].receivedLength != tasks[index].length)
+                done = false;
+    }
+    
+    for(UInt32 index = 0; index < kTaskCount; index++)
+    {
+        Task * task = &tasks[index];
+        UInt32 offset;
+        
+        for(offset = 0; offset < task->length; offset++)
+            if(task->received[offset] != 1)
+                break;
+        
+        snprintf(what,sizeof(what),"task %u: every byte received once (first error at %u of %u)",
+                 index,offset,task->length);
+        check(offset == task->length,what);
+        
+        snprintf(what,sizeof(what),"task %u: no sequences left",index);
+        check(task->activeCount == 0 && task->outstandingR2Ts == 0,what);
+        
+        free(task->received);
+    }
+    
+    check(taskCount == 0,"no tasks left on the connection");
+}
+
+/*! Checks that R2Ts beyond the negotiated MaxOutstandingR2T are detected
+ *  (the connection is failed in that case) without disturbing the
+ *  sequences already recorded, for values of MaxOutstandingR2T below,
+ *  at and above the number of sequences a task can track. */
+static void testMaxOutstandingR2T()
+{
+    const UInt32 negotiated[] = { 0, 1, 2, kTaskSequences, kTaskSequences + 5 };
+    char what[128];
+    
+    for(UInt32 test = 0; test < sizeof(negotiated)/sizeof(negotiated[0]); test++)
+    {
+        iSCSIR2TSequence sequences[kTaskSequences];
+        UInt8 activeCount = 0;
+        UInt32 limit = iSCSIR2TGetMaxOutstanding(negotiated[test],kTaskSequences);
+        
+        memset(sequences,0,sizeof(sequences));
+        
+        snprintf(what,sizeof(what),"MaxOutstandingR2T=%u: limit %u",negotiated[test],limit);
+        check(limit >= 1 && limit <= kTaskSequences &&
+              (negotiated[test] == 0 || negotiated[test] > kTaskSequences ||
+               limit == negotiated[test]),what);
+        
+        for(UInt32 R2TSN = 0; R2TSN < limit; R2TSN++)
+        {
+            snprintf(what,sizeof(what),"MaxOutstandingR2T=%u: R2T %u accepted",negotiated[test],R2TSN);
+            check(iSCSIR2TSequenceAdd(sequences,kTaskSequences,&activeCount,negotiated[test],0,100 + R2TSN,
+                                      R2TSN,R2TSN*kMaxBurstLength,kMaxBurstLength) != NULL,what);
+        }
+        
+        snprintf(what,sizeof(what),"MaxOutstandingR2T=%u: R2T %u rejected",negotiated[test],limit);
+        check(iSCSIR2TSequenceAdd(sequences,kTaskSequences,&activeCount,negotiated[test],0,100 + limit,
+                                  limit,limit*kMaxBurstLength,kMaxBurstLength) == NULL,what);
+        
+        snprintf(what,sizeof(what),"MaxOutstandingR2T=%u: rejection leaves %u sequences",
+                 negotiated[test],limit);
+        check(activeCount == limit,what);
+        
+        for(UInt32 index = 0; index < limit; index++)
+        {
+            snprintf(what,sizeof(what),"MaxOutstandingR2T=%u: sequence %u intact",negotiated[test],index);
+            check(sequences[index].active && sequences[index].targetTransferTag == 100 + index &&
+                  sequences[index].bufferOffset == index*kMaxBurstLength,what);
+        }
+        
+        // Once a sequence completes the target may issue another R2T
+        iSCSIR2TSequenceRelease(&sequences[0],&activeCount);
+        
+        iSCSIR2TSequence * sequence =
+            iSCSIR2TSequenceAdd(sequences,kTaskSequences,&activeCount,negotiated[test],0,200,limit,0,1);
+        
+        snprintf(what,sizeof(what),"MaxOutstandingR2T=%u: freed entry reused",negotiated[test]);
+        check(sequence == &sequences[0] && sequence->dataSent == 0 && sequence->dataSN == 0 &&
+              activeCount == limit,what);
+    }
+}
+
+/*! Checks that a connection detects R2Ts for more tasks than it tracks,
+ *  and that further R2Ts for tasks it already tracks are accepted. */
+static void testTaskListOverflow()
+{
+    const UInt8 maxTasks = 4;
+    UInt32 taskTags[4];
+    UInt8 taskCount = 0;
+    
+    for(UInt32 tag = 0; tag < maxTasks; tag++)
+        check(iSCSIR2TTaskListAdd(taskTags,&taskCount,maxTasks,tag),"task fits on the connection");
+    
+    check(iSCSIR2TTaskListAdd(taskTags,&taskCount,maxTasks,2) && taskCount == maxTasks,
+          "task already on the connection is accepted once");
+    check(!iSCSIR2TTaskListAdd(taskTags,&taskCount,maxTasks,maxTasks) && taskCount == maxTasks,
+          "task beyond the connection's limit is rejected");
+}
+
+/*! Checks the segmentation of a sequence into Data-Out PDUs, including a
+ *  sequence that is an exact multiple of the segment length and one that
+ *  is shorter than a segment. */
+static void testSegmentation()
+{
+    const UInt32 lengths[] = { 1, kMaxSegmentLength - 1, kMaxSegmentLength,
+                               kMaxSegmentLength + 1, 4*kMaxSegmentLength, kMaxBurstLength - 3 };
+    char what[128];
+    
+    for(UInt32 test = 0; test < sizeof(lengths)/sizeof(lengths[0]); test++)
+    {
+        iSCSIR2TSequence sequences[kTaskSequences];
+        UInt8 activeCount = 0;
+        
+        memset(sequences,0,sizeof(sequences));
+        
+        iSCSIR2TSequence * sequence =
+            iSCSIR2TSequenceAdd(sequences,kTaskSequences,&activeCount,1,0,1,0,12345,lengths[test]);
+        
+        UInt32 expectedOffset = 12345, pdus = 0;
+        bool finalPDU = false;
+        
+        while(!finalPDU)
+        {
+            UInt32 bufferOffset, length;
+            finalPDU = iSCSIR2TSequenceGetNextSegment(sequence,kMaxSegmentLength,&bufferOffset,&length);
+            
+            snprintf(what,sizeof(what),"%u bytes: PDU %u at %u, length %u",
+                     lengths[test],pdus,bufferOffset,length);
+            check(bufferOffset == expectedOffset && sequence->dataSN == pdus &&
+                  length != 0 && length <= kMaxSegmentLength,what);
+            
+            iSCSIR2TSequenceSegmentSent(sequence,length);
+            expectedOffset += length;
+            pdus++;
+        }
+        
+        snprintf(what,sizeof(what),"%u bytes: sent in %u PDUs",lengths[test],pdus);
+        check(sequence->dataSent == lengths[test] &&
+              pdus == (lengths[test] + kMaxSegmentLength - 1)/kMaxSegmentLength,what);
+    }
+}
+
+int main(int argc,const char * argv[])
+{
+    srand(1);
+    
+    testSegmentation();
+    testMaxOutstandingR2T();
+    testTaskListOverflow();
+    
+    for(unsigned int run = 0; run < kRunCount; run++)
+        testInterleavedSequences(false);
+    
+    // Interleaving must actually have happened, within and across tasks
+    check(sequenceSwitches != 0,"sequences of a task were interleaved");
+    check(taskSwitches != 0,"sequences of different tasks were interleaved");
+    check(R2TsIssued > kRunCount*kTaskCount,"tasks were sent several R2Ts");
+    
+    for(unsigned int run = 0; run < kRunCount; run++)
+        testInterleavedSequences(true);
+    
+    printf("r2tSequenceTest: %s (%u R2Ts; %u sequence and %u task switches)\n",
+           failures ? "FAILED" : "passed",R2TsIssued,sequenceSwitches,taskSwitches);
+    return failures ? 1 : 0;
+}
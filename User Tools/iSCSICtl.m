@@ -49,6 +49,15 @@ CFStringRef kModeProbe = CFSTR("-probe");
 /*! Unmount command-line mode. */
 CFStringRef kModeUnmount = CFSTR("-unmount");
 
+/*! Latency command-line mode; displays task latency percentiles. */
+CFStringRef kModeLatency = CFSTR("-latency");
+
+/*! Trace command-line mode; displays sampled tasks and their stages. */
+CFStringRef kModeTrace = CFSTR("-trace");
+
+/*! PDU trace command-line mode; enables or disables the PDU trace log. */
+CFStringRef kModePDUTrace = CFSTR("-pdutrace");
+
 
 /*! Sets the initiator name. */
 CFStringRef kOptInitiatorName = CFSTR("InitiatorName");
@@ -90,6 +99,12 @@ CFStringRef kOptMutualUser = CFSTR("mutualUser");
 /*! Mutual-secret (CHAP) command-line option. */
 CFStringRef kOptMutualSecret = CFSTR("mutualSecret");
 
+/*! Task trace sampling interval command-line option. */
+CFStringRef kOptInterval = CFSTR("interval");
+
+/*! PDU trace command-line option (on or off). */
+CFStringRef kOptPDUTrace = CFSTR("pdutrace");
+
 
 // TODO: the "all" flag should be used to remove/login/logout "all" sessions
 // it needs to be impelemented in respective functions below
@@ -1284,6 +1299,332 @@ errno_t iSCSICtlListLUNs(iSCSIDaemonHandle handle,CFDictionaryRef options)
     return 0;
 }
 
+/*! Helper function.  Estimates a percentile of the latencies recorded in a
+ *  histogram.  The estimate is the upper bound of the bucket that contains
+ *  the percentile, so it is never less than the true value.
+ *  @param histogram the latency histogram.
+ *  @param percentile the percentile to estimate (between 0 and 1).
+ *  @return the estimated latency, in microseconds. */
+UInt64 iSCSICtlGetLatencyPercentile(const iSCSIKernelLatencyHistogram * histogram,double percentile)
+{
+    UInt64 total = 0;
+    for(UInt32 bucket = 0; bucket < kiSCSILatencyHistogramBuckets; bucket++)
+        total += histogram->buckets[bucket];
+    
+    UInt64 rank = (UInt64)(percentile*total + 0.5);
+    if(rank == 0)
+        rank = 1;
+    
+    UInt64 cumulative = 0;
+    for(UInt32 bucket = 0; bucket < kiSCSILatencyHistogramBuckets - 1; bucket++)
+    {
+        cumulative += histogram->buckets[bucket];
+        
+        if(cumulative >= rank) {
+            UInt64 upperBound = iSCSILatencyHistogramGetBucketValue(bucket + 1) - 1;
+            return upperBound < histogram->maxUs ? upperBound : histogram->maxUs;
+        }
+    }
+    return histogram->maxUs;
+}
+
+/*! Helper function.  Displays the latencies of each category of task (read,
+ *  write and other) recorded for a connection or a LUN, or the time spent
+ *  in each stage by tasks of a connection.
+ *  @param handle a handle to the iSCSI daemon.
+ *  @param sessionId the session identifier.
+ *  @param scope one of the iSCSILatencyScopes values.
+ *  @param identifier the connection identifier or LUN, depending on scope.
+ *  @return an error code indicating the result of the operation. */
+errno_t iSCSICtlDisplayLatencyHistograms(iSCSIDaemonHandle handle,
+                                         SID sessionId,
+                                         UInt32 scope,
+                                         UInt32 identifier)
+{
+    CFStringRef categoryNames[kiSCSILatencyCategoryCount];
+    categoryNames[kiSCSILatencyRead] = CFSTR("Read");
+    categoryNames[kiSCSILatencyWrite] = CFSTR("Write");
+    categoryNames[kiSCSILatencyOther] = CFSTR("Other");
+    
+    CFStringRef stageNames[kiSCSITaskStageCount];
+    stageNames[kiSCSITaskStageQueue] = CFSTR("Queue");
+    stageNames[kiSCSITaskStageSend] = CFSTR("Send");
+    stageNames[kiSCSITaskStageResponse] = CFSTR("Response");
+    stageNames[kiSCSITaskStageTransfer] = CFSTR("Transfer");
+    stageNames[kiSCSITaskStageCompletion] = CFSTR("Completion");
+    
+    CFStringRef * names = categoryNames;
+    UInt32 count = kiSCSILatencyCategoryCount;
+    
+    if(scope == kiSCSILatencyScopeStage) {
+        names = stageNames;
+        count = kiSCSITaskStageCount;
+    }
+    
+    iSCSIKernelLatencyHistogram histogram;
+    errno_t error = 0;
+    
+    for(UInt32 category = 0; category < count; category++)
+    {
+        if((error = iSCSIDaemonGetLatencyHistogram(handle,sessionId,scope,identifier,category,&histogram)))
+            break;
+        
+        if(histogram.count == 0)
+            continue;
+        
+        CFStringRef latency = CFStringCreateWithFormat(
+            kCFAllocatorDefault,NULL,
+            CFSTR("\t\t%@: %llu tasks [ mean: %llu us, p50: %llu us, p90: %llu us, "
+                  "p99: %llu us, p99.9: %llu us, max: %llu us ]\n"),
+            names[category],histogram.count,histogram.sumUs/histogram.count,
+            iSCSICtlGetLatencyPercentile(&histogram,0.5),
+            iSCSICtlGetLatencyPercentile(&histogram,0.9),
+            iSCSICtlGetLatencyPercentile(&histogram,0.99),
+            iSCSICtlGetLatencyPercentile(&histogram,0.999),
+            histogram.maxUs);
+        
+        iSCSICtlDisplayString(latency);
+        CFRelease(latency);
+    }
+    return error;
+}
+
+/*! Displays task latency percentiles of each connection and each LUN of
+ *  the session associated with the specified target.
+ *  @param handle a handle to the iSCSI daemon.
+ *  @param options the command-line options dictionary.
+ *  @return an error code indicating the result of the operation. */
+errno_t iSCSICtlDisplayLatency(iSCSIDaemonHandle handle,CFDictionaryRef options)
+{
+    if(handle < 0 || !options)
+        return EINVAL;
+    
+    iSCSITargetRef target = NULL;
+    SID sessionId = kiSCSIInvalidSessionId;
+    
+    if(!(target = iSCSICtlCreateTargetFromOptions(options)))
+        return EINVAL;
+    
+    CFStringRef targetIQN = iSCSITargetGetIQN(target);
+    errno_t error = iSCSIDaemonGetSessionIdForTarget(handle,targetIQN,&sessionId);
+    
+    if(!error && sessionId == kiSCSIInvalidSessionId)
+    {
+        iSCSICtlDisplayError("The specified target has no active session.");
+        error = EINVAL;
+    }
+    
+    if(error) {
+        iSCSITargetRelease(target);
+        return error;
+    }
+    
+    // Connections that are not active have no histograms and are skipped
+    for(CID connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++)
+    {
+        iSCSIKernelLatencyHistogram histogram;
+        if(iSCSIDaemonGetLatencyHistogram(handle,sessionId,kiSCSILatencyScopeConnection,
+                                          connectionId,kiSCSILatencyRead,&histogram))
+            continue;
+        
+        CFStringRef connectionStr = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,
+                                                             CFSTR("\tConnection: %u\n"),connectionId);
+        iSCSICtlDisplayString(connectionStr);
+        CFRelease(connectionStr);
+        
+        iSCSICtlDisplayLatencyHistograms(handle,sessionId,kiSCSILatencyScopeConnection,connectionId);
+        
+        // Break the latency down by stage to show whether queuing, the
+        // network or the target dominates
+        iSCSICtlDisplayString(CFSTR("\tConnection stages:\n"));
+        iSCSICtlDisplayLatencyHistograms(handle,sessionId,kiSCSILatencyScopeStage,connectionId);
+    }
+    
+    // The kernel only keeps histograms for a limited number of LUNs per
+    // session, so LUNs without histograms are skipped
+    io_object_t LUN = IO_OBJECT_NULL;
+    io_iterator_t LUNIterator = IO_OBJECT_NULL;
+    
+    iSCSIIORegistryGetLUNs(targetIQN,&LUNIterator);
+    while((LUN = IOIteratorNext(LUNIterator)) != IO_OBJECT_NULL)
+    {
+        CFDictionaryRef properties = iSCSIIORegistryCreateCFPropertiesForLUN(LUN);
+        CFNumberRef LUNIdentifier = CFDictionaryGetValue(properties,CFSTR(kIOPropertySCSILogicalUnitNumberKey));
+        
+        UInt32 LUNValue = 0;
+        CFNumberGetValue(LUNIdentifier,kCFNumberSInt32Type,&LUNValue);
+        
+        iSCSIKernelLatencyHistogram histogram;
+        if(!iSCSIDaemonGetLatencyHistogram(handle,sessionId,kiSCSILatencyScopeLUN,
+                                           LUNValue,kiSCSILatencyRead,&histogram))
+        {
+            CFStringRef LUNStr = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,
+                                                          CFSTR("\tLUN: %@\n"),LUNIdentifier);
+            iSCSICtlDisplayString(LUNStr);
+            CFRelease(LUNStr);
+            
+            iSCSICtlDisplayLatencyHistograms(handle,sessionId,kiSCSILatencyScopeLUN,LUNValue);
+        }
+        
+        IOObjectRelease(LUN);
+        CFRelease(properties);
+    }
+    
+    IOObjectRelease(LUNIterator);
+    iSCSITargetRelease(target);
+    
+    return 0;
+}
+
+/*! Displays the tasks sampled by the task trace of the session associated
+ *  with the specified target, along with the time each spent in each stage.
+ *  If an interval is specified the sampling interval is changed first (an
+ *  interval of 0 disables the trace).
+ *  @param handle a handle to the iSCSI daemon.
+ *  @param options the command-line options dictionary.
+ *  @return an error code indicating the result of the operation. */
+errno_t iSCSICtlDisplayTaskTrace(iSCSIDaemonHandle handle,CFDictionaryRef options)
+{
+    if(handle < 0 || !options)
+        return EINVAL;
+    
+    iSCSITargetRef target = NULL;
+    SID sessionId = kiSCSIInvalidSessionId;
+    
+    if(!(target = iSCSICtlCreateTargetFromOptions(options)))
+        return EINVAL;
+    
+    errno_t error = iSCSIDaemonGetSessionIdForTarget(handle,iSCSITargetGetIQN(target),&sessionId);
+    iSCSITargetRelease(target);
+    
+    if(!error && sessionId == kiSCSIInvalidSessionId)
+    {
+        iSCSICtlDisplayError("The specified target has no active session.");
+        return EINVAL;
+    }
+    
+    CFStringRef interval;
+    if(!error && CFDictionaryGetValueIfPresent(options,kOptInterval,(const void **)&interval))
+    {
+        NSString * intervalStr = (__bridge NSString*)interval;
+        int intervalValue = [intervalStr intValue];
+        
+        if(intervalValue < 0) {
+            iSCSICtlDisplayError("the specified sampling interval is invalid.");
+            return EINVAL;
+        }
+        error = iSCSIDaemonSetTaskTraceInterval(handle,sessionId,intervalValue);
+    }
+    
+    iSCSIKernelTaskTrace trace;
+    
+    if(!error)
+        error = iSCSIDaemonGetTaskTrace(handle,sessionId,&trace);
+    
+    if(error) {
+        iSCSICtlDisplayError(strerror(error));
+        return error;
+    }
+    
+    for(UInt32 index = 0; index < trace.count; index++)
+    {
+        iSCSIKernelTaskTraceRecord * record = &trace.records[index];
+        
+        // Stages that the task did not reach are displayed as "-"
+        CFStringRef stages[kiSCSITaskStageCount];
+        for(UInt32 stage = 0; stage < kiSCSITaskStageCount; stage++)
+        {
+            if(record->stageUs[stage] == kiSCSITaskStageNotReached)
+                stages[stage] = CFSTR("-");
+            else
+                stages[stage] = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),
+                                                         record->stageUs[stage]);
+        }
+        
+        CFStringRef recordStr = CFStringCreateWithFormat(
+            kCFAllocatorDefault,NULL,
+            CFSTR("%llu.%06llu [ Connection: %u, LUN: %llu, Tag: 0x%08x, Length: %u, "
+                  "Response: %u ] queue: %@ us, send: %@ us, response: %@ us, "
+                  "transfer: %@ us, completion: %@ us\n"),
+            record->completionTimeUs/1000000,record->completionTimeUs%1000000,
+            record->connectionId,record->LUN,record->initiatorTaskTag,
+            record->transferLength,record->serviceResponse,
+            stages[kiSCSITaskStageQueue],stages[kiSCSITaskStageSend],
+            stages[kiSCSITaskStageResponse],stages[kiSCSITaskStageTransfer],
+            stages[kiSCSITaskStageCompletion]);
+        
+        iSCSICtlDisplayString(recordStr);
+        CFRelease(recordStr);
+        
+        for(UInt32 stage = 0; stage < kiSCSITaskStageCount; stage++)
+            if(record->stageUs[stage] != kiSCSITaskStageNotReached)
+                CFRelease(stages[stage]);
+    }
+    
+    if(trace.dropped != 0)
+    {
+        CFStringRef droppedStr = CFStringCreateWithFormat(
+            kCFAllocatorDefault,NULL,CFSTR("%u records were overwritten before they were read\n"),
+            trace.dropped);
+        iSCSICtlDisplayString(droppedStr);
+        CFRelease(droppedStr);
+    }
+    
+    return 0;
+}
+
+/*! Enables or disables the PDU trace of the session associated with the
+ *  specified target.  While enabled, iscsid writes the PDUs sent and
+ *  received by the session to its PDU trace log.
+ *  @param handle a handle to the iSCSI daemon.
+ *  @param options the command-line options dictionary.
+ *  @return an error code indicating the result of the operation. */
+errno_t iSCSICtlSetPDUTrace(iSCSIDaemonHandle handle,CFDictionaryRef options)
+{
+    if(handle < 0 || !options)
+        return EINVAL;
+    
+    Boolean enable;
+    CFStringRef state;
+    
+    if(!CFDictionaryGetValueIfPresent(options,kOptPDUTrace,(const void **)&state))
+        state = CFSTR("on");
+    
+    if(CFStringCompare(state,CFSTR("on"),0) == kCFCompareEqualTo)
+        enable = true;
+    else if(CFStringCompare(state,CFSTR("off"),0) == kCFCompareEqualTo)
+        enable = false;
+    else {
+        iSCSICtlDisplayError("the PDU trace must be either on or off.");
+        return EINVAL;
+    }
+    
+    iSCSITargetRef target = NULL;
+    SID sessionId = kiSCSIInvalidSessionId;
+    
+    if(!(target = iSCSICtlCreateTargetFromOptions(options)))
+        return EINVAL;
+    
+    errno_t error = iSCSIDaemonGetSessionIdForTarget(handle,iSCSITargetGetIQN(target),&sessionId);
+    iSCSITargetRelease(target);
+    
+    if(!error && sessionId == kiSCSIInvalidSessionId)
+    {
+        iSCSICtlDisplayError("The specified target has no active session.");
+        return EINVAL;
+    }
+    
+    if(!error)
+        error = iSCSIDaemonSetPDUTrace(handle,sessionId,enable);
+    
+    if(error) {
+        iSCSICtlDisplayError(strerror(error));
+        return error;
+    }
+    
+    return 0;
+}
+
 errno_t iSCSICtlProbeTargetForAuthMethod(iSCSIDaemonHandle handle,CFDictionaryRef options)
 {
     if(handle < 0 || !options)
@@ -1508,6 +1849,12 @@ int main(int argc, char * argv[])
         error = iSCSICtlListTargets(handle,optDictionary);
     else if(CFStringCompare(mode,kModeListLUNs,0) == kCFCompareEqualTo)
         error = iSCSICtlListLUNs(handle,optDictionary);
+    else if(CFStringCompare(mode,kModeLatency,0) == kCFCompareEqualTo)
+        error = iSCSICtlDisplayLatency(handle,optDictionary);
+    else if(CFStringCompare(mode,kModeTrace,0) == kCFCompareEqualTo)
+        error = iSCSICtlDisplayTaskTrace(handle,optDictionary);
+    else if(CFStringCompare(mode,kModePDUTrace,0) == kCFCompareEqualTo)
+        error = iSCSICtlSetPDUTrace(handle,optDictionary);
     else if(CFStringCompare(mode,kModeProbe,0) == kCFCompareEqualTo)
         error = iSCSICtlProbeTargetForAuthMethod(handle,optDictionary);
     else if(CFStringCompare(mode,kModeMount,0) == kCFCompareEqualTo)
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 
 // Foundation includes
 #include <launch.h>
@@ -132,6 +133,42 @@ const struct iSCSIDRspGetConnectionConfig iSCSIDRspGetConnectionConfigInit = {
     .dataLength = 0
 };
 
+const struct iSCSIDRspGetLatencyHistogram iSCSIDRspGetLatencyHistogramInit = {
+    .funcCode = kiSCSIDGetLatencyHistogram,
+    .errorCode = 0,
+    .dataLength = 0
+};
+
+const struct iSCSIDRspSetTaskTraceInterval iSCSIDRspSetTaskTraceIntervalInit = {
+    .funcCode = kiSCSIDSetTaskTraceInterval,
+    .errorCode = 0
+};
+
+const struct iSCSIDRspGetTaskTrace iSCSIDRspGetTaskTraceInit = {
+    .funcCode = kiSCSIDGetTaskTrace,
+    .errorCode = 0,
+    .dataLength = 0
+};
+
+const struct iSCSIDRspSetPDUTrace iSCSIDRspSetPDUTraceInit = {
+    .funcCode = kiSCSIDSetPDUTrace,
+    .errorCode = 0
+};
+
+/*! File that PDU traces are drained to. */
+static const char * kiSCSIDPDUTraceLogPath = "/var/log/iscsid-pdutrace.log";
+
+/*! Interval at which PDU traces are drained, in seconds.  Each ring holds
+ *  kiSCSIPDUTraceRecords PDUs, so this bounds the PDU rate that can be
+ *  traced without dropping records. */
+static const CFTimeInterval kiSCSIDPDUTraceDrainInterval = 0.1;
+
+/*! Timer that drains PDU traces while any are enabled. */
+static CFRunLoopTimerRef PDUTraceTimer = NULL;
+
+/*! Log that PDU traces are drained to. */
+static FILE * PDUTraceLog = NULL;
+
 errno_t iSCSIDLoginSession(int fd,struct iSCSIDCmdLoginSession * cmd)
 {
     // Grab objects from stream
@@ -573,6 +610,108 @@ errno_t iSCSIDCopyConnectionConfig(int fd,struct iSCSIDCmdCopyConnectionConfig *
     return 0;
 }
 
+errno_t iSCSIDGetLatencyHistogram(int fd,struct iSCSIDCmdGetLatencyHistogram * cmd)
+{
+    iSCSIKernelLatencyHistogram histogram;
+    errno_t error = iSCSIGetLatencyHistogram(cmd->sessionId,cmd->scope,cmd->identifier,
+                                             cmd->category,&histogram);
+    
+    // Compose a response to send back to the client
+    struct iSCSIDRspGetLatencyHistogram rsp = iSCSIDRspGetLatencyHistogramInit;
+    rsp.errorCode = error;
+    rsp.dataLength = error ? 0 : sizeof(histogram);
+    
+    if(send(fd,&rsp,sizeof(rsp),0) != sizeof(rsp))
+        return EAGAIN;
+    
+    if(rsp.dataLength && send(fd,&histogram,rsp.dataLength,0) != rsp.dataLength)
+        return EAGAIN;
+    
+    return 0;
+}
+
+errno_t iSCSIDSetTaskTraceInterval(int fd,struct iSCSIDCmdSetTaskTraceInterval * cmd)
+{
+    errno_t error = iSCSISetTaskTraceInterval(cmd->sessionId,cmd->interval);
+    
+    // Compose a response to send back to the client
+    struct iSCSIDRspSetTaskTraceInterval rsp = iSCSIDRspSetTaskTraceIntervalInit;
+    rsp.errorCode = error;
+    
+    if(send(fd,&rsp,sizeof(rsp),0) != sizeof(rsp))
+        return EAGAIN;
+    
+    return 0;
+}
+
+errno_t iSCSIDGetTaskTrace(int fd,struct iSCSIDCmdGetTaskTrace * cmd)
+{
+    iSCSIKernelTaskTrace trace;
+    errno_t error = iSCSIGetTaskTrace(cmd->sessionId,&trace);
+    
+    // Compose a response to send back to the client
+    struct iSCSIDRspGetTaskTrace rsp = iSCSIDRspGetTaskTraceInit;
+    rsp.errorCode = error;
+    rsp.dataLength = error ? 0 : sizeof(trace);
+    
+    if(send(fd,&rsp,sizeof(rsp),0) != sizeof(rsp))
+        return EAGAIN;
+    
+    if(rsp.dataLength && send(fd,&trace,rsp.dataLength,0) != rsp.dataLength)
+        return EAGAIN;
+    
+    return 0;
+}
+
+/*! Drains the PDU traces to the PDU trace log.  Stops the timer once no
+ *  traces remain.
+ *  @param timer the drain timer.
+ *  @param info always NULL (not used). */
+void iSCSIDDrainPDUTraces(CFRunLoopTimerRef timer,void * info)
+{
+    iSCSIDrainPDUTraces(PDUTraceLog);
+    
+    if(iSCSIHasPDUTraces())
+        return;
+    
+    CFRunLoopTimerInvalidate(PDUTraceTimer);
+    CFRelease(PDUTraceTimer);
+    PDUTraceTimer = NULL;
+    
+    fclose(PDUTraceLog);
+    PDUTraceLog = NULL;
+}
+
+errno_t iSCSIDSetPDUTrace(int fd,struct iSCSIDCmdSetPDUTrace * cmd)
+{
+    errno_t error = 0;
+    
+    if(cmd->enable && !PDUTraceLog && !(PDUTraceLog = fopen(kiSCSIDPDUTraceLogPath,"a")))
+        error = errno;
+    
+    if(!error)
+        error = iSCSISetPDUTraceEnabled(cmd->sessionId,cmd->enable);
+    
+    // Drain traces until the last one has been disabled and drained
+    if(!PDUTraceTimer && PDUTraceLog)
+    {
+        PDUTraceTimer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                                             CFAbsoluteTimeGetCurrent() + kiSCSIDPDUTraceDrainInterval,
+                                             kiSCSIDPDUTraceDrainInterval,0,0,
+                                             iSCSIDDrainPDUTraces,NULL);
+        CFRunLoopAddTimer(CFRunLoopGetMain(),PDUTraceTimer,kCFRunLoopDefaultMode);
+    }
+    
+    // Compose a response to send back to the client
+    struct iSCSIDRspSetPDUTrace rsp = iSCSIDRspSetPDUTraceInit;
+    rsp.errorCode = error;
+    
+    if(send(fd,&rsp,sizeof(rsp),0) != sizeof(rsp))
+        return EAGAIN;
+    
+    return 0;
+}
+
 /*! Handles power event messages received from the kernel.  This callback
  *  is only active when iSCSIDRegisterForPowerEvents() has been called.
  *  @param refCon always NULL (not used).
@@ -683,6 +822,14 @@ void iSCSIDProcessIncomingRequest(CFSocketRef socket,
             error = iSCSIDCopySessionConfig(fd,(iSCSIDCmdCopySessionConfig*)&cmd); break;
         case kiSCSIDCopyConnectionConfig:
             error = iSCSIDCopyConnectionConfig(fd,(iSCSIDCmdCopyConnectionConfig*)&cmd); break;
+        case kiSCSIDGetLatencyHistogram:
+            error = iSCSIDGetLatencyHistogram(fd,(iSCSIDCmdGetLatencyHistogram*)&cmd); break;
+        case kiSCSIDSetTaskTraceInterval:
+            error = iSCSIDSetTaskTraceInterval(fd,(iSCSIDCmdSetTaskTraceInterval*)&cmd); break;
+        case kiSCSIDGetTaskTrace:
+            error = iSCSIDGetTaskTrace(fd,(iSCSIDCmdGetTaskTrace*)&cmd); break;
+        case kiSCSIDSetPDUTrace:
+            error = iSCSIDSetPDUTrace(fd,(iSCSIDCmdSetPDUTrace*)&cmd); break;
         default:
             // Close our connection to the iSCSI kernel extension
             iSCSICleanup();
@@ -86,6 +86,31 @@ const struct iSCSIDCmdCopyConnectionConfig iSCSIDCmdCopyConnectionConfigInit  =
     .connectionId = kiSCSIInvalidConnectionId
 };
 
+const struct iSCSIDCmdGetLatencyHistogram iSCSIDCmdGetLatencyHistogramInit  = {
+    .funcCode = kiSCSIDGetLatencyHistogram,
+    .sessionId = kiSCSIInvalidSessionId,
+    .scope = kiSCSILatencyScopeConnection,
+    .identifier = 0,
+    .category = kiSCSILatencyRead
+};
+
+const struct iSCSIDCmdSetTaskTraceInterval iSCSIDCmdSetTaskTraceIntervalInit  = {
+    .funcCode = kiSCSIDSetTaskTraceInterval,
+    .sessionId = kiSCSIInvalidSessionId,
+    .interval = 0
+};
+
+const struct iSCSIDCmdGetTaskTrace iSCSIDCmdGetTaskTraceInit  = {
+    .funcCode = kiSCSIDGetTaskTrace,
+    .sessionId = kiSCSIInvalidSessionId
+};
+
+const struct iSCSIDCmdSetPDUTrace iSCSIDCmdSetPDUTraceInit  = {
+    .funcCode = kiSCSIDSetPDUTrace,
+    .sessionId = kiSCSIInvalidSessionId,
+    .enable = 0
+};
+
 
 
 iSCSIDaemonHandle iSCSIDaemonConnect()
@@ -709,4 +734,152 @@ iSCSIConnectionConfigRef iSCSIDaemonCopyConnectionConfig(iSCSIDaemonHandle handl
     
     // Get the session information struct
     return iSCSIDCreateObjectFromSocket(handle,rsp.dataLength,(void *(* )(CFDataRef))&iSCSIConnectionConfigCreateWithData);
+}
+
+/*! Gets a task latency histogram of a connection or a LUN.
+ *  @param handle a handle to a daemon connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param scope one of the iSCSILatencyScopes values.
+ *  @param identifier the connection identifier or LUN, depending on scope.
+ *  @param category one of the iSCSILatencyCategories values, or one of the
+ *  iSCSITaskStages values for stage histograms.
+ *  @param histogram the histogram to get.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIDaemonGetLatencyHistogram(iSCSIDaemonHandle handle,
+                                       SID sessionId,
+                                       UInt32 scope,
+                                       UInt32 identifier,
+                                       UInt32 category,
+                                       iSCSIKernelLatencyHistogram * histogram)
+{
+    // Validate inputs
+    if(handle < 0 || sessionId == kiSCSIInvalidSessionId || !histogram)
+        return EINVAL;
+    
+    // Send command to daemon
+    iSCSIDCmdGetLatencyHistogram cmd = iSCSIDCmdGetLatencyHistogramInit;
+    cmd.sessionId = sessionId;
+    cmd.scope = scope;
+    cmd.identifier = identifier;
+    cmd.category = category;
+    
+    if(send(handle,&cmd,sizeof(cmd),0) != sizeof(cmd))
+        return EIO;
+    
+    // Receive daemon response header
+    iSCSIDRspGetLatencyHistogram rsp;
+    if(recv(handle,&rsp,sizeof(rsp),0) != sizeof(rsp))
+        return EIO;
+    
+    if(rsp.errorCode)
+        return rsp.errorCode;
+    
+    if(rsp.dataLength != sizeof(*histogram))
+        return EIO;
+    
+    // Get the histogram itself
+    if(recv(handle,histogram,rsp.dataLength,MSG_WAITALL) != rsp.dataLength)
+        return EIO;
+    
+    return 0;
+}
+
+/*! Sets how often completed tasks of a session are sampled into the
+ *  session's task trace.
+ *  @param handle a handle to a daemon connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param interval one in every interval tasks is sampled (0 disables the
+ *  task trace).
+ *  @return error code indicating result of operation. */
+errno_t iSCSIDaemonSetTaskTraceInterval(iSCSIDaemonHandle handle,
+                                        SID sessionId,
+                                        UInt32 interval)
+{
+    // Validate inputs
+    if(handle < 0 || sessionId == kiSCSIInvalidSessionId)
+        return EINVAL;
+    
+    // Send command to daemon
+    iSCSIDCmdSetTaskTraceInterval cmd = iSCSIDCmdSetTaskTraceIntervalInit;
+    cmd.sessionId = sessionId;
+    cmd.interval = interval;
+    
+    if(send(handle,&cmd,sizeof(cmd),0) != sizeof(cmd))
+        return EIO;
+    
+    // Receive daemon response header
+    iSCSIDRspSetTaskTraceInterval rsp;
+    if(recv(handle,&rsp,sizeof(rsp),0) != sizeof(rsp))
+        return EIO;
+    
+    return rsp.errorCode;
+}
+
+/*! Removes and gets the records of a session's task trace.
+ *  @param handle a handle to a daemon connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param trace the records to get.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIDaemonGetTaskTrace(iSCSIDaemonHandle handle,
+                                SID sessionId,
+                                iSCSIKernelTaskTrace * trace)
+{
+    // Validate inputs
+    if(handle < 0 || sessionId == kiSCSIInvalidSessionId || !trace)
+        return EINVAL;
+    
+    // Send command to daemon
+    iSCSIDCmdGetTaskTrace cmd = iSCSIDCmdGetTaskTraceInit;
+    cmd.sessionId = sessionId;
+    
+    if(send(handle,&cmd,sizeof(cmd),0) != sizeof(cmd))
+        return EIO;
+    
+    // Receive daemon response header
+    iSCSIDRspGetTaskTrace rsp;
+    if(recv(handle,&rsp,sizeof(rsp),0) != sizeof(rsp))
+        return EIO;
+    
+    if(rsp.errorCode)
+        return rsp.errorCode;
+    
+    if(rsp.dataLength != sizeof(*trace))
+        return EIO;
+    
+    // Get the trace records themselves
+    if(recv(handle,trace,rsp.dataLength,MSG_WAITALL) != rsp.dataLength)
+        return EIO;
+    
+    return 0;
+}
+
+/*! Enables or disables the PDU traces of the connections of a session.
+ *  While enabled, the daemon periodically writes the PDUs sent and
+ *  received by the session to its PDU trace log.
+ *  @param handle a handle to a daemon connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param enable true to start tracing PDUs, false to stop.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIDaemonSetPDUTrace(iSCSIDaemonHandle handle,
+                               SID sessionId,
+                               Boolean enable)
+{
+    // Validate inputs
+    if(handle < 0 || sessionId == kiSCSIInvalidSessionId)
+        return EINVAL;
+    
+    // Send command to daemon
+    iSCSIDCmdSetPDUTrace cmd = iSCSIDCmdSetPDUTraceInit;
+    cmd.sessionId = sessionId;
+    cmd.enable = enable;
+    
+    if(send(handle,&cmd,sizeof(cmd),0) != sizeof(cmd))
+        return EIO;
+    
+    // Receive daemon response header
+    iSCSIDRspSetPDUTrace rsp;
+    if(recv(handle,&rsp,sizeof(rsp),0) != sizeof(rsp))
+        return EIO;
+    
+    return rsp.errorCode;
 }
\ No newline at end of file
@@ -179,6 +179,53 @@ iSCSIConnectionConfigRef iSCSIDaemonCopyConnectionConfig(iSCSIDaemonHandle handl
                                                          SID sessionId,
                                                          CID connectionId);
 
+/*! Gets a task latency histogram of a connection or a LUN.
+ *  @param handle a handle to a daemon connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param scope one of the iSCSILatencyScopes values.
+ *  @param identifier the connection identifier or LUN, depending on scope.
+ *  @param category one of the iSCSILatencyCategories values, or one of the
+ *  iSCSITaskStages values for stage histograms.
+ *  @param histogram the histogram to get.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIDaemonGetLatencyHistogram(iSCSIDaemonHandle handle,
+                                       SID sessionId,
+                                       UInt32 scope,
+                                       UInt32 identifier,
+                                       UInt32 category,
+                                       iSCSIKernelLatencyHistogram * histogram);
+
+/*! Sets how often completed tasks of a session are sampled into the
+ *  session's task trace.
+ *  @param handle a handle to a daemon connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param interval one in every interval tasks is sampled (0 disables the
+ *  task trace).
+ *  @return error code indicating result of operation. */
+errno_t iSCSIDaemonSetTaskTraceInterval(iSCSIDaemonHandle handle,
+                                        SID sessionId,
+                                        UInt32 interval);
+
+/*! Removes and gets the records of a session's task trace.
+ *  @param handle a handle to a daemon connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param trace the records to get.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIDaemonGetTaskTrace(iSCSIDaemonHandle handle,
+                                SID sessionId,
+                                iSCSIKernelTaskTrace * trace);
+
+/*! Enables or disables the PDU traces of the connections of a session.
+ *  While enabled, the daemon periodically writes the PDUs sent and
+ *  received by the session to its PDU trace log.
+ *  @param handle a handle to a daemon connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param enable true to start tracing PDUs, false to stop.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIDaemonSetPDUTrace(iSCSIDaemonHandle handle,
+                               SID sessionId,
+                               Boolean enable);
+
 
 
 #endif /* defined(__ISCSI_DAEMON_INTERFACE__) */
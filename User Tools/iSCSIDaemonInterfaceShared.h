@@ -527,6 +527,134 @@ typedef struct iSCSIDRspGetConnectionConfig {
 } __attribute__((packed)) iSCSIDRspGetConnectionConfig;
 
 
+
+/*! Command to get a task latency histogram of a connection or a LUN. */
+typedef struct iSCSIDCmdGetLatencyHistogram {
+    
+    const UInt16 funcCode;
+    UInt16  reserved;
+    UInt32  sessionId;
+    UInt32  scope;
+    UInt32  identifier;
+    UInt32  category;
+    UInt32  reserved2;
+    
+} __attribute__((packed)) iSCSIDCmdGetLatencyHistogram;
+
+/*! Default initialization for a get latency histogram command. */
+extern const iSCSIDCmdGetLatencyHistogram iSCSIDCmdGetLatencyHistogramInit;
+
+/*! Response to command to get a task latency histogram. */
+typedef struct iSCSIDRspGetLatencyHistogram {
+    
+    const UInt8 funcCode;
+    UInt16 reserved;
+    UInt32 errorCode;
+    UInt8  reserved2;
+    UInt32 reserved3;
+    UInt32 reserved4;
+    UInt32 dataLength;
+    UInt32 reserved5;
+    
+} __attribute__((packed)) iSCSIDRspGetLatencyHistogram;
+
+
+
+/*! Command to set the sampling interval of a session's task trace. */
+typedef struct iSCSIDCmdSetTaskTraceInterval {
+    
+    const UInt16 funcCode;
+    UInt16  reserved;
+    UInt32  sessionId;
+    UInt32  interval;
+    UInt32  reserved2;
+    UInt32  reserved3;
+    UInt32  reserved4;
+    
+} __attribute__((packed)) iSCSIDCmdSetTaskTraceInterval;
+
+/*! Default initialization for a set task trace interval command. */
+extern const iSCSIDCmdSetTaskTraceInterval iSCSIDCmdSetTaskTraceIntervalInit;
+
+/*! Response to command to set the sampling interval of a task trace. */
+typedef struct iSCSIDRspSetTaskTraceInterval {
+    
+    const UInt8 funcCode;
+    UInt16 reserved;
+    UInt32 errorCode;
+    UInt8  reserved2;
+    UInt32 reserved3;
+    UInt32 reserved4;
+    UInt32 reserved5;
+    UInt32 reserved6;
+    
+} __attribute__((packed)) iSCSIDRspSetTaskTraceInterval;
+
+
+
+/*! Command to get the records of a session's task trace. */
+typedef struct iSCSIDCmdGetTaskTrace {
+    
+    const UInt16 funcCode;
+    UInt16  reserved;
+    UInt32  sessionId;
+    UInt32  reserved2;
+    UInt32  reserved3;
+    UInt32  reserved4;
+    UInt32  reserved5;
+    
+} __attribute__((packed)) iSCSIDCmdGetTaskTrace;
+
+/*! Default initialization for a get task trace command. */
+extern const iSCSIDCmdGetTaskTrace iSCSIDCmdGetTaskTraceInit;
+
+/*! Response to command to get the records of a task trace. */
+typedef struct iSCSIDRspGetTaskTrace {
+    
+    const UInt8 funcCode;
+    UInt16 reserved;
+    UInt32 errorCode;
+    UInt8  reserved2;
+    UInt32 reserved3;
+    UInt32 reserved4;
+    UInt32 dataLength;
+    UInt32 reserved5;
+    
+} __attribute__((packed)) iSCSIDRspGetTaskTrace;
+
+
+
+/*! Command to enable or disable the PDU traces of a session. */
+typedef struct iSCSIDCmdSetPDUTrace {
+    
+    const UInt16 funcCode;
+    UInt16  reserved;
+    UInt32  sessionId;
+    UInt32  enable;
+    UInt32  reserved2;
+    UInt32  reserved3;
+    UInt32  reserved4;
+    
+} __attribute__((packed)) iSCSIDCmdSetPDUTrace;
+
+/*! Default initialization for a set PDU trace command. */
+extern const iSCSIDCmdSetPDUTrace iSCSIDCmdSetPDUTraceInit;
+
+/*! Response to command to enable or disable the PDU traces of a session. */
+typedef struct iSCSIDRspSetPDUTrace {
+    
+    const UInt8 funcCode;
+    UInt16 reserved;
+    UInt32 errorCode;
+    UInt8  reserved2;
+    UInt32 reserved3;
+    UInt32 reserved4;
+    UInt32 reserved5;
+    UInt32 reserved6;
+    
+} __attribute__((packed)) iSCSIDRspSetPDUTrace;
+
+
 ////////////////////////////// DAEMON FUNCTIONS ////////////////////////////////
 
 enum iSCSIDFunctionCodes {
@@ -548,6 +676,10 @@ enum iSCSIDFunctionCodes {
     kiSCSIDSetInitiatorIQN = 14,
     kiSCSIDSetInitiatorAlias = 15,
     kiSCSIDShutdownDaemon = 16,
+    kiSCSIDGetLatencyHistogram = 17,
+    kiSCSIDSetTaskTraceInterval = 18,
+    kiSCSIDGetTaskTrace = 19,
+    kiSCSIDSetPDUTrace = 20,
     kiSCSIDInvalidFunctionCode
 };
 
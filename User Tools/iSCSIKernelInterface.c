@@ -16,6 +16,7 @@
 
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IOReturn.h>
+#include <libkern/OSAtomic.h>
 
 static io_service_t service;
 static io_connect_t connection;
@@ -23,6 +24,14 @@ static CFMachPortContext notificationContext;
 static CFMachPortRef     notificationPort;
 static iSCSIKernelNotificationCallback callback;
 
+/*! Connection that PDU traces are mapped through.  It is separate from the
+ *  connection above so that mappings outlive iSCSIKernelCleanup(), and is
+ *  closed once the last trace has been unmapped. */
+static io_connect_t traceConnection = IO_OBJECT_NULL;
+
+/*! Number of PDU traces mapped through traceConnection. */
+static UInt32 traceMappingCount = 0;
+
 /*! Select error codes used by the iSCSI user client. */
 errno_t IOReturnToErrno(kern_return_t result)
 {
@@ -868,5 +877,270 @@ CFStringRef iSCSIKernelCreateHostInterfaceForConnectionId(SID sessionId,CID conn
     return CFStringCreateWithCString(kCFAllocatorDefault,hostInterface,kCFStringEncodingASCII);
 }
 
+/*! Gets command window statistics associated with a particular session.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param stats the statistics to get.  The user of this function is
+ *  responsible for allocating and freeing the statistics struct.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelGetSessionStatistics(SID sessionId,iSCSIKernelSessionStats * stats)
+{
+    // Check parameters
+    if(sessionId == kiSCSIInvalidSessionId || !stats)
+        return EINVAL;
+    
+    const UInt32 inputCnt = 1;
+    const UInt64 input = sessionId;
+    size_t statsSize = sizeof(struct iSCSIKernelSessionStats);
+    
+    return IOReturnToErrno(IOConnectCallMethod(connection,kiSCSIGetSessionStatistics,&input,inputCnt,
+                                               0,0,0,0,stats,&statsSize));
+}
+
+/*! Gets usage statistics of the kernel's preallocated pools (task queue
+ *  nodes and PDU buffers), including high-water marks.
+ *  @param stats the statistics to get.  The user of this function is
+ *  responsible for allocating and freeing the statistics struct.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelGetPoolStatistics(iSCSIKernelPoolStats * stats)
+{
+    // Check parameters
+    if(!stats)
+        return EINVAL;
+    
+    size_t statsSize = sizeof(struct iSCSIKernelPoolStats);
+    
+    return IOReturnToErrno(IOConnectCallMethod(connection,kiSCSIGetPoolStatistics,0,0,
+                                               0,0,0,0,stats,&statsSize));
+}
+
+/*! Gets throughput, task rate and round-trip time estimates of a connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param connectionId the connection associated with the session.
+ *  @param stats the statistics to get.  The user of this function is
+ *  responsible for allocating and freeing the statistics struct.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelGetConnectionStatistics(SID sessionId,CID connectionId,
+                                           iSCSIKernelConnectionStats * stats)
+{
+    // Check parameters
+    if(sessionId == kiSCSIInvalidSessionId || connectionId == kiSCSIInvalidConnectionId || !stats)
+        return EINVAL;
+    
+    const UInt32 inputCnt = 2;
+    const UInt64 input[] = {sessionId,connectionId};
+    size_t statsSize = sizeof(struct iSCSIKernelConnectionStats);
+    
+    return IOReturnToErrno(IOConnectCallMethod(connection,kiSCSIGetConnectionStatistics,input,inputCnt,
+                                               0,0,0,0,stats,&statsSize));
+}
+
+/*! Gets a task latency histogram of a connection or a LUN.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param scope one of the iSCSILatencyScopes values.
+ *  @param identifier the connection identifier or LUN, depending on scope.
+ *  @param category one of the iSCSILatencyCategories values, or one of the
+ *  iSCSITaskStages values for stage histograms.
+ *  @param histogram the histogram to get.  The user of this function is
+ *  responsible for allocating and freeing the histogram struct.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelGetLatencyHistogram(SID sessionId,UInt32 scope,UInt64 identifier,
+                                       UInt32 category,iSCSIKernelLatencyHistogram * histogram)
+{
+    // Check parameters
+    if(sessionId == kiSCSIInvalidSessionId || !histogram)
+        return EINVAL;
+    
+    const UInt32 inputCnt = 4;
+    const UInt64 input[] = {sessionId,scope,identifier,category};
+    size_t histogramSize = sizeof(struct iSCSIKernelLatencyHistogram);
+    
+    return IOReturnToErrno(IOConnectCallMethod(connection,kiSCSIGetLatencyHistogram,input,inputCnt,
+                                               0,0,0,0,histogram,&histogramSize));
+}
+
+/*! Sets how often completed tasks of a session are sampled into the
+ *  session's task trace.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param interval one in every interval tasks is sampled (0 disables the
+ *  task trace).
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelSetTaskTraceInterval(SID sessionId,UInt32 interval)
+{
+    // Check parameters
+    if(sessionId == kiSCSIInvalidSessionId)
+        return EINVAL;
+    
+    const UInt32 inputCnt = 2;
+    const UInt64 input[] = {sessionId,interval};
+    
+    return IOReturnToErrno(IOConnectCallScalarMethod(connection,kiSCSISetTaskTraceInterval,
+                                                     input,inputCnt,0,0));
+}
+
+/*! Removes and gets the records of a session's task trace.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param trace the records to get.  The user of this function is
+ *  responsible for allocating and freeing the trace struct.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelGetTaskTrace(SID sessionId,iSCSIKernelTaskTrace * trace)
+{
+    // Check parameters
+    if(sessionId == kiSCSIInvalidSessionId || !trace)
+        return EINVAL;
+    
+    const UInt32 inputCnt = 1;
+    const UInt64 input = sessionId;
+    size_t traceSize = sizeof(struct iSCSIKernelTaskTrace);
+    
+    return IOReturnToErrno(IOConnectCallMethod(connection,kiSCSIGetTaskTrace,&input,inputCnt,
+                                               0,0,0,0,trace,&traceSize));
+}
+
+/*! Enables or disables the PDU trace of a connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param connectionId the connection identifier.
+ *  @param enable true to start recording PDUs, false to stop.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelSetPDUTraceEnabled(SID sessionId,CID connectionId,Boolean enable)
+{
+    // Check parameters
+    if(sessionId == kiSCSIInvalidSessionId || connectionId == kiSCSIInvalidConnectionId)
+        return EINVAL;
+    
+    const UInt32 inputCnt = 3;
+    const UInt64 input[] = {sessionId,connectionId,enable};
+    
+    return IOReturnToErrno(IOConnectCallScalarMethod(connection,kiSCSISetPDUTraceEnabled,
+                                                     input,inputCnt,0,0));
+}
+
+/*! Maps the PDU trace of a connection into this process (read-only).  The
+ *  trace must have been enabled at least once.  Mappings remain valid after
+ *  iSCSIKernelCleanup() until they are unmapped.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param connectionId the connection identifier.
+ *  @param trace the mapped trace (returned).
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelMapPDUTrace(SID sessionId,CID connectionId,
+                               const iSCSIKernelPDUTrace ** trace)
+{
+    // Check parameters
+    if(sessionId == kiSCSIInvalidSessionId || connectionId == kiSCSIInvalidConnectionId || !trace)
+        return EINVAL;
+    
+    IOReturn result;
+    
+    if(traceConnection == IO_OBJECT_NULL)
+    {
+        io_service_t traceService =
+            IOServiceGetMatchingService(kIOMasterPortDefault,
+                                        IOServiceMatching(kiSCSIVirtualHBA_IOClassName));
+        
+        if(traceService == IO_OBJECT_NULL)
+            return ENODEV;
+        
+        result = IOServiceOpen(traceService,mach_task_self(),0,&traceConnection);
+        IOObjectRelease(traceService);
+        
+        if(result != kIOReturnSuccess) {
+            traceConnection = IO_OBJECT_NULL;
+            return IOReturnToErrno(result);
+        }
+    }
+    
+    mach_vm_address_t address = 0;
+    mach_vm_size_t size = 0;
+    
+    result = IOConnectMapMemory64(traceConnection,
+                                  iSCSIKernelPDUTraceMemoryType(sessionId,connectionId),
+                                  mach_task_self(),&address,&size,
+                                  kIOMapAnywhere | kIOMapReadOnly);
+    
+    if(result == kIOReturnSuccess && size < sizeof(iSCSIKernelPDUTrace)) {
+        IOConnectUnmapMemory64(traceConnection,iSCSIKernelPDUTraceMemoryType(sessionId,connectionId),
+                               mach_task_self(),address);
+        result = kIOReturnNoSpace;
+    }
+    
+    if(result != kIOReturnSuccess)
+    {
+        if(traceMappingCount == 0) {
+            IOServiceClose(traceConnection);
+            traceConnection = IO_OBJECT_NULL;
+        }
+        return IOReturnToErrno(result);
+    }
+    
+    traceMappingCount++;
+    *trace = (const iSCSIKernelPDUTrace *)(uintptr_t)address;
+    return 0;
+}
+
+/*! Unmaps the PDU trace of a connection that was mapped using
+ *  iSCSIKernelMapPDUTrace().  The trace remains valid in the kernel.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param connectionId the connection identifier.
+ *  @param trace the mapped trace. */
+void iSCSIKernelUnmapPDUTrace(SID sessionId,CID connectionId,
+                              const iSCSIKernelPDUTrace * trace)
+{
+    if(!trace || traceConnection == IO_OBJECT_NULL)
+        return;
+    
+    IOConnectUnmapMemory64(traceConnection,iSCSIKernelPDUTraceMemoryType(sessionId,connectionId),
+                           mach_task_self(),(mach_vm_address_t)(uintptr_t)trace);
+    
+    if(--traceMappingCount == 0) {
+        IOServiceClose(traceConnection);
+        traceConnection = IO_OBJECT_NULL;
+    }
+}
+
+/*! Copies the records of a PDU trace ring that were written since a
+ *  position.  Records that were overwritten by the kernel before they could
+ *  be copied are counted as dropped.  Never blocks the kernel.
+ *  @param ring the ring to read (see iSCSIKernelMapPDUTrace()).
+ *  @param position the position of the next record to read.  Updated to
+ *  the position following the last record read or dropped.
+ *  @param records the records that were read (returned).
+ *  @param maxRecords the maximum number of records to read.
+ *  @param dropped incremented by the number of records that were dropped.
+ *  @return the number of records read. */
+UInt32 iSCSIKernelReadPDUTrace(const iSCSIKernelPDUTraceRing * ring,
+                               UInt64 * position,
+                               iSCSIKernelPDUTraceRecord * records,
+                               UInt32 maxRecords,
+                               UInt64 * dropped)
+{
+    UInt64 head = ring->head;
+    OSMemoryBarrier();
+    
+    // Skip records that have already been overwritten
+    if(head - *position > kiSCSIPDUTraceRecords) {
+        *dropped += head - *position - kiSCSIPDUTraceRecords;
+        *position = head - kiSCSIPDUTraceRecords;
+    }
+    
+    UInt32 count = 0;
+    
+    while(*position < head && count < maxRecords)
+    {
+        const iSCSIKernelPDUTraceRecord * record =
+            &ring->records[*position & (kiSCSIPDUTraceRecords-1)];
+        
+        records[count] = *record;
+        OSMemoryBarrier();
+        
+        // The copy is only valid if the record was not rewritten meanwhile
+        if(records[count].sequence == *position + 1 && record->sequence == *position + 1)
+            count++;
+        else
+            (*dropped)++;
+        
+        (*position)++;
+    }
+    return count;
+}
+
 
 
@@ -252,5 +252,96 @@ CFStringRef iSCSIKernelCreatePortalPortForConnectionId(SID sessionId,CID connect
  *  session or connection was invalid. */
 CFStringRef iSCSIKernelCreateHostInterfaceForConnectionId(SID sessionId,CID connectionId);
 
+/*! Gets command window statistics associated with a particular session.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param stats the statistics to get.  The user of this function is
+ *  responsible for allocating and freeing the statistics struct.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelGetSessionStatistics(SID sessionId,iSCSIKernelSessionStats * stats);
+
+/*! Gets usage statistics of the kernel's preallocated pools (task queue
+ *  nodes and PDU buffers), including high-water marks.
+ *  @param stats the statistics to get.  The user of this function is
+ *  responsible for allocating and freeing the statistics struct.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelGetPoolStatistics(iSCSIKernelPoolStats * stats);
+
+/*! Gets throughput, task rate and round-trip time estimates of a connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param connectionId the connection associated with the session.
+ *  @param stats the statistics to get.  The user of this function is
+ *  responsible for allocating and freeing the statistics struct.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelGetConnectionStatistics(SID sessionId,CID connectionId,
+                                           iSCSIKernelConnectionStats * stats);
+
+/*! Gets a task latency histogram of a connection or a LUN.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param scope one of the iSCSILatencyScopes values.
+ *  @param identifier the connection identifier or LUN, depending on scope.
+ *  @param category one of the iSCSILatencyCategories values, or one of the
+ *  iSCSITaskStages values for stage histograms.
+ *  @param histogram the histogram to get.  The user of this function is
+ *  responsible for allocating and freeing the histogram struct.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelGetLatencyHistogram(SID sessionId,UInt32 scope,UInt64 identifier,
+                                       UInt32 category,iSCSIKernelLatencyHistogram * histogram);
+
+/*! Sets how often completed tasks of a session are sampled into the
+ *  session's task trace.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param interval one in every interval tasks is sampled (0 disables the
+ *  task trace).
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelSetTaskTraceInterval(SID sessionId,UInt32 interval);
+
+/*! Removes and gets the records of a session's task trace.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param trace the records to get.  The user of this function is
+ *  responsible for allocating and freeing the trace struct.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelGetTaskTrace(SID sessionId,iSCSIKernelTaskTrace * trace);
+
+/*! Enables or disables the PDU trace of a connection.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param connectionId the connection identifier.
+ *  @param enable true to start recording PDUs, false to stop.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelSetPDUTraceEnabled(SID sessionId,CID connectionId,Boolean enable);
+
+/*! Maps the PDU trace of a connection into this process (read-only).  The
+ *  trace must have been enabled at least once.  Mappings remain valid after
+ *  iSCSIKernelCleanup() until they are unmapped.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param connectionId the connection identifier.
+ *  @param trace the mapped trace (returned).
+ *  @return error code indicating result of operation. */
+errno_t iSCSIKernelMapPDUTrace(SID sessionId,CID connectionId,
+                               const iSCSIKernelPDUTrace ** trace);
+
+/*! Unmaps the PDU trace of a connection that was mapped using
+ *  iSCSIKernelMapPDUTrace().  The trace remains valid in the kernel.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param connectionId the connection identifier.
+ *  @param trace the mapped trace. */
+void iSCSIKernelUnmapPDUTrace(SID sessionId,CID connectionId,
+                              const iSCSIKernelPDUTrace * trace);
+
+/*! Copies the records of a PDU trace ring that were written since a
+ *  position.  Records that were overwritten by the kernel before they could
+ *  be copied are counted as dropped.  Never blocks the kernel.
+ *  @param ring the ring to read (see iSCSIKernelMapPDUTrace()).
+ *  @param position the position of the next record to read.  Updated to
+ *  the position following the last record read or dropped.
+ *  @param records the records that were read (returned).
+ *  @param maxRecords the maximum number of records to read.
+ *  @param dropped incremented by the number of records that were dropped.
+ *  @return the number of records read. */
+UInt32 iSCSIKernelReadPDUTrace(const iSCSIKernelPDUTraceRing * ring,
+                               UInt64 * position,
+                               iSCSIKernelPDUTraceRecord * records,
+                               UInt32 maxRecords,
+                               UInt64 * dropped);
+
 
 #endif /* defined(__ISCSI_KERNEL_INTERFACE_H__) */
@@ -0,0 +1,63 @@
+/*!
+ * @author		Nareg Sinenian
+ * @file		iSCSILatencyHistogram.h
+ * @version		1.0
+ * @copyright	(c) 2013-2015 Nareg Sinenian. All rights reserved.
+ * @brief		Bucket layout of the latency histograms kept by the kernel.
+ *              This header has no dependencies other than the UInt32 and
+ *              UInt64 types, so that it can be tested on the host.
+ */
+
+#ifndef __ISCSI_LATENCY_HISTOGRAM_H__
+#define __ISCSI_LATENCY_HISTOGRAM_H__
+
+/*! Latency histograms are log-linear: each power of two is divided into
+ *  2^(kiSCSILatencyHistogramSubBucketBits-1) equal buckets, so that any
+ *  recorded value is within 1/2^(kiSCSILatencyHistogramSubBucketBits-1)
+ *  (about 6%) of the lower bound of its bucket. */
+static const UInt32 kiSCSILatencyHistogramSubBucketBits = 5;
+
+/*! Number of buckets in a latency histogram; this covers latencies from
+ *  1 microsecond to 2^32 microseconds (larger values are clamped). */
+static const UInt32 kiSCSILatencyHistogramBuckets = 464;
+
+/*! Gets the latency histogram bucket that a latency is recorded in.
+ *  @param latencyUs the latency, in microseconds.
+ *  @return the bucket index. */
+static inline UInt32 iSCSILatencyHistogramGetBucket(UInt64 latencyUs)
+{
+    const UInt32 subBuckets = 1 << kiSCSILatencyHistogramSubBucketBits;
+    const UInt32 halfSubBuckets = subBuckets >> 1;
+    
+    if(latencyUs > 0xFFFFFFFF)
+        latencyUs = 0xFFFFFFFF;
+    
+    // Values below the first power of two are recorded exactly
+    if(latencyUs < subBuckets)
+        return (UInt32)latencyUs;
+    
+    UInt32 exponent = 63 - __builtin_clzll(latencyUs);
+    UInt32 subBucket = (UInt32)(latencyUs >> (exponent - kiSCSILatencyHistogramSubBucketBits + 1));
+    
+    return subBuckets + (exponent - kiSCSILatencyHistogramSubBucketBits)*halfSubBuckets +
+           (subBucket - halfSubBuckets);
+}
+
+/*! Gets the smallest latency that is recorded in a latency histogram bucket.
+ *  @param bucket the bucket index.
+ *  @return the latency, in microseconds. */
+static inline UInt64 iSCSILatencyHistogramGetBucketValue(UInt32 bucket)
+{
+    const UInt32 subBuckets = 1 << kiSCSILatencyHistogramSubBucketBits;
+    const UInt32 halfSubBuckets = subBuckets >> 1;
+    
+    if(bucket < subBuckets)
+        return bucket;
+    
+    UInt32 exponent = (bucket - subBuckets)/halfSubBuckets + kiSCSILatencyHistogramSubBucketBits;
+    UInt64 subBucket = (bucket - subBuckets)%halfSubBuckets + halfSubBuckets;
+    
+    return subBucket << (exponent - kiSCSILatencyHistogramSubBucketBits + 1);
+}
+
+#endif /* defined(__ISCSI_LATENCY_HISTOGRAM_H__) */
@@ -30,6 +30,52 @@ CFStringRef kiSCSIInitiatorAlias = CFSTR("default");
  *  to produce the data section of text and login PDUs. */
 const unsigned int kiSCSISessionMaxTextKeyValuePairs = 100;
 
+/*! A PDU trace of a connection that is mapped into this process. */
+typedef struct iSCSIPDUTraceMapping {
+    
+    /*! The mapped trace, or NULL if the trace is not mapped. */
+    const iSCSIKernelPDUTrace * trace;
+    
+    /*! Position of the next record to drain from each ring. */
+    UInt64 position[kiSCSIPDUTraceDirectionCount];
+    
+    /*! Indicates whether the trace is still enabled.  Disabled traces are
+     *  unmapped once their remaining records have been drained. */
+    Boolean enabled;
+    
+} iSCSIPDUTraceMapping;
+
+/*! Mapped PDU traces, indexed by session and connection identifier. */
+static iSCSIPDUTraceMapping * iSCSIPDUTraceMappings = NULL;
+
+/*! Gets the PDU trace mapping of a connection.
+ *  @param sessionId the session identifier.
+ *  @param connectionId the connection identifier.
+ *  @return the mapping. */
+static iSCSIPDUTraceMapping * iSCSIGetPDUTraceMapping(SID sessionId,CID connectionId)
+{
+    return &iSCSIPDUTraceMappings[sessionId*kiSCSIMaxConnectionsPerSession + connectionId];
+}
+
+/*! Unmaps the PDU trace of a connection, if it is mapped.  Called before a
+ *  connection is released, as its identifier may be reused.
+ *  @param sessionId the session identifier.
+ *  @param connectionId the connection identifier. */
+static void iSCSIReleasePDUTrace(SID sessionId,CID connectionId)
+{
+    if(!iSCSIPDUTraceMappings || sessionId >= kiSCSIMaxSessions ||
+       connectionId >= kiSCSIMaxConnectionsPerSession)
+        return;
+    
+    iSCSIPDUTraceMapping * mapping = iSCSIGetPDUTraceMapping(sessionId,connectionId);
+    
+    if(!mapping->trace)
+        return;
+    
+    iSCSIKernelUnmapPDUTrace(sessionId,connectionId,mapping->trace);
+    memset(mapping,0,sizeof(iSCSIPDUTraceMapping));
+}
+
 /*! Helper function used during session negotiation.  Returns true if BOTH
  *  the command and the response strings are "Yes" */
 Boolean iSCSILVGetEqual(CFStringRef cmdStr,CFStringRef rspStr)
@@ -135,7 +181,7 @@ void iSCSINegotiateBuildSWDictNormal(iSCSISessionConfigRef sessCfg,
     CFDictionaryAddValue(sessCmd,kiSCSILKFirstBurstLength,value);
     CFRelease(value);
     
-    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_MaxOutstandingR2T);
+    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kiSCSIMaxOutstandingR2T);
     CFDictionaryAddValue(sessCmd,kiSCSILKMaxOutstandingR2T,value);
     CFRelease(value);
     
@@ -771,6 +817,7 @@ errno_t iSCSILogoutConnection(SID sessionId,
     error = iSCSISessionLogoutCommon(sessionId,connectionId,kISCSIPDULogoutCloseConnection,statusCode);
 
     // Release the connection in the kernel
+    iSCSIReleasePDUTrace(sessionId,connectionId);
     iSCSIKernelReleaseConnection(sessionId,connectionId);
     
     return error;
@@ -908,6 +955,9 @@ errno_t iSCSILogoutSession(SID sessionId,
         error = iSCSISessionLogoutCommon(sessionId, connectionId,kiSCSIPDULogoutCloseSession,statusCode);
 
     // Release all of the connections in the kernel by releasing the session
+    for(connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++)
+        iSCSIReleasePDUTrace(sessionId,connectionId);
+    
     iSCSIKernelReleaseSession(sessionId);
     
     return error;
@@ -1273,6 +1323,173 @@ iSCSIConnectionConfigRef iSCSICopyConnectionConfig(SID sessionId,CID connectionI
     return connCfg;
 }
 
+/*! Gets a task latency histogram of a connection or a LUN.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param scope one of the iSCSILatencyScopes values.
+ *  @param identifier the connection identifier or LUN, depending on scope.
+ *  @param category one of the iSCSILatencyCategories values, or one of the
+ *  iSCSITaskStages values for stage histograms.
+ *  @param histogram the histogram to get.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIGetLatencyHistogram(SID sessionId,UInt32 scope,UInt64 identifier,
+                                 UInt32 category,iSCSIKernelLatencyHistogram * histogram)
+{
+    if(sessionId == kiSCSIInvalidSessionId || !histogram)
+        return EINVAL;
+    
+    return iSCSIKernelGetLatencyHistogram(sessionId,scope,identifier,category,histogram);
+}
+
+/*! Sets how often completed tasks of a session are sampled into the
+ *  session's task trace.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param interval one in every interval tasks is sampled (0 disables the
+ *  task trace).
+ *  @return error code indicating result of operation. */
+errno_t iSCSISetTaskTraceInterval(SID sessionId,UInt32 interval)
+{
+    if(sessionId == kiSCSIInvalidSessionId)
+        return EINVAL;
+    
+    return iSCSIKernelSetTaskTraceInterval(sessionId,interval);
+}
+
+/*! Removes and gets the records of a session's task trace.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param trace the records to get.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIGetTaskTrace(SID sessionId,iSCSIKernelTaskTrace * trace)
+{
+    if(sessionId == kiSCSIInvalidSessionId || !trace)
+        return EINVAL;
+    
+    return iSCSIKernelGetTaskTrace(sessionId,trace);
+}
+
+/*! Enables or disables the PDU traces of the connections of a session.
+ *  The traces of enabled connections are mapped into this process so that
+ *  they can be drained using iSCSIDrainPDUTraces().  Connections that are
+ *  added to the session later are not traced.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param enable true to start recording PDUs, false to stop.
+ *  @return error code indicating result of operation. */
+errno_t iSCSISetPDUTraceEnabled(SID sessionId,Boolean enable)
+{
+    if(sessionId >= kiSCSIMaxSessions)
+        return EINVAL;
+    
+    if(!iSCSIPDUTraceMappings)
+        iSCSIPDUTraceMappings = calloc(kiSCSIMaxSessions*kiSCSIMaxConnectionsPerSession,
+                                       sizeof(iSCSIPDUTraceMapping));
+    if(!iSCSIPDUTraceMappings)
+        return ENOMEM;
+    
+    CID connectionIds[kiSCSIMaxConnectionsPerSession];
+    UInt32 connectionCount = 0;
+    
+    errno_t error = iSCSIKernelGetConnectionIds(sessionId,connectionIds,&connectionCount);
+    
+    for(UInt32 index = 0; !error && index < connectionCount; index++)
+    {
+        CID connectionId = connectionIds[index];
+        
+        if(connectionId >= kiSCSIMaxConnectionsPerSession)
+            continue;
+        
+        if((error = iSCSIKernelSetPDUTraceEnabled(sessionId,connectionId,enable)))
+            break;
+        
+        iSCSIPDUTraceMapping * mapping = iSCSIGetPDUTraceMapping(sessionId,connectionId);
+        mapping->enabled = enable;
+        
+        if(!enable || mapping->trace)
+            continue;
+        
+        if((error = iSCSIKernelMapPDUTrace(sessionId,connectionId,&mapping->trace)))
+            break;
+        
+        // Only drain records written from now on
+        for(UInt32 direction = 0; direction < kiSCSIPDUTraceDirectionCount; direction++)
+            mapping->position[direction] = mapping->trace->rings[direction].head;
+    }
+    return error;
+}
+
+/*! Gets whether any PDU traces are mapped into this process.
+ *  @return true if there are PDU traces to drain. */
+Boolean iSCSIHasPDUTraces()
+{
+    if(!iSCSIPDUTraceMappings)
+        return false;
+    
+    for(UInt32 index = 0; index < kiSCSIMaxSessions*kiSCSIMaxConnectionsPerSession; index++)
+        if(iSCSIPDUTraceMappings[index].trace)
+            return true;
+    
+    return false;
+}
+
+/*! Writes the records of all mapped PDU traces that were recorded since
+ *  the last call to a file, one line per PDU.  Traces that were disabled
+ *  are unmapped once drained.
+ *  @param file the file to write to.
+ *  @return the number of records written. */
+UInt32 iSCSIDrainPDUTraces(FILE * file)
+{
+    static const char * directionNames[kiSCSIPDUTraceDirectionCount] = {"sent","recv"};
+    iSCSIKernelPDUTraceRecord records[64];
+    UInt32 written = 0;
+    
+    if(!iSCSIPDUTraceMappings || !file)
+        return 0;
+    
+    for(SID sessionId = 0; sessionId < kiSCSIMaxSessions; sessionId++)
+    {
+        for(CID connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++)
+        {
+            iSCSIPDUTraceMapping * mapping = iSCSIGetPDUTraceMapping(sessionId,connectionId);
+            
+            if(!mapping->trace)
+                continue;
+            
+            for(UInt32 direction = 0; direction < kiSCSIPDUTraceDirectionCount; direction++)
+            {
+                const iSCSIKernelPDUTraceRing * ring = &mapping->trace->rings[direction];
+                UInt64 dropped = 0;
+                UInt32 count;
+                
+                while((count = iSCSIKernelReadPDUTrace(ring,&mapping->position[direction],records,
+                                                       sizeof(records)/sizeof(records[0]),&dropped)))
+                {
+                    for(UInt32 index = 0; index < count; index++)
+                    {
+                        const iSCSIKernelPDUTraceRecord * record = &records[index];
+                        
+                        fprintf(file,"%llu.%09llu %u:%u %s op 0x%02x flags 0x%02x itt 0x%08x "
+                                "sn %u expsn %u len %u\n",
+                                record->timestampNs / 1000000000ULL,
+                                record->timestampNs % 1000000000ULL,
+                                sessionId,connectionId,directionNames[direction],
+                                record->opCode,record->flags,record->initiatorTaskTag,
+                                record->sequenceNumber,record->expSequenceNumber,
+                                record->dataLength);
+                    }
+                    written += count;
+                }
+                
+                if(dropped)
+                    fprintf(file,"%u:%u %s dropped %llu records\n",
+                            sessionId,connectionId,directionNames[direction],dropped);
+            }
+            
+            if(!mapping->enabled)
+                iSCSIReleasePDUTrace(sessionId,connectionId);
+        }
+    }
+    fflush(file);
+    return written;
+}
+
 /*! Sets the name of this initiator.  This is the IQN-format name that is
  *  exchanged with a target during negotiation.
  *  @param initiatorIQN the initiator name. */
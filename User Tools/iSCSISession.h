@@ -13,6 +13,7 @@
 #define __ISCSI_SESSION_H__
 
 #include <CoreFoundation/CoreFoundation.h>
+#include <stdio.h>
 #include <netdb.h>
 #include <ifaddrs.h>
 
@@ -158,6 +159,51 @@ iSCSISessionConfigRef iSCSICopySessionConfig(SID sessionId);
  *  @return  the configuration object associated with the specified connection. */
 iSCSIConnectionConfigRef iSCSICopyConnectionConfig(SID sessionId,CID connectionId);
 
+/*! Gets a task latency histogram of a connection or a LUN.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param scope one of the iSCSILatencyScopes values.
+ *  @param identifier the connection identifier or LUN, depending on scope.
+ *  @param category one of the iSCSILatencyCategories values, or one of the
+ *  iSCSITaskStages values for stage histograms.
+ *  @param histogram the histogram to get.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIGetLatencyHistogram(SID sessionId,UInt32 scope,UInt64 identifier,
+                                 UInt32 category,iSCSIKernelLatencyHistogram * histogram);
+
+/*! Sets how often completed tasks of a session are sampled into the
+ *  session's task trace.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param interval one in every interval tasks is sampled (0 disables the
+ *  task trace).
+ *  @return error code indicating result of operation. */
+errno_t iSCSISetTaskTraceInterval(SID sessionId,UInt32 interval);
+
+/*! Removes and gets the records of a session's task trace.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param trace the records to get.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIGetTaskTrace(SID sessionId,iSCSIKernelTaskTrace * trace);
+
+/*! Enables or disables the PDU traces of the connections of a session.
+ *  The traces of enabled connections are mapped into this process so that
+ *  they can be drained using iSCSIDrainPDUTraces().  Connections that are
+ *  added to the session later are not traced.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param enable true to start recording PDUs, false to stop.
+ *  @return error code indicating result of operation. */
+errno_t iSCSISetPDUTraceEnabled(SID sessionId,Boolean enable);
+
+/*! Gets whether any PDU traces are mapped into this process.
+ *  @return true if there are PDU traces to drain. */
+Boolean iSCSIHasPDUTraces();
+
+/*! Writes the records of all mapped PDU traces that were recorded since
+ *  the last call to a file, one line per PDU.  Traces that were disabled
+ *  are unmapped once drained.
+ *  @param file the file to write to.
+ *  @return the number of records written. */
+UInt32 iSCSIDrainPDUTraces(FILE * file);
+
 /*! Sets the name of this initiator.  This is the IQN-format name that is
  *  exchanged with a target during negotiation.
  *  @param initiatorIQN the initiator name. */
@@ -10,6 +10,8 @@
 #ifndef __ISCSI_TYPES_SHARED_H__
 #define __ISCSI_TYPES_SHARED_H__
 
+#include "iSCSILatencyHistogram.h"
+
 /*! Session identifier. */
 typedef UInt16 SID;
 
@@ -32,7 +34,35 @@ static const UInt32 kiSCSIInvalidConnectionId = 0xFFFFFFFF;
 static const UInt16 kiSCSIMaxSessions = 16;
 
 /*! Max number of connections per session. */
-static const UInt32 kiSCSIMaxConnectionsPerSession = 2;
+static const UInt32 kiSCSIMaxConnectionsPerSession = 8;
+
+/*! Max number of R2Ts that may be outstanding per task (this is the value
+ *  offered for MaxOutstandingR2T during login). */
+static const UInt16 kiSCSIMaxOutstandingR2T = 4;
+
+/*! Policies used to select the connection that carries a new SCSI task when
+ *  a session has multiple connections (MC/S). */
+enum iSCSIConnectionSchedulingPolicies {
+    
+    /*! Tasks are assigned to active connections in turn. */
+    kiSCSIConnectionSchedulingRoundRobin = 0,
+    
+    /*! Tasks are assigned to the connection with the fewest bytes
+     *  outstanding (requested but not yet completed). */
+    kiSCSIConnectionSchedulingLeastOutstandingBytes = 1,
+    
+    /*! Tasks are assigned to the connection that is expected to finish
+     *  its outstanding transfers first, based on its measured bandwidth. */
+    kiSCSIConnectionSchedulingBandwidthWeighted = 2
+};
+
+/*! Largest poll budget (in microseconds) accepted for a session; the
+ *  session's workloop can't process other events while it polls. */
+static const UInt32 kiSCSIMaxPollBudgetUs = 1000;
+
+/*! Largest share of time (in percent) that a session's workloop may spend
+ *  polling. */
+static const UInt8 kiSCSIMaxPollCPUPercent = 50;
 
 /*! Struct used to set session-wide options in the kernel. */
 typedef struct iSCSIKernelSessionCfg
@@ -76,6 +106,41 @@ typedef struct iSCSIKernelSessionCfg
     /*! Target portal group tag. */
     TPGT targetPortalGroupTag;
     
+    /*! Policy used to distribute tasks across connections (see the
+     *  enumerated type iSCSIConnectionSchedulingPolicies). */
+    UInt8 connectionSchedulingPolicy;
+    
+    /*! Shortest timeout, in milliseconds, given to a task.  Task timeouts
+     *  are derived from the round-trip time of the connection and the size
+     *  of the transfer, and are limited to this floor. */
+    UInt32 taskTimeoutMinMs;
+    
+    /*! Longest timeout, in milliseconds, given to a task. */
+    UInt32 taskTimeoutMaxMs;
+    
+    /*! Completed tasks are held back and handed to the SCSI stack together
+     *  at the end of each receive batch.  Once this many tasks have been
+     *  held they are handed over right away (0 for no limit). */
+    UInt16 completionCoalesceCount;
+    
+    /*! Longest time, in microseconds, that completed tasks are held back
+     *  after a receive batch ends in the hope of handing over more tasks
+     *  at once.  With 0, completions are handed over as each receive batch
+     *  ends. */
+    UInt32 completionCoalesceUs;
+    
+    /*! Time, in microseconds, that the session's workloop spins waiting for
+     *  responses (instead of waiting to be woken by the socket) after
+     *  commands have been sent or PDUs have been processed.  Polling is
+     *  disabled with 0; larger values are limited to kiSCSIMaxPollBudgetUs. */
+    UInt32 pollBudgetUs;
+    
+    /*! Largest share of time (in percent) that the session's workloop may
+     *  spend polling; once exceeded, polling is suspended for the remainder
+     *  of the measurement interval.  Larger values are limited to
+     *  kiSCSIMaxPollCPUPercent. */
+    UInt8 pollCPUPercent;
+    
 } iSCSIKernelSessionCfg;
 
 /*! Struct used to set connection-wide options in the kernel. */
@@ -105,8 +170,344 @@ typedef struct iSCSIKernelConnectionCfg
     /*! Maximum data segment length initiator can receive. */
     UInt32 maxRecvDataSegmentLength;
     
+    /*! Maximum number of SCSI tasks that may be outstanding on this
+     *  connection at any one time (subject to the command window). */
+    UInt16 queueDepth;
+    
 } iSCSIKernelConnectionCfg;
 
+/*! Struct used to retrieve session-wide statistics from the kernel. */
+typedef struct iSCSIKernelSessionStats
+{
+    /*! Number of commands issued (commands that consume a CmdSN). */
+    UInt64 commandsIssued;
+    
+    /*! Sum, over all commands issued, of the number of commands outstanding
+     *  at the target (CmdSN - ExpCmdSN) when each command was issued.  Dividing
+     *  this by windowSizeSum yields the average command window utilization. */
+    UInt64 windowInUseSum;
+    
+    /*! Sum, over all commands issued, of the command window size
+     *  (MaxCmdSN - ExpCmdSN + 1) when each command was issued. */
+    UInt64 windowSizeSum;
+    
+    /*! Number of times tasks were held because the command window closed. */
+    UInt64 windowStallCount;
+    
+    /*! Total time tasks were held waiting for the command window to open
+     *  (in microseconds). */
+    UInt64 windowStallTimeUs;
+    
+    /*! Current size of the command window (MaxCmdSN - ExpCmdSN + 1). */
+    UInt32 windowSize;
+    
+    /*! Largest number of commands outstanding at the target. */
+    UInt32 peakWindowInUse;
+    
+    /*! Number of PDUs sent on all connections of the session. */
+    UInt64 pdusSent;
+    
+    /*! Number of socket sends used to transmit those PDUs. */
+    UInt64 sendCount;
+    
+    /*! Number of tasks handed to the SCSI stack for completion. */
+    UInt64 completionsDelivered;
+    
+    /*! Number of batches in which those tasks were handed over. */
+    UInt64 completionBatches;
+    
+    /*! Number of times the session's workloop polled for a PDU. */
+    UInt64 polls;
+    
+    /*! Number of polls that found a PDU before the poll budget ran out. */
+    UInt64 pollHits;
+    
+    /*! Number of polls skipped because the CPU budget was used up. */
+    UInt64 pollsThrottled;
+    
+    /*! Total time spent polling (in microseconds). */
+    UInt64 pollTimeUs;
+    
+} iSCSIKernelSessionStats;
+
+/*! Struct used to retrieve throughput and latency estimates of a connection.
+ *  Rates are exponentially weighted moving averages measured over the time
+ *  that tasks of each direction were outstanding on the connection. */
+typedef struct iSCSIKernelConnectionStats
+{
+    /*! Read throughput, in bytes per second. */
+    UInt64 readBytesPerSecond;
+    
+    /*! Write throughput, in bytes per second. */
+    UInt64 writeBytesPerSecond;
+    
+    /*! Read tasks completed per second. */
+    UInt32 readIOPS;
+    
+    /*! Write tasks completed per second. */
+    UInt32 writeIOPS;
+    
+    /*! Number of read tasks completed. */
+    UInt64 readsCompleted;
+    
+    /*! Number of write tasks completed. */
+    UInt64 writesCompleted;
+    
+    /*! Number of bytes read. */
+    UInt64 bytesRead;
+    
+    /*! Number of bytes written. */
+    UInt64 bytesWritten;
+    
+    /*! Smoothed round-trip time, in microseconds. */
+    UInt32 smoothedRTTUs;
+    
+    /*! Round-trip time variation, in microseconds. */
+    UInt32 RTTVarianceUs;
+    
+} iSCSIKernelConnectionStats;
+
+/*! Commands whose latencies are recorded in separate histograms. */
+enum iSCSILatencyCategories {
+    
+    /*! READ commands. */
+    kiSCSILatencyRead = 0,
+    
+    /*! WRITE and WRITE AND VERIFY commands. */
+    kiSCSILatencyWrite = 1,
+    
+    /*! All other commands. */
+    kiSCSILatencyOther = 2,
+    
+    /*! Number of latency categories. */
+    kiSCSILatencyCategoryCount = 3
+};
+
+/*! Objects for which latency histograms are kept. */
+enum iSCSILatencyScopes {
+    
+    /*! Histograms of a connection (identified by its connection ID). */
+    kiSCSILatencyScopeConnection = 0,
+    
+    /*! Histograms of a LUN of a session (identified by its LUN). */
+    kiSCSILatencyScopeLUN = 1,
+    
+    /*! Histograms of the stages of tasks of a connection (identified by its
+     *  connection ID); the category is a value of iSCSITaskStages. */
+    kiSCSILatencyScopeStage = 2
+};
+
+/*! Stages that a task passes through.  The time spent in each stage is
+ *  recorded separately, so that the latency of a task can be attributed to
+ *  queuing in the initiator, the network or the target. */
+enum iSCSITaskStages {
+    
+    /*! From when the SCSI stack hands the task to the HBA until the task is
+     *  started on the connection's workloop (queue wait). */
+    kiSCSITaskStageQueue = 0,
+    
+    /*! From when the task is started until its SCSI command PDU has been
+     *  built and sent. */
+    kiSCSITaskStageSend = 1,
+    
+    /*! From when the SCSI command PDU is sent until the first R2T, Data-In or
+     *  SCSI response PDU for the task is received (network and target). */
+    kiSCSITaskStageResponse = 2,
+    
+    /*! From the first PDU received for the task until its status is
+     *  received (data transfer). */
+    kiSCSITaskStageTransfer = 3,
+    
+    /*! From when the status is received until the task has been completed. */
+    kiSCSITaskStageCompletion = 4,
+    
+    /*! Number of task stages. */
+    kiSCSITaskStageCount = 5
+};
+
+/*! Struct used to retrieve a latency histogram from the kernel.  Latencies
+ *  are measured in microseconds from the time a task is started until it
+ *  completes. */
+typedef struct iSCSIKernelLatencyHistogram
+{
+    /*! Number of latencies recorded. */
+    UInt64 count;
+    
+    /*! Sum of all latencies recorded, in microseconds. */
+    UInt64 sumUs;
+    
+    /*! Largest latency recorded, in microseconds. */
+    UInt64 maxUs;
+    
+    /*! Number of latencies recorded in each bucket (see
+     *  iSCSILatencyHistogramGetBucket()). */
+    UInt64 buckets[kiSCSILatencyHistogramBuckets];
+    
+} iSCSIKernelLatencyHistogram;
+
+/*! Value of a stage in a task trace record if the task did not reach the
+ *  stage (e.g., because it was aborted). */
+static const UInt32 kiSCSITaskStageNotReached = 0xFFFFFFFF;
+
+/*! Maximum number of records retrieved from a task trace at once (this is
+ *  also the number of records that the kernel retains for each session). */
+static const UInt32 kiSCSITaskTraceRecords = 64;
+
+/*! A sampled task, as recorded by the kernel's task trace. */
+typedef struct iSCSIKernelTaskTraceRecord
+{
+    /*! System uptime when the task completed, in microseconds. */
+    UInt64 completionTimeUs;
+    
+    /*! LUN addressed by the task. */
+    UInt64 LUN;
+    
+    /*! Initiator task tag of the task. */
+    UInt32 initiatorTaskTag;
+    
+    /*! Number of bytes the task requested to transfer. */
+    UInt32 transferLength;
+    
+    /*! Time spent in each stage, in microseconds (see iSCSITaskStages), or
+     *  kiSCSITaskStageNotReached. */
+    UInt32 stageUs[kiSCSITaskStageCount];
+    
+    /*! Connection that the task ran on. */
+    UInt16 connectionId;
+    
+    /*! Latency category of the task (see iSCSILatencyCategories). */
+    UInt8 category;
+    
+    /*! SCSI service response the task was completed with. */
+    UInt8 serviceResponse;
+    
+} iSCSIKernelTaskTraceRecord;
+
+/*! Struct used to retrieve the records of a session's task trace.  Records
+ *  are returned oldest first and are removed from the trace. */
+typedef struct iSCSIKernelTaskTrace
+{
+    /*! Number of valid entries in records. */
+    UInt32 count;
+    
+    /*! Number of records that were overwritten before they were retrieved. */
+    UInt32 dropped;
+    
+    /*! The records. */
+    iSCSIKernelTaskTraceRecord records[kiSCSITaskTraceRecords];
+    
+} iSCSIKernelTaskTrace;
+
+/*! Directions of PDUs recorded by the PDU trace.  Each direction of a
+ *  connection is recorded in its own ring, so that every ring has a single
+ *  producer. */
+enum iSCSIPDUTraceDirections {
+    
+    /*! PDUs sent to the target. */
+    kiSCSIPDUTraceSent = 0,
+    
+    /*! PDUs received from the target. */
+    kiSCSIPDUTraceReceived = 1,
+    
+    /*! Number of PDU trace directions. */
+    kiSCSIPDUTraceDirectionCount = 2
+};
+
+/*! Number of records in each ring of a PDU trace (a power of two). */
+static const UInt32 kiSCSIPDUTraceRecords = 2048;
+
+/*! A PDU, as recorded by the kernel's PDU trace. */
+typedef struct iSCSIKernelPDUTraceRecord
+{
+    /*! Position of the record in the ring's history plus one.  The kernel
+     *  clears this before it rewrites a record and sets it last, so a copy
+     *  of a record is only valid if this matches before and after copying. */
+    volatile UInt64 sequence;
+    
+    /*! System uptime when the PDU was sent or received, in nanoseconds. */
+    UInt64 timestampNs;
+    
+    /*! Initiator task tag of the PDU. */
+    UInt32 initiatorTaskTag;
+    
+    /*! CmdSN of a sent PDU or StatSN of a received PDU. */
+    UInt32 sequenceNumber;
+    
+    /*! ExpStatSN of a sent PDU or ExpCmdSN of a received PDU. */
+    UInt32 expSequenceNumber;
+    
+    /*! Length of the PDU's data segment. */
+    UInt32 dataLength;
+    
+    /*! Opcode of the PDU, including the immediate delivery flag. */
+    UInt8 opCode;
+    
+    /*! Opcode-specific flags of the PDU (byte 1 of the header). */
+    UInt8 flags;
+    
+    UInt8 reserved[6];
+    
+} iSCSIKernelPDUTraceRecord;
+
+/*! A ring of PDU trace records.  The kernel writes records in order and
+ *  overwrites the oldest record once the ring is full; readers keep their
+ *  own position and never write to the ring. */
+typedef struct iSCSIKernelPDUTraceRing
+{
+    /*! Number of records written to the ring. */
+    volatile UInt64 head;
+    
+    /*! Keeps records off the cache line of the head. */
+    UInt8 reserved[56];
+    
+    /*! The records; record n is stored at index n % kiSCSIPDUTraceRecords. */
+    iSCSIKernelPDUTraceRecord records[kiSCSIPDUTraceRecords];
+    
+} iSCSIKernelPDUTraceRing;
+
+/*! The PDU trace of a connection, as shared between the kernel and user
+ *  space (see iSCSIKernelPDUTraceMemoryType()). */
+typedef struct iSCSIKernelPDUTrace
+{
+    /*! Rings of each direction (see iSCSIPDUTraceDirections). */
+    iSCSIKernelPDUTraceRing rings[kiSCSIPDUTraceDirectionCount];
+    
+} iSCSIKernelPDUTrace;
+
+/*! Gets the memory type that the PDU trace of a connection is mapped with
+ *  (see IOConnectMapMemory64()).
+ *  @param sessionId the session identifier.
+ *  @param connectionId the connection identifier.
+ *  @return the memory type. */
+static inline UInt32 iSCSIKernelPDUTraceMemoryType(SID sessionId,CID connectionId)
+{
+    return ((UInt32)sessionId << 16) | (connectionId & 0xFFFF);
+}
+
+/*! Number of size classes in the kernel's PDU buffer pool. */
+static const UInt8 kiSCSIPDUBufferPoolClasses = 3;
+
+/*! Struct used to retrieve usage statistics of the kernel's preallocated
+ *  pools (task queue nodes and PDU scratch buffers). */
+typedef struct iSCSIKernelPoolStats
+{
+    /*! Number of task queue nodes in use. */
+    UInt32 taskNodesInUse;
+    
+    /*! Largest number of task queue nodes in use at any one time. */
+    UInt32 taskNodesHighWater;
+    
+    /*! Size, in bytes, of the buffers in each size class. */
+    UInt32 bufferSize[kiSCSIPDUBufferPoolClasses];
+    
+    /*! Number of buffers in use for each size class. */
+    UInt32 buffersInUse[kiSCSIPDUBufferPoolClasses];
+    
+    /*! Largest number of buffers in use at any one time for each size class. */
+    UInt32 buffersHighWater[kiSCSIPDUBufferPoolClasses];
+    
+} iSCSIKernelPoolStats;
+
 
 
 